@@ -3,9 +3,12 @@
 package gid
 
 import (
+	"context"
 	"errors"
 	"strings"
 	"sync"
+	"sync/atomic"
+	"time"
 )
 
 // DeviceInfo provides general information about a device
@@ -42,18 +45,185 @@ type Device interface {
 	Read([]byte) (int, error)
 	// ReadFeature from the device
 	ReadFeature([]byte) (int, error)
+	// Stats returns the I/O counters of the device
+	Stats() DeviceStats
+	// Info returns the description of the device, whose strings are served
+	// from memory once known
+	Info() DeviceInfo
+}
+
+// DeviceStats holds the I/O counters of an open device. They are maintained by
+// the libusb backend, the hidraw backend only counts reports, bytes, feature
+// transfers and errors, and they are all zero on other platforms.
+type DeviceStats struct {
+	ReportsReceived uint64 // Input reports received from the device
+	ReportsDropped  uint64 // Input reports discarded because nobody read them in time
+	BytesReceived   uint64 // Bytes of input reports received
+	Writes          uint64 // Output reports written
+	BytesWritten    uint64 // Bytes of output reports written
+	FeatureGets     uint64 // Feature reports read
+	FeatureSets     uint64 // Feature reports written
+	Timeouts        uint64 // Transfers which timed out, including idle input transfers
+	Errors          uint64 // Transfers which failed for another reason
+	ZeroCopy        bool   // Input reports are received in device memory, without a kernel copy
+
+	ReadLatency    LatencyHistogram // Submit to complete latency of input transfers
+	WriteLatency   LatencyHistogram // Latency of output report writes
+	FeatureLatency LatencyHistogram // Latency of feature report reads and writes
+}
+
+// LatencyBucket counts the latencies within [Min, Max).
+type LatencyBucket struct {
+	Min   time.Duration
+	Max   time.Duration
+	Count uint64
+}
+
+// LatencyHistogram is a log-linear histogram of latencies, with a relative
+// precision of 1/8th.
+type LatencyHistogram struct {
+	Count   uint64          // Number of latencies recorded
+	Sum     time.Duration   // Sum of the latencies recorded
+	Buckets []LatencyBucket // Non-empty buckets, by increasing latency
+}
+
+// Mean returns the average latency recorded.
+func (h *LatencyHistogram) Mean() time.Duration {
+	if h.Count == 0 {
+		return 0
+	}
+	return h.Sum / time.Duration(h.Count)
+}
+
+// Quantile returns an upper bound of the q-quantile of the latencies recorded,
+// for example Quantile(0.99) for the 99th percentile.
+func (h *LatencyHistogram) Quantile(q float64) time.Duration {
+	if h.Count == 0 {
+		return 0
+	}
+	rank := uint64(q * float64(h.Count))
+	var seen uint64
+	for _, b := range h.Buckets {
+		seen += b.Count
+		if seen > rank {
+			return b.Max
+		}
+	}
+	return h.Buckets[len(h.Buckets)-1].Max
+}
+
+// EventType tells whether a device has been plugged in or unplugged.
+type EventType int
+
+const (
+	// DeviceArrived is reported for devices which have been plugged in.
+	DeviceArrived EventType = iota + 1
+	// DeviceLeft is reported for devices which have been unplugged.
+	DeviceLeft
+)
+
+// String returns a human readable name of the event type.
+func (t EventType) String() string {
+	switch t {
+	case DeviceArrived:
+		return "arrived"
+	case DeviceLeft:
+		return "left"
+	default:
+		return "unknown"
+	}
+}
+
+// Event describes a HID device arrival or removal reported by Watch.
+type Event struct {
+	// Type tells whether the device arrived or left
+	Type EventType
+	// Device contains the information about the device. For removals it is the
+	// information reported when the device arrived.
+	Device DeviceInfo
+}
+
+// PollStats reports what busy polling, enabled with SetBusyPoll, has cost so far.
+type PollStats struct {
+	Windows uint64        // Spin windows opened after a completion
+	Polls   uint64        // Non-blocking checks for completions while spinning
+	Hits    uint64        // Completions picked up while spinning
+	Misses  uint64        // Windows which expired without picking anything up
+	Spin    time.Duration // Total time spent spinning
+}
+
+// TraceKind tells which point of a transfer's lifecycle a TraceEvent records.
+type TraceKind uint8
+
+const (
+	// TraceSubmit is recorded when a transfer is handed to the OS.
+	TraceSubmit TraceKind = iota + 1
+	// TraceReap is recorded when the OS hands a transfer back.
+	TraceReap
+	// TraceTimeout is recorded when a transfer times out.
+	TraceTimeout
+	// TraceCancel is recorded when the cancellation of a transfer is requested.
+	TraceCancel
+	// TraceComplete is recorded when a transfer is completed.
+	TraceComplete
+)
+
+// String returns a human readable name of the trace kind.
+func (k TraceKind) String() string {
+	switch k {
+	case TraceSubmit:
+		return "submit"
+	case TraceReap:
+		return "reap"
+	case TraceTimeout:
+		return "timeout"
+	case TraceCancel:
+		return "cancel"
+	case TraceComplete:
+		return "complete"
+	default:
+		return "unknown"
+	}
+}
+
+// TraceEvent is a record of the native transfer trace ring, see SetTrace.
+type TraceEvent struct {
+	Time         time.Duration // Monotonic clock time of the event
+	Transfer     uintptr       // Address of the native transfer
+	Kind         TraceKind     // Lifecycle point recorded
+	Endpoint     uint8         // Endpoint address of the transfer
+	TransferType uint8         // Native transfer type
+	Status       int           // Submission, OS, cancellation or transfer status
+	Length       int           // Transfer length, or length transferred once reaped
+}
+
+// VirtualDevice describes a simulated HID device, see AddVirtualDevice. Output
+// reports written to it are read back as input reports, feature reports read
+// back what was last written, and input reports carrying a counter pattern
+// arrive every ReportInterval.
+type VirtualDevice struct {
+	VendorID            uint16        // Device Vendor ID
+	ProductID           uint16        // Device Product ID
+	VersionNumber       uint16        // Version number of the device
+	Manufacturer        string        // Manufacturer string, none if empty
+	Product             string        // Product string, none if empty
+	SerialNumber        string        // Serial number string, none if empty
+	InputReportLength   uint16        // Size of the input reports, zero selects 64
+	OutputReportLength  uint16        // Size of the output reports, zero for none
+	FeatureReportLength uint16        // Size of the feature reports, zero for none
+	ReportInterval      time.Duration // Period of the input reports, zero for none
+	ControlLatency      time.Duration // Time taken by control and output transfers
+	Interfaces          uint8         // Number of identical HID interfaces up to 4, zero selects one
 }
 
 // ListFirstDevice returns the first device of which the cond function returns true.
 // If cond is nil, the first device is returned.
 // If no device is found, nil is returned.
 func ListFirstDevice(cond func(*DeviceInfo) bool) *DeviceInfo {
-	ch := Devices()
-	defer drainDevices(ch)
-
-	for dev := range ch {
-		if cond == nil || cond(dev) {
-			return dev
+	infos := Snapshot()
+	for i := range infos {
+		if cond == nil || cond(&infos[i]) {
+			return &infos[i]
 		}
 	}
 	return nil
@@ -63,9 +233,10 @@ func ListFirstDevice(cond func(*DeviceInfo) bool) *DeviceInfo {
 // If cond is nil, all devices are returned.
 func ListAllDevices(cond func(*DeviceInfo) bool) []*DeviceInfo {
 	var result []*DeviceInfo
-	for dev := range Devices() {
-		if cond == nil || cond(dev) {
-			result = append(result, dev)
+	infos := Snapshot()
+	for i := range infos {
+		if cond == nil || cond(&infos[i]) {
+			result = append(result, &infos[i])
 		}
 	}
 	return result
@@ -118,6 +289,463 @@ func drainDevices(ch <-chan *DeviceInfo) {
 	}()
 }
 
+// snapshotDevices adapts a device snapshot to the channel based API. The channel
+// is sized to hold every device, so it is filled and closed up front.
+func snapshotDevices(infos []DeviceInfo) <-chan *DeviceInfo {
+	result := make(chan *DeviceInfo, len(infos))
+	for i := range infos {
+		result <- &infos[i]
+	}
+	close(result)
+	return result
+}
+
+// collectDevices gathers every device emitted on the given channel.
+func collectDevices(ch <-chan *DeviceInfo) []DeviceInfo {
+	var infos []DeviceInfo
+	for dev := range ch {
+		infos = append(infos, *dev)
+	}
+	return infos
+}
+
+// watchTracker pairs arrivals and removals reported by a watch: arrivals of
+// already known devices and removals of unknown ones are dropped, and removals
+// are completed with the information gathered on arrival.
+type watchTracker struct {
+	filter func(*DeviceInfo) bool
+	known  map[string]DeviceInfo
+}
+
+func newWatchTracker(filter func(*DeviceInfo) bool) *watchTracker {
+	return &watchTracker{filter: filter, known: make(map[string]DeviceInfo)}
+}
+
+// track returns the event to report for the given change, if any.
+func (w *watchTracker) track(typ EventType, info DeviceInfo) (Event, bool) {
+	switch typ {
+	case DeviceArrived:
+		if _, ok := w.known[info.Path]; ok {
+			return Event{}, false
+		}
+		if w.filter != nil && !w.filter(&info) {
+			return Event{}, false
+		}
+		w.known[info.Path] = info
+	case DeviceLeft:
+		prev, ok := w.known[info.Path]
+		if !ok {
+			return Event{}, false
+		}
+		delete(w.known, info.Path)
+		info = prev
+	}
+	return Event{Type: typ, Device: info}, true
+}
+
+// pollWatch implements Watch on platforms without native hotplug notifications
+// by comparing snapshots taken at the given interval.
+func pollWatch(ctx context.Context, filter func(*DeviceInfo) bool, interval time.Duration) <-chan Event {
+	result := make(chan Event, maxDeviceChannelSize)
+	go func() {
+		defer close(result)
+
+		tracker := newWatchTracker(filter)
+		ticker := time.NewTicker(interval)
+		defer ticker.Stop()
+
+		for {
+			present := make(map[string]bool)
+			for _, info := range Snapshot() {
+				present[info.Path] = true
+				if ev, ok := tracker.track(DeviceArrived, info); ok {
+					select {
+					case result <- ev:
+					case <-ctx.Done():
+						return
+					}
+				}
+			}
+			for path, info := range tracker.known {
+				if present[path] {
+					continue
+				}
+				if ev, ok := tracker.track(DeviceLeft, info); ok {
+					select {
+					case result <- ev:
+					case <-ctx.Done():
+						return
+					}
+				}
+			}
+			select {
+			case <-ticker.C:
+			case <-ctx.Done():
+				return
+			}
+		}
+	}()
+	return result
+}
+
+// Pool shares open devices between users, so that repeated operations on a
+// device don't pay for opening it each time. Acquire opens a device on first use
+// and hands the same handle to later users, counting references, and Release
+// gives a reference back. A device nobody holds stays open for the idle timeout
+// of the pool, then it is closed. A device which is unplugged or fails with a
+// disconnection error leaves the pool at once, so that the next Acquire opens
+// it afresh, and is closed when its last user releases it.
+//
+// Unplugged devices are noticed through Watch, started with the first Acquire.
+type Pool struct {
+	idle time.Duration
+
+	mu      sync.Mutex
+	entries map[string]*poolEntry // Open devices by path
+	stop    context.CancelFunc    // Stops the hotplug watch, nil until started
+	closed  bool
+}
+
+// poolEntry is a device shared through a Pool.
+type poolEntry struct {
+	pool  *Pool
+	path  string
+	dev   Device
+	err   error         // Failure to open the device, set before ready is closed
+	ready chan struct{} // Closed once the device is opened or failed to
+	refs  int           // Number of unreleased PooledDevice, guarded by pool.mu
+	gone  bool          // Left the pool, guarded by pool.mu
+	timer *time.Timer   // Closes the device once idle, guarded by pool.mu
+}
+
+// PooledDevice is a reference to a device shared through a Pool. It can be used
+// as a Device until it is released: Close releases it as well, the underlying
+// device stays open for the other users of the pool.
+type PooledDevice struct {
+	entry    *poolEntry
+	released int32
+}
+
+// errPoolClosed is returned by Acquire once the pool is closed.
+var errPoolClosed = errors.New("hid: device pool closed")
+
+// NewPool creates a pool keeping devices open for the given time after their
+// last user released them. Zero keeps them open until they are unplugged or the
+// pool is closed.
+func NewPool(idle time.Duration) *Pool {
+	return &Pool{idle: idle, entries: make(map[string]*poolEntry)}
+}
+
+// Acquire returns a reference to the device with the given path, opening it if
+// the pool doesn't hold it yet. The reference must be released with Release or
+// Close.
+func (p *Pool) Acquire(path string) (*PooledDevice, error) {
+	p.mu.Lock()
+	if p.closed {
+		p.mu.Unlock()
+		return nil, errPoolClosed
+	}
+	e := p.entries[path]
+	if e != nil {
+		e.refs++
+		if e.timer != nil {
+			e.timer.Stop()
+			e.timer = nil
+		}
+		p.mu.Unlock()
+
+		// Another user may still be opening the device
+		<-e.ready
+		if e.err != nil {
+			return nil, e.err
+		}
+		return &PooledDevice{entry: e}, nil
+	}
+	e = &poolEntry{pool: p, path: path, ready: make(chan struct{}), refs: 1}
+	p.entries[path] = e
+	if p.stop == nil {
+		// Start watching before the device is opened, so that its removal
+		// can't go unnoticed
+		ctx, cancel := context.WithCancel(context.Background())
+		p.stop = cancel
+		go p.watch(Watch(ctx, nil))
+	}
+	p.mu.Unlock()
+
+	// Open without holding the lock, users of other devices don't wait for it
+	var dev Device
+	info, err := ByPath(path)
+	if err == nil {
+		dev, err = info.Open()
+	}
+	p.mu.Lock()
+	e.dev, e.err = dev, err
+	if err != nil {
+		p.remove(e)
+	}
+	p.mu.Unlock()
+	close(e.ready)
+
+	if err != nil {
+		return nil, err
+	}
+	return &PooledDevice{entry: e}, nil
+}
+
+// Len returns the number of devices held open by the pool.
+func (p *Pool) Len() int {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+	return len(p.entries)
+}
+
+// Close empties the pool. Idle devices are closed right away, the ones in use
+// when their last user releases them.
+func (p *Pool) Close() {
+	p.mu.Lock()
+	if p.closed {
+		p.mu.Unlock()
+		return
+	}
+	p.closed = true
+	var idle []Device
+	for _, e := range p.entries {
+		if p.remove(e) {
+			idle = append(idle, e.dev)
+		}
+	}
+	stop := p.stop
+	p.mu.Unlock()
+
+	if stop != nil {
+		stop()
+	}
+	for _, dev := range idle {
+		dev.Close()
+	}
+}
+
+// remove takes an entry out of the pool, reporting whether it is idle and must
+// be closed by the caller. The pool lock must be held.
+func (p *Pool) remove(e *poolEntry) bool {
+	if e.gone {
+		return false
+	}
+	e.gone = true
+	if p.entries[e.path] == e {
+		delete(p.entries, e.path)
+	}
+	if e.timer != nil {
+		e.timer.Stop()
+		e.timer = nil
+	}
+	return e.refs == 0 && e.dev != nil
+}
+
+// invalidate takes a device which has been unplugged out of the pool.
+func (p *Pool) invalidate(e *poolEntry) {
+	p.mu.Lock()
+	idle := p.remove(e)
+	p.mu.Unlock()
+	if idle {
+		e.dev.Close()
+	}
+}
+
+// release drops a reference to an entry, closing the device if it left the pool
+// or arming the idle timer.
+func (p *Pool) release(e *poolEntry) {
+	p.mu.Lock()
+	e.refs--
+	if e.refs > 0 || e.dev == nil {
+		p.mu.Unlock()
+		return
+	}
+	if e.gone {
+		p.mu.Unlock()
+		e.dev.Close()
+		return
+	}
+	if p.idle > 0 {
+		// The timer is checked under the lock, so a stale one does nothing
+		var timer *time.Timer
+		timer = time.AfterFunc(p.idle, func() {
+			p.mu.Lock()
+			idle := e.timer == timer && p.remove(e)
+			p.mu.Unlock()
+			if idle {
+				e.dev.Close()
+			}
+		})
+		e.timer = timer
+	}
+	p.mu.Unlock()
+}
+
+// watch takes the devices reported unplugged by events out of the pool.
+func (p *Pool) watch(events <-chan Event) {
+	for ev := range events {
+		if ev.Type != DeviceLeft {
+			continue
+		}
+		p.mu.Lock()
+		e := p.entries[ev.Device.Path]
+		p.mu.Unlock()
+		if e != nil {
+			p.invalidate(e)
+		}
+	}
+}
+
+// Release gives the reference back to the pool. The device must not be used
+// afterwards. Releasing a reference again has no effect.
+func (d *PooledDevice) Release() {
+	if atomic.CompareAndSwapInt32(&d.released, 0, 1) {
+		d.entry.pool.release(d.entry)
+	}
+}
+
+// Close releases the reference, see Release.
+func (d *PooledDevice) Close() {
+	d.Release()
+}
+
+// check takes the device out of the pool if err tells it is gone.
+func (d *PooledDevice) check(err error) error {
+	if err == ErrNoDevice || err == errDeviceClosed {
+		d.entry.pool.invalidate(d.entry)
+	}
+	return err
+}
+
+// device returns the shared device, or nil once the reference is released.
+func (d *PooledDevice) device() Device {
+	if atomic.LoadInt32(&d.released) != 0 {
+		return nil
+	}
+	return d.entry.dev
+}
+
+// Write sends an output report to the device.
+func (d *PooledDevice) Write(b []byte) error {
+	dev := d.device()
+	if dev == nil {
+		return errDeviceClosed
+	}
+	return d.check(dev.Write(b))
+}
+
+// WriteFeature sends a feature report to the device.
+func (d *PooledDevice) WriteFeature(b []byte) error {
+	dev := d.device()
+	if dev == nil {
+		return errDeviceClosed
+	}
+	return d.check(dev.WriteFeature(b))
+}
+
+// Read reads an input report from the device.
+func (d *PooledDevice) Read(b []byte) (int, error) {
+	dev := d.device()
+	if dev == nil {
+		return 0, errDeviceClosed
+	}
+	n, err := dev.Read(b)
+	return n, d.check(err)
+}
+
+// ReadFeature reads a feature report from the device.
+func (d *PooledDevice) ReadFeature(b []byte) (int, error) {
+	dev := d.device()
+	if dev == nil {
+		return 0, errDeviceClosed
+	}
+	n, err := dev.ReadFeature(b)
+	return n, d.check(err)
+}
+
+// Stats returns the I/O counters of the shared device, which include the
+// operations of all its users.
+func (d *PooledDevice) Stats() DeviceStats {
+	dev := d.device()
+	if dev == nil {
+		return DeviceStats{}
+	}
+	return dev.Stats()
+}
+
+// Info returns the description of the shared device.
+func (d *PooledDevice) Info() DeviceInfo {
+	dev := d.device()
+	if dev == nil {
+		return DeviceInfo{}
+	}
+	return dev.Info()
+}
+
+// Error is a failure reported by the native USB layer. The possible values are
+// the Err* variables below, which are allocated once, so failures can be told
+// apart by comparing against them without any allocation or string matching.
+type Error struct {
+	// Code is the libusb error code of the failure
+	Code int
+
+	msg string
+}
+
+// Error returns the description of the failure.
+func (e *Error) Error() string {
+	return e.msg
+}
+
+var (
+	ErrIO           = &Error{Code: -1, msg: "hid: input/output error"}
+	ErrInvalidParam = &Error{Code: -2, msg: "hid: invalid parameter"}
+	ErrAccess       = &Error{Code: -3, msg: "hid: access denied (insufficient permissions)"}
+	ErrNoDevice     = &Error{Code: -4, msg: "hid: no such device (it may have been disconnected)"}
+	ErrNotFound     = &Error{Code: -5, msg: "hid: entity not found"}
+	ErrBusy         = &Error{Code: -6, msg: "hid: resource busy"}
+	ErrTimeout      = &Error{Code: -7, msg: "hid: operation timed out"}
+	ErrOverflow     = &Error{Code: -8, msg: "hid: overflow"}
+	ErrPipe         = &Error{Code: -9, msg: "hid: pipe error"}
+	ErrInterrupted  = &Error{Code: -10, msg: "hid: system call interrupted"}
+	ErrNoMem        = &Error{Code: -11, msg: "hid: insufficient memory"}
+	ErrNotSupported = &Error{Code: -12, msg: "hid: operation not supported"}
+	ErrOther        = &Error{Code: -99, msg: "hid: unknown failure"}
+)
+
+// errorFromCode maps a libusb error code to its sentinel error.
+func errorFromCode(code int) error {
+	switch code {
+	case -1:
+		return ErrIO
+	case -2:
+		return ErrInvalidParam
+	case -3:
+		return ErrAccess
+	case -4:
+		return ErrNoDevice
+	case -5:
+		return ErrNotFound
+	case -6:
+		return ErrBusy
+	case -7:
+		return ErrTimeout
+	case -8:
+		return ErrOverflow
+	case -9:
+		return ErrPipe
+	case -10:
+		return ErrInterrupted
+	case -11:
+		return ErrNoMem
+	case -12:
+		return ErrNotSupported
+	default:
+		return ErrOther
+	}
+}
+
 // enumerateLock is a mutex serializing access to USB device enumeration needed
 // by the macOS USB HID system calls, which require 2 consecutive method calls
 // for enumeration, causing crashes if called concurrently.
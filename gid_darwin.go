@@ -19,9 +19,11 @@ void deviceUnpluged(IOHIDDeviceRef osd, IOReturn ret, void* dev);
 import "C"
 
 import (
+	"context"
 	"errors"
 	"fmt"
 	"reflect"
+	"time"
 	"unsafe"
 )
 
@@ -140,6 +142,7 @@ type osxDevice struct {
 	osDevice     C.IOHIDDeviceRef
 	disconnected bool
 	closeDM      cleanupDeviceManagerFn
+	info         DeviceInfo
 }
 
 func cfstring(s string) C.CFStringRef {
@@ -221,6 +224,20 @@ func iterateDevices(action func(device C.IOHIDDeviceRef) bool) cleanupDeviceMana
 	}
 }
 
+// Watch streams the arrival and removal of HID devices matching filter until
+// ctx is done, at which point the channel is closed. Devices attached when the
+// watch starts are reported as arrivals. If filter is nil, all devices match.
+//
+// Changes are detected by enumerating the devices once per second.
+func Watch(ctx context.Context, filter func(*DeviceInfo) bool) <-chan Event {
+	return pollWatch(ctx, filter, time.Second)
+}
+
+// Snapshot returns the DeviceInfo of every HID device currently attached.
+func Snapshot() []DeviceInfo {
+	return collectDevices(Devices())
+}
+
 // Devices returns a channel that will receive a DeviceInfo struct for each HID device.
 func Devices() <-chan *DeviceInfo {
 	result := make(chan *DeviceInfo, maxDeviceChannelSize)
@@ -270,7 +287,16 @@ func (di *DeviceInfo) Open() (Device, error) {
 			res := C.IOHIDDeviceOpen(device, C.kIOHIDOptionsTypeSeizeDevice)
 			if res == C.kIOReturnSuccess {
 				C.CFRetain(C.CFTypeRef(device))
-				dev = &osxDevice{osDevice: device}
+				dev = &osxDevice{osDevice: device, info: *di}
+				if dev.info.Manufacturer == "" {
+					dev.info.Manufacturer = getStringProp(device, cfstring(C.kIOHIDManufacturerKey))
+				}
+				if dev.info.Product == "" {
+					dev.info.Product = getStringProp(device, cfstring(C.kIOHIDProductKey))
+				}
+				if dev.info.SerialNumber == "" {
+					dev.info.SerialNumber = getStringProp(device, cfstring(C.kIOHIDSerialNumberKey))
+				}
 				err = nil
 				C.IOHIDDeviceRegisterRemovalCallback(device, (C.IOHIDCallback)(unsafe.Pointer(C.deviceUnpluged)), unsafe.Pointer(dev))
 			} else {
@@ -294,6 +320,18 @@ func deviceUnpluged(osdev C.IOHIDDeviceRef, result C.IOReturn, dev unsafe.Pointe
 	od.Close()
 }
 
+// Stats returns the I/O counters of the device, which are not maintained on
+// this platform.
+func (dev *osxDevice) Stats() DeviceStats {
+	return DeviceStats{}
+}
+
+// Info returns the description of the device it was opened from, completed
+// with the strings IOKit keeps for the device.
+func (dev *osxDevice) Info() DeviceInfo {
+	return dev.info
+}
+
 func (dev *osxDevice) Close() {
 	if !dev.disconnected {
 		C.IOHIDDeviceClose(dev.osDevice, C.kIOHIDOptionsTypeSeizeDevice)
@@ -378,6 +416,89 @@ func (dev *osxDevice) ReadInterrupt(endpoint byte, data []byte) (int, error) {
 	return 0, errNotImplemented
 }
 
+// SetContexts sets the number of native event handling contexts devices are
+// spread over. There is a single one on this platform.
+func SetContexts(n int) error {
+	if n != 1 {
+		return ErrNotSupported
+	}
+	return nil
+}
+
+// OpenOn connects to an HID device by its path name, handling its events on
+// the context of the given index. There is a single one on this platform.
+func (di *DeviceInfo) OpenOn(index int) (Device, error) {
+	if index != 0 {
+		return nil, ErrNotSupported
+	}
+	return di.Open()
+}
+
+// SetBusyPoll makes the native event handling thread spin for completed
+// transfers. It is not supported on this platform.
+func SetBusyPoll(window time.Duration) error {
+	return ErrNotSupported
+}
+
+// BusyPollStats returns the busy polling counters, see SetBusyPoll.
+func BusyPollStats() PollStats {
+	return PollStats{}
+}
+
+// SetTrace enables the native transfer trace ring. It is not supported on this
+// platform.
+func SetTrace(capacity int) error {
+	return ErrNotSupported
+}
+
+// DumpTrace returns the records of the native transfer trace ring. It is not
+// supported on this platform.
+func DumpTrace(index int, max int) ([]TraceEvent, error) {
+	return nil, ErrNotSupported
+}
+
+// SetScanThreads spreads the reads done while scanning for devices over several
+// threads. It is not supported on this platform.
+func SetScanThreads(n int) error {
+	return ErrNotSupported
+}
+
+// SetHotplugDebounce sets how long the hotplug monitor collects device changes
+// before reporting them. It is not supported on this platform.
+func SetHotplugDebounce(window time.Duration) error {
+	return ErrNotSupported
+}
+
+// UseHidrawBackend lists and opens devices through the Linux hidraw driver. It
+// is not supported on this platform.
+func UseHidrawBackend(enable bool) error {
+	return ErrNotSupported
+}
+
+// OpenInterfaces connects to every HID interface of a composite device at once.
+// Interfaces are separate devices on this platform, open them one by one.
+func (di *DeviceInfo) OpenInterfaces() ([]Device, error) {
+	return nil, ErrNotSupported
+}
+
+// UseVirtualBackend switches the native library to a simulated bus. It is not
+// supported on this platform.
+func UseVirtualBackend() error {
+	return ErrNotSupported
+}
+
+// AddVirtualDevice plugs a simulated device into the bus of the virtual
+// backend. It is not supported on this platform.
+func AddVirtualDevice(d VirtualDevice) (int, error) {
+	return 0, ErrNotSupported
+}
+
+// RemoveVirtualDevice unplugs a simulated device. It is not supported on this
+// platform.
+func RemoveVirtualDevice(id int) error {
+	return ErrNotSupported
+}
+
 // Supported returns whether this platform is supported by the HID library or not.
 // The goal of this method is to allow programmatically handling platforms that do
 // not support USB HID and not having to fall back to build constraints.
@@ -3,9 +3,26 @@
 
 package gid
 
+import (
+	"context"
+	"time"
+)
+
+// Snapshot returns the DeviceInfo of every HID device currently attached.
+func Snapshot() []DeviceInfo {
+	return nil
+}
+
 // Devices returns a channel that will receive a DeviceInfo struct for each HID device.
 func Devices() <-chan *DeviceInfo {
-	result := make(chan *DeviceInfo)
+	return snapshotDevices(nil)
+}
+
+// Watch streams the arrival and removal of HID devices matching filter until
+// ctx is done. It is not supported on this platform, the channel is closed
+// right away.
+func Watch(ctx context.Context, filter func(*DeviceInfo) bool) <-chan Event {
+	result := make(chan Event)
 	close(result)
 	return result
 }
@@ -15,6 +32,89 @@ func ByPath(path string) (*DeviceInfo, error) {
 	return nil, errUnsupportedPlatform
 }
 
+// SetContexts sets the number of native event handling contexts devices are
+// spread over. There is a single one on this platform.
+func SetContexts(n int) error {
+	if n != 1 {
+		return errUnsupportedPlatform
+	}
+	return nil
+}
+
+// OpenOn connects to an HID device by its path name, handling its events on
+// the context of the given index. There is a single one on this platform.
+func (di *DeviceInfo) OpenOn(index int) (Device, error) {
+	if index != 0 {
+		return nil, errUnsupportedPlatform
+	}
+	return di.Open()
+}
+
+// SetBusyPoll makes the native event handling thread spin for completed
+// transfers. It is not supported on this platform.
+func SetBusyPoll(window time.Duration) error {
+	return errUnsupportedPlatform
+}
+
+// BusyPollStats returns the busy polling counters, see SetBusyPoll.
+func BusyPollStats() PollStats {
+	return PollStats{}
+}
+
+// SetTrace enables the native transfer trace ring. It is not supported on this
+// platform.
+func SetTrace(capacity int) error {
+	return errUnsupportedPlatform
+}
+
+// DumpTrace returns the records of the native transfer trace ring. It is not
+// supported on this platform.
+func DumpTrace(index int, max int) ([]TraceEvent, error) {
+	return nil, errUnsupportedPlatform
+}
+
+// SetScanThreads spreads the reads done while scanning for devices over several
+// threads. It is not supported on this platform.
+func SetScanThreads(n int) error {
+	return errUnsupportedPlatform
+}
+
+// SetHotplugDebounce sets how long the hotplug monitor collects device changes
+// before reporting them. It is not supported on this platform.
+func SetHotplugDebounce(window time.Duration) error {
+	return errUnsupportedPlatform
+}
+
+// UseHidrawBackend lists and opens devices through the Linux hidraw driver. It
+// is not supported on this platform.
+func UseHidrawBackend(enable bool) error {
+	return errUnsupportedPlatform
+}
+
+// OpenInterfaces connects to every HID interface of a composite device at once.
+// It is not supported on this platform.
+func (di *DeviceInfo) OpenInterfaces() ([]Device, error) {
+	return nil, errUnsupportedPlatform
+}
+
+// UseVirtualBackend switches the native library to a simulated bus. It is not
+// supported on this platform.
+func UseVirtualBackend() error {
+	return errUnsupportedPlatform
+}
+
+// AddVirtualDevice plugs a simulated device into the bus of the virtual
+// backend. It is not supported on this platform.
+func AddVirtualDevice(d VirtualDevice) (int, error) {
+	return 0, errUnsupportedPlatform
+}
+
+// RemoveVirtualDevice unplugs a simulated device. It is not supported on this
+// platform.
+func RemoveVirtualDevice(id int) error {
+	return errUnsupportedPlatform
+}
+
 // Supported returns whether this platform is supported by the HID library or not.
 // The goal of this method is to allow programmatically handling platforms that do
 // not support USB HID and not having to fall back to build constraints.
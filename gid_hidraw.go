@@ -0,0 +1,413 @@
+//go:build linux && cgo
+// +build linux,cgo
+
+package gid
+
+import (
+	"errors"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"sort"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"unsafe"
+)
+
+// hidrawBackend is set when devices are listed through the kernel hidraw driver
+// instead of libusb, see UseHidrawBackend.
+var hidrawBackend int32
+
+const (
+	hidrawClassDir = "/sys/class/hidraw"
+	hidrawNodeDir  = "/dev"
+	hidrawPrefix   = "/dev/hidraw"
+)
+
+// hidBusUSB is the bus type of USB devices in the HID_ID of a HID device uevent.
+const hidBusUSB = 0x03
+
+// usingHidraw reports whether devices are listed through hidraw.
+func usingHidraw() bool {
+	return atomic.LoadInt32(&hidrawBackend) != 0
+}
+
+// isHidrawPath reports whether a device path names a hidraw node.
+func isHidrawPath(path string) bool {
+	return strings.HasPrefix(path, hidrawPrefix)
+}
+
+// hidrawSnapshot returns the DeviceInfo of every device bound to hidraw, by
+// increasing node number.
+func hidrawSnapshot() []DeviceInfo {
+	dir, err := os.Open(hidrawClassDir)
+	if err != nil {
+		return nil
+	}
+	names, err := dir.Readdirnames(-1)
+	dir.Close()
+	if err != nil {
+		return nil
+	}
+	sort.Slice(names, func(i, j int) bool {
+		if len(names[i]) != len(names[j]) {
+			return len(names[i]) < len(names[j])
+		}
+		return names[i] < names[j]
+	})
+
+	infos := make([]DeviceInfo, 0, len(names))
+	for _, name := range names {
+		if info, ok := hidrawDeviceInfo(name); ok {
+			infos = append(infos, info)
+		}
+	}
+	return infos
+}
+
+// hidrawDeviceInfo gathers what sysfs tells about a hidraw node. The strings of
+// USB devices come from the USB device, those of other buses from the name and
+// unique ID the HID driver reports.
+func hidrawDeviceInfo(name string) (DeviceInfo, bool) {
+	hid, err := filepath.EvalSymlinks(filepath.Join(hidrawClassDir, name, "device"))
+	if err != nil {
+		return DeviceInfo{}, false
+	}
+	uevent, err := ioutil.ReadFile(filepath.Join(hid, "uevent"))
+	if err != nil {
+		return DeviceInfo{}, false
+	}
+
+	info := DeviceInfo{Path: filepath.Join(hidrawNodeDir, name)}
+	var bus, vendor, product uint32
+	found := false
+	for _, line := range strings.Split(string(uevent), "\n") {
+		kv := strings.SplitN(line, "=", 2)
+		if len(kv) != 2 {
+			continue
+		}
+		switch kv[0] {
+		case "HID_ID":
+			if _, err := fmt.Sscanf(kv[1], "%x:%x:%x", &bus, &vendor, &product); err == nil {
+				found = true
+			}
+		case "HID_NAME":
+			info.Product = kv[1]
+		case "HID_UNIQ":
+			info.SerialNumber = kv[1]
+		}
+	}
+	if !found {
+		return DeviceInfo{}, false
+	}
+	info.VendorID = uint16(vendor)
+	info.ProductID = uint16(product)
+
+	// A USB HID device sits below its interface, itself below the USB device
+	if bus == hidBusUSB {
+		usb := filepath.Dir(filepath.Dir(hid))
+		if version, ok := readSysfsHex(filepath.Join(usb, "bcdDevice")); ok {
+			info.VersionNumber = uint16(version)
+			info.Manufacturer = readSysfsString(filepath.Join(usb, "manufacturer"))
+			if product := readSysfsString(filepath.Join(usb, "product")); product != "" {
+				info.Product = product
+			}
+			info.SerialNumber = readSysfsString(filepath.Join(usb, "serial"))
+		}
+	}
+
+	if desc, err := ioutil.ReadFile(filepath.Join(hid, "report_descriptor")); err == nil {
+		info.InputReportLength, info.OutputReportLength, info.FeatureReportLength =
+			hidrawReportLengths(desc)
+	}
+	return info, true
+}
+
+// readSysfsString returns the content of a sysfs attribute without the trailing
+// newline, or an empty string if it can't be read.
+func readSysfsString(path string) string {
+	b, err := ioutil.ReadFile(path)
+	if err != nil {
+		return ""
+	}
+	return strings.TrimRight(string(b), "\n")
+}
+
+// readSysfsHex parses a hexadecimal sysfs attribute.
+func readSysfsHex(path string) (uint32, bool) {
+	var v uint32
+	if _, err := fmt.Sscanf(readSysfsString(path), "%x", &v); err != nil {
+		return 0, false
+	}
+	return v, true
+}
+
+// hidrawReportLengths returns the length of the longest input, output and
+// feature reports declared by a report descriptor. Like on Windows, the lengths
+// count the report ID byte.
+func hidrawReportLengths(desc []byte) (input, output, feature uint16) {
+	type globals struct {
+		size, count uint32
+		id          uint8
+	}
+	var cur globals
+	var stack []globals
+	var bits [3]map[uint8]uint32
+	for i := range bits {
+		bits[i] = make(map[uint8]uint32)
+	}
+
+	for i := 0; i < len(desc); {
+		prefix := desc[i]
+		if prefix == 0xfe {
+			// Long item, its size follows the prefix
+			if i+1 >= len(desc) {
+				break
+			}
+			i += 3 + int(desc[i+1])
+			continue
+		}
+		size := int(prefix & 0x03)
+		if size == 3 {
+			size = 4
+		}
+		if i+1+size > len(desc) {
+			break
+		}
+		var value uint32
+		for j := 0; j < size; j++ {
+			value |= uint32(desc[i+1+j]) << (8 * uint(j))
+		}
+		switch prefix & 0xfc {
+		case 0x74: // Report Size
+			cur.size = value
+		case 0x94: // Report Count
+			cur.count = value
+		case 0x84: // Report ID
+			cur.id = uint8(value)
+		case 0xa4: // Push
+			stack = append(stack, cur)
+		case 0xb4: // Pop
+			if n := len(stack); n > 0 {
+				cur = stack[n-1]
+				stack = stack[:n-1]
+			}
+		case 0x80: // Input
+			bits[0][cur.id] += cur.size * cur.count
+		case 0x90: // Output
+			bits[1][cur.id] += cur.size * cur.count
+		case 0xb0: // Feature
+			bits[2][cur.id] += cur.size * cur.count
+		}
+		i += 1 + size
+	}
+
+	var lengths [3]uint16
+	for i, reports := range bits {
+		for _, n := range reports {
+			if length := uint16((n+7)/8 + 1); length > lengths[i] {
+				lengths[i] = length
+			}
+		}
+	}
+	return lengths[0], lengths[1], lengths[2]
+}
+
+// hidrawError maps the failure of a hidraw operation to the sentinel errors.
+func hidrawError(err error) error {
+	if errors.Is(err, os.ErrClosed) {
+		return errDeviceClosed
+	}
+	var errno syscall.Errno
+	if !errors.As(err, &errno) {
+		return ErrOther
+	}
+	switch errno {
+	case syscall.EIO:
+		return ErrIO
+	case syscall.EINVAL:
+		return ErrInvalidParam
+	case syscall.EACCES, syscall.EPERM:
+		return ErrAccess
+	case syscall.ENODEV, syscall.ENXIO:
+		return ErrNoDevice
+	case syscall.ENOENT:
+		return ErrNotFound
+	case syscall.EBUSY:
+		return ErrBusy
+	case syscall.ETIMEDOUT:
+		return ErrTimeout
+	case syscall.EOVERFLOW:
+		return ErrOverflow
+	case syscall.EPIPE:
+		return ErrPipe
+	case syscall.EINTR:
+		return ErrInterrupted
+	case syscall.ENOMEM:
+		return ErrNoMem
+	default:
+		return ErrOther
+	}
+}
+
+// hidiocFeature builds the HIDIOCSFEATURE (nr 6) and HIDIOCGFEATURE (nr 7)
+// ioctl requests for a buffer of the given length. The layout of the request
+// depends on the architecture, see the gid_hidraw_ioc files.
+func hidiocFeature(nr uintptr, length int) uintptr {
+	return iocReadWrite<<iocDirShift | uintptr(length)<<16 | 'H'<<8 | nr
+}
+
+// maxHidiocLength is the largest buffer the size field of an ioctl can hold.
+const maxHidiocLength = 1<<iocSizeBits - 1
+
+// hidrawDevice is a device opened through its hidraw node. Reports are read and
+// written as plain file I/O, which blocks in the Go runtime poller rather than
+// in a thread, and feature reports go through ioctls.
+type hidrawDevice struct {
+	// The counters come first to keep them 64-bit aligned for atomic access
+	reports  uint64
+	received uint64
+	writes   uint64
+	written  uint64
+	gets     uint64
+	sets     uint64
+	failures uint64
+
+	*DeviceInfo // Embed the infos for easier access
+
+	file *os.File
+
+	info     DeviceInfo // The infos completed from sysfs, see Info
+	infoOnce sync.Once
+}
+
+// openHidraw opens the hidraw node of a device. The kernel driver stays bound.
+func openHidraw(di *DeviceInfo) (Device, error) {
+	file, err := os.OpenFile(di.Path, os.O_RDWR, 0)
+	if err != nil {
+		return nil, hidrawError(err)
+	}
+	return &hidrawDevice{DeviceInfo: di, file: file}, nil
+}
+
+// Close closes the hidraw node. Blocked reads fail with a closed device error.
+func (dev *hidrawDevice) Close() {
+	dev.file.Close()
+}
+
+// failure counts a failed operation and converts its error.
+func (dev *hidrawDevice) failure(err error) error {
+	err = hidrawError(err)
+	if err != errDeviceClosed {
+		atomic.AddUint64(&dev.failures, 1)
+	}
+	return err
+}
+
+// Write sends an output report, whose first byte is the report ID or zero if
+// the device doesn't number its reports.
+func (dev *hidrawDevice) Write(b []byte) error {
+	if len(b) == 0 {
+		return nil
+	}
+	if _, err := dev.file.Write(b); err != nil {
+		return dev.failure(err)
+	}
+	atomic.AddUint64(&dev.writes, 1)
+	atomic.AddUint64(&dev.written, uint64(len(b)))
+	return nil
+}
+
+// Read waits for an input report. Reports of devices numbering them start with
+// the report ID.
+func (dev *hidrawDevice) Read(b []byte) (int, error) {
+	n, err := dev.file.Read(b)
+	if err != nil {
+		// hidraw fails reads with EIO once the device is gone
+		if errors.Is(err, syscall.EIO) {
+			atomic.AddUint64(&dev.failures, 1)
+			return 0, ErrNoDevice
+		}
+		return 0, dev.failure(err)
+	}
+	atomic.AddUint64(&dev.reports, 1)
+	atomic.AddUint64(&dev.received, uint64(n))
+	return n, nil
+}
+
+// ioctl issues a feature report request on the buffer, returning the length
+// the driver reports.
+func (dev *hidrawDevice) ioctl(nr uintptr, b []byte) (int, error) {
+	if len(b) == 0 || len(b) > maxHidiocLength {
+		return 0, ErrInvalidParam
+	}
+	conn, err := dev.file.SyscallConn()
+	if err != nil {
+		return 0, dev.failure(err)
+	}
+	var n uintptr
+	var errno syscall.Errno
+	err = conn.Control(func(fd uintptr) {
+		n, _, errno = syscall.Syscall(syscall.SYS_IOCTL, fd,
+			hidiocFeature(nr, len(b)), uintptr(unsafe.Pointer(&b[0])))
+	})
+	if err != nil {
+		return 0, dev.failure(err)
+	}
+	if errno != 0 {
+		return 0, dev.failure(errno)
+	}
+	return int(n), nil
+}
+
+// WriteFeature sends a feature report, whose first byte is the report ID.
+func (dev *hidrawDevice) WriteFeature(b []byte) error {
+	if _, err := dev.ioctl(6, b); err != nil {
+		return err
+	}
+	atomic.AddUint64(&dev.sets, 1)
+	return nil
+}
+
+// ReadFeature reads the feature report whose ID is in the first byte of b. The
+// report is returned with its ID.
+func (dev *hidrawDevice) ReadFeature(b []byte) (int, error) {
+	n, err := dev.ioctl(7, b)
+	if err != nil {
+		return 0, err
+	}
+	atomic.AddUint64(&dev.gets, 1)
+	return n, nil
+}
+
+// Info returns the description of the device. If the DeviceInfo it was opened
+// from has no strings, they are read from sysfs on the first call.
+func (dev *hidrawDevice) Info() DeviceInfo {
+	dev.infoOnce.Do(func() {
+		dev.info = *dev.DeviceInfo
+		if dev.info.Manufacturer != "" || dev.info.Product != "" || dev.info.SerialNumber != "" {
+			return
+		}
+		if info, ok := hidrawDeviceInfo(filepath.Base(dev.info.Path)); ok {
+			dev.info = info
+		}
+	})
+	return dev.info
+}
+
+// Stats returns the I/O counters of the device. The hidraw backend keeps no
+// latency histograms.
+func (dev *hidrawDevice) Stats() DeviceStats {
+	return DeviceStats{
+		ReportsReceived: atomic.LoadUint64(&dev.reports),
+		BytesReceived:   atomic.LoadUint64(&dev.received),
+		Writes:          atomic.LoadUint64(&dev.writes),
+		BytesWritten:    atomic.LoadUint64(&dev.written),
+		FeatureGets:     atomic.LoadUint64(&dev.gets),
+		FeatureSets:     atomic.LoadUint64(&dev.sets),
+		Errors:          atomic.LoadUint64(&dev.failures),
+	}
+}
@@ -0,0 +1,9 @@
+//go:build linux && cgo && hidraw
+// +build linux,cgo,hidraw
+
+package gid
+
+// Built with the hidraw tag, devices are listed through hidraw by default.
+func init() {
+	hidrawBackend = 1
+}
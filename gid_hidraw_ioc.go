@@ -0,0 +1,12 @@
+//go:build linux && cgo && !ppc && !ppc64 && !ppc64le && !mips && !mipsle && !mips64 && !mips64le && !sparc64
+// +build linux,cgo,!ppc,!ppc64,!ppc64le,!mips,!mipsle,!mips64,!mips64le,!sparc64
+
+package gid
+
+// Layout of the ioctl request numbers of the asm-generic architectures: two
+// direction bits at the top, above a 14-bit size.
+const (
+	iocReadWrite = 3
+	iocDirShift  = 30
+	iocSizeBits  = 14
+)
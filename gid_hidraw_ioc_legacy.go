@@ -0,0 +1,14 @@
+//go:build linux && cgo && (ppc || ppc64 || ppc64le || mips || mipsle || mips64 || mips64le || sparc64)
+// +build linux
+// +build cgo
+// +build ppc ppc64 ppc64le mips mipsle mips64 mips64le sparc64
+
+package gid
+
+// Layout of the ioctl request numbers of powerpc, mips and sparc: three
+// direction bits at the top, above a 13-bit size.
+const (
+	iocReadWrite = 6
+	iocDirShift  = 29
+	iocSizeBits  = 13
+)
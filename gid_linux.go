@@ -6,102 +6,708 @@ package gid
 
 #include <poll.h>
 #include "hidapi_linux.h"
+
+// The hidapi error code is kept per thread, and goroutines may move between
+// threads from one cgo call to the next. The wrappers below thus fetch it in
+// the same call as the operation, and return both by value.
+typedef struct {
+	int res;
+	int err;
+} gid_result;
+
+static gid_result gid_result_of(int res) {
+	gid_result r = { res, res < 0 ? hid_error_code(NULL) : 0 };
+	return r;
+}
+
+static gid_result gid_write(hid_device *dev, const unsigned char *data, size_t length) {
+	return gid_result_of(hid_write(dev, data, length));
+}
+
+static gid_result gid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length) {
+	return gid_result_of(hid_send_feature_report(dev, data, length));
+}
+
+static gid_result gid_read(hid_device *dev, unsigned char *data, size_t length) {
+	return gid_result_of(hid_read(dev, data, length));
+}
+
+static gid_result gid_get_feature_report(hid_device *dev, unsigned char *data, size_t length) {
+	return gid_result_of(hid_get_feature_report(dev, data, length));
+}
+
+typedef struct {
+	hid_device *dev;
+	int err;
+} gid_open_result;
+
+static gid_open_result gid_open_path(const char *path, int context) {
+	gid_open_result r = { hid_open_path_context(path, context), 0 };
+	if (!r.dev)
+		r.err = hid_error_code(NULL);
+	return r;
+}
+
+static gid_result gid_open_interfaces(const char *path, hid_device **devs, int max) {
+	return gid_result_of(hid_open_interfaces(path, devs, max));
+}
+
+static int gid_interface(hid_device *dev) {
+	return dev->interface;
+}
+
+static gid_result gid_set_context_count(int count) {
+	return gid_result_of(hid_set_context_count(count));
+}
+
+static gid_result gid_set_busy_poll(unsigned int window_us) {
+	return gid_result_of(hid_set_busy_poll(window_us));
+}
+
+static gid_result gid_set_trace(unsigned int capacity) {
+	return gid_result_of(hid_set_trace(capacity));
+}
+
+static gid_result gid_trace_dump(int context, struct hid_trace_event *records, int max_events) {
+	return gid_result_of(hid_trace_dump(context, records, max_events));
+}
+
+static gid_result gid_set_backend(const char *name) {
+	return gid_result_of(hid_set_backend(name));
+}
+
+static gid_result gid_virtual_add_device(const struct hid_virtual_device *device) {
+	return gid_result_of(hid_virtual_add_device(device));
+}
+
+static gid_result gid_virtual_remove_device(int id) {
+	return gid_result_of(hid_virtual_remove_device(id));
+}
+
+static gid_result gid_set_scan_threads(unsigned int threads) {
+	return gid_result_of(hid_set_scan_threads(threads));
+}
+
+static gid_result gid_set_hotplug_debounce(unsigned int window_ms) {
+	return gid_result_of(hid_set_hotplug_debounce(window_ms));
+}
 */
 import "C"
 
 import (
-	"errors"
+	"context"
+	"fmt"
+	"math"
+	"os"
+	"strings"
 	"sync"
+	"sync/atomic"
+	"time"
 	"unsafe"
 )
 
+// Snapshot returns the DeviceInfo of every HID device currently attached.
+//
+// The whole enumeration is gathered by the native layer into one packed buffer
+// and decoded in place, so no goroutines or channels are involved. With the
+// hidraw backend, see UseHidrawBackend, the devices are read from sysfs.
+func Snapshot() []DeviceInfo {
+	if usingHidraw() {
+		return hidrawSnapshot()
+	}
+	snap := C.hid_enumerate_snapshot(C.ushort(0), C.ushort(0))
+	if snap == nil {
+		return nil
+	}
+	defer C.hid_free_snapshot(snap)
+
+	count := int(snap.count)
+	if count == 0 {
+		return nil
+	}
+	entries := (*[1 << 20]C.struct_hid_snapshot_entry)(unsafe.Pointer(snap.entries))[:count:count]
+	str := func(off, n C.uint) string {
+		if n == 0 {
+			return ""
+		}
+		return C.GoStringN((*C.char)(unsafe.Pointer(uintptr(unsafe.Pointer(snap.strings))+uintptr(off))), C.int(n))
+	}
+
+	infos := make([]DeviceInfo, count)
+	for i := range entries {
+		e := &entries[i]
+		infos[i] = DeviceInfo{
+			Path:          str(e.path, e.path_len),
+			VendorID:      uint16(e.vendor_id),
+			ProductID:     uint16(e.product_id),
+			VersionNumber: uint16(e.release_number),
+			SerialNumber:  str(e.serial_number, e.serial_number_len),
+			Manufacturer:  str(e.manufacturer_string, e.manufacturer_string_len),
+			Product:       str(e.product_string, e.product_string_len),
+		}
+	}
+	return infos
+}
+
 // Devices returns a channel that will receive a DeviceInfo struct for each HID device.
 func Devices() <-chan *DeviceInfo {
-	result := make(chan *DeviceInfo, maxDeviceChannelSize)
+	return snapshotDevices(Snapshot())
+}
+
+// Watch streams the arrival and removal of HID devices matching filter until
+// ctx is done, at which point the channel is closed. Devices attached when the
+// watch starts are reported as arrivals. If filter is nil, all devices match.
+//
+// Changes are delivered by the libusb hotplug monitor, so nothing is enumerated
+// while no device comes or goes. The monitor reports bursts of changes, such as
+// the ones caused by a hub reset, as their net effect, see SetHotplugDebounce.
+// If hotplug notifications are not available, the channel is closed right away.
+//
+// With the hidraw backend, changes are detected by listing the devices once per
+// second.
+func Watch(ctx context.Context, filter func(*DeviceInfo) bool) <-chan Event {
+	if usingHidraw() {
+		return pollWatch(ctx, filter, time.Second)
+	}
+	result := make(chan Event, maxDeviceChannelSize)
+
+	watch := C.hid_hotplug_watch_create()
+
+	if watch == nil {
+		close(result)
+		return result
+	}
 	go func() {
-		enumerateLock.Lock()
-		defer enumerateLock.Unlock()
 		defer close(result)
 
-		// Gather all device infos and ensure they are freed before returning
-		head := C.hid_enumerate(C.ushort(0), C.ushort(0))
-		if head == nil {
-			return
-		}
-		defer C.hid_free_enumeration(head)
-
-		// Iterate the list and retrieve the device details
-		for ; head != nil; head = head.next {
-			info := DeviceInfo{
-				Path:          C.GoString(head.path),
-				VendorID:      uint16(head.vendor_id),
-				ProductID:     uint16(head.product_id),
-				VersionNumber: uint16(head.release_number),
+		// Wake the native wait up once the context is done, and make sure the
+		// waker is gone before the watch is released.
+		var pend sync.WaitGroup
+		done := make(chan struct{})
+
+		pend.Add(1)
+		go func() {
+			defer pend.Done()
+			select {
+			case <-ctx.Done():
+				C.hid_hotplug_watch_interrupt(watch)
+			case <-done:
 			}
-			if head.serial_number != nil {
-				info.SerialNumber, _ = wcharTToString(head.serial_number)
+		}()
+		defer C.hid_hotplug_watch_destroy(watch)
+		defer pend.Wait()
+		defer close(done)
+
+		tracker := newWatchTracker(filter)
+		for {
+			events := C.hid_hotplug_watch_wait(watch)
+			if events == nil {
+				return
 			}
-			if head.product_string != nil {
-				info.Product, _ = wcharTToString(head.product_string)
+			var batch []Event
+			for ev := events; ev != nil; ev = ev.next {
+				typ := DeviceArrived
+				if ev.event == C.HID_HOTPLUG_LEFT {
+					typ = DeviceLeft
+				}
+				for d := ev.devs; d != nil; d = d.next {
+					if e, ok := tracker.track(typ, deviceInfoFromC(d)); ok {
+						batch = append(batch, e)
+					}
+				}
 			}
-			if head.manufacturer_string != nil {
-				info.Manufacturer, _ = wcharTToString(head.manufacturer_string)
+			C.hid_hotplug_free_events(events)
+
+			for _, e := range batch {
+				select {
+				case result <- e:
+				case <-ctx.Done():
+					return
+				}
 			}
-			result <- &info
 		}
 	}()
 	return result
 }
 
+// SetBusyPoll makes the native event handling thread keep checking a device for
+// completed transfers for the given window after each completion, rather than
+// going back to sleep right away. This lowers the latency of devices reporting
+// every millisecond or so, at the expense of CPU time which can be monitored
+// with BusyPollStats. A spin lasts two windows at most, and ends early when the
+// thread is needed for another device. A zero window disables busy polling,
+// which is the default.
+func SetBusyPoll(window time.Duration) error {
+	if window < 0 {
+		return ErrInvalidParam
+	}
+	us := window / time.Microsecond
+	if us > math.MaxUint32 {
+		us = math.MaxUint32
+	}
+	if res := C.gid_set_busy_poll(C.uint(us)); res.res < 0 {
+		return errorFromCode(int(res.err))
+	}
+	return nil
+}
+
+// BusyPollStats returns the busy polling counters, see SetBusyPoll.
+func BusyPollStats() PollStats {
+	var stats C.struct_hid_busy_poll_stats
+	C.hid_get_busy_poll_stats(&stats)
+	return PollStats{
+		Windows: uint64(stats.windows),
+		Polls:   uint64(stats.polls),
+		Hits:    uint64(stats.hits),
+		Misses:  uint64(stats.misses),
+		Spin:    time.Duration(stats.spin_ns),
+	}
+}
+
+// SetTrace enables the native trace ring of every event handling context, which
+// records the submission, reaping, timeout, cancellation and completion of
+// transfers without taking any lock. The capacity is the number of records kept
+// per context and is fixed once a ring exists, zero disables tracing.
+func SetTrace(capacity int) error {
+	if capacity < 0 || uint64(capacity) > math.MaxUint32 {
+		return ErrInvalidParam
+	}
+	if res := C.gid_set_trace(C.uint(capacity)); res.res < 0 {
+		return errorFromCode(int(res.err))
+	}
+	return nil
+}
+
+// DumpTrace returns up to max of the most recent records of the trace ring of
+// the context of the given index, oldest first, see SetTrace and SetContexts.
+func DumpTrace(index int, max int) ([]TraceEvent, error) {
+	if index < 0 || max < 0 {
+		return nil, ErrInvalidParam
+	}
+	if max == 0 {
+		return nil, nil
+	}
+	records := make([]C.struct_hid_trace_event, max)
+	res := C.gid_trace_dump(C.int(index), &records[0], C.int(max))
+	if res.res < 0 {
+		return nil, errorFromCode(int(res.err))
+	}
+	events := make([]TraceEvent, int(res.res))
+	for i := range events {
+		r := &records[i]
+		events[i] = TraceEvent{
+			Time:         time.Duration(r.timestamp_ns),
+			Transfer:     uintptr(r.transfer),
+			Kind:         TraceKind(r._type),
+			Endpoint:     uint8(r.endpoint),
+			TransferType: uint8(r.transfer_type),
+			Status:       int(r.status),
+			Length:       int(r.length),
+		}
+	}
+	return events, nil
+}
+
+// deviceInfoFromC converts a native enumeration record.
+func deviceInfoFromC(d *C.struct_hid_device_info) DeviceInfo {
+	info := DeviceInfo{
+		Path:          C.GoString(d.path),
+		VendorID:      uint16(d.vendor_id),
+		ProductID:     uint16(d.product_id),
+		VersionNumber: uint16(d.release_number),
+	}
+	if d.serial_number != nil {
+		info.SerialNumber, _ = wcharTToString(d.serial_number)
+	}
+	if d.product_string != nil {
+		info.Product, _ = wcharTToString(d.product_string)
+	}
+	if d.manufacturer_string != nil {
+		info.Manufacturer, _ = wcharTToString(d.manufacturer_string)
+	}
+	return info
+}
+
 // ByPath returns a device by its path.
 func ByPath(path string) (*DeviceInfo, error) {
-	ch := Devices()
-	defer drainDevices(ch)
-
-	for d := range ch {
-		if d.Path == path {
-			return d, nil
+	infos := Snapshot()
+	for i := range infos {
+		if infos[i].Path == path {
+			return &infos[i], nil
 		}
 	}
 	return nil, errDeviceNotFound
 }
 
-// Open connects to an HID device by its path name.
+// maxScanThreads is the most threads SetScanThreads accepts.
+const maxScanThreads = 64
+
+// SetScanThreads spreads the sysfs reads done while scanning for devices over
+// the given number of threads, which shortens the scan on hosts with many USB
+// devices. Scans happen when the library initializes and when SetContexts adds
+// contexts. Zero, the default, scans on the calling thread only. At most 64
+// threads are accepted.
+func SetScanThreads(n int) error {
+	if n < 0 || n > maxScanThreads {
+		return ErrInvalidParam
+	}
+	if res := C.gid_set_scan_threads(C.uint(n)); res.res < 0 {
+		return errorFromCode(int(res.err))
+	}
+	return nil
+}
+
+// sysfsDevice is what a scan of the sysfs tree reads about a device.
+type sysfsDevice struct {
+	name        string
+	bus         uint8
+	address     uint8
+	descriptors int // Length of the descriptors read
+	status      int // Native error code of the reads, zero on success
+}
+
+// scanSysfsTree scans the sysfs tree at root the way the native library lists
+// the devices when it initializes, spreading the reads over the given number
+// of threads. It lets the tests exercise the scan on a tree of their own, and
+// fails while the native library uses the real tree.
+func scanSysfsTree(root string, threads int) ([]sysfsDevice, error) {
+	croot := C.CString(root)
+	defer C.free(unsafe.Pointer(croot))
+
+	infos := make([]C.struct_sysfs_device_info, 64)
+	for {
+		n := int(C.linux_sysfs_scan_tree(croot, C.uint(threads), &infos[0], C.int(len(infos))))
+		if n < 0 {
+			return nil, errorFromCode(n)
+		}
+		if n > len(infos) {
+			infos = make([]C.struct_sysfs_device_info, n)
+			continue
+		}
+		devices := make([]sysfsDevice, n)
+		for i := range devices {
+			info := &infos[i]
+			devices[i] = sysfsDevice{
+				name:        C.GoString(&info.devname[0]),
+				bus:         uint8(info.busnum),
+				address:     uint8(info.devaddr),
+				descriptors: int(info.descriptors_len),
+				status:      int(info.status),
+			}
+		}
+		return devices, nil
+	}
+}
+
+// hotplugChange is a device removal or arrival reported by the kernel.
+type hotplugChange struct {
+	removed bool
+	bus     uint8
+	address uint8
+	name    string // Name of the device in sysfs, only set for messages
+}
+
+// foldHotplugChanges folds the messages read from the kernel within a debounce
+// window into the changes the native hotplug monitor reports for them. It lets
+// the tests exercise the folding without a netlink socket, and fails while the
+// native library monitors the real devices.
+func foldHotplugChanges(messages []hotplugChange) ([]hotplugChange, error) {
+	msgs := make([]C.struct_linux_hotplug_change, len(messages)+1)
+	for i, m := range messages {
+		name := C.CString(m.name)
+		defer C.free(unsafe.Pointer(name))
+		msgs[i] = C.struct_linux_hotplug_change{
+			busnum:   C.uint8_t(m.bus),
+			devaddr:  C.uint8_t(m.address),
+			sys_name: name,
+		}
+		if m.removed {
+			msgs[i].detached = 1
+		}
+	}
+	// Each message changes one device at most twice
+	changes := make([]C.struct_linux_hotplug_change, 2*len(messages)+1)
+	n := int(C.linux_netlink_fold_changes(&msgs[0], C.int(len(messages)), &changes[0], C.int(len(changes))))
+	if n < 0 {
+		return nil, errorFromCode(n)
+	}
+	folded := make([]hotplugChange, n)
+	for i := range folded {
+		c := &changes[i]
+		folded[i] = hotplugChange{removed: c.detached != 0, bus: uint8(c.busnum), address: uint8(c.devaddr)}
+	}
+	return folded, nil
+}
+
+// SetHotplugDebounce sets how long the hotplug monitor collects device changes
+// before reporting them to Watch and the other hotplug consumers. A device
+// removed and added again within the window is reported at most once in each
+// direction, and not at all if it comes back at the same address. The window
+// is rounded down to milliseconds and may not exceed 10 seconds. Zero, the
+// default, only coalesces the changes read in one wakeup of the monitor.
+func SetHotplugDebounce(window time.Duration) error {
+	if window < 0 || window > 10*time.Second {
+		return ErrInvalidParam
+	}
+	ms := window / time.Millisecond
+	if res := C.gid_set_hotplug_debounce(C.uint(ms)); res.res < 0 {
+		return errorFromCode(int(res.err))
+	}
+	return nil
+}
+
+// UseHidrawBackend lists the devices bound to the kernel hidraw driver instead
+// of the USB devices seen through libusb if enable is true, and switches back
+// to libusb otherwise. Devices opened through hidraw are read and written as
+// plain files, so a blocked Read waits in the Go runtime poller rather than in
+// a native thread. The kernel driver stays bound to them, and Bluetooth and I2C
+// devices are listed too. Their paths name the hidraw node, from which Open
+// picks the backend, so devices listed before a switch can still be opened.
+//
+// Building with the hidraw tag makes hidraw the default backend.
+func UseHidrawBackend(enable bool) error {
+	if !enable {
+		atomic.StoreInt32(&hidrawBackend, 0)
+		return nil
+	}
+	if _, err := os.Stat(hidrawClassDir); err != nil {
+		return ErrNotSupported
+	}
+	atomic.StoreInt32(&hidrawBackend, 1)
+	return nil
+}
+
+// UseVirtualBackend switches the native library to a simulated bus holding the
+// devices added with AddVirtualDevice instead of the USB devices of the system,
+// so that enumeration, hotplug and I/O can be exercised without hardware. It
+// must be called before any device is enumerated or opened, and fails with
+// ErrBusy afterwards.
+func UseVirtualBackend() error {
+	name := C.CString("virtual")
+	defer C.free(unsafe.Pointer(name))
+	if res := C.gid_set_backend(name); res.res < 0 {
+		return errorFromCode(int(res.err))
+	}
+	return nil
+}
+
+// AddVirtualDevice plugs a simulated device into the bus of the virtual
+// backend, see UseVirtualBackend, and returns its ID. The device can be added
+// before the backend is selected.
+func AddVirtualDevice(d VirtualDevice) (int, error) {
+	if d.ReportInterval < 0 || d.ControlLatency < 0 ||
+		d.ReportInterval/time.Microsecond > math.MaxUint32 ||
+		d.ControlLatency/time.Microsecond > math.MaxUint32 {
+		return 0, ErrInvalidParam
+	}
+	desc := C.struct_hid_virtual_device{
+		vendor_id:             C.ushort(d.VendorID),
+		product_id:            C.ushort(d.ProductID),
+		release_number:        C.ushort(d.VersionNumber),
+		input_report_length:   C.ushort(d.InputReportLength),
+		output_report_length:  C.ushort(d.OutputReportLength),
+		feature_report_length: C.ushort(d.FeatureReportLength),
+		report_interval_us:    C.uint(d.ReportInterval / time.Microsecond),
+		latency_us:            C.uint(d.ControlLatency / time.Microsecond),
+		interface_count:       C.uchar(d.Interfaces),
+	}
+	fields := []struct {
+		dst **C.char
+		src string
+	}{
+		{&desc.manufacturer_string, d.Manufacturer},
+		{&desc.product_string, d.Product},
+		{&desc.serial_number, d.SerialNumber},
+	}
+	for _, s := range fields {
+		if s.src != "" {
+			*s.dst = C.CString(s.src)
+			defer C.free(unsafe.Pointer(*s.dst))
+		}
+	}
+	res := C.gid_virtual_add_device(&desc)
+	if res.res < 0 {
+		return 0, errorFromCode(int(res.err))
+	}
+	return int(res.res), nil
+}
+
+// RemoveVirtualDevice unplugs a device added with AddVirtualDevice.
+func RemoveVirtualDevice(id int) error {
+	if res := C.gid_virtual_remove_device(C.int(id)); res.res < 0 {
+		return errorFromCode(int(res.err))
+	}
+	return nil
+}
+
+// SetContexts sets the number of native event handling contexts devices are
+// spread over, so that the completions of devices on different contexts are
+// handled without contending for the same locks. It must be called before any
+// device is enumerated or opened, and fails with ErrBusy afterwards.
+func SetContexts(n int) error {
+	if n < 1 || n > C.HID_MAX_CONTEXTS {
+		return ErrInvalidParam
+	}
+	if res := C.gid_set_context_count(C.int(n)); res.res < 0 {
+		return errorFromCode(int(res.err))
+	}
+	return nil
+}
+
+// Open connects to an HID device by its path name. The event handling context
+// of the device is picked from its path, see SetContexts. Devices listed by the
+// hidraw backend are opened through their hidraw node.
 func (di *DeviceInfo) Open() (Device, error) {
-	enumerateLock.Lock()
-	defer enumerateLock.Unlock()
+	return di.open(-1)
+}
 
+// OpenOn connects to an HID device by its path name, handling its events on the
+// context of the given index, which must be below the count set with SetContexts.
+// The index is ignored for devices listed by the hidraw backend.
+func (di *DeviceInfo) OpenOn(index int) (Device, error) {
+	if index < 0 {
+		return nil, ErrInvalidParam
+	}
+	return di.open(index)
+}
+
+// open connects to an HID device on the context of the given index, or on the
+// one picked from its path if index is negative.
+func (di *DeviceInfo) open(index int) (Device, error) {
+	if isHidrawPath(di.Path) {
+		return openHidraw(di)
+	}
 	path := C.CString(di.Path)
 	defer C.free(unsafe.Pointer(path))
 
-	device := C.hid_open_path(path)
-	if device == nil {
-		return nil, errors.New("hidapi: failed to open device")
+	opened := C.gid_open_path(path, C.int(index))
+	if opened.dev == nil {
+		return nil, errorFromCode(int(opened.err))
 	}
 	return &linuxDevice{
 		DeviceInfo: di,
-		device:     device,
+		handle:     unsafe.Pointer(opened.dev),
+		drained:    make(chan struct{}),
 	}, nil
 }
 
+// maxInterfaces is the number of interfaces a device can have, whose numbers
+// are bytes.
+const maxInterfaces = 256
+
+// OpenInterfaces connects to every HID interface of the composite device di is
+// an interface of. The interfaces share one native handle and one thread
+// receiving their input reports, where opening them one by one takes a handle
+// and a thread apiece. They are returned in the order of the configuration
+// descriptor, each with the path of its interface, and are closed one by one,
+// the device being released along with the last of them. Devices listed by the
+// hidraw backend can't be opened this way.
+func (di *DeviceInfo) OpenInterfaces() ([]Device, error) {
+	if isHidrawPath(di.Path) {
+		return nil, ErrNotSupported
+	}
+	path := C.CString(di.Path)
+	defer C.free(unsafe.Pointer(path))
+
+	handles := make([]*C.hid_device, maxInterfaces)
+	opened := C.gid_open_interfaces(path, &handles[0], C.int(len(handles)))
+	if opened.res < 0 {
+		return nil, errorFromCode(int(opened.err))
+	}
+
+	// Interface paths only differ by the number after the last colon
+	prefix := di.Path[:strings.LastIndexByte(di.Path, ':')+1]
+	devs := make([]Device, int(opened.res))
+	for i := range devs {
+		info := *di
+		info.Path = fmt.Sprintf("%s%02x", prefix, int(C.gid_interface(handles[i])))
+		devs[i] = &linuxDevice{
+			DeviceInfo: &info,
+			handle:     unsafe.Pointer(handles[i]),
+			drained:    make(chan struct{}),
+		}
+	}
+	return devs, nil
+}
+
+// deviceClosed is the flag in linuxDevice.state marking a closed handle.
+const deviceClosed = 1 << 30
+
 // Device is a live HID USB connected device handle.
+//
+// The I/O methods don't synchronize with each other: each of them pins the
+// handle by bumping the in-flight counter in state, which Close waits to drain
+// before releasing the native handle.
 type linuxDevice struct {
 	*DeviceInfo // Embed the infos for easier access
 
-	device *C.hid_device // Low level HID device to communicate through
-	lock   sync.Mutex
+	handle  unsafe.Pointer // Low level *C.hid_device to communicate through, nil once closed
+	state   int32          // Number of in-flight calls, or'ed with deviceClosed once closing
+	drained chan struct{}  // Closed by the last in-flight call to finish after Close
+
+	info     DeviceInfo // The infos completed with the strings of the device, see Info
+	infoOnce sync.Once
+}
+
+// acquire pins the native handle for the duration of a call, returning nil if
+// the device has been closed. Every successful acquire must be released.
+func (dev *linuxDevice) acquire() *C.hid_device {
+	for {
+		state := atomic.LoadInt32(&dev.state)
+		if state&deviceClosed != 0 {
+			return nil
+		}
+		if atomic.CompareAndSwapInt32(&dev.state, state, state+1) {
+			return (*C.hid_device)(atomic.LoadPointer(&dev.handle))
+		}
+	}
+}
+
+// release unpins the native handle, waking a pending Close if this was the
+// last call in flight.
+func (dev *linuxDevice) release() {
+	if atomic.AddInt32(&dev.state, -1) == deviceClosed {
+		close(dev.drained)
+	}
+}
+
+// closed reports whether Close has been called on the device.
+func (dev *linuxDevice) closed() bool {
+	return atomic.LoadInt32(&dev.state)&deviceClosed != 0
 }
 
 // Close releases the HID USB device handle.
+//
+// Blocked reads are woken up and fail with a closed device error, other calls
+// in flight are waited for before the native handle is freed.
 func (dev *linuxDevice) Close() {
-	dev.lock.Lock()
-	defer dev.lock.Unlock()
+	var state int32
+	for {
+		state = atomic.LoadInt32(&dev.state)
+		if state&deviceClosed != 0 {
+			return
+		}
+		if atomic.CompareAndSwapInt32(&dev.state, state, state|deviceClosed) {
+			break
+		}
+	}
+	device := (*C.hid_device)(atomic.LoadPointer(&dev.handle))
+	if state != 0 {
+		C.hid_shutdown(device)
+		<-dev.drained
+	}
+	atomic.StorePointer(&dev.handle, nil)
+	C.hid_close(device)
+}
 
-	if dev.device != nil {
-		C.hid_close(dev.device)
-		dev.device = nil
+// failure converts the error code of a failed native call into an error.
+func (dev *linuxDevice) failure(code C.int) error {
+	// Verify if closed or other error
+	if dev.closed() {
+		return errDeviceClosed
 	}
-	return
+	// Device not closed, some other error occurred
+	return errorFromCode(int(code))
 }
 
 // Write sends an output report to a HID device.
@@ -114,33 +720,18 @@ func (dev *linuxDevice) Write(b []byte) error {
 		return nil
 	}
 	// Abort if device closed in between
-	dev.lock.Lock()
-	device := dev.device
-	dev.lock.Unlock()
-
+	device := dev.acquire()
 	if device == nil {
 		return errDeviceClosed
 	}
+	defer dev.release()
+
 	report := b
 
 	// Execute the write operation
-	written := int(C.hid_write(device, (*C.uchar)(&report[0]), C.size_t(len(report))))
-	if written == -1 {
-		// If write failed, verify if closed or other error
-		dev.lock.Lock()
-		device = dev.device
-		dev.lock.Unlock()
-
-		if device == nil {
-			return errDeviceClosed
-		}
-		// Device not closed, some other error occurred
-		message := C.hid_error(device)
-		if message == nil {
-			return errors.New("hidapi: unknown failure")
-		}
-		failure, _ := wcharTToString(message)
-		return errors.New("hidapi: " + failure)
+	written := C.gid_write(device, (*C.uchar)(&report[0]), C.size_t(len(report)))
+	if written.res == -1 {
+		return dev.failure(written.err)
 	}
 
 	return nil
@@ -163,32 +754,16 @@ func (dev *linuxDevice) WriteFeature(b []byte) error {
 		return nil
 	}
 	// Abort if device closed in between
-	dev.lock.Lock()
-	device := dev.device
-	dev.lock.Unlock()
-
+	device := dev.acquire()
 	if device == nil {
 		return errDeviceClosed
 	}
+	defer dev.release()
 
 	// Send the feature report
-	written := int(C.hid_send_feature_report(device, (*C.uchar)(&b[0]), C.size_t(len(b))))
-	if written == -1 {
-		// If write failed, verify if closed or other error
-		dev.lock.Lock()
-		device = dev.device
-		dev.lock.Unlock()
-
-		if device == nil {
-			return errDeviceClosed
-		}
-		// Device not closed, some other error occurred
-		message := C.hid_error(device)
-		if message == nil {
-			return errors.New("hidapi: unknown failure")
-		}
-		failure, _ := wcharTToString(message)
-		return errors.New("hidapi: " + failure)
+	written := C.gid_send_feature_report(device, (*C.uchar)(&b[0]), C.size_t(len(b)))
+	if written.res == -1 {
+		return dev.failure(written.err)
 	}
 	return nil
 }
@@ -197,6 +772,88 @@ func (dev *linuxDevice) WriteInterrupt(endpoint byte, data []byte) (int, error)
 	return 0, errNotImplemented
 }
 
+// Stats returns the I/O counters of the device, or zeroes once it is closed.
+func (dev *linuxDevice) Stats() DeviceStats {
+	device := dev.acquire()
+	if device == nil {
+		return DeviceStats{}
+	}
+	defer dev.release()
+
+	var stats C.struct_hid_device_stats
+	if C.hid_get_device_stats(device, &stats) < 0 {
+		return DeviceStats{}
+	}
+	return DeviceStats{
+		ReportsReceived: uint64(stats.reports_received),
+		ReportsDropped:  uint64(stats.reports_dropped),
+		BytesReceived:   uint64(stats.bytes_received),
+		Writes:          uint64(stats.writes),
+		BytesWritten:    uint64(stats.bytes_written),
+		FeatureGets:     uint64(stats.feature_gets),
+		FeatureSets:     uint64(stats.feature_sets),
+		Timeouts:        uint64(stats.timeouts),
+		Errors:          uint64(stats.errors),
+		ZeroCopy:        C.hid_get_read_buffer_mode(device) == C.HID_BUFFER_DEVICE,
+		ReadLatency:     latencyFromC(&stats.read_latency),
+		WriteLatency:    latencyFromC(&stats.write_latency),
+		FeatureLatency:  latencyFromC(&stats.feature_latency),
+	}
+}
+
+// Info returns the description of the device. The strings missing from the
+// DeviceInfo it was opened from are read from the device on the first call,
+// later calls return them from memory. The native layer caches them too, for
+// as long as the handle is open.
+func (dev *linuxDevice) Info() DeviceInfo {
+	dev.infoOnce.Do(func() {
+		dev.info = *dev.DeviceInfo
+		device := dev.acquire()
+		if device == nil {
+			return
+		}
+		defer dev.release()
+
+		var buf [256]C.wchar_t
+		str := func(res C.int) string {
+			if res < 0 {
+				return ""
+			}
+			s, _ := wcharTToString(&buf[0])
+			return s
+		}
+		if dev.info.Manufacturer == "" {
+			dev.info.Manufacturer = str(C.hid_get_manufacturer_string(device, &buf[0], C.size_t(len(buf))))
+		}
+		if dev.info.Product == "" {
+			dev.info.Product = str(C.hid_get_product_string(device, &buf[0], C.size_t(len(buf))))
+		}
+		if dev.info.SerialNumber == "" {
+			dev.info.SerialNumber = str(C.hid_get_serial_number_string(device, &buf[0], C.size_t(len(buf))))
+		}
+	})
+	return dev.info
+}
+
+// latencyFromC converts a native latency histogram, keeping non-empty buckets.
+func latencyFromC(h *C.struct_hid_latency_histogram) LatencyHistogram {
+	hist := LatencyHistogram{
+		Count: uint64(h.count),
+		Sum:   time.Duration(h.sum_ns),
+	}
+	for i, n := range h.buckets {
+		if n == 0 {
+			continue
+		}
+		hist.Buckets = append(hist.Buckets, LatencyBucket{
+			Min:   time.Duration(C.hid_latency_bucket_floor(C.int(i))) * time.Microsecond,
+			Max:   time.Duration(C.hid_latency_bucket_floor(C.int(i+1))) * time.Microsecond,
+			Count: uint64(n),
+		})
+	}
+	return hist
+}
+
 // Read retrieves an input report from a HID device.
 func (dev *linuxDevice) Read(b []byte) (int, error) {
 	// Abort if nothing to read
@@ -204,33 +861,18 @@ func (dev *linuxDevice) Read(b []byte) (int, error) {
 		return 0, nil
 	}
 	// Abort if device closed in between
-	dev.lock.Lock()
-	device := dev.device
-	dev.lock.Unlock()
-
+	device := dev.acquire()
 	if device == nil {
 		return 0, errDeviceClosed
 	}
-	// Execute the read operation
-	read := int(C.hid_read(device, (*C.uchar)(&b[0]), C.size_t(len(b))))
-	if read == -1 {
-		// If the read failed, verify if closed or other error
-		dev.lock.Lock()
-		device = dev.device
-		dev.lock.Unlock()
+	defer dev.release()
 
-		if device == nil {
-			return 0, errDeviceClosed
-		}
-		// Device not closed, some other error occurred
-		message := C.hid_error(device)
-		if message == nil {
-			return 0, errors.New("hidapi: unknown failure")
-		}
-		failure, _ := wcharTToString(message)
-		return 0, errors.New("hidapi: " + failure)
+	// Execute the read operation
+	read := C.gid_read(device, (*C.uchar)(&b[0]), C.size_t(len(b)))
+	if read.res == -1 {
+		return 0, dev.failure(read.err)
 	}
-	return read, nil
+	return int(read.res), nil
 }
 
 // ReadFeature retrieves a feature report from a HID device
@@ -244,36 +886,19 @@ func (dev *linuxDevice) ReadFeature(b []byte) (int, error) {
 		return 0, nil
 	}
 	// Abort if device closed in between
-	dev.lock.Lock()
-	device := dev.device
-	dev.lock.Unlock()
-
+	device := dev.acquire()
 	if device == nil {
 		return 0, errDeviceClosed
 	}
+	defer dev.release()
 
 	// Retrieve the feature report
-	read := int(C.hid_get_feature_report(device, (*C.uchar)(&b[0]), C.size_t(len(b))))
-	if read == -1 {
-		// If the read failed, verify if closed or other error
-		dev.lock.Lock()
-		device = dev.device
-		dev.lock.Unlock()
-
-		if device == nil {
-			return 0, errDeviceClosed
-		}
-
-		// Device not closed, some other error occurred
-		message := C.hid_error(device)
-		if message == nil {
-			return 0, errors.New("hidapi: unknown failure")
-		}
-		failure, _ := wcharTToString(message)
-		return 0, errors.New("hidapi: " + failure)
+	read := C.gid_get_feature_report(device, (*C.uchar)(&b[0]), C.size_t(len(b)))
+	if read.res == -1 {
+		return 0, dev.failure(read.err)
 	}
 
-	return read, nil
+	return int(read.res), nil
 }
 
 func (dev *linuxDevice) ReadInterrupt(endpoint byte, data []byte) (int, error) {
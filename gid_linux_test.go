@@ -0,0 +1,137 @@
+//go:build cgo
+// +build cgo
+
+package gid
+
+import (
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"strings"
+	"testing"
+)
+
+func TestScanSysfsTree(t *testing.T) {
+	root, err := ioutil.TempDir("", "gid-sysfs")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(root)
+
+	want := make(map[string]sysfsDevice)
+	write := func(dir, attr string, data []byte) {
+		if err := ioutil.WriteFile(filepath.Join(root, dir, attr), data, 0644); err != nil {
+			t.Fatal(err)
+		}
+	}
+	add := func(name string, bus, address uint8, descriptors int) {
+		if err := os.Mkdir(filepath.Join(root, name), 0755); err != nil {
+			t.Fatal(err)
+		}
+		write(name, "busnum", []byte(fmt.Sprintf("%d\n", bus)))
+		write(name, "devnum", []byte(fmt.Sprintf("%d\n", address)))
+		write(name, "speed", []byte("480\n"))
+		write(name, "descriptors", make([]byte, descriptors))
+		want[name] = sysfsDevice{name: name, bus: bus, address: address, descriptors: descriptors}
+	}
+	// Root hubs with two levels of devices behind them, one of which has
+	// more descriptors than are read at once
+	for bus := uint8(1); bus <= 3; bus++ {
+		add(fmt.Sprintf("usb%d", bus), bus, 1, 18+9+9+7)
+		for port := uint8(1); port <= 8; port++ {
+			add(fmt.Sprintf("%d-%d", bus, port), bus, 1+port, 18+9+9+9+7)
+			add(fmt.Sprintf("%d-%d.%d", bus, port, port), bus, 10+port, 18+9+9+9+7+7)
+		}
+	}
+	add("3-9", 3, 20, 6000)
+	// A device gone while scanning, an interface and a driver link are skipped
+	add("2-9", 2, 21, 18)
+	os.Remove(filepath.Join(root, "2-9", "devnum"))
+	want["2-9"] = sysfsDevice{name: "2-9", bus: 2, status: -4}
+	if err := os.Mkdir(filepath.Join(root, "1-1:1.0"), 0755); err != nil {
+		t.Fatal(err)
+	}
+	write(".", "uevent", nil)
+
+	for _, threads := range []int{0, 1, 4} {
+		devices, err := scanSysfsTree(root, threads)
+		if err == ErrBusy {
+			t.Skip("the native library is using the real sysfs tree")
+		}
+		if err != nil {
+			t.Fatalf("%d threads: can't scan: %v", threads, err)
+		}
+		if len(devices) != len(want) {
+			t.Errorf("%d threads: %d devices, want %d", threads, len(devices), len(want))
+		}
+		seen := make(map[string]int)
+		for i, dev := range devices {
+			seen[dev.name] = i
+			if dev != want[dev.name] {
+				t.Errorf("%d threads: read %+v, want %+v", threads, dev, want[dev.name])
+			}
+			// Parents come first, root hubs being the parents of the
+			// devices with no dot in their name
+			parent := fmt.Sprintf("usb%c", dev.name[0])
+			if i := strings.LastIndexByte(dev.name, '.'); i > 0 {
+				parent = dev.name[:i]
+			}
+			if _, ok := seen[parent]; !ok && !strings.HasPrefix(dev.name, "usb") {
+				t.Errorf("%d threads: %s listed before its parent %s", threads, dev.name, parent)
+			}
+		}
+	}
+}
+
+func TestHotplugFold(t *testing.T) {
+	removed := func(bus, address uint8, name string) hotplugChange {
+		return hotplugChange{removed: true, bus: bus, address: address, name: name}
+	}
+	arrived := func(bus, address uint8, name string) hotplugChange {
+		return hotplugChange{bus: bus, address: address, name: name}
+	}
+	tests := []struct {
+		name     string
+		messages []hotplugChange
+		want     []hotplugChange
+	}{
+		{
+			name:     "back at the same address",
+			messages: []hotplugChange{removed(1, 5, "1-2"), arrived(1, 5, "1-2")},
+		},
+		{
+			name:     "back at a new address",
+			messages: []hotplugChange{removed(1, 5, "1-2"), arrived(1, 6, "1-2")},
+			want:     []hotplugChange{removed(1, 5, ""), arrived(1, 6, "")},
+		},
+		{
+			name:     "gone again",
+			messages: []hotplugChange{arrived(1, 7, "1-3"), removed(1, 7, "1-3")},
+		},
+		{
+			name:     "several devices",
+			messages: []hotplugChange{removed(1, 5, "1-2"), arrived(2, 3, "2-1"), arrived(1, 5, "1-2")},
+			want:     []hotplugChange{arrived(2, 3, "")},
+		},
+	}
+	for _, test := range tests {
+		got, err := foldHotplugChanges(test.messages)
+		if err == ErrBusy {
+			t.Skip("the native library is monitoring the real devices")
+		}
+		if err != nil {
+			t.Fatalf("%s: can't fold: %v", test.name, err)
+		}
+		if len(got) != len(test.want) {
+			t.Errorf("%s: folded into %+v, want %+v", test.name, got, test.want)
+			continue
+		}
+		for i := range got {
+			if got[i] != test.want[i] {
+				t.Errorf("%s: folded into %+v, want %+v", test.name, got, test.want)
+				break
+			}
+		}
+	}
+}
@@ -1,12 +1,93 @@
 package gid_test
 
 import (
+	"bytes"
+	"context"
+	"encoding/binary"
+	"fmt"
+	"os"
+	"runtime"
+	"strings"
 	"sync"
 	"testing"
+	"time"
 
 	"github.com/b1ug/gid"
 )
 
+// virtual is set when the tests run against the simulated bus rather than the
+// devices plugged into the machine, see TestMain.
+var virtual bool
+
+// testContexts is the number of event handling contexts used on the simulated
+// bus, so that devices are spread over several of them.
+const testContexts = 4
+
+// TestMain puts a blink(1) lookalike on the simulated bus of the libusb backend,
+// so the tests exercise enumeration and I/O end to end without hardware. Set
+// GID_TEST_HARDWARE to test against the real devices instead.
+func TestMain(m *testing.M) {
+	if runtime.GOOS == "linux" && gid.Supported() && os.Getenv("GID_TEST_HARDWARE") == "" {
+		if err := gid.UseVirtualBackend(); err != nil {
+			panic(err)
+		}
+		if err := gid.SetContexts(testContexts); err != nil {
+			panic(err)
+		}
+		// The simulated bus is only seen through libusb, even when built
+		// with hidraw as the default backend
+		gid.UseHidrawBackend(false)
+		if _, err := gid.AddVirtualDevice(gid.VirtualDevice{
+			VendorID:            0x27b8,
+			ProductID:           0x01ed,
+			VersionNumber:       0x0002,
+			Manufacturer:        "ThingM",
+			Product:             "blink(1) mk2",
+			SerialNumber:        "20000001",
+			InputReportLength:   8,
+			FeatureReportLength: 8,
+			ReportInterval:      time.Millisecond,
+		}); err != nil {
+			panic(err)
+		}
+		virtual = true
+	}
+	os.Exit(m.Run())
+}
+
+// addVirtual plugs a device with the given serial number into the simulated bus,
+// and returns its enumeration record and a function unplugging it.
+func addVirtual(t *testing.T, d gid.VirtualDevice) (*gid.DeviceInfo, func()) {
+	if !virtual {
+		t.Skip("not running on the simulated bus")
+	}
+	id, err := gid.AddVirtualDevice(d)
+	if err != nil {
+		t.Fatalf("can't add virtual device: %v", err)
+	}
+	remove := func() { gid.RemoveVirtualDevice(id) }
+
+	info := gid.ListFirstDevice(func(info *gid.DeviceInfo) bool {
+		return info.SerialNumber == d.SerialNumber
+	})
+	if info == nil {
+		remove()
+		t.Fatalf("virtual device %q not enumerated", d.SerialNumber)
+	}
+	return info, remove
+}
+
+// readTimeout reads an input report, closing the device if none arrives in time.
+func readTimeout(t *testing.T, dev gid.Device, buf []byte) int {
+	timer := time.AfterFunc(5*time.Second, dev.Close)
+	defer timer.Stop()
+	n, err := dev.Read(buf)
+	if err != nil {
+		t.Fatalf("can't read input report: %v", err)
+	}
+	return n
+}
+
 func TestSupported(t *testing.T) {
 	if !gid.Supported() {
 		t.Error("platform is not supported")
@@ -40,6 +121,266 @@ func TestListAll(t *testing.T) {
 	}
 }
 
+func TestSnapshot(t *testing.T) {
+	infos := gid.Snapshot()
+
+	listed := make(map[string]int)
+	var count int
+	for info := range gid.Devices() {
+		listed[info.Path]++
+		count++
+	}
+	if count != len(infos) {
+		t.Fatalf("Snapshot found %d devices, Devices %d", len(infos), count)
+	}
+	for _, info := range infos {
+		if info.Path == "" {
+			t.Errorf("device without path: %+v", info)
+		}
+		if listed[info.Path] == 0 {
+			t.Errorf("device missing from Devices: %+v", info)
+		}
+		listed[info.Path]--
+		t.Logf("%+v", info)
+	}
+}
+
+func TestWatch(t *testing.T) {
+	ctx, cancel := context.WithTimeout(context.Background(), 200*time.Millisecond)
+	defer cancel()
+
+	// The attached devices are reported as arrivals, then the channel must be
+	// closed once the context expires.
+	for ev := range gid.Watch(ctx, nil) {
+		t.Logf("%v: %+v", ev.Type, ev.Device)
+	}
+}
+
+func TestOpenMissing(t *testing.T) {
+	if runtime.GOOS != "linux" || !gid.Supported() {
+		t.Skip("typed errors are only reported by the libusb backend")
+	}
+	dev, err := (&gid.DeviceInfo{Path: "ffff:ffff:ff"}).Open()
+	if err == nil {
+		dev.Close()
+		t.Fatal("opened a device which can't exist")
+	}
+	if _, ok := err.(*gid.Error); !ok {
+		t.Fatalf("untyped error %T: %v", err, err)
+	}
+	// Without a USB bus to look the device up on, such as in a container
+	// tested against the hardware, the native library fails to initialize
+	if (virtual || err != gid.ErrOther) && err != gid.ErrNotFound {
+		t.Fatalf("open failed with %v, want %v", err, gid.ErrNotFound)
+	}
+}
+
+func TestBusyPoll(t *testing.T) {
+	if runtime.GOOS != "linux" || !gid.Supported() {
+		t.Skip("busy polling is only implemented by the libusb backend")
+	}
+	if err := gid.SetBusyPoll(-time.Millisecond); err != gid.ErrInvalidParam {
+		t.Fatalf("negative window accepted: %v", err)
+	}
+	if err := gid.SetBusyPoll(200 * time.Microsecond); err != nil {
+		t.Fatalf("can't enable busy polling: %v", err)
+	}
+	defer gid.SetBusyPoll(0)
+
+	stats := gid.BusyPollStats()
+	if stats.Hits > stats.Polls || stats.Misses > stats.Windows {
+		t.Fatalf("inconsistent counters: %+v", stats)
+	}
+	t.Logf("busy poll stats: %+v", stats)
+}
+
+func TestBusyPollStream(t *testing.T) {
+	const window = 2 * time.Millisecond
+	info, remove := addVirtual(t, gid.VirtualDevice{
+		VendorID:          0x1209,
+		ProductID:         0x0005,
+		SerialNumber:      "busypoll",
+		InputReportLength: 4,
+		ReportInterval:    500 * time.Microsecond,
+	})
+	defer remove()
+	other, removeOther := addVirtual(t, gid.VirtualDevice{
+		VendorID:            0x1209,
+		ProductID:           0x0005,
+		SerialNumber:        "busypollclose",
+		FeatureReportLength: 8,
+	})
+	defer removeOther()
+	second, err := other.OpenOn(0)
+	if err != nil {
+		t.Fatalf("can't open virtual device: %v", err)
+	}
+	if err := gid.SetBusyPoll(window); err != nil {
+		t.Fatalf("can't enable busy polling: %v", err)
+	}
+	defer gid.SetBusyPoll(0)
+	before := gid.BusyPollStats()
+
+	dev, err := info.OpenOn(0)
+	if err != nil {
+		second.Close()
+		t.Fatalf("can't open virtual device: %v", err)
+	}
+	defer dev.Close()
+	buf := make([]byte, 64)
+	for i := 0; i < 100; i++ {
+		readTimeout(t, dev, buf)
+	}
+
+	// The event handling thread spins on the stream, which must not hold
+	// up a device of the same context being closed.
+	closed := make(chan struct{})
+	go func() {
+		second.Close()
+		close(closed)
+	}()
+	select {
+	case <-closed:
+	case <-time.After(5 * time.Second):
+		t.Fatal("closing a device got stuck behind busy polling")
+	}
+
+	stats := gid.BusyPollStats()
+	windows := stats.Windows - before.Windows
+	hits := stats.Hits - before.Hits
+	spin := stats.Spin - before.Spin
+	t.Logf("%d windows, %d hits, %v spinning", windows, hits, spin)
+	if windows == 0 || hits == 0 {
+		t.Fatalf("nothing picked up while spinning: %+v", stats)
+	}
+	// Spins are capped at two windows, plus the last check for completions
+	if limit := time.Duration(windows) * (2*window + time.Millisecond); spin > limit {
+		t.Errorf("spun %v over %d windows, more than %v", spin, windows, limit)
+	}
+}
+
+func TestScanThreads(t *testing.T) {
+	if runtime.GOOS != "linux" || !gid.Supported() {
+		t.Skip("scan threads are only implemented by the libusb backend")
+	}
+	if err := gid.SetScanThreads(-1); err != gid.ErrInvalidParam {
+		t.Fatalf("negative thread count accepted: %v", err)
+	}
+	if err := gid.SetScanThreads(65); err != gid.ErrInvalidParam {
+		t.Fatalf("oversized pool accepted: %v", err)
+	}
+	if err := gid.SetScanThreads(4); err != nil {
+		t.Fatalf("can't set scan threads: %v", err)
+	}
+	defer gid.SetScanThreads(0)
+
+	if devices := gid.ListAllDevices(nil); virtual && len(devices) == 0 {
+		t.Fatal("no device found")
+	}
+}
+
+func TestOpenOn(t *testing.T) {
+	if _, err := (&gid.DeviceInfo{Path: "ffff:ffff:ff"}).OpenOn(-1); err == nil {
+		t.Fatal("opened a device on a negative context")
+	}
+	info, remove := addVirtual(t, gid.VirtualDevice{
+		VendorID:            0x1209,
+		ProductID:           0x0019,
+		SerialNumber:        "contexts",
+		FeatureReportLength: 8,
+	})
+	defer remove()
+	if err := gid.SetContexts(2); err != gid.ErrBusy {
+		t.Errorf("context count changed after initialization: %v", err)
+	}
+
+	buf := make([]byte, 9)
+	for i := 0; i < testContexts; i++ {
+		dev, err := info.OpenOn(i)
+		if err != nil {
+			t.Fatalf("can't open virtual device on context %d: %v", i, err)
+		}
+		report := []byte{1, 'o', byte(i), 0, 0, 0, 0, 0, 0}
+		if err := dev.WriteFeature(report); err != nil {
+			dev.Close()
+			t.Fatalf("can't write feature report on context %d: %v", i, err)
+		}
+		buf[0] = 1
+		n, err := dev.ReadFeature(buf)
+		dev.Close()
+		if err != nil || !bytes.Equal(buf[:n], report) {
+			t.Fatalf("feature report on context %d = %v (%v), want %v", i, buf[:n], err, report)
+		}
+	}
+	if dev, err := info.OpenOn(testContexts); err == nil {
+		dev.Close()
+		t.Fatalf("opened a device on context %d of %d", testContexts, testContexts)
+	}
+}
+
+func TestTrace(t *testing.T) {
+	if runtime.GOOS != "linux" || !gid.Supported() {
+		t.Skip("tracing is only implemented by the libusb backend")
+	}
+	info, remove := addVirtual(t, gid.VirtualDevice{
+		VendorID:            0x1209,
+		ProductID:           0x0006,
+		SerialNumber:        "trace",
+		FeatureReportLength: 8,
+	})
+	defer remove()
+	if err := gid.SetTrace(4096); err != nil {
+		t.Fatalf("can't enable tracing: %v", err)
+	}
+	defer gid.SetTrace(0)
+
+	dev, err := info.OpenOn(0)
+	if err != nil {
+		t.Fatalf("can't open virtual device: %v", err)
+	}
+	report := []byte{1, 't', 0, 0, 0, 0, 0, 0, 0}
+	if err := dev.WriteFeature(report); err != nil {
+		dev.Close()
+		t.Fatalf("can't write feature report: %v", err)
+	}
+	if _, err := dev.ReadFeature(report); err != nil {
+		dev.Close()
+		t.Fatalf("can't read feature report: %v", err)
+	}
+	dev.Close()
+
+	events, err := gid.DumpTrace(0, 4096)
+	if err != nil {
+		t.Fatalf("can't dump the trace: %v", err)
+	}
+	// The feature reports travel over control transfers, on endpoint 0
+	submitted := make(map[uintptr]time.Duration)
+	var roundTrips int
+	// Records of concurrent transfers may be slightly out of order, those of
+	// a single transfer are not
+	for _, ev := range events {
+		if ev.Endpoint != 0 {
+			continue
+		}
+		switch ev.Kind {
+		case gid.TraceSubmit:
+			submitted[ev.Transfer] = ev.Time
+		case gid.TraceComplete:
+			if at, ok := submitted[ev.Transfer]; ok {
+				if ev.Time < at {
+					t.Errorf("transfer completed at %v, before its submission at %v", ev.Time, at)
+				}
+				delete(submitted, ev.Transfer)
+				roundTrips++
+			}
+		}
+	}
+	if roundTrips == 0 {
+		t.Fatalf("no control transfer submitted and completed in %d records", len(events))
+	}
+	t.Logf("%d control transfers traced in %d records", roundTrips, len(events))
+}
+
 func TestOpenFirst(t *testing.T) {
 	dev := gid.ListFirstDevice(nil)
 	if dev == nil {
@@ -51,7 +392,859 @@ func TestOpenFirst(t *testing.T) {
 			t.Logf("can't open 1st device: %v", err)
 		} else {
 			t.Logf("opened 1st device: %+v", d)
+			t.Logf("stats of 1st device: %+v", d.Stats())
 			d.Close()
 		}
 	}
 }
+
+func TestLatencyHistogram(t *testing.T) {
+	h := gid.LatencyHistogram{
+		Count: 4,
+		Sum:   40 * time.Microsecond,
+		Buckets: []gid.LatencyBucket{
+			{Min: 4 * time.Microsecond, Max: 5 * time.Microsecond, Count: 3},
+			{Min: 26 * time.Microsecond, Max: 28 * time.Microsecond, Count: 1},
+		},
+	}
+	if m := h.Mean(); m != 10*time.Microsecond {
+		t.Errorf("mean = %v, want 10µs", m)
+	}
+	if q := h.Quantile(0.5); q != 5*time.Microsecond {
+		t.Errorf("median = %v, want 5µs", q)
+	}
+	if q := h.Quantile(0.99); q != 28*time.Microsecond {
+		t.Errorf("99th percentile = %v, want 28µs", q)
+	}
+	var empty gid.LatencyHistogram
+	if empty.Mean() != 0 || empty.Quantile(0.5) != 0 {
+		t.Errorf("empty histogram reports latencies")
+	}
+}
+
+func TestVirtualEnumerate(t *testing.T) {
+	info, remove := addVirtual(t, gid.VirtualDevice{
+		VendorID:      0x1209,
+		ProductID:     0x0001,
+		VersionNumber: 0x0100,
+		Manufacturer:  "gid",
+		Product:       "Prüfgerät",
+		SerialNumber:  "enumerate",
+	})
+	defer remove()
+	if info.VendorID != 0x1209 || info.ProductID != 0x0001 || info.VersionNumber != 0x0100 {
+		t.Errorf("wrong ids: %+v", info)
+	}
+	if info.Manufacturer != "gid" || info.Product != "Prüfgerät" {
+		t.Errorf("wrong strings: %+v", info)
+	}
+	if dup := gid.ListAllDevices(func(i *gid.DeviceInfo) bool { return i.Path == info.Path }); len(dup) != 1 {
+		t.Errorf("path %q enumerated %d times", info.Path, len(dup))
+	}
+}
+
+func TestDeviceInfo(t *testing.T) {
+	info, remove := addVirtual(t, gid.VirtualDevice{
+		VendorID:     0x1209,
+		ProductID:    0x0009,
+		Manufacturer: "gid",
+		Product:      "strings",
+		SerialNumber: "info",
+	})
+	removed := false
+	defer func() {
+		if !removed {
+			remove()
+		}
+	}()
+
+	enumerated, err := info.Open()
+	if err != nil {
+		t.Fatalf("can't open virtual device: %v", err)
+	}
+	defer enumerated.Close()
+	if got := enumerated.Info(); got != *info {
+		t.Errorf("info = %+v, want %+v", got, *info)
+	}
+
+	// Without enumeration, the strings are read from the device once
+	dev, err := (&gid.DeviceInfo{Path: info.Path}).Open()
+	if err != nil {
+		t.Fatalf("can't open virtual device by path: %v", err)
+	}
+	defer dev.Close()
+	want := gid.DeviceInfo{Path: info.Path, Manufacturer: "gid", Product: "strings", SerialNumber: "info"}
+	if got := dev.Info(); got != want {
+		t.Errorf("info read from device = %+v, want %+v", got, want)
+	}
+	remove()
+	removed = true
+	if got := dev.Info(); got != want {
+		t.Errorf("info of unplugged device = %+v, want %+v", got, want)
+	}
+}
+
+func TestVirtualEcho(t *testing.T) {
+	for _, output := range []uint16{0, 8} {
+		info, remove := addVirtual(t, gid.VirtualDevice{
+			VendorID:           0x1209,
+			ProductID:          0x0002,
+			SerialNumber:       "echo" + string(rune('0'+output)),
+			InputReportLength:  8,
+			OutputReportLength: output,
+			ControlLatency:     100 * time.Microsecond,
+		})
+		defer remove()
+		dev, err := info.Open()
+		if err != nil {
+			t.Fatalf("can't open virtual device: %v", err)
+		}
+
+		report := []byte{0, 1, 2, 3, 4, 5, 6, 7, 8}
+		if err := dev.Write(report); err != nil {
+			t.Fatalf("can't write output report: %v", err)
+		}
+		buf := make([]byte, 16)
+		n := readTimeout(t, dev, buf)
+		if !bytes.Equal(buf[:n], report[1:]) {
+			t.Errorf("echo over %d byte OUT endpoint = %v, want %v", output, buf[:n], report[1:])
+		}
+		if stats := dev.Stats(); stats.Writes != 1 || stats.ReportsReceived != 1 || !stats.ZeroCopy {
+			t.Errorf("wrong stats: %+v", stats)
+		}
+		dev.Close()
+	}
+}
+
+func TestVirtualFeature(t *testing.T) {
+	info, remove := addVirtual(t, gid.VirtualDevice{
+		VendorID:            0x1209,
+		ProductID:           0x0003,
+		SerialNumber:        "feature",
+		FeatureReportLength: 8,
+	})
+	defer remove()
+	dev, err := info.Open()
+	if err != nil {
+		t.Fatalf("can't open virtual device: %v", err)
+	}
+	defer dev.Close()
+
+	buf := make([]byte, 9)
+	buf[0] = 1
+	if n, err := dev.ReadFeature(buf); err != nil || n != 9 || buf[0] != 1 || buf[1] != 0 {
+		t.Fatalf("unset feature report = %v (%d, %v)", buf, n, err)
+	}
+	report := []byte{1, 'c', 0xff, 0, 0, 0, 0, 0, 0}
+	if err := dev.WriteFeature(report); err != nil {
+		t.Fatalf("can't write feature report: %v", err)
+	}
+	if n, err := dev.ReadFeature(buf); err != nil || !bytes.Equal(buf[:n], report) {
+		t.Fatalf("feature report = %v (%v), want %v", buf[:n], err, report)
+	}
+}
+
+func TestVirtualReportInterval(t *testing.T) {
+	info, remove := addVirtual(t, gid.VirtualDevice{
+		VendorID:          0x1209,
+		ProductID:         0x0004,
+		SerialNumber:      "interval",
+		InputReportLength: 4,
+		ReportInterval:    2 * time.Millisecond,
+	})
+	defer remove()
+	dev, err := info.Open()
+	if err != nil {
+		t.Fatalf("can't open virtual device: %v", err)
+	}
+	defer dev.Close()
+
+	buf := make([]byte, 64)
+	start := time.Now()
+	var prev byte
+	for i := 0; i < 10; i++ {
+		if n := readTimeout(t, dev, buf); n != 4 || buf[1] != buf[0]+1 {
+			t.Fatalf("report %d = %v", i, buf[:n])
+		}
+		if i > 0 && buf[0] != prev+1 {
+			t.Logf("reports skipped between %d and %d", prev, buf[0])
+		}
+		prev = buf[0]
+	}
+	if elapsed := time.Since(start); elapsed < 15*time.Millisecond {
+		t.Errorf("10 reports every 2ms arrived in %v", elapsed)
+	}
+}
+
+func TestVirtualWatch(t *testing.T) {
+	if !virtual {
+		t.Skip("not running on the simulated bus")
+	}
+	ctx, cancel := context.WithTimeout(context.Background(), 5*time.Second)
+	defer cancel()
+
+	filter := func(info *gid.DeviceInfo) bool { return info.SerialNumber == "watch" }
+	events := gid.Watch(ctx, filter)
+	id, err := gid.AddVirtualDevice(gid.VirtualDevice{
+		VendorID:     0x1209,
+		ProductID:    0x0005,
+		Product:      "hotplug",
+		SerialNumber: "watch",
+	})
+	if err != nil {
+		t.Fatalf("can't add virtual device: %v", err)
+	}
+	removed := false
+	defer func() {
+		if !removed {
+			gid.RemoveVirtualDevice(id)
+		}
+	}()
+
+	for _, want := range []gid.EventType{gid.DeviceArrived, gid.DeviceLeft} {
+		ev, ok := <-events
+		if !ok {
+			t.Fatalf("watch ended waiting for %v", want)
+		}
+		if ev.Type != want || ev.Device.SerialNumber != "watch" {
+			t.Fatalf("got %v of %+v, want %v", ev.Type, ev.Device, want)
+		}
+		if want == gid.DeviceArrived {
+			if err := gid.RemoveVirtualDevice(id); err != nil {
+				t.Fatalf("can't remove virtual device: %v", err)
+			}
+			removed = true
+		}
+	}
+	if err := gid.RemoveVirtualDevice(id); err == nil {
+		t.Errorf("removed a device twice")
+	}
+}
+
+func TestOpenInterfaces(t *testing.T) {
+	info, remove := addVirtual(t, gid.VirtualDevice{
+		VendorID:           0x1209,
+		ProductID:          0x0008,
+		SerialNumber:       "composite",
+		InputReportLength:  4,
+		OutputReportLength: 4,
+		Interfaces:         3,
+	})
+	defer remove()
+	if n := len(gid.ListAllDevices(func(i *gid.DeviceInfo) bool { return i.SerialNumber == "composite" })); n != 3 {
+		t.Fatalf("%d interfaces enumerated, want 3", n)
+	}
+
+	devs, err := info.OpenInterfaces()
+	if err != nil {
+		t.Fatalf("can't open interfaces: %v", err)
+	}
+	if len(devs) != 3 {
+		t.Fatalf("opened %d interfaces, want 3", len(devs))
+	}
+	for _, dev := range devs {
+		defer dev.Close()
+	}
+
+	// Every interface echoes its own output reports, whatever the order
+	buf := make([]byte, 16)
+	for round := 0; round < 2; round++ {
+		for i, dev := range devs {
+			if err := dev.Write([]byte{0, byte(i), 1, 2, 3}); err != nil {
+				t.Fatalf("can't write to interface %d: %v", i, err)
+			}
+		}
+		for i := len(devs) - 1; i >= 0; i-- {
+			if n := readTimeout(t, devs[i], buf); n != 4 || buf[0] != byte(i) {
+				t.Errorf("interface %d echoed %v", i, buf[:n])
+			}
+		}
+	}
+
+	// The others keep working once one of them is closed
+	devs[1].Close()
+	if err := devs[2].Write([]byte{0, 9, 9, 9, 9}); err != nil {
+		t.Fatalf("can't write after closing a sibling: %v", err)
+	}
+	if n := readTimeout(t, devs[2], buf); n != 4 || buf[0] != 9 {
+		t.Errorf("echo after closing a sibling = %v", buf[:n])
+	}
+	time.AfterFunc(10*time.Millisecond, devs[0].Close)
+	if _, err := devs[0].Read(buf); err == nil {
+		t.Error("read of a closed interface succeeded")
+	}
+	if _, err := (&gid.DeviceInfo{Path: "ffff:ffff:ff"}).OpenInterfaces(); err == nil {
+		t.Error("opened the interfaces of a missing device")
+	}
+}
+
+func TestPool(t *testing.T) {
+	info, remove := addVirtual(t, gid.VirtualDevice{
+		VendorID:            0x1209,
+		ProductID:           0x0006,
+		SerialNumber:        "pool",
+		FeatureReportLength: 8,
+	})
+	removed := false
+	defer func() {
+		if !removed {
+			remove()
+		}
+	}()
+	pool := gid.NewPool(time.Hour)
+	defer pool.Close()
+
+	a, err := pool.Acquire(info.Path)
+	if err != nil {
+		t.Fatalf("can't acquire device: %v", err)
+	}
+	b, err := pool.Acquire(info.Path)
+	if err != nil {
+		t.Fatalf("can't acquire device twice: %v", err)
+	}
+	if err := a.WriteFeature([]byte{1, 'c', 0xff, 0, 0, 0, 0, 0, 0}); err != nil {
+		t.Fatalf("can't write feature report: %v", err)
+	}
+	if sets := b.Stats().FeatureSets; sets != 1 || pool.Len() != 1 {
+		t.Fatalf("handle not shared: %d feature sets seen, %d devices pooled", sets, pool.Len())
+	}
+	a.Release()
+	b.Close()
+	if err := a.WriteFeature([]byte{1}); err == nil {
+		t.Error("wrote through a released device")
+	}
+
+	// The idle device is handed out again
+	c, err := pool.Acquire(info.Path)
+	if err != nil {
+		t.Fatalf("can't acquire idle device: %v", err)
+	}
+	if sets := c.Stats().FeatureSets; sets != 1 {
+		t.Fatalf("idle device reopened: %d feature sets seen", sets)
+	}
+
+	// Unplugging takes it out of the pool
+	remove()
+	removed = true
+	deadline := time.Now().Add(5 * time.Second)
+	for pool.Len() != 0 {
+		if time.Now().After(deadline) {
+			t.Fatal("unplugged device still pooled")
+		}
+		time.Sleep(time.Millisecond)
+	}
+	c.Release()
+	if _, err := pool.Acquire(info.Path); err == nil {
+		t.Fatal("acquired an unplugged device")
+	}
+}
+
+func TestPoolIdle(t *testing.T) {
+	info, remove := addVirtual(t, gid.VirtualDevice{
+		VendorID:     0x1209,
+		ProductID:    0x0007,
+		SerialNumber: "poolidle",
+	})
+	defer remove()
+	pool := gid.NewPool(10 * time.Millisecond)
+	defer pool.Close()
+
+	dev, err := pool.Acquire(info.Path)
+	if err != nil {
+		t.Fatalf("can't acquire device: %v", err)
+	}
+	time.Sleep(20 * time.Millisecond)
+	if pool.Len() != 1 {
+		t.Fatal("device in use evicted")
+	}
+	dev.Release()
+	deadline := time.Now().Add(5 * time.Second)
+	for pool.Len() != 0 {
+		if time.Now().After(deadline) {
+			t.Fatal("idle device not evicted")
+		}
+		time.Sleep(time.Millisecond)
+	}
+
+	pool.Close()
+	if _, err := pool.Acquire(info.Path); err == nil {
+		t.Fatal("acquired from a closed pool")
+	}
+}
+
+// uhid event types and layout, see linux/uhid.h. The events are packed, and
+// their fields are in host byte order, little endian on the test machines.
+const (
+	uhidDestroy        = 1
+	uhidOutput         = 6
+	uhidGetReport      = 9
+	uhidGetReportReply = 10
+	uhidCreate2        = 11
+	uhidInput2         = 12
+	uhidSetReport      = 13
+	uhidSetReportReply = 14
+
+	uhidEventSize = 4376
+)
+
+// uhidDescriptor declares unnumbered 8 byte input, output and feature reports.
+var uhidDescriptor = []byte{
+	0x06, 0x00, 0xff, // Usage Page (Vendor Defined 0xFF00)
+	0x09, 0x01, // Usage (1)
+	0xa1, 0x01, // Collection (Application)
+	0x15, 0x00, // Logical Minimum (0)
+	0x26, 0xff, 0x00, // Logical Maximum (255)
+	0x75, 0x08, // Report Size (8)
+	0x95, 0x08, // Report Count (8)
+	0x09, 0x01, 0x81, 0x02, // Usage (1), Input (Data, Variable, Absolute)
+	0x09, 0x01, 0x91, 0x02, // Usage (1), Output (Data, Variable, Absolute)
+	0x09, 0x01, 0xb1, 0x02, // Usage (1), Feature (Data, Variable, Absolute)
+	0xc0, // End Collection
+}
+
+// addUhid creates a HID device through /dev/uhid which echoes output reports as
+// input reports and reads back the last feature report written, and returns a
+// function destroying it. The test is skipped if uhid is not available.
+func addUhid(t *testing.T, serial string) func() {
+	f, err := os.OpenFile("/dev/uhid", os.O_RDWR, 0)
+	if err != nil {
+		t.Skipf("uhid not available: %v", err)
+	}
+	le := binary.LittleEndian
+	ev := make([]byte, uhidEventSize)
+	le.PutUint32(ev[0:], uhidCreate2)
+	copy(ev[4:132], "gid uhid")
+	copy(ev[196:260], serial)
+	le.PutUint16(ev[260:], uint16(len(uhidDescriptor)))
+	le.PutUint16(ev[262:], 0x06) // BUS_VIRTUAL
+	le.PutUint32(ev[264:], 0x1209)
+	le.PutUint32(ev[268:], 0x0020)
+	le.PutUint32(ev[272:], 0x0100)
+	copy(ev[280:], uhidDescriptor)
+	if _, err := f.Write(ev); err != nil {
+		f.Close()
+		t.Skipf("can't create uhid device: %v", err)
+	}
+
+	done := make(chan struct{})
+	go func() {
+		defer close(done)
+		var feature []byte
+		ev := make([]byte, uhidEventSize)
+		for {
+			if _, err := f.Read(ev); err != nil {
+				return
+			}
+			reply := make([]byte, uhidEventSize)
+			switch le.Uint32(ev) {
+			case uhidOutput:
+				// Output reports come with their report ID byte, input
+				// reports of unnumbered devices go without
+				size := int(le.Uint16(ev[4100:]))
+				if size < 1 || size > 4096 {
+					continue
+				}
+				le.PutUint32(reply, uhidInput2)
+				le.PutUint16(reply[4:], uint16(size-1))
+				copy(reply[6:], ev[5:4+size])
+			case uhidSetReport:
+				size := int(le.Uint16(ev[10:]))
+				feature = append(feature[:0], ev[12:12+size]...)
+				le.PutUint32(reply, uhidSetReportReply)
+				copy(reply[4:8], ev[4:8])
+			case uhidGetReport:
+				le.PutUint32(reply, uhidGetReportReply)
+				copy(reply[4:8], ev[4:8])
+				le.PutUint16(reply[10:], uint16(len(feature)))
+				copy(reply[12:], feature)
+			default:
+				continue
+			}
+			if _, err := f.Write(reply); err != nil {
+				return
+			}
+		}
+	}()
+	return func() {
+		destroy := make([]byte, uhidEventSize)
+		le.PutUint32(destroy, uhidDestroy)
+		f.Write(destroy)
+		f.Close()
+		<-done
+	}
+}
+
+func TestHidraw(t *testing.T) {
+	if runtime.GOOS != "linux" || !gid.Supported() {
+		t.Skip("hidraw is only available on Linux")
+	}
+	destroy := addUhid(t, "hidraw")
+	defer destroy()
+	if err := gid.UseHidrawBackend(true); err != nil {
+		t.Fatalf("can't switch to hidraw: %v", err)
+	}
+	defer gid.UseHidrawBackend(false)
+
+	var info *gid.DeviceInfo
+	deadline := time.Now().Add(5 * time.Second)
+	for info == nil {
+		if time.Now().After(deadline) {
+			t.Fatal("uhid device not listed")
+		}
+		time.Sleep(10 * time.Millisecond)
+		info = gid.ListFirstDevice(func(info *gid.DeviceInfo) bool {
+			return info.SerialNumber == "hidraw"
+		})
+	}
+	if info.VendorID != 0x1209 || info.ProductID != 0x0020 || info.Product != "gid uhid" ||
+		info.InputReportLength != 9 || info.FeatureReportLength != 9 {
+		t.Fatalf("unexpected device info %+v", info)
+	}
+
+	dev, err := info.Open()
+	if err != nil {
+		t.Fatalf("can't open hidraw device: %v", err)
+	}
+	defer dev.Close()
+
+	report := []byte{0, 1, 2, 3, 4, 5, 6, 7, 8}
+	if err := dev.Write(report); err != nil {
+		t.Fatalf("can't write output report: %v", err)
+	}
+	buf := make([]byte, 64)
+	if n := readTimeout(t, dev, buf); !bytes.Equal(buf[:n], report[1:]) {
+		t.Fatalf("input report = %v, want %v", buf[:n], report[1:])
+	}
+
+	feature := []byte{0, 'c', 0xff, 0, 0, 0, 0, 0, 0}
+	if err := dev.WriteFeature(feature); err != nil {
+		t.Fatalf("can't write feature report: %v", err)
+	}
+	buf = make([]byte, len(feature))
+	if n, err := dev.ReadFeature(buf); err != nil || !bytes.Equal(buf[:n], feature) {
+		t.Fatalf("feature report = %v (%v), want %v", buf[:n], err, feature)
+	}
+	if stats := dev.Stats(); stats.Writes != 1 || stats.ReportsReceived != 1 ||
+		stats.FeatureSets != 1 || stats.FeatureGets != 1 {
+		t.Errorf("unexpected stats %+v", stats)
+	}
+}
+
+// benchVirtual plugs n devices into the simulated bus for a benchmark, and
+// returns a function unplugging them.
+func benchVirtual(b *testing.B, n int, d gid.VirtualDevice) func() {
+	if !virtual {
+		b.Skip("not running on the simulated bus")
+	}
+	ids := make([]int, 0, n)
+	remove := func() {
+		for _, id := range ids {
+			gid.RemoveVirtualDevice(id)
+		}
+	}
+	serial := d.SerialNumber
+	for i := 0; i < n; i++ {
+		if n > 1 {
+			d.SerialNumber = fmt.Sprintf("%s%d", serial, i)
+		}
+		id, err := gid.AddVirtualDevice(d)
+		if err != nil {
+			remove()
+			b.Fatalf("can't add virtual device: %v", err)
+		}
+		ids = append(ids, id)
+	}
+	return remove
+}
+
+// benchOpen plugs a device into the simulated bus and opens it.
+func benchOpen(b *testing.B, d gid.VirtualDevice) (gid.Device, func()) {
+	remove := benchVirtual(b, 1, d)
+	info := gid.ListFirstDevice(func(info *gid.DeviceInfo) bool {
+		return info.SerialNumber == d.SerialNumber
+	})
+	if info == nil {
+		remove()
+		b.Fatalf("virtual device %q not enumerated", d.SerialNumber)
+	}
+	dev, err := info.Open()
+	if err != nil {
+		remove()
+		b.Fatalf("can't open virtual device: %v", err)
+	}
+	return dev, func() {
+		dev.Close()
+		remove()
+	}
+}
+
+// benchFeatureRoundTrips writes and reads back a feature report b.N times.
+func benchFeatureRoundTrips(b *testing.B, dev gid.Device) {
+	report := []byte{1, 'c', 0xff, 0, 0, 0, 0, 0, 0}
+	buf := make([]byte, len(report))
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if err := dev.WriteFeature(report); err != nil {
+			b.Fatalf("can't write feature report: %v", err)
+		}
+		buf[0] = report[0]
+		if _, err := dev.ReadFeature(buf); err != nil {
+			b.Fatalf("can't read feature report: %v", err)
+		}
+	}
+}
+
+// benchDeviceCounts are the sizes of the bus enumeration is benchmarked on,
+// counting the device added by TestMain.
+var benchDeviceCounts = []int{1, 10, 100}
+
+func BenchmarkDevices(b *testing.B) {
+	for _, n := range benchDeviceCounts {
+		b.Run(fmt.Sprintf("devices=%d", n), func(b *testing.B) {
+			defer benchVirtual(b, n-1, gid.VirtualDevice{
+				VendorID:     0x1209,
+				ProductID:    0x0010,
+				Manufacturer: "gid",
+				Product:      "bench",
+				SerialNumber: "devices",
+			})()
+			b.ReportAllocs()
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				for range gid.Devices() {
+				}
+			}
+		})
+	}
+}
+
+func BenchmarkListAllDevices(b *testing.B) {
+	for _, n := range benchDeviceCounts {
+		b.Run(fmt.Sprintf("devices=%d", n), func(b *testing.B) {
+			defer benchVirtual(b, n-1, gid.VirtualDevice{
+				VendorID:     0x1209,
+				ProductID:    0x0011,
+				Manufacturer: "gid",
+				Product:      "bench",
+				SerialNumber: "list",
+			})()
+			b.ReportAllocs()
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				if devs := gid.ListAllDevices(nil); len(devs) != n {
+					b.Fatalf("listed %d devices, want %d", len(devs), n)
+				}
+			}
+		})
+	}
+}
+
+// BenchmarkOpenClose measures opening a device by path among growing numbers of
+// devices on the bus.
+func BenchmarkOpenClose(b *testing.B) {
+	for _, n := range benchDeviceCounts {
+		b.Run(fmt.Sprintf("devices=%d", n), func(b *testing.B) {
+			defer benchVirtual(b, n, gid.VirtualDevice{
+				VendorID:     0x1209,
+				ProductID:    0x0012,
+				SerialNumber: "openclose",
+			})()
+			info := gid.ListFirstDevice(func(info *gid.DeviceInfo) bool {
+				return strings.HasPrefix(info.SerialNumber, "openclose")
+			})
+			if info == nil {
+				b.Fatal("virtual device not enumerated")
+			}
+			b.ReportAllocs()
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				dev, err := info.Open()
+				if err != nil {
+					b.Fatalf("can't open virtual device: %v", err)
+				}
+				dev.Close()
+			}
+		})
+	}
+}
+
+// BenchmarkOpenInterfaces compares opening and closing the interfaces of a
+// composite device one by one with doing it on a single shared handle.
+func BenchmarkOpenInterfaces(b *testing.B) {
+	defer benchVirtual(b, 1, gid.VirtualDevice{
+		VendorID:     0x1209,
+		ProductID:    0x0018,
+		SerialNumber: "interfaces",
+		Interfaces:   4,
+	})()
+	infos := gid.ListAllDevices(func(info *gid.DeviceInfo) bool {
+		return info.SerialNumber == "interfaces"
+	})
+	if len(infos) != 4 {
+		b.Fatalf("%d interfaces enumerated, want 4", len(infos))
+	}
+
+	b.Run("each", func(b *testing.B) {
+		b.ReportAllocs()
+		devs := make([]gid.Device, len(infos))
+		for i := 0; i < b.N; i++ {
+			for j, info := range infos {
+				dev, err := info.Open()
+				if err != nil {
+					b.Fatalf("can't open interface: %v", err)
+				}
+				devs[j] = dev
+			}
+			for _, dev := range devs {
+				dev.Close()
+			}
+		}
+	})
+	b.Run("shared", func(b *testing.B) {
+		b.ReportAllocs()
+		for i := 0; i < b.N; i++ {
+			devs, err := infos[0].OpenInterfaces()
+			if err != nil {
+				b.Fatalf("can't open interfaces: %v", err)
+			}
+			for _, dev := range devs {
+				dev.Close()
+			}
+		}
+	})
+}
+
+// BenchmarkPoolAcquire is BenchmarkOpenClose going through a device pool,
+// which keeps the device open between users.
+func BenchmarkPoolAcquire(b *testing.B) {
+	defer benchVirtual(b, 1, gid.VirtualDevice{
+		VendorID:     0x1209,
+		ProductID:    0x0012,
+		SerialNumber: "poolacquire",
+	})()
+	info := gid.ListFirstDevice(func(info *gid.DeviceInfo) bool {
+		return info.SerialNumber == "poolacquire"
+	})
+	if info == nil {
+		b.Fatal("virtual device not enumerated")
+	}
+	pool := gid.NewPool(time.Minute)
+	defer pool.Close()
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		dev, err := pool.Acquire(info.Path)
+		if err != nil {
+			b.Fatalf("can't acquire virtual device: %v", err)
+		}
+		dev.Release()
+	}
+}
+
+// BenchmarkRead measures sustained input report throughput at various report
+// rates. The shortest interval has the device report about as fast as it is
+// polled.
+func BenchmarkRead(b *testing.B) {
+	for _, interval := range []time.Duration{time.Millisecond, 125 * time.Microsecond, time.Microsecond} {
+		b.Run(fmt.Sprintf("interval=%v", interval), func(b *testing.B) {
+			dev, done := benchOpen(b, gid.VirtualDevice{
+				VendorID:          0x1209,
+				ProductID:         0x0013,
+				SerialNumber:      "read",
+				InputReportLength: 64,
+				ReportInterval:    interval,
+			})
+			defer done()
+			buf := make([]byte, 64)
+			b.SetBytes(int64(len(buf)))
+			b.ReportAllocs()
+			b.ResetTimer()
+			start := time.Now()
+			for i := 0; i < b.N; i++ {
+				if _, err := dev.Read(buf); err != nil {
+					b.Fatalf("can't read input report: %v", err)
+				}
+			}
+			b.ReportMetric(float64(b.N)/time.Since(start).Seconds(), "reports/s")
+		})
+	}
+}
+
+func BenchmarkFeatureRoundTrip(b *testing.B) {
+	dev, done := benchOpen(b, gid.VirtualDevice{
+		VendorID:            0x1209,
+		ProductID:           0x0014,
+		SerialNumber:        "feature",
+		FeatureReportLength: 8,
+	})
+	defer done()
+	benchFeatureRoundTrips(b, dev)
+}
+
+// BenchmarkFeatureUnderLoad does feature round trips while another device
+// streams input reports, so that the event handling thread is busy completing
+// transfers unrelated to the ones waited for.
+func BenchmarkFeatureUnderLoad(b *testing.B) {
+	_, stop := benchOpen(b, gid.VirtualDevice{
+		VendorID:          0x1209,
+		ProductID:         0x0017,
+		SerialNumber:      "load",
+		InputReportLength: 64,
+		ReportInterval:    50 * time.Microsecond,
+	})
+	defer stop()
+	dev, done := benchOpen(b, gid.VirtualDevice{
+		VendorID:            0x1209,
+		ProductID:           0x0017,
+		SerialNumber:        "loadfeature",
+		FeatureReportLength: 8,
+	})
+	defer done()
+	benchFeatureRoundTrips(b, dev)
+}
+
+// BenchmarkParallelFeature has goroutines contend for a single device.
+func BenchmarkParallelFeature(b *testing.B) {
+	dev, done := benchOpen(b, gid.VirtualDevice{
+		VendorID:            0x1209,
+		ProductID:           0x0015,
+		SerialNumber:        "parallel",
+		FeatureReportLength: 8,
+	})
+	defer done()
+	b.ReportAllocs()
+	b.ResetTimer()
+	b.RunParallel(func(pb *testing.PB) {
+		report := []byte{1, 'c', 0xff, 0, 0, 0, 0, 0, 0}
+		buf := make([]byte, len(report))
+		for pb.Next() {
+			if err := dev.WriteFeature(report); err != nil {
+				b.Errorf("can't write feature report: %v", err)
+				return
+			}
+			buf[0] = report[0]
+			if _, err := dev.ReadFeature(buf); err != nil {
+				b.Errorf("can't read feature report: %v", err)
+				return
+			}
+		}
+	})
+}
+
+// BenchmarkParallelDevices has goroutines enumerate the bus concurrently.
+func BenchmarkParallelDevices(b *testing.B) {
+	defer benchVirtual(b, 9, gid.VirtualDevice{
+		VendorID:     0x1209,
+		ProductID:    0x0016,
+		SerialNumber: "pardevices",
+	})()
+	b.ReportAllocs()
+	b.ResetTimer()
+	b.RunParallel(func(pb *testing.PB) {
+		for pb.Next() {
+			for range gid.Devices() {
+			}
+		}
+	})
+}
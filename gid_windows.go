@@ -15,9 +15,11 @@ package gid
 import "C"
 
 import (
+	"context"
 	"errors"
 	"fmt"
 	"syscall"
+	"time"
 	"unsafe"
 )
 
@@ -42,6 +44,17 @@ func (dev *winDevice) isValid() bool {
 	return dev.handle != syscall.InvalidHandle
 }
 
+// Stats returns the I/O counters of the device, which are not maintained on
+// this platform.
+func (dev *winDevice) Stats() DeviceStats {
+	return DeviceStats{}
+}
+
+// Info returns the description of the device it was opened from.
+func (dev *winDevice) Info() DeviceInfo {
+	return *dev.info
+}
+
 func (dev *winDevice) Close() {
 	syscall.CloseHandle(dev.handle)
 	dev.handle = syscall.InvalidHandle
@@ -291,6 +304,20 @@ func ByPath(devicePath string) (*DeviceInfo, error) {
 	return devInfo, nil
 }
 
+// Watch streams the arrival and removal of HID devices matching filter until
+// ctx is done, at which point the channel is closed. Devices attached when the
+// watch starts are reported as arrivals. If filter is nil, all devices match.
+//
+// Changes are detected by enumerating the devices once per second.
+func Watch(ctx context.Context, filter func(*DeviceInfo) bool) <-chan Event {
+	return pollWatch(ctx, filter, time.Second)
+}
+
+// Snapshot returns the DeviceInfo of every HID device currently attached.
+func Snapshot() []DeviceInfo {
+	return collectDevices(Devices())
+}
+
 // Devices returns all HID devices which are connected to the system.
 func Devices() <-chan *DeviceInfo {
 	result := make(chan *DeviceInfo, maxDeviceChannelSize)
@@ -340,6 +367,89 @@ func (di *DeviceInfo) Open() (Device, error) {
 	}
 }
 
+// SetContexts sets the number of native event handling contexts devices are
+// spread over. There is a single one on this platform.
+func SetContexts(n int) error {
+	if n != 1 {
+		return ErrNotSupported
+	}
+	return nil
+}
+
+// OpenOn connects to an HID device by its path name, handling its events on
+// the context of the given index. There is a single one on this platform.
+func (di *DeviceInfo) OpenOn(index int) (Device, error) {
+	if index != 0 {
+		return nil, ErrNotSupported
+	}
+	return di.Open()
+}
+
+// SetBusyPoll makes the native event handling thread spin for completed
+// transfers. It is not supported on this platform.
+func SetBusyPoll(window time.Duration) error {
+	return ErrNotSupported
+}
+
+// BusyPollStats returns the busy polling counters, see SetBusyPoll.
+func BusyPollStats() PollStats {
+	return PollStats{}
+}
+
+// SetTrace enables the native transfer trace ring. It is not supported on this
+// platform.
+func SetTrace(capacity int) error {
+	return ErrNotSupported
+}
+
+// DumpTrace returns the records of the native transfer trace ring. It is not
+// supported on this platform.
+func DumpTrace(index int, max int) ([]TraceEvent, error) {
+	return nil, ErrNotSupported
+}
+
+// SetScanThreads spreads the reads done while scanning for devices over several
+// threads. It is not supported on this platform.
+func SetScanThreads(n int) error {
+	return ErrNotSupported
+}
+
+// SetHotplugDebounce sets how long the hotplug monitor collects device changes
+// before reporting them. It is not supported on this platform.
+func SetHotplugDebounce(window time.Duration) error {
+	return ErrNotSupported
+}
+
+// UseHidrawBackend lists and opens devices through the Linux hidraw driver. It
+// is not supported on this platform.
+func UseHidrawBackend(enable bool) error {
+	return ErrNotSupported
+}
+
+// OpenInterfaces connects to every HID interface of a composite device at once.
+// Interfaces are separate devices on this platform, open them one by one.
+func (di *DeviceInfo) OpenInterfaces() ([]Device, error) {
+	return nil, ErrNotSupported
+}
+
+// UseVirtualBackend switches the native library to a simulated bus. It is not
+// supported on this platform.
+func UseVirtualBackend() error {
+	return ErrNotSupported
+}
+
+// AddVirtualDevice plugs a simulated device into the bus of the virtual
+// backend. It is not supported on this platform.
+func AddVirtualDevice(d VirtualDevice) (int, error) {
+	return 0, ErrNotSupported
+}
+
+// RemoveVirtualDevice unplugs a simulated device. It is not supported on this
+// platform.
+func RemoveVirtualDevice(id int) error {
+	return ErrNotSupported
+}
+
 // Supported returns whether this platform is supported by the HID library or not.
 // The goal of this method is to allow programmatically handling platforms that do
 // not support USB HID and not having to fall back to build constraints.
@@ -24,6 +24,11 @@
 // line 1 "libusb/libusb/config.h"
 #ifndef CONFIG_H
 #define CONFIG_H
+
+/* Wait for events with epoll and signal internal events through an eventfd */
+#if defined(OS_LINUX) && !defined(USBI_NO_EPOLL)
+#define USBI_EPOLL_AVAILABLE 1
+#endif
 #endif
 // line 23 "libusb/libusb/os/threads_posix.c"
 
@@ -85,6 +90,7 @@
 #define usbi_cond_init(cond)		pthread_cond_init((cond), NULL)
 #define usbi_cond_wait			pthread_cond_wait
 #define usbi_cond_broadcast		pthread_cond_broadcast
+#define usbi_cond_signal		pthread_cond_signal
 #define usbi_cond_destroy		pthread_cond_destroy
 
 #define usbi_tls_key_t			pthread_key_t
@@ -1109,6 +1115,40 @@ typedef struct libusb_device libusb_device;
  */
 typedef struct libusb_device_handle libusb_device_handle;
 
+/** \ingroup libusb_dev
+ * Wildcard for the fields of struct libusb_device_filter */
+#define LIBUSB_DEVICE_MATCH_ANY -1
+
+/** \ingroup libusb_dev
+ * Selects the devices visited by libusb_foreach_device(). Each field holds
+ * the value to match or LIBUSB_DEVICE_MATCH_ANY.
+ */
+struct libusb_device_filter {
+	/** idVendor of the device descriptor */
+	int vendor_id;
+
+	/** idProduct of the device descriptor */
+	int product_id;
+
+	/** bDeviceClass of the device descriptor */
+	int dev_class;
+};
+
+/** \ingroup libusb_dev
+ * Callback invoked by libusb_foreach_device() for each matching device.
+ *
+ * The callback runs with the device list of the context locked. It may read
+ * the descriptors and properties of the device and take a reference on it
+ * with libusb_ref_device(), but must not open devices or call any function
+ * which lists or looks up devices.
+ *
+ * \param dev the device, only valid during the callback unless referenced
+ * \param user_data the user data passed to libusb_foreach_device()
+ * \returns 0 to visit the next device, any other value to stop
+ */
+typedef int (LIBUSB_CALL *libusb_device_visitor_fn)(libusb_device *dev,
+	void *user_data);
+
 /** \ingroup libusb_dev
  * Speed codes. Indicates the speed at which the device is operating.
  */
@@ -1443,9 +1483,160 @@ enum libusb_log_level {
 	LIBUSB_LOG_LEVEL_DEBUG,
 };
 
+/** \ingroup libusb_lib
+ * Counters of the busy-poll reaping mode, as returned by
+ * libusb_get_busy_poll_stats().
+ */
+struct libusb_busy_poll_stats {
+	/** Number of spin windows opened after a completion */
+	uint64_t windows;
+
+	/** Number of non-blocking reap attempts made while spinning */
+	uint64_t polls;
+
+	/** Number of completions reaped while spinning */
+	uint64_t hits;
+
+	/** Number of windows which expired without reaping anything */
+	uint64_t misses;
+
+	/** Total time spent spinning, in nanoseconds */
+	uint64_t spin_ns;
+};
+
+/** \ingroup libusb_lib
+ * Points of the transfer lifecycle recorded by the trace ring, see
+ * libusb_set_trace().
+ */
+enum libusb_trace_event_type {
+	/** The transfer was submitted, status is the submission result */
+	LIBUSB_TRACE_SUBMIT = 1,
+
+	/** The OS handed the transfer back, status is the OS status */
+	LIBUSB_TRACE_REAP = 2,
+
+	/** The transfer timed out and is being cancelled */
+	LIBUSB_TRACE_TIMEOUT = 3,
+
+	/** Cancellation was requested, status is the cancellation result */
+	LIBUSB_TRACE_CANCEL = 4,
+
+	/** The transfer is completed, status is its \ref libusb_transfer_status */
+	LIBUSB_TRACE_COMPLETE = 5,
+};
+
+/** \ingroup libusb_lib
+ * A trace ring record, as returned by libusb_trace_dump().
+ */
+struct libusb_trace_event {
+	/** Monotonic clock time of the event, in nanoseconds */
+	uint64_t timestamp_ns;
+
+	/** Address of the struct libusb_transfer */
+	uint64_t transfer;
+
+	/** Transfer length, or length transferred for REAP and COMPLETE */
+	uint32_t length;
+
+	/** Event specific status, see \ref libusb_trace_event_type */
+	int32_t status;
+
+	/** One of \ref libusb_trace_event_type */
+	uint8_t type;
+
+	/** Endpoint address of the transfer */
+	uint8_t endpoint;
+
+	/** One of \ref libusb_transfer_type */
+	uint8_t transfer_type;
+
+	uint8_t reserved;
+};
+
+/** \ingroup libusb_lib
+ * A virtual HID device of the simulated backend, see
+ * libusb_virtual_add_device().
+ *
+ * The device has a single configuration with one or more identical HID
+ * interfaces. Interface n has an interrupt IN endpoint and, if the device has
+ * output reports, an interrupt OUT endpoint, both numbered n + 1. Its report
+ * descriptor declares vendor defined input, output and feature reports of the
+ * given sizes. Output reports are echoed back as input reports of the
+ * interface they were sent to, periodic input reports come from the first
+ * interface, and feature reports read back what was last set.
+ */
+struct libusb_virtual_device {
+	/** Vendor ID of the device descriptor */
+	uint16_t idVendor;
+
+	/** Product ID of the device descriptor */
+	uint16_t idProduct;
+
+	/** Release number of the device descriptor */
+	uint16_t bcdDevice;
+
+	/** UTF-8 manufacturer string, or NULL for none */
+	const char *manufacturer;
+
+	/** UTF-8 product string, or NULL for none */
+	const char *product;
+
+	/** UTF-8 serial number string, or NULL for none */
+	const char *serial_number;
+
+	/** Size of the input reports, up to 1024 bytes. 0 selects 64. */
+	uint16_t input_report_size;
+
+	/** Size of the output reports, or 0 for no OUT endpoint */
+	uint16_t output_report_size;
+
+	/** Size of the feature reports, or 0 for none */
+	uint16_t feature_report_size;
+
+	/** Interval of the periodic input reports in microseconds, or 0 to
+	 * only report echoed output reports */
+	unsigned int report_interval_us;
+
+	/** Time taken to complete control and OUT transfers, in microseconds */
+	unsigned int latency_us;
+
+	/** Number of HID interfaces, up to 4. 0 selects 1. */
+	uint8_t num_interfaces;
+
+	/** Optional handler of control requests, called on the bus thread with
+	 * the setup packet in host byte order and its data stage. It returns
+	 * the number of bytes transferred, LIBUSB_ERROR_NOT_SUPPORTED to fall
+	 * back to the built in handling, or another error to stall. It must
+	 * not call libusb_virtual_add_device() or
+	 * libusb_virtual_remove_device(). */
+	int (LIBUSB_CALL *control)(void *user_data,
+		const struct libusb_control_setup *setup, unsigned char *data);
+
+	/** Optional generator of the periodic input reports, called on the bus
+	 * thread. It fills report and returns its length, or a negative value
+	 * to skip the report. By default reports carry a counter pattern. */
+	int (LIBUSB_CALL *input_report)(void *user_data, unsigned char *report,
+		int length);
+
+	/** Passed to the callbacks */
+	void *user_data;
+};
+
 int LIBUSB_CALL libusb_init(libusb_context **ctx);
+int LIBUSB_CALL libusb_set_backend(const char *name);
+int LIBUSB_CALL libusb_set_scan_threads(unsigned int threads);
+int LIBUSB_CALL libusb_set_hotplug_debounce(unsigned int window_ms);
 void LIBUSB_CALL libusb_exit(libusb_context *ctx);
+int LIBUSB_CALL libusb_set_trace(libusb_context *ctx, unsigned int capacity);
+int LIBUSB_CALL libusb_trace_dump(libusb_context *ctx,
+	struct libusb_trace_event *events, int max_events);
 void LIBUSB_CALL libusb_set_debug(libusb_context *ctx, int level);
+int LIBUSB_CALL libusb_set_busy_poll(libusb_context *ctx, unsigned int window_us);
+int LIBUSB_CALL libusb_get_busy_poll_stats(libusb_context *ctx,
+	struct libusb_busy_poll_stats *stats);
+int LIBUSB_CALL libusb_virtual_add_device(
+	const struct libusb_virtual_device *device);
+int LIBUSB_CALL libusb_virtual_remove_device(int id);
 const struct libusb_version * LIBUSB_CALL libusb_get_version(void);
 int LIBUSB_CALL libusb_has_capability(uint32_t capability);
 const char * LIBUSB_CALL libusb_error_name(int errcode);
@@ -1454,6 +1645,11 @@ const char * LIBUSB_CALL libusb_strerror(enum libusb_error errcode);
 
 ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx,
 	libusb_device ***list);
+libusb_device * LIBUSB_CALL libusb_get_device_by_address(libusb_context *ctx,
+	uint8_t bus_number, uint8_t device_address);
+int LIBUSB_CALL libusb_foreach_device(libusb_context *ctx,
+	const struct libusb_device_filter *filter,
+	libusb_device_visitor_fn callback, void *user_data);
 void LIBUSB_CALL libusb_free_device_list(libusb_device **list,
 	int unref_devices);
 libusb_device * LIBUSB_CALL libusb_ref_device(libusb_device *dev);
@@ -2189,6 +2385,9 @@ extern "C" {
 #define USB_MAXINTERFACES	32
 #define USB_MAXCONFIG		8
 
+/* Buckets of the per-context device indexes, a power of two */
+#define USBI_DEVS_HASH_SIZE	256
+
 /* Backend specific capabilities */
 #define USBI_CAP_HAS_HID_ACCESS			0x00010000
 #define USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER	0x00020000
@@ -2444,6 +2643,7 @@ int usbi_cond_wait(usbi_cond_t *cond, usbi_mutex_t *mutex);
 int usbi_cond_timedwait(usbi_cond_t *cond,
 	usbi_mutex_t *mutex, const struct timeval *tv);
 int usbi_cond_broadcast(usbi_cond_t *cond);
+int usbi_cond_signal(usbi_cond_t *cond);
 int usbi_cond_destroy(usbi_cond_t *cond);
 
 int usbi_tls_key_create(usbi_tls_key_t *key);
@@ -2466,12 +2666,35 @@ struct libusb_context {
 	int debug;
 	int debug_fixed;
 
-	/* internal event pipe, used for signalling occurrence of an internal event. */
+	/* busy-poll reaping window in microseconds, 0 when disabled, accessed
+	 * atomically as it may change while events are handled. the counters
+	 * are written by the event handling thread under event_data_lock */
+	unsigned int busy_poll_us;
+	struct libusb_busy_poll_stats busy_poll_stats;
+
+	/* transfer lifecycle trace ring. it is allocated the first time tracing
+	 * gets enabled and only freed with the context, so recording needs no
+	 * lock: trace_enabled is checked first, with acquire semantics */
+	struct usbi_trace_ring *trace;
+	int trace_enabled;
+
+	/* internal event pipe, used for signalling occurrence of an internal event.
+	 * with epoll, both ends are the same eventfd. */
 	int event_pipe[2];
 
+#ifdef USBI_EPOLL_AVAILABLE
+	/* epoll instance watching every fd of ipollfds */
+	int epoll_fd;
+#endif
+
 	struct list_head usb_devs;
 	usbi_mutex_t usb_devs_lock;
 
+	/* usb_devs hashed by session ID and by bus number and device address,
+	 * protected by usb_devs_lock */
+	struct list_head usb_devs_by_session[USBI_DEVS_HASH_SIZE];
+	struct list_head usb_devs_by_address[USBI_DEVS_HASH_SIZE];
+
 	/* A list of open handles. Backends are free to traverse this if required.
 	 */
 	struct list_head open_devs;
@@ -2481,11 +2704,15 @@ struct libusb_context {
 	struct list_head hotplug_cbs;
 	usbi_mutex_t hotplug_cbs_lock;
 
-	/* this is a list of in-flight transfer handles, sorted by timeout
-	 * expiration. URBs to timeout the soonest are placed at the beginning of
-	 * the list, URBs that will time out later are placed after, and urbs with
-	 * infinite timeout are always placed at the very end. */
+	/* this is a list of in-flight transfer handles, in submission order.
+	 * URBs with a finite timeout are also kept in timeout_heap, a binary
+	 * min-heap ordered by expiration, so the URB to time out the soonest is
+	 * always timeout_heap[0]. URBs with infinite timeout are only on the
+	 * list. */
 	struct list_head flying_transfers;
+	struct usbi_transfer **timeout_heap;
+	unsigned int timeout_heap_len;
+	unsigned int timeout_heap_size;
 	/* Note paths taking both this and usbi_transfer->lock must always
 	 * take this lock first */
 	usbi_mutex_t flying_transfers_lock;
@@ -2522,7 +2749,9 @@ struct libusb_context {
 	unsigned int device_close;
 
 	/* list and count of poll fds and an array of poll fd structures that is
-	 * (re)allocated as necessary prior to polling. Protected by event_data_lock. */
+	 * (re)allocated as necessary prior to polling. Protected by event_data_lock.
+	 * with epoll, the array is not used: fds are registered with epoll_fd as
+	 * they are added to the list. */
 	struct list_head ipollfds;
 	struct pollfd *pollfds;
 	POLL_NFDS_TYPE pollfds_cnt;
@@ -2530,6 +2759,11 @@ struct libusb_context {
 	/* A list of pending hotplug messages. Protected by event_data_lock. */
 	struct list_head hotplug_msgs;
 
+	/* Messages held back while a backend applies a batch of device changes,
+	 * see usbi_hotplug_batch_begin(). Protected by event_data_lock. */
+	struct list_head hotplug_batch;
+	int hotplug_batching;
+
 	/* A list of pending completed transfers. Protected by event_data_lock. */
 	struct list_head completed_transfers;
 
@@ -2588,10 +2822,16 @@ struct libusb_device {
 
 	struct list_head list;
 	unsigned long session_data;
+	struct list_head session_list;
+	struct list_head address_list;
 
 	struct libusb_device_descriptor device_descriptor;
 	int attached;
 
+	/* parsed configuration descriptors shared with callers, protected by
+	 * lock and released when the device is destroyed */
+	struct libusb_config_descriptor *config_cache[USB_MAXCONFIG];
+
 	unsigned char os_priv
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
 	[] /* valid C99 code */
@@ -2653,6 +2893,7 @@ struct usbi_transfer {
 	uint32_t stream_id;
 	uint8_t state_flags;   /* Protected by usbi_transfer->lock */
 	uint8_t timeout_flags; /* Protected by the flying_stransfers_lock */
+	int timeout_pos;       /* Index in ctx->timeout_heap, or -1 */
 
 	/* this lock is held during libusb_submit_transfer() and
 	 * libusb_cancel_transfer() (allowing the OS backend to prevent duplicate
@@ -2711,10 +2952,38 @@ struct usb_descriptor_header {
 	uint8_t bDescriptorType;
 };
 
+/* trace ring: a power of two sized array of records, claimed by writers
+ * with an atomic increment of head. each slot carries a sequence number,
+ * 0 while it is being written and the claiming head value plus one once it
+ * is complete, which lets readers tell torn and overwritten records apart */
+struct usbi_trace_slot {
+	uint64_t seq;
+	struct libusb_trace_event event;
+};
+
+struct usbi_trace_ring {
+	uint64_t head;
+	unsigned int mask;
+	struct usbi_trace_slot slots[];
+};
+
+void usbi_trace_record(struct usbi_transfer *itransfer, uint8_t type,
+	int status, unsigned int length);
+
+/* record a transfer lifecycle event if tracing is enabled on the context */
+#define usbi_trace(itransfer, type, status, length)				\
+	do {									\
+		if (__atomic_load_n(&ITRANSFER_CTX(itransfer)->trace_enabled,	\
+				__ATOMIC_ACQUIRE))				\
+			usbi_trace_record((itransfer), (type), (status), (length)); \
+	} while (0)
+
 /* shared data and functions */
 
 int usbi_io_init(struct libusb_context *ctx);
 void usbi_io_exit(struct libusb_context *ctx);
+void usbi_timeout_heap_remove(struct libusb_context *ctx,
+	struct usbi_transfer *transfer);
 
 struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	unsigned long session_id);
@@ -2731,15 +3000,24 @@ void usbi_signal_transfer_completion(struct usbi_transfer *transfer);
 int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
 	void *dest, int host_endian);
 int usbi_device_cache_descriptor(libusb_device *dev);
+void usbi_clear_config_cache(libusb_device *dev);
 int usbi_get_config_index_by_value(struct libusb_device *dev,
 	uint8_t bConfigurationValue, int *idx);
 
 void usbi_connect_device (struct libusb_device *dev);
 void usbi_disconnect_device (struct libusb_device *dev);
 
+/* Hold back hotplug notifications for ctx between these calls and deliver
+ * them to the event handler together at the end */
+void usbi_hotplug_batch_begin(struct libusb_context *ctx);
+void usbi_hotplug_batch_end(struct libusb_context *ctx);
+
 int usbi_signal_event(struct libusb_context *ctx);
 int usbi_clear_event(struct libusb_context *ctx);
 
+int usbi_busy_poll(struct libusb_context *ctx, int (*reap)(void *arg),
+	void *arg, int own_fd);
+
 /* Internal abstraction for poll (needs struct usbi_transfer on Windows) */
 #if defined(OS_LINUX) || defined(OS_DARWIN) || defined(OS_OPENBSD) || defined(OS_NETBSD) ||\
 	defined(OS_HAIKU) || defined(OS_SUNOS)
@@ -3480,9 +3758,19 @@ struct usbi_os_backend {
 	size_t transfer_priv_size;
 };
 
-extern const struct usbi_os_backend * const usbi_backend;
+extern const struct usbi_os_backend *usbi_backend;
+
+/* Threads a backend may use to scan for devices, see
+ * libusb_set_scan_threads() */
+#define USBI_MAX_SCAN_THREADS	64
+extern unsigned int usbi_scan_threads;
+
+/* Window in which hotplug messages are collected and coalesced before they
+ * are applied, see libusb_set_hotplug_debounce() */
+extern unsigned int usbi_hotplug_debounce_ms;
 
 extern const struct usbi_os_backend linux_usbfs_backend;
+extern const struct usbi_os_backend virtual_backend;
 extern const struct usbi_os_backend darwin_backend;
 extern const struct usbi_os_backend openbsd_backend;
 extern const struct usbi_os_backend netbsd_backend;
@@ -3825,10 +4113,23 @@ void linux_udev_hotplug_poll(void);
 int linux_netlink_start_event_monitor(void);
 int linux_netlink_stop_event_monitor(void);
 void linux_netlink_hotplug_poll(void);
+
+/* A device removal or arrival, as reported by a netlink message */
+struct linux_hotplug_change {
+	int detached;
+	uint8_t busnum;
+	uint8_t devaddr;
+	const char *sys_name;
+};
+
+int linux_netlink_fold_changes(const struct linux_hotplug_change *messages,
+	int count, struct linux_hotplug_change *changes, int max);
 #endif
 
 void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_name);
 void linux_device_disconnected(uint8_t busnum, uint8_t devaddr);
+void linux_disconnect_device(struct libusb_context *ctx, uint8_t busnum,
+	uint8_t devaddr);
 
 int linux_get_device_address (struct libusb_context *ctx, int detached,
 	uint8_t *busnum, uint8_t *devaddr, const char *dev_node,
@@ -3915,6 +4216,10 @@ static int sysfs_can_relate_devices = -1;
  * descriptors file, so from then on we can use them. */
 static int sysfs_has_descriptors = -1;
 
+/* SYSFS_DEVICE_PATH, opened while any context is initialized so that device
+ * attributes are read with openat() instead of rebuilding absolute paths */
+static int sysfs_dir_fd = -1;
+
 /* how many times have we initted (and not exited) ? */
 static int init_count = 0;
 
@@ -3923,6 +4228,18 @@ static usbi_mutex_static_t linux_hotplug_startstop_lock = USBI_MUTEX_INITIALIZER
 /* Serialize scan-devices, event-thread, and poll */
 usbi_mutex_static_t linux_hotplug_lock = USBI_MUTEX_INITIALIZER;
 
+/* Open handles indexed by their usbfs fd, so that op_handle_events() can
+ * dispatch a ready fd without searching ctx->open_devs. fds are unique across
+ * contexts, so a single table serves them all. It is made of chunks which are
+ * never moved nor freed once allocated, so lookups take no lock. An entry is
+ * set before its fd joins the pollfd set and cleared after it left it, and
+ * handles can't be closed while events are handled, so the event handler
+ * never sees a stale entry. fds beyond the table fall back to the list. */
+#define FD_TABLE_CHUNK_SIZE	1024
+#define FD_TABLE_CHUNKS		1024
+static struct libusb_device_handle **fd_table[FD_TABLE_CHUNKS];
+static usbi_mutex_static_t fd_table_lock = USBI_MUTEX_INITIALIZER;
+
 static int linux_start_event_monitor(void);
 static int linux_stop_event_monitor(void);
 static int linux_scan_devices(struct libusb_context *ctx);
@@ -3940,6 +4257,21 @@ struct linux_device_priv {
 	int active_config; /* cache val for !sysfs_can_relate_devices  */
 };
 
+/* everything a sysfs scan learns about a device. It is read without touching
+ * any context so that a full scan can spread the reads over worker threads. */
+struct sysfs_device_info {
+	char devname[NAME_MAX + 1];
+	uint8_t busnum;
+	uint8_t devaddr;
+	int speed;
+	unsigned char *descriptors;
+	int descriptors_len;
+	int status;
+};
+
+int linux_sysfs_scan_tree(const char *root, unsigned int threads,
+	struct sysfs_device_info *infos, int max);
+
 struct linux_device_handle_priv {
 	int fd;
 	int fd_removed;
@@ -4033,6 +4365,59 @@ static struct linux_device_handle_priv *_device_handle_priv(
 	return (struct linux_device_handle_priv *) handle->os_priv;
 }
 
+static void fd_table_set(int fd, struct libusb_device_handle *handle)
+{
+	struct libusb_device_handle **chunk;
+
+	if (fd < 0 || fd >= FD_TABLE_CHUNK_SIZE * FD_TABLE_CHUNKS)
+		return;
+
+	chunk = __atomic_load_n(&fd_table[fd / FD_TABLE_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+	if (!chunk) {
+		if (!handle)
+			return;
+		usbi_mutex_static_lock(&fd_table_lock);
+		chunk = fd_table[fd / FD_TABLE_CHUNK_SIZE];
+		if (!chunk) {
+			chunk = calloc(FD_TABLE_CHUNK_SIZE, sizeof(*chunk));
+			/* publish the zeroed chunk to the lock-free lookups */
+			__atomic_store_n(&fd_table[fd / FD_TABLE_CHUNK_SIZE], chunk,
+				__ATOMIC_RELEASE);
+		}
+		usbi_mutex_static_unlock(&fd_table_lock);
+		/* without a chunk, lookups of this fd fall back to the list */
+		if (!chunk)
+			return;
+	}
+	__atomic_store_n(&chunk[fd % FD_TABLE_CHUNK_SIZE], handle, __ATOMIC_RELEASE);
+}
+
+static struct libusb_device_handle *fd_table_get(struct libusb_context *ctx, int fd)
+{
+	struct libusb_device_handle *handle;
+
+	if (fd >= 0 && fd < FD_TABLE_CHUNK_SIZE * FD_TABLE_CHUNKS) {
+		struct libusb_device_handle **chunk;
+
+		chunk = __atomic_load_n(&fd_table[fd / FD_TABLE_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+		if (chunk) {
+			handle = __atomic_load_n(&chunk[fd % FD_TABLE_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+			if (handle)
+				return handle;
+		}
+	}
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
+		if (_device_handle_priv(handle)->fd == fd) {
+			usbi_mutex_unlock(&ctx->open_devs_lock);
+			return handle;
+		}
+	}
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+	return NULL;
+}
+
 /* check dirent for a /dev/usbdev%d.%d name
  * optionally return bus/device on success */
 static int _is_usbdev_entry(struct dirent *entry, int *bus_p, int *dev_p)
@@ -4172,7 +4557,6 @@ static int kernel_version_ge(int major, int minor, int sublevel)
 
 static int op_init(struct libusb_context *ctx)
 {
-	struct stat statbuf;
 	int r;
 
 	usbfs_path = find_usbfs_path();
@@ -4226,9 +4610,11 @@ static int op_init(struct libusb_context *ctx)
 		}
 	}
 
-	if (sysfs_can_relate_devices || sysfs_has_descriptors) {
-		r = stat(SYSFS_DEVICE_PATH, &statbuf);
-		if (r != 0 || !S_ISDIR(statbuf.st_mode)) {
+	usbi_mutex_static_lock(&linux_hotplug_startstop_lock);
+	if (init_count == 0 && (sysfs_can_relate_devices || sysfs_has_descriptors)) {
+		sysfs_dir_fd = open(SYSFS_DEVICE_PATH,
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (sysfs_dir_fd < 0) {
 			usbi_warn(ctx, "sysfs not mounted");
 			sysfs_can_relate_devices = 0;
 			sysfs_has_descriptors = 0;
@@ -4241,7 +4627,6 @@ static int op_init(struct libusb_context *ctx)
 	if (sysfs_has_descriptors)
 		usbi_dbg("sysfs has complete descriptors");
 
-	usbi_mutex_static_lock(&linux_hotplug_startstop_lock);
 	r = LIBUSB_SUCCESS;
 	if (init_count == 0) {
 		/* start up hotplug event handler */
@@ -4255,6 +4640,10 @@ static int op_init(struct libusb_context *ctx)
 			linux_stop_event_monitor();
 	} else
 		usbi_err(ctx, "error starting hotplug event monitor");
+	if (init_count == 0 && sysfs_dir_fd >= 0) {
+		close(sysfs_dir_fd);
+		sysfs_dir_fd = -1;
+	}
 	usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
 
 	return r;
@@ -4267,6 +4656,10 @@ static void op_exit(void)
 	if (!--init_count) {
 		/* tear down event handler */
 		(void)linux_stop_event_monitor();
+		if (sysfs_dir_fd >= 0) {
+			close(sysfs_dir_fd);
+			sysfs_dir_fd = -1;
+		}
 	}
 	usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
 }
@@ -4315,18 +4708,34 @@ static void op_hotplug_poll(void)
 #endif
 }
 
+/* open the attribute attr of the sysfs device devname, relative to
+ * sysfs_dir_fd. Sets errno and returns -1 on failure. */
+static int sysfs_openat(const char *devname, const char *attr)
+{
+	char path[PATH_MAX];
+	size_t devname_len = strlen(devname);
+	size_t attr_len = strlen(attr);
+
+	if (devname_len + attr_len + 2 > sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memcpy(path, devname, devname_len);
+	path[devname_len] = '/';
+	memcpy(path + devname_len + 1, attr, attr_len + 1);
+
+	return openat(sysfs_dir_fd, path, O_RDONLY | O_CLOEXEC);
+}
+
 static int _open_sysfs_attr(struct libusb_device *dev, const char *attr)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
-	char filename[PATH_MAX];
 	int fd;
 
-	snprintf(filename, PATH_MAX, "%s/%s/%s",
-		SYSFS_DEVICE_PATH, priv->sysfs_dir, attr);
-	fd = open(filename, O_RDONLY);
+	fd = sysfs_openat(priv->sysfs_dir, attr);
 	if (fd < 0) {
-		usbi_err(DEVICE_CTX(dev),
-			"open %s failed ret=%d errno=%d", filename, fd, errno);
+		usbi_err(DEVICE_CTX(dev), "open %s/%s failed ret=%d errno=%d",
+			priv->sysfs_dir, attr, fd, errno);
 		return LIBUSB_ERROR_IO;
 	}
 
@@ -4337,35 +4746,99 @@ static int _open_sysfs_attr(struct libusb_device *dev, const char *attr)
 static int __read_sysfs_attr(struct libusb_context *ctx,
 	const char *devname, const char *attr)
 {
-	char filename[PATH_MAX];
-	FILE *f;
-	int r, value;
+	char buf[24];
+	char *endptr;
+	ssize_t r;
+	long value;
+	int fd;
 
-	snprintf(filename, PATH_MAX, "%s/%s/%s", SYSFS_DEVICE_PATH,
-		 devname, attr);
-	f = fopen(filename, "r");
-	if (f == NULL) {
+	fd = sysfs_openat(devname, attr);
+	if (fd < 0) {
 		if (errno == ENOENT) {
 			/* File doesn't exist. Assume the device has been
 			   disconnected (see trac ticket #70). */
 			return LIBUSB_ERROR_NO_DEVICE;
 		}
-		usbi_err(ctx, "open %s failed errno=%d", filename, errno);
+		usbi_err(ctx, "open %s/%s failed errno=%d", devname, attr, errno);
 		return LIBUSB_ERROR_IO;
 	}
 
-	r = fscanf(f, "%d", &value);
-	fclose(f);
-	if (r != 1) {
-		usbi_err(ctx, "fscanf %s returned %d, errno=%d", attr, r, errno);
+	r = pread(fd, buf, sizeof(buf) - 1, 0);
+	close(fd);
+	if (r <= 0) {
+		usbi_err(ctx, "read %s returned %d, errno=%d", attr, (int) r, errno);
 		return LIBUSB_ERROR_NO_DEVICE; /* For unplug race (trac #70) */
 	}
-	if (value < 0) {
-		usbi_err(ctx, "%s contains a negative value", filename);
+	buf[r] = '\0';
+
+	value = strtol(buf, &endptr, 10);
+	if (endptr == buf) {
+		usbi_err(ctx, "%s/%s is not a number", devname, attr);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if (value < 0 || value > INT_MAX) {
+		usbi_err(ctx, "%s/%s contains a negative value", devname, attr);
 		return LIBUSB_ERROR_IO;
 	}
 
-	return value;
+	return (int) value;
+}
+
+/* read a whole descriptors file. The common case takes a single read into a
+ * stack buffer and one exactly sized allocation. usbfs has holes in the file,
+ * so those reads start from zeroed memory. */
+static int read_descriptors(struct libusb_context *ctx, int fd,
+	unsigned char **descriptors, int *descriptors_len)
+{
+	unsigned char buf[4096];
+	unsigned char *heap = NULL;
+	unsigned char *data = buf;
+	size_t size = sizeof(buf);
+	size_t len = 0;
+	ssize_t r;
+
+	if (!sysfs_has_descriptors)
+		memset(buf, 0, sizeof(buf));
+
+	for (;;) {
+		r = pread(fd, data + len, size - len, len);
+		if (r < 0) {
+			usbi_err(ctx, "read descriptor failed ret=%d errno=%d",
+				 fd, errno);
+			free(heap);
+			return LIBUSB_ERROR_IO;
+		}
+		len += r;
+		if (len < size || r == 0)
+			break;
+
+		/* more descriptors than the buffer holds, keep doubling */
+		size *= 2;
+		if (!heap) {
+			heap = malloc(size);
+			if (heap)
+				memcpy(heap, buf, len);
+		} else {
+			heap = usbi_reallocf(heap, size);
+		}
+		if (!heap)
+			return LIBUSB_ERROR_NO_MEM;
+		if (!sysfs_has_descriptors)
+			memset(heap + len, 0, size - len);
+		data = heap;
+	}
+
+	if (heap) {
+		*descriptors = heap;
+	} else {
+		*descriptors = malloc(len ? len : 1);
+		if (!*descriptors)
+			return LIBUSB_ERROR_NO_MEM;
+		memcpy(*descriptors, buf, len);
+	}
+	*descriptors_len = (int) len;
+
+	return LIBUSB_SUCCESS;
 }
 
 static int op_get_device_descriptor(struct libusb_device *dev,
@@ -4682,14 +5155,72 @@ static int usbfs_get_active_config(struct libusb_device *dev, int fd)
 	return LIBUSB_SUCCESS;
 }
 
+static void set_device_speed(struct libusb_device *dev, int speed)
+{
+	switch (speed) {
+	case     1: dev->speed = LIBUSB_SPEED_LOW; break;
+	case    12: dev->speed = LIBUSB_SPEED_FULL; break;
+	case   480: dev->speed = LIBUSB_SPEED_HIGH; break;
+	case  5000: dev->speed = LIBUSB_SPEED_SUPER; break;
+	default:
+		usbi_warn(DEVICE_CTX(dev), "Unknown device speed: %d Mbps", speed);
+	}
+}
+
+/* read the sysfs attributes and descriptors of info->devname into info */
+static void sysfs_read_device_info(struct libusb_context *ctx,
+	struct sysfs_device_info *info)
+{
+	int fd, r;
+
+	r = __read_sysfs_attr(ctx, info->devname, "busnum");
+	if (r < 0)
+		goto out;
+	if (r > 255) {
+		r = LIBUSB_ERROR_INVALID_PARAM;
+		goto out;
+	}
+	info->busnum = (uint8_t) r;
+
+	r = __read_sysfs_attr(ctx, info->devname, "devnum");
+	if (r < 0)
+		goto out;
+	if (r > 255) {
+		r = LIBUSB_ERROR_INVALID_PARAM;
+		goto out;
+	}
+	info->devaddr = (uint8_t) r;
+
+	/* Note speed can contain 1.5, in this case __read_sysfs_attr
+	   will stop parsing at the '.' and return 1 */
+	info->speed = __read_sysfs_attr(ctx, info->devname, "speed");
+
+	r = LIBUSB_SUCCESS;
+	if (!sysfs_has_descriptors)
+		goto out;
+
+	fd = sysfs_openat(info->devname, "descriptors");
+	if (fd < 0) {
+		usbi_err(ctx, "open %s/descriptors failed errno=%d",
+			info->devname, errno);
+		r = LIBUSB_ERROR_IO;
+		goto out;
+	}
+	r = read_descriptors(ctx, fd, &info->descriptors,
+		&info->descriptors_len);
+	close(fd);
+
+out:
+	info->status = r;
+}
+
 static int initialize_device(struct libusb_device *dev, uint8_t busnum,
-	uint8_t devaddr, const char *sysfs_dir)
+	uint8_t devaddr, const char *sysfs_dir, struct sysfs_device_info *info)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
 	struct libusb_context *ctx = DEVICE_CTX(dev);
-	int descriptors_size = 512; /* Begin with a 1024 byte alloc */
 	int fd, speed;
-	ssize_t r;
+	int r;
 
 	dev->bus_number = busnum;
 	dev->device_address = devaddr;
@@ -4701,52 +5232,33 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 
 		/* Note speed can contain 1.5, in this case __read_sysfs_attr
 		   will stop parsing at the '.' and return 1 */
-		speed = __read_sysfs_attr(DEVICE_CTX(dev), sysfs_dir, "speed");
-		if (speed >= 0) {
-			switch (speed) {
-			case     1: dev->speed = LIBUSB_SPEED_LOW; break;
-			case    12: dev->speed = LIBUSB_SPEED_FULL; break;
-			case   480: dev->speed = LIBUSB_SPEED_HIGH; break;
-			case  5000: dev->speed = LIBUSB_SPEED_SUPER; break;
-			default:
-				usbi_warn(DEVICE_CTX(dev), "Unknown device speed: %d Mbps", speed);
-			}
-		}
+		if (info)
+			speed = info->speed;
+		else
+			speed = __read_sysfs_attr(DEVICE_CTX(dev), sysfs_dir, "speed");
+		if (speed >= 0)
+			set_device_speed(dev, speed);
 	}
 
 	/* cache descriptors in memory */
-	if (sysfs_has_descriptors)
-		fd = _open_sysfs_attr(dev, "descriptors");
-	else
-		fd = _get_usbfs_fd(dev, O_RDONLY, 0);
-	if (fd < 0)
-		return fd;
-
-	do {
-		descriptors_size *= 2;
-		priv->descriptors = usbi_reallocf(priv->descriptors,
-						  descriptors_size);
-		if (!priv->descriptors) {
-			close(fd);
-			return LIBUSB_ERROR_NO_MEM;
-		}
-		/* usbfs has holes in the file */
-		if (!sysfs_has_descriptors) {
-			memset(priv->descriptors + priv->descriptors_len,
-			       0, descriptors_size - priv->descriptors_len);
-		}
-		r = read(fd, priv->descriptors + priv->descriptors_len,
-			 descriptors_size - priv->descriptors_len);
-		if (r < 0) {
-			usbi_err(ctx, "read descriptor failed ret=%d errno=%d",
-				 fd, errno);
-			close(fd);
-			return LIBUSB_ERROR_IO;
-		}
-		priv->descriptors_len += r;
-	} while (priv->descriptors_len == descriptors_size);
+	if (info && info->descriptors) {
+		priv->descriptors = info->descriptors;
+		priv->descriptors_len = info->descriptors_len;
+		info->descriptors = NULL;
+	} else {
+		if (sysfs_has_descriptors)
+			fd = _open_sysfs_attr(dev, "descriptors");
+		else
+			fd = _get_usbfs_fd(dev, O_RDONLY, 0);
+		if (fd < 0)
+			return fd;
 
-	close(fd);
+		r = read_descriptors(ctx, fd, &priv->descriptors,
+			&priv->descriptors_len);
+		close(fd);
+		if (r < 0)
+			return r;
+	}
 
 	if (priv->descriptors_len < DEVICE_DESC_LENGTH) {
 		usbi_err(ctx, "short descriptor read (%d)",
@@ -4851,8 +5363,9 @@ retry:
 	return LIBUSB_SUCCESS;
 }
 
-int linux_enumerate_device(struct libusb_context *ctx,
-	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir)
+static int linux_enumerate_device_info(struct libusb_context *ctx,
+	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir,
+	struct sysfs_device_info *info)
 {
 	unsigned long session_id;
 	struct libusb_device *dev;
@@ -4879,7 +5392,7 @@ int linux_enumerate_device(struct libusb_context *ctx,
 	if (!dev)
 		return LIBUSB_ERROR_NO_MEM;
 
-	r = initialize_device(dev, busnum, devaddr, sysfs_dir);
+	r = initialize_device(dev, busnum, devaddr, sysfs_dir, info);
 	if (r < 0)
 		goto out;
 	r = usbi_sanitize_device(dev);
@@ -4898,6 +5411,12 @@ out:
 	return r;
 }
 
+int linux_enumerate_device(struct libusb_context *ctx,
+	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir)
+{
+	return linux_enumerate_device_info(ctx, busnum, devaddr, sysfs_dir, NULL);
+}
+
 void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_name)
 {
 	struct libusb_context *ctx;
@@ -4909,21 +5428,28 @@ void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_na
 	usbi_mutex_static_unlock(&active_contexts_lock);
 }
 
-void linux_device_disconnected(uint8_t busnum, uint8_t devaddr)
+void linux_disconnect_device(struct libusb_context *ctx, uint8_t busnum,
+	uint8_t devaddr)
 {
-	struct libusb_context *ctx;
 	struct libusb_device *dev;
 	unsigned long session_id = busnum << 8 | devaddr;
 
+	dev = usbi_get_device_by_session_id (ctx, session_id);
+	if (NULL != dev) {
+		usbi_disconnect_device (dev);
+		libusb_unref_device(dev);
+	} else {
+		usbi_dbg("device not found for session %x", session_id);
+	}
+}
+
+void linux_device_disconnected(uint8_t busnum, uint8_t devaddr)
+{
+	struct libusb_context *ctx;
+
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
-		dev = usbi_get_device_by_session_id (ctx, session_id);
-		if (NULL != dev) {
-			usbi_disconnect_device (dev);
-			libusb_unref_device(dev);
-		} else {
-			usbi_dbg("device not found for session %x", session_id);
-		}
+		linux_disconnect_device(ctx, busnum, devaddr);
 	}
 	usbi_mutex_static_unlock(&active_contexts_lock);
 }
@@ -5032,31 +5558,189 @@ static int sysfs_scan_device(struct libusb_context *ctx, const char *devname)
 }
 
 #if !defined(USE_UDEV)
-static int sysfs_get_device_list(struct libusb_context *ctx)
+struct sysfs_scan {
+	struct libusb_context *ctx;
+	struct sysfs_device_info *devices;
+	int count;
+	int next;
+};
+
+static void *sysfs_scan_worker(void *arg)
 {
-	DIR *devices = opendir(SYSFS_DEVICE_PATH);
-	struct dirent *entry;
-	int r = LIBUSB_ERROR_IO;
+	struct sysfs_scan *scan = arg;
+	int i;
 
-	if (!devices) {
-		usbi_err(ctx, "opendir devices failed errno=%d", errno);
-		return r;
-	}
+	while ((i = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED)) <
+			scan->count)
+		sysfs_read_device_info(scan->ctx, &scan->devices[i]);
 
-	while ((entry = readdir(devices))) {
+	return NULL;
+}
+
+/* root hubs first, then by depth in the topology, so that parents are
+ * usually enumerated before their children */
+static int sysfs_device_order(const void *a, const void *b)
+{
+	const char *x = ((const struct sysfs_device_info *) a)->devname;
+	const char *y = ((const struct sysfs_device_info *) b)->devname;
+	int x_hub = !strncmp(x, "usb", 3);
+	int y_hub = !strncmp(y, "usb", 3);
+	size_t x_len, y_len;
+
+	if (x_hub != y_hub)
+		return y_hub - x_hub;
+	x_len = strlen(x);
+	y_len = strlen(y);
+	if (x_len != y_len)
+		return x_len < y_len ? -1 : 1;
+	return strcmp(x, y);
+}
+
+/* read the attributes of all devices, on up to wanted threads including the
+ * calling one */
+static void sysfs_read_devices(struct libusb_context *ctx,
+	struct sysfs_device_info *devices, int count, int wanted)
+{
+	struct sysfs_scan scan = { ctx, devices, count, 0 };
+	pthread_t threads[USBI_MAX_SCAN_THREADS];
+	int nthreads = 0;
+
+	if (wanted > USBI_MAX_SCAN_THREADS)
+		wanted = USBI_MAX_SCAN_THREADS;
+	if (wanted > count)
+		wanted = count;
+	while (nthreads < wanted - 1) {
+		if (pthread_create(&threads[nthreads], NULL, sysfs_scan_worker, &scan)) {
+			usbi_dbg("scan worker %d failed to start", nthreads);
+			break;
+		}
+		nthreads++;
+	}
+
+	sysfs_scan_worker(&scan);
+	while (nthreads--)
+		pthread_join(threads[nthreads], NULL);
+}
+
+/* list the devices of the sysfs tree at sysfs_dir_fd, root hubs first and
+ * parents before children, and read their attributes on up to threads
+ * threads. returns the number of devices listed in *infos, or an error code */
+static int sysfs_scan_devices(struct libusb_context *ctx, int threads,
+	struct sysfs_device_info **infos)
+{
+	struct sysfs_device_info *found = NULL;
+	struct dirent *entry;
+	DIR *devices;
+	int count = 0, size = 0;
+	size_t len;
+	int fd;
+
+	/* a fresh open, as a duplicate would share the offset of sysfs_dir_fd
+	 * with concurrent scans */
+	fd = openat(sysfs_dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	devices = fd < 0 ? NULL : fdopendir(fd);
+	if (!devices) {
+		usbi_err(ctx, "opendir devices failed errno=%d", errno);
+		if (fd >= 0)
+			close(fd);
+		return LIBUSB_ERROR_IO;
+	}
+
+	while ((entry = readdir(devices))) {
 		if ((!isdigit(entry->d_name[0]) && strncmp(entry->d_name, "usb", 3))
 				|| strchr(entry->d_name, ':'))
 			continue;
 
-		if (sysfs_scan_device(ctx, entry->d_name)) {
-			usbi_dbg("failed to enumerate dir entry %s", entry->d_name);
+		if (count == size) {
+			size = size ? size * 2 : 64;
+			found = usbi_reallocf(found, size * sizeof(*found));
+			if (!found) {
+				closedir(devices);
+				return LIBUSB_ERROR_NO_MEM;
+			}
+		}
+		memset(&found[count], 0, sizeof(*found));
+		len = strnlen(entry->d_name, NAME_MAX);
+		memcpy(found[count].devname, entry->d_name, len);
+		count++;
+	}
+	closedir(devices);
+
+	qsort(found, count, sizeof(*found), sysfs_device_order);
+	sysfs_read_devices(ctx, found, count, threads);
+
+	*infos = found;
+	return count;
+}
+
+/* scan the sysfs tree at root as sysfs_get_device_list() does, without
+ * enumerating the devices, for testing. Only possible while no context uses
+ * the backend. returns the number of devices, the first max of which are
+ * copied to infos without their descriptors, or an error code */
+int linux_sysfs_scan_tree(const char *root, unsigned int threads,
+	struct sysfs_device_info *infos, int max)
+{
+	struct sysfs_device_info *found = NULL;
+	int count, i;
+
+	usbi_mutex_static_lock(&linux_hotplug_startstop_lock);
+	if (init_count) {
+		usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+	sysfs_dir_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (sysfs_dir_fd < 0) {
+		usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	count = sysfs_scan_devices(NULL, (int) threads, &found);
+	for (i = 0; i < count; i++) {
+		if (i < max) {
+			infos[i] = found[i];
+			infos[i].descriptors = NULL;
+		}
+		free(found[i].descriptors);
+	}
+	free(found);
+
+	close(sysfs_dir_fd);
+	sysfs_dir_fd = -1;
+	usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
+
+	return count;
+}
+
+static int sysfs_get_device_list(struct libusb_context *ctx)
+{
+	struct sysfs_device_info *infos = NULL;
+	int count;
+	int i;
+	int r = LIBUSB_ERROR_IO;
+
+	count = sysfs_scan_devices(ctx, (int) __atomic_load_n(&usbi_scan_threads,
+		__ATOMIC_RELAXED), &infos);
+	if (count < 0)
+		return count;
+
+	for (i = 0; i < count; i++) {
+		struct sysfs_device_info *info = &infos[i];
+
+		if (info->status == LIBUSB_SUCCESS) {
+			usbi_dbg("bus=%d dev=%d", info->busnum, info->devaddr);
+			info->status = linux_enumerate_device_info(ctx, info->busnum,
+				info->devaddr, info->devname, info);
+		}
+		free(info->descriptors);
+		if (info->status) {
+			usbi_dbg("failed to enumerate dir entry %s", info->devname);
 			continue;
 		}
 
 		r = 0;
 	}
 
-	closedir(devices);
+	free(infos);
 	return r;
 }
 
@@ -5113,9 +5797,12 @@ static int op_open(struct libusb_device_handle *handle)
 			hpriv->caps |= USBFS_CAP_BULK_CONTINUATION;
 	}
 
+	fd_table_set(hpriv->fd, handle);
 	r = usbi_add_pollfd(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
-	if (r < 0)
+	if (r < 0) {
+		fd_table_set(hpriv->fd, NULL);
 		close(hpriv->fd);
+	}
 
 	return r;
 }
@@ -5126,6 +5813,7 @@ static void op_close(struct libusb_device_handle *dev_handle)
 	/* fd may have already been removed by POLLERR condition in op_handle_events() */
 	if (!hpriv->fd_removed)
 		usbi_remove_pollfd(HANDLE_CTX(dev_handle), hpriv->fd);
+	fd_table_set(hpriv->fd, NULL);
 	close(hpriv->fd);
 }
 
@@ -6377,6 +7065,7 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 
 	usbi_dbg("urb type=%d status=%d transferred=%d", urb->type, urb->status,
 		urb->actual_length);
+	usbi_trace(itransfer, LIBUSB_TRACE_REAP, urb->status, urb->actual_length);
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
@@ -6394,33 +7083,45 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	}
 }
 
+static int busy_poll_reap(void *arg)
+{
+	return reap_for_handle(arg);
+}
+
+/* busy-poll reaping: keep reaping handle without blocking instead of going
+ * back to sleep in poll() right after the last completion, see
+ * usbi_busy_poll(). returns like reap_for_handle() does for the attempt
+ * which ended the spin. */
+static int busy_poll_handle(struct libusb_context *ctx,
+	struct libusb_device_handle *handle)
+{
+	return usbi_busy_poll(ctx, busy_poll_reap, handle,
+		_device_handle_priv(handle)->fd);
+}
+
 static int op_handle_events(struct libusb_context *ctx,
 	struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready)
 {
 	int r;
+	int reaped;
 	unsigned int i = 0;
 
-	usbi_mutex_lock(&ctx->open_devs_lock);
 	for (i = 0; i < nfds && num_ready > 0; i++) {
 		struct pollfd *pollfd = &fds[i];
 		struct libusb_device_handle *handle;
-		struct linux_device_handle_priv *hpriv = NULL;
+		struct linux_device_handle_priv *hpriv;
 
 		if (!pollfd->revents)
 			continue;
 
 		num_ready--;
-		list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
-			hpriv = _device_handle_priv(handle);
-			if (hpriv->fd == pollfd->fd)
-				break;
-		}
-
-		if (!hpriv || hpriv->fd != pollfd->fd) {
+		handle = fd_table_get(ctx, pollfd->fd);
+		if (!handle) {
 			usbi_err(ctx, "cannot find handle for fd %d",
 				 pollfd->fd);
 			continue;
 		}
+		hpriv = _device_handle_priv(handle);
 
 		if (pollfd->revents & POLLERR) {
 			/* remove the fd from the pollfd set so that it doesn't continuously
@@ -6447,19 +7148,19 @@ static int op_handle_events(struct libusb_context *ctx,
 			continue;
 		}
 
-		do {
-			r = reap_for_handle(handle);
-		} while (r == 0);
+		reaped = 0;
+		while ((r = reap_for_handle(handle)) == 0)
+			reaped = 1;
+		if (r == 1 && reaped &&
+				__atomic_load_n(&ctx->busy_poll_us, __ATOMIC_RELAXED))
+			r = busy_poll_handle(ctx, handle);
 		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
 			continue;
 		else if (r < 0)
-			goto out;
+			return r;
 	}
 
-	r = 0;
-out:
-	usbi_mutex_unlock(&ctx->open_devs_lock);
-	return r;
+	return 0;
 }
 
 static int op_clock_gettime(int clk_id, struct timespec *tp)
@@ -6533,595 +7234,2008 @@ const struct usbi_os_backend linux_usbfs_backend = {
 	.device_handle_priv_size = sizeof(struct linux_device_handle_priv),
 	.transfer_priv_size = sizeof(struct linux_transfer_priv),
 };
-// line 1 "libusb/libusb/os/linux_netlink.c"
+// line 1 "libusb/libusb/os/virtual.c"
 /* -*- Mode: C; c-basic-offset:8 ; indent-tabs-mode:t -*- */
 /*
- * Linux usbfs backend for libusb
- * Copyright (C) 2007-2009 Daniel Drake <dsd@gentoo.org>
- * Copyright (c) 2001 Johannes Erdfelt <johannes@erdfelt.com>
- * Copyright (c) 2013 Nathan Hjelm <hjelmn@mac.com>
- * Copyright (c) 2016 Chris Dickens <christopher.a.dickens@gmail.com>
- *
- * This library is free software; you can redistribute it and/or
- * modify it under the terms of the GNU Lesser General Public
- * License as published by the Free Software Foundation; either
- * version 2.1 of the License, or (at your option) any later version.
- *
- * This library is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
- * Lesser General Public License for more details.
- *
- * You should have received a copy of the GNU Lesser General Public
- * License along with this library; if not, write to the Free Software
- * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ * Simulated bus of virtual HID devices, for testing and benchmarking the
+ * stack above the OS backend without hardware.
+ *
+ * The devices live in virtual_devices and are enumerated into every context
+ * created while the backend is selected, hotplug style. Transfers are
+ * queued under virtual_lock and completed by a single bus thread through
+ * usbi_signal_transfer_completion(): control and OUT transfers once their
+ * latency has passed, IN transfers with the echoed output reports or the
+ * periodic input reports of their device.
  */
 
-// SKIP #include "libusb/libusb/config.h"
-// line 25 "libusb/libusb/os/linux_netlink.c"
+#define VIRTUAL_BUSNUM			254
+#define VIRTUAL_MAX_REPORT		1024
+#define VIRTUAL_MAX_ECHOES		32
+#define VIRTUAL_MAX_INTERFACES		4
+#define VIRTUAL_INTERFACE_LENGTH	(LIBUSB_DT_INTERFACE_SIZE + 9 + \
+	2 * LIBUSB_DT_ENDPOINT_SIZE)
+#define VIRTUAL_CONFIG_LENGTH		(LIBUSB_DT_CONFIG_SIZE + \
+	VIRTUAL_MAX_INTERFACES * VIRTUAL_INTERFACE_LENGTH)
+#define VIRTUAL_REPORT_DESC_LENGTH	40
+
+/* HID class requests and descriptor types */
+#define VIRTUAL_HID_GET_REPORT		0x01
+#define VIRTUAL_HID_GET_IDLE		0x02
+#define VIRTUAL_HID_GET_PROTOCOL	0x03
+#define VIRTUAL_HID_SET_REPORT		0x09
+#define VIRTUAL_HID_SET_IDLE		0x0a
+#define VIRTUAL_HID_SET_PROTOCOL	0x0b
+#define VIRTUAL_REPORT_INPUT		1
+#define VIRTUAL_REPORT_OUTPUT		2
+#define VIRTUAL_REPORT_FEATURE		3
+
+/* An echoed output report, or the last value set of a feature report */
+struct virtual_report {
+	struct list_head list;
+	int id;
+	/* interface an output report is echoed on */
+	int interface;
+	int length;
+	unsigned char data[];
+};
 
-#include <assert.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <poll.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/types.h>
+struct virtual_device {
+	/* in virtual_devices while attached */
+	struct list_head list;
 
-#ifdef HAVE_ASM_TYPES_H
-#include <asm/types.h>
-#endif
+	/* held by the list and by every libusb_device of the device */
+	int refcnt;
 
-#include <sys/socket.h>
-#include <linux/netlink.h>
+	int id;
+	uint8_t devaddr;
+	int attached;
+	struct libusb_virtual_device desc;
+
+	unsigned char device_desc[DEVICE_DESC_LENGTH];
+	unsigned char config_desc[VIRTUAL_CONFIG_LENGTH];
+	int config_len;
+	unsigned char report_desc[VIRTUAL_REPORT_DESC_LENGTH];
+	int report_desc_len;
+	/* manufacturer, product and serial number, as string descriptors */
+	unsigned char strings[3][256];
+
+	/* the state below is guarded by virtual_lock */
+	struct list_head in_transfers;
+	struct list_head echoes;
+	int echo_count;
+	struct list_head features;
+	uint64_t next_report_ns;
+	uint32_t sequence;
+};
 
-// SKIP #include "libusb/libusb/libusbi.h"
-// line 44 "libusb/libusb/os/linux_netlink.c"
-// SKIP #include "libusb/libusb/os/linux_usbfs.h"
-// line 45 "libusb/libusb/os/linux_netlink.c"
+struct virtual_device_priv {
+	struct virtual_device *vdev;
+};
 
-#define NL_GROUP_KERNEL 1
+struct virtual_transfer_priv {
+	/* in virtual_pending, or in_transfers of the device, while queued */
+	struct list_head list;
+	struct usbi_transfer *itransfer;
+	struct virtual_device *vdev;
+	/* interface of the endpoint of an interrupt transfer */
+	int interface;
+	uint64_t due_ns;
+	int queued;
+	/* taken off the queues, until the completion is handled */
+	int completing;
+	int cancelled;
+	enum libusb_transfer_status status;
+};
 
-static int linux_netlink_socket = -1;
-static int netlink_control_pipe[2] = { -1, -1 };
-static pthread_t libusb_linux_event_thread;
+/* Guards the device list, the transfer queues and the device state. Taken
+   before active_contexts_lock. */
+static usbi_mutex_static_t virtual_lock = USBI_MUTEX_INITIALIZER;
+static struct list_head virtual_devices = { &virtual_devices, &virtual_devices };
+static struct list_head virtual_pending = { &virtual_pending, &virtual_pending };
+static int virtual_last_id = 0;
+static int virtual_contexts = 0;
+static int virtual_stop = 0;
+static pthread_cond_t virtual_cond;
 
-static void *linux_netlink_event_thread_main(void *arg);
+/* Serializes starting and stopping the bus thread, taken before
+   virtual_lock */
+static usbi_mutex_static_t virtual_thread_lock = USBI_MUTEX_INITIALIZER;
+static pthread_t virtual_thread;
 
-static int set_fd_cloexec_nb(int fd)
+static struct virtual_device_priv *_virtual_device_priv(struct libusb_device *dev)
 {
-	int flags;
+	return (struct virtual_device_priv *) dev->os_priv;
+}
 
-#if defined(FD_CLOEXEC)
-	flags = fcntl(fd, F_GETFD);
-	if (flags == -1) {
-		usbi_err(NULL, "failed to get netlink fd flags (%d)", errno);
-		return -1;
-	}
+static uint64_t virtual_now_ns(void)
+{
+	struct timespec now;
 
-	if (!(flags & FD_CLOEXEC)) {
-		if (fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
-			usbi_err(NULL, "failed to set netlink fd flags (%d)", errno);
-			return -1;
-		}
-	}
-#endif
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
 
-	flags = fcntl(fd, F_GETFL);
-	if (flags == -1) {
-		usbi_err(NULL, "failed to get netlink fd status flags (%d)", errno);
-		return -1;
-	}
+static void virtual_free_reports(struct list_head *reports)
+{
+	struct virtual_report *report, *next;
 
-	if (!(flags & O_NONBLOCK)) {
-		if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-			usbi_err(NULL, "failed to set netlink fd status flags (%d)", errno);
-			return -1;
-		}
+	list_for_each_entry_safe(report, next, reports, list, struct virtual_report) {
+		list_del(&report->list);
+		free(report);
 	}
+}
 
-	return 0;
+static void virtual_unref_device(struct virtual_device *vdev)
+{
+	if (__atomic_sub_fetch(&vdev->refcnt, 1, __ATOMIC_ACQ_REL))
+		return;
+	virtual_free_reports(&vdev->echoes);
+	virtual_free_reports(&vdev->features);
+	free(vdev);
 }
 
-int linux_netlink_start_event_monitor(void)
+/* Encode a UTF-8 string as a string descriptor */
+static void virtual_string_descriptor(unsigned char *buf, const char *str)
 {
-	struct sockaddr_nl sa_nl = { .nl_family = AF_NETLINK, .nl_groups = NL_GROUP_KERNEL };
-	int socktype = SOCK_RAW;
-	int opt = 1;
-	int ret;
+	const unsigned char *s = (const unsigned char *)str;
+	int len = 2;
 
-#if defined(SOCK_CLOEXEC)
-	socktype |= SOCK_CLOEXEC;
-#endif
-#if defined(SOCK_NONBLOCK)
-	socktype |= SOCK_NONBLOCK;
-#endif
+	while (*s) {
+		uint32_t c = *s++;
+		int extra = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
 
-	linux_netlink_socket = socket(PF_NETLINK, socktype, NETLINK_KOBJECT_UEVENT);
-	if (linux_netlink_socket == -1 && errno == EINVAL) {
-		usbi_dbg("failed to create netlink socket of type %d, attempting SOCK_RAW", socktype);
-		linux_netlink_socket = socket(PF_NETLINK, SOCK_RAW, NETLINK_KOBJECT_UEVENT);
+		if (extra)
+			c &= 0x3f >> extra;
+		while (extra-- && (*s & 0xc0) == 0x80)
+			c = c << 6 | (*s++ & 0x3f);
+		if (len + (c > 0xffff ? 4 : 2) > 254)
+			break;
+		if (c > 0xffff) {
+			c -= 0x10000;
+			buf[len++] = (0xd800 | (c >> 10)) & 0xff;
+			buf[len++] = (0xd800 | (c >> 10)) >> 8;
+			c = 0xdc00 | (c & 0x3ff);
+		}
+		buf[len++] = c & 0xff;
+		buf[len++] = (c >> 8) & 0xff;
+	}
+	buf[0] = (unsigned char)len;
+	buf[1] = LIBUSB_DT_STRING;
+}
+
+/* Append a main item declaring count vendor defined bytes */
+static int virtual_report_item(unsigned char *p, uint8_t item, int count)
+{
+	p[0] = 0x96;	/* Report Count, 2 bytes */
+	p[1] = count & 0xff;
+	p[2] = count >> 8;
+	p[3] = 0x09;	/* Usage */
+	p[4] = 0x01;
+	p[5] = item;
+	p[6] = 0x02;	/* Data, Variable, Absolute */
+	return 7;
+}
+
+static void virtual_build_descriptors(struct virtual_device *vdev)
+{
+	const struct libusb_virtual_device *d = &vdev->desc;
+	unsigned char *p = vdev->report_desc;
+	unsigned char *c = vdev->config_desc;
+	int interval_ms = d->report_interval_us / 1000;
+	int num_endpoints = d->output_report_size ? 2 : 1;
+	const char *strings[3];
+	int i, n;
+
+	/* vendor defined collection of byte sized reports */
+	*p++ = 0x06; *p++ = 0x00; *p++ = 0xff;	/* Usage Page (0xff00) */
+	*p++ = 0x09; *p++ = 0x01;		/* Usage (1) */
+	*p++ = 0xa1; *p++ = 0x01;		/* Collection (Application) */
+	*p++ = 0x15; *p++ = 0x00;		/* Logical Minimum (0) */
+	*p++ = 0x26; *p++ = 0xff; *p++ = 0x00;	/* Logical Maximum (255) */
+	*p++ = 0x75; *p++ = 0x08;		/* Report Size (8) */
+	p += virtual_report_item(p, 0x81, d->input_report_size);
+	if (d->output_report_size)
+		p += virtual_report_item(p, 0x91, d->output_report_size);
+	if (d->feature_report_size)
+		p += virtual_report_item(p, 0xb1, d->feature_report_size);
+	*p++ = 0xc0;				/* End Collection */
+	vdev->report_desc_len = (int)(p - vdev->report_desc);
+
+	p = vdev->device_desc;
+	p[0] = LIBUSB_DT_DEVICE_SIZE;
+	p[1] = LIBUSB_DT_DEVICE;
+	p[2] = 0x00; p[3] = 0x02;		/* USB 2.0 */
+	p[4] = p[5] = p[6] = 0;			/* class per interface */
+	p[7] = 64;
+	p[8] = d->idVendor & 0xff; p[9] = d->idVendor >> 8;
+	p[10] = d->idProduct & 0xff; p[11] = d->idProduct >> 8;
+	p[12] = d->bcdDevice & 0xff; p[13] = d->bcdDevice >> 8;
+	p[14] = d->manufacturer ? 1 : 0;
+	p[15] = d->product ? 2 : 0;
+	p[16] = d->serial_number ? 3 : 0;
+	p[17] = 1;
+
+	vdev->config_len = LIBUSB_DT_CONFIG_SIZE + d->num_interfaces *
+		(LIBUSB_DT_INTERFACE_SIZE + 9 + num_endpoints * LIBUSB_DT_ENDPOINT_SIZE);
+	if (interval_ms < 1)
+		interval_ms = 1;
+	else if (interval_ms > 255)
+		interval_ms = 255;
+
+	*c++ = LIBUSB_DT_CONFIG_SIZE;
+	*c++ = LIBUSB_DT_CONFIG;
+	*c++ = vdev->config_len & 0xff; *c++ = vdev->config_len >> 8;
+	*c++ = d->num_interfaces;		/* bNumInterfaces */
+	*c++ = 1;				/* bConfigurationValue */
+	*c++ = 0;				/* iConfiguration */
+	*c++ = 0x80;				/* bus powered */
+	*c++ = 50;				/* 100mA */
+
+	for (n = 0; n < d->num_interfaces; n++) {
+		*c++ = LIBUSB_DT_INTERFACE_SIZE;
+		*c++ = LIBUSB_DT_INTERFACE;
+		*c++ = (unsigned char)n;		/* bInterfaceNumber */
+		*c++ = 0;				/* bAlternateSetting */
+		*c++ = num_endpoints;
+		*c++ = LIBUSB_CLASS_HID;
+		*c++ = 0; *c++ = 0; *c++ = 0;
+
+		*c++ = 9;
+		*c++ = LIBUSB_DT_HID;
+		*c++ = 0x11; *c++ = 0x01;		/* HID 1.11 */
+		*c++ = 0;				/* bCountryCode */
+		*c++ = 1;				/* bNumDescriptors */
+		*c++ = LIBUSB_DT_REPORT;
+		*c++ = vdev->report_desc_len & 0xff; *c++ = vdev->report_desc_len >> 8;
+
+		*c++ = LIBUSB_DT_ENDPOINT_SIZE;
+		*c++ = LIBUSB_DT_ENDPOINT;
+		*c++ = LIBUSB_ENDPOINT_IN | (n + 1);
+		*c++ = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+		*c++ = d->input_report_size & 0xff; *c++ = d->input_report_size >> 8;
+		*c++ = (unsigned char)interval_ms;
+
+		if (d->output_report_size) {
+			*c++ = LIBUSB_DT_ENDPOINT_SIZE;
+			*c++ = LIBUSB_DT_ENDPOINT;
+			*c++ = LIBUSB_ENDPOINT_OUT | (n + 1);
+			*c++ = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+			*c++ = d->output_report_size & 0xff; *c++ = d->output_report_size >> 8;
+			*c++ = (unsigned char)interval_ms;
+		}
 	}
 
-	if (linux_netlink_socket == -1) {
-		usbi_err(NULL, "failed to create netlink socket (%d)", errno);
-		goto err;
+	strings[0] = d->manufacturer;
+	strings[1] = d->product;
+	strings[2] = d->serial_number;
+	for (i = 0; i < 3; i++) {
+		if (strings[i])
+			virtual_string_descriptor(vdev->strings[i], strings[i]);
 	}
+}
 
-	ret = set_fd_cloexec_nb(linux_netlink_socket);
-	if (ret == -1)
-		goto err_close_socket;
-
-	ret = bind(linux_netlink_socket, (struct sockaddr *)&sa_nl, sizeof(sa_nl));
-	if (ret == -1) {
-		usbi_err(NULL, "failed to bind netlink socket (%d)", errno);
-		goto err_close_socket;
-	}
+/* Add vdev to ctx, if it is not there yet. Called with virtual_lock held. */
+static int virtual_enumerate_device(struct libusb_context *ctx,
+	struct virtual_device *vdev)
+{
+	unsigned long session_id = VIRTUAL_BUSNUM << 8 | vdev->devaddr;
+	struct libusb_device *dev;
+	int r;
 
-	ret = setsockopt(linux_netlink_socket, SOL_SOCKET, SO_PASSCRED, &opt, sizeof(opt));
-	if (ret == -1) {
-		usbi_err(NULL, "failed to set netlink socket SO_PASSCRED option (%d)", errno);
-		goto err_close_socket;
+	dev = usbi_get_device_by_session_id(ctx, session_id);
+	if (dev) {
+		libusb_unref_device(dev);
+		return LIBUSB_SUCCESS;
 	}
 
-	ret = usbi_pipe(netlink_control_pipe);
-	if (ret) {
-		usbi_err(NULL, "failed to create netlink control pipe");
-		goto err_close_socket;
-	}
+	dev = usbi_alloc_device(ctx, session_id);
+	if (!dev)
+		return LIBUSB_ERROR_NO_MEM;
 
-	ret = pthread_create(&libusb_linux_event_thread, NULL, linux_netlink_event_thread_main, NULL);
-	if (ret != 0) {
-		usbi_err(NULL, "failed to create netlink event thread (%d)", ret);
-		goto err_close_pipe;
-	}
+	__atomic_add_fetch(&vdev->refcnt, 1, __ATOMIC_RELAXED);
+	_virtual_device_priv(dev)->vdev = vdev;
+	dev->bus_number = VIRTUAL_BUSNUM;
+	dev->port_number = vdev->devaddr;
+	dev->device_address = vdev->devaddr;
+	dev->speed = LIBUSB_SPEED_FULL;
 
-	return LIBUSB_SUCCESS;
+	r = usbi_sanitize_device(dev);
+	if (r < 0)
+		libusb_unref_device(dev);
+	else
+		usbi_connect_device(dev);
 
-err_close_pipe:
-	close(netlink_control_pipe[0]);
-	close(netlink_control_pipe[1]);
-	netlink_control_pipe[0] = -1;
-	netlink_control_pipe[1] = -1;
-err_close_socket:
-	close(linux_netlink_socket);
-	linux_netlink_socket = -1;
-err:
-	return LIBUSB_ERROR_OTHER;
+	return r;
 }
 
-int linux_netlink_stop_event_monitor(void)
+static int virtual_copy(unsigned char *data, int length,
+	const unsigned char *src, int src_length)
 {
-	char dummy = 1;
-	ssize_t r;
+	int n = src_length < length ? src_length : length;
 
-	assert(linux_netlink_socket != -1);
+	memcpy(data, src, n);
+	return n;
+}
 
-	/* Write some dummy data to the control pipe and
-	 * wait for the thread to exit */
-	r = usbi_write(netlink_control_pipe[1], &dummy, sizeof(dummy));
-	if (r <= 0)
-		usbi_warn(NULL, "netlink control pipe signal failed");
+/* Fill data with the next periodic input report of vdev. Called with
+   virtual_lock held. */
+static int virtual_input_report(struct virtual_device *vdev,
+	unsigned char *data, int length)
+{
+	int i;
 
-	pthread_join(libusb_linux_event_thread, NULL);
+	if (length > vdev->desc.input_report_size)
+		length = vdev->desc.input_report_size;
+	if (vdev->desc.input_report)
+		return vdev->desc.input_report(vdev->desc.user_data, data, length);
 
-	close(linux_netlink_socket);
-	linux_netlink_socket = -1;
+	for (i = 0; i < length; i++)
+		data[i] = (unsigned char)(vdev->sequence + i);
+	vdev->sequence++;
+	return length;
+}
 
-	/* close and reset control pipe */
-	close(netlink_control_pipe[0]);
-	close(netlink_control_pipe[1]);
-	netlink_control_pipe[0] = -1;
-	netlink_control_pipe[1] = -1;
+/* Queue an output report to be echoed as input report of the given
+   interface. Called with virtual_lock held. */
+static int virtual_echo(struct virtual_device *vdev, int interface,
+	const unsigned char *data, int length)
+{
+	struct virtual_report *report;
 
-	return LIBUSB_SUCCESS;
+	/* like a device not polled by the host, drop what does not fit */
+	if (vdev->echo_count >= VIRTUAL_MAX_ECHOES)
+		return length;
+
+	report = malloc(sizeof(*report) + length);
+	if (!report)
+		return LIBUSB_ERROR_NO_MEM;
+	report->id = 0;
+	report->interface = interface;
+	report->length = length;
+	memcpy(report->data, data, length);
+	list_add_tail(&report->list, &vdev->echoes);
+	vdev->echo_count++;
+	return length;
 }
 
-static const char *netlink_message_parse(const char *buffer, size_t len, const char *key)
+static struct virtual_report *virtual_find_feature(struct virtual_device *vdev,
+	int id)
 {
-	const char *end = buffer + len;
-	size_t keylen = strlen(key);
+	struct virtual_report *report;
 
-	while (buffer < end && *buffer) {
-		if (strncmp(buffer, key, keylen) == 0 && buffer[keylen] == '=')
-			return buffer + keylen + 1;
-		buffer += strlen(buffer) + 1;
+	list_for_each_entry(report, &vdev->features, list, struct virtual_report) {
+		if (report->id == id)
+			return report;
 	}
-
 	return NULL;
 }
 
-/* parse parts of netlink message common to both libudev and the kernel */
-static int linux_netlink_parse(const char *buffer, size_t len, int *detached,
-	const char **sys_name, uint8_t *busnum, uint8_t *devaddr)
+static int virtual_set_feature(struct virtual_device *vdev, int id,
+	const unsigned char *data, int length)
 {
-	const char *tmp, *slash;
+	struct virtual_report *report = virtual_find_feature(vdev, id);
 
-	errno = 0;
+	if (report) {
+		list_del(&report->list);
+		free(report);
+	}
+	report = malloc(sizeof(*report) + length);
+	if (!report)
+		return LIBUSB_ERROR_NO_MEM;
+	report->id = id;
+	report->length = length;
+	memcpy(report->data, data, length);
+	list_add_tail(&report->list, &vdev->features);
+	return length;
+}
 
-	*sys_name = NULL;
-	*detached = 0;
-	*busnum   = 0;
-	*devaddr  = 0;
+static int virtual_get_feature(struct virtual_device *vdev, int id,
+	unsigned char *data, int length)
+{
+	struct virtual_report *report = virtual_find_feature(vdev, id);
 
-	tmp = netlink_message_parse(buffer, len, "ACTION");
-	if (!tmp) {
-		return -1;
-	} else if (strcmp(tmp, "remove") == 0) {
-		*detached = 1;
-	} else if (strcmp(tmp, "add") != 0) {
-		usbi_dbg("unknown device action %s", tmp);
-		return -1;
-	}
+	if (report)
+		return virtual_copy(data, length, report->data, report->length);
 
-	/* check that this is a usb message */
-	tmp = netlink_message_parse(buffer, len, "SUBSYSTEM");
-	if (!tmp || strcmp(tmp, "usb") != 0) {
-		/* not usb. ignore */
-		return -1;
+	/* never set, read as zeroes behind the report ID */
+	if (length > vdev->desc.feature_report_size + (id ? 1 : 0))
+		length = vdev->desc.feature_report_size + (id ? 1 : 0);
+	memset(data, 0, length);
+	if (id && length)
+		data[0] = (unsigned char)id;
+	return length;
+}
+
+/* The standard and HID class requests a HID device answers. Called with
+   virtual_lock held. */
+static int virtual_default_control(struct virtual_device *vdev,
+	const struct libusb_control_setup *setup, unsigned char *data)
+{
+	int type = setup->wValue >> 8;
+	int index = setup->wValue & 0xff;
+	int length = setup->wLength;
+
+	switch (setup->bmRequestType << 8 | setup->bRequest) {
+	case (LIBUSB_ENDPOINT_IN << 8) | LIBUSB_REQUEST_GET_STATUS:
+		memset(data, 0, length < 2 ? length : 2);
+		return length < 2 ? length : 2;
+	case (LIBUSB_ENDPOINT_IN << 8) | LIBUSB_REQUEST_GET_CONFIGURATION:
+		if (length)
+			data[0] = 1;
+		return length ? 1 : 0;
+	case (LIBUSB_ENDPOINT_IN << 8) | LIBUSB_REQUEST_GET_DESCRIPTOR:
+		switch (type) {
+		case LIBUSB_DT_DEVICE:
+			return virtual_copy(data, length, vdev->device_desc,
+				DEVICE_DESC_LENGTH);
+		case LIBUSB_DT_CONFIG:
+			if (index)
+				break;
+			return virtual_copy(data, length, vdev->config_desc,
+				vdev->config_len);
+		case LIBUSB_DT_STRING:
+			if (index == 0) {
+				static const unsigned char langids[] =
+					{ 4, LIBUSB_DT_STRING, 0x09, 0x04 };
+				return virtual_copy(data, length, langids, 4);
+			}
+			if (index > 3 || !vdev->strings[index - 1][0])
+				break;
+			return virtual_copy(data, length, vdev->strings[index - 1],
+				vdev->strings[index - 1][0]);
+		}
+		break;
+	case ((LIBUSB_ENDPOINT_IN | LIBUSB_RECIPIENT_INTERFACE) << 8) |
+		LIBUSB_REQUEST_GET_DESCRIPTOR:
+		if (type == LIBUSB_DT_HID)
+			return virtual_copy(data, length, vdev->config_desc +
+				LIBUSB_DT_CONFIG_SIZE + LIBUSB_DT_INTERFACE_SIZE, 9);
+		if (type == LIBUSB_DT_REPORT)
+			return virtual_copy(data, length, vdev->report_desc,
+				vdev->report_desc_len);
+		break;
+	case ((LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE) << 8) |
+		VIRTUAL_HID_SET_REPORT:
+		if (type == VIRTUAL_REPORT_OUTPUT)
+			return virtual_echo(vdev, setup->wIndex, data, length);
+		if (type == VIRTUAL_REPORT_FEATURE && vdev->desc.feature_report_size)
+			return virtual_set_feature(vdev, index, data, length);
+		break;
+	case ((LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE) << 8) |
+		VIRTUAL_HID_SET_IDLE:
+	case ((LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE) << 8) |
+		VIRTUAL_HID_SET_PROTOCOL:
+		return 0;
+	case ((LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS |
+		LIBUSB_RECIPIENT_INTERFACE) << 8) | VIRTUAL_HID_GET_REPORT:
+		if (type == VIRTUAL_REPORT_INPUT)
+			return virtual_input_report(vdev, data, length);
+		if (type == VIRTUAL_REPORT_FEATURE && vdev->desc.feature_report_size)
+			return virtual_get_feature(vdev, index, data, length);
+		break;
+	case ((LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS |
+		LIBUSB_RECIPIENT_INTERFACE) << 8) | VIRTUAL_HID_GET_IDLE:
+	case ((LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS |
+		LIBUSB_RECIPIENT_INTERFACE) << 8) | VIRTUAL_HID_GET_PROTOCOL:
+		if (length)
+			data[0] = setup->bRequest == VIRTUAL_HID_GET_PROTOCOL;
+		return length ? 1 : 0;
 	}
 
-	/* check that this is an actual usb device */
-	tmp = netlink_message_parse(buffer, len, "DEVTYPE");
-	if (!tmp || strcmp(tmp, "usb_device") != 0) {
-		/* not usb. ignore */
-		return -1;
+	return LIBUSB_ERROR_PIPE;
+}
+
+/* Carry out a due control or OUT transfer. Called with virtual_lock held. */
+static void virtual_run_transfer(struct virtual_transfer_priv *tpriv)
+{
+	struct usbi_transfer *itransfer = tpriv->itransfer;
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct virtual_device *vdev = tpriv->vdev;
+	struct libusb_control_setup setup;
+	unsigned char *data;
+	int r;
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_CONTROL) {
+		r = virtual_echo(vdev, tpriv->interface, transfer->buffer,
+			transfer->length);
+		goto out;
 	}
 
-	tmp = netlink_message_parse(buffer, len, "BUSNUM");
-	if (tmp) {
-		*busnum = (uint8_t)(strtoul(tmp, NULL, 10) & 0xff);
-		if (errno) {
-			errno = 0;
-			return -1;
-		}
+	memcpy(&setup, transfer->buffer, LIBUSB_CONTROL_SETUP_SIZE);
+	setup.wValue = libusb_le16_to_cpu(setup.wValue);
+	setup.wIndex = libusb_le16_to_cpu(setup.wIndex);
+	setup.wLength = libusb_le16_to_cpu(setup.wLength);
+	if (setup.wLength > transfer->length - LIBUSB_CONTROL_SETUP_SIZE)
+		setup.wLength = transfer->length - LIBUSB_CONTROL_SETUP_SIZE;
+	data = transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE;
 
-		tmp = netlink_message_parse(buffer, len, "DEVNUM");
-		if (NULL == tmp)
-			return -1;
+	r = LIBUSB_ERROR_NOT_SUPPORTED;
+	if (vdev->desc.control)
+		r = vdev->desc.control(vdev->desc.user_data, &setup, data);
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED)
+		r = virtual_default_control(vdev, &setup, data);
+	if (r > setup.wLength)
+		r = setup.wLength;
 
-		*devaddr = (uint8_t)(strtoul(tmp, NULL, 10) & 0xff);
-		if (errno) {
-			errno = 0;
-			return -1;
-		}
+out:
+	if (r < 0) {
+		itransfer->transferred = 0;
+		tpriv->status = LIBUSB_TRANSFER_STALL;
 	} else {
-		/* no bus number. try "DEVICE" */
-		tmp = netlink_message_parse(buffer, len, "DEVICE");
-		if (!tmp) {
-			/* not usb. ignore */
-			return -1;
-		}
+		itransfer->transferred = r;
+		tpriv->status = LIBUSB_TRANSFER_COMPLETED;
+	}
+}
 
-		/* Parse a device path such as /dev/bus/usb/003/004 */
-		slash = strrchr(tmp, '/');
-		if (!slash)
-			return -1;
+static void virtual_complete(struct virtual_transfer_priv *tpriv,
+	struct list_head *done)
+{
+	list_del(&tpriv->list);
+	tpriv->queued = 0;
+	tpriv->completing = 1;
+	list_add_tail(&tpriv->list, done);
+}
 
-		*busnum = (uint8_t)(strtoul(slash - 3, NULL, 10) & 0xff);
-		if (errno) {
-			errno = 0;
-			return -1;
-		}
+/* Return the first echo queued for an interface of vdev, or NULL. Called
+   with virtual_lock held. */
+static struct virtual_report *virtual_find_echo(struct virtual_device *vdev,
+	int interface)
+{
+	struct virtual_report *report;
 
-		*devaddr = (uint8_t)(strtoul(slash + 1, NULL, 10) & 0xff);
-		if (errno) {
-			errno = 0;
-			return -1;
+	list_for_each_entry(report, &vdev->echoes, list, struct virtual_report) {
+		if (report->interface == interface)
+			return report;
+	}
+	return NULL;
+}
+
+/* Complete the IN transfers of vdev for which a report is available.
+   Returns when the next periodic report is due. Called with virtual_lock
+   held. */
+static uint64_t virtual_feed_input(struct virtual_device *vdev, uint64_t now,
+	struct list_head *done)
+{
+	uint64_t interval_ns = (uint64_t)vdev->desc.report_interval_us * 1000;
+	struct virtual_transfer_priv *tpriv, *next;
+	uint64_t due = UINT64_MAX;
+
+	list_for_each_entry_safe(tpriv, next, &vdev->in_transfers, list, struct virtual_transfer_priv) {
+		struct libusb_transfer *transfer =
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(tpriv->itransfer);
+		struct virtual_report *report;
+		int r;
+
+		report = virtual_find_echo(vdev, tpriv->interface);
+		if (report) {
+			r = virtual_copy(transfer->buffer, transfer->length,
+				report->data, report->length);
+			list_del(&report->list);
+			vdev->echo_count--;
+			free(report);
+		} else if (interval_ns && tpriv->interface == 0) {
+			if (vdev->next_report_ns > now) {
+				due = vdev->next_report_ns;
+				continue;
+			}
+			/* reports are missed while nothing is polling */
+			vdev->next_report_ns += interval_ns;
+			if (vdev->next_report_ns < now)
+				vdev->next_report_ns = now + interval_ns;
+			r = virtual_input_report(vdev, transfer->buffer,
+				transfer->length);
+			if (r < 0) {
+				due = vdev->next_report_ns;
+				continue;
+			}
+		} else {
+			continue;
 		}
 
-		return 0;
+		tpriv->itransfer->transferred = r;
+		tpriv->status = LIBUSB_TRANSFER_COMPLETED;
+		virtual_complete(tpriv, done);
 	}
 
-	tmp = netlink_message_parse(buffer, len, "DEVPATH");
-	if (!tmp)
-		return -1;
+	return due;
+}
 
-	slash = strrchr(tmp, '/');
-	if (slash)
-		*sys_name = slash + 1;
+static void virtual_signal_completions(struct list_head *done)
+{
+	struct virtual_transfer_priv *tpriv, *next;
 
-	/* found a usb device */
-	return 0;
+	list_for_each_entry_safe(tpriv, next, done, list, struct virtual_transfer_priv) {
+		list_del(&tpriv->list);
+		usbi_signal_transfer_completion(tpriv->itransfer);
+	}
 }
 
-static int linux_netlink_read_message(void)
+static void *virtual_bus_thread(void *arg)
 {
-	char cred_buffer[CMSG_SPACE(sizeof(struct ucred))];
-	char msg_buffer[2048];
-	const char *sys_name = NULL;
-	uint8_t busnum, devaddr;
-	int detached, r;
-	ssize_t len;
-	struct cmsghdr *cmsg;
-	struct ucred *cred;
-	struct sockaddr_nl sa_nl;
-	struct iovec iov = { .iov_base = msg_buffer, .iov_len = sizeof(msg_buffer) };
-	struct msghdr msg = {
-		.msg_iov = &iov, .msg_iovlen = 1,
-		.msg_control = cred_buffer, .msg_controllen = sizeof(cred_buffer),
-		.msg_name = &sa_nl, .msg_namelen = sizeof(sa_nl)
-	};
+	struct list_head done;
 
-	/* read netlink message */
-	len = recvmsg(linux_netlink_socket, &msg, 0);
-	if (len == -1) {
-		if (errno != EAGAIN && errno != EINTR)
-			usbi_err(NULL, "error receiving message from netlink (%d)", errno);
-		return -1;
-	}
+	UNUSED(arg);
 
-	if (len < 32 || (msg.msg_flags & MSG_TRUNC)) {
-		usbi_err(NULL, "invalid netlink message length");
-		return -1;
-	}
+	usbi_mutex_static_lock(&virtual_lock);
+	while (!virtual_stop) {
+		struct virtual_transfer_priv *tpriv, *next;
+		struct virtual_device *vdev;
+		uint64_t now = virtual_now_ns();
+		uint64_t wakeup = UINT64_MAX;
+		struct timespec ts;
 
-	if (sa_nl.nl_groups != NL_GROUP_KERNEL || sa_nl.nl_pid != 0) {
-		usbi_dbg("ignoring netlink message from unknown group/PID (%u/%u)",
-			 (unsigned int)sa_nl.nl_groups, (unsigned int)sa_nl.nl_pid);
-		return -1;
+		list_init(&done);
+		list_for_each_entry_safe(tpriv, next, &virtual_pending, list, struct virtual_transfer_priv) {
+			if (tpriv->due_ns <= now) {
+				virtual_run_transfer(tpriv);
+				virtual_complete(tpriv, &done);
+			} else if (tpriv->due_ns < wakeup) {
+				wakeup = tpriv->due_ns;
+			}
+		}
+		list_for_each_entry(vdev, &virtual_devices, list, struct virtual_device) {
+			uint64_t due = virtual_feed_input(vdev, now, &done);
+			if (due < wakeup)
+				wakeup = due;
+		}
+
+		if (!list_empty(&done)) {
+			/* completions take the event data lock of the context,
+			 * which must not nest inside virtual_lock */
+			usbi_mutex_static_unlock(&virtual_lock);
+			virtual_signal_completions(&done);
+			usbi_mutex_static_lock(&virtual_lock);
+			continue;
+		}
+
+		if (wakeup == UINT64_MAX) {
+			pthread_cond_wait(&virtual_cond, &virtual_lock);
+			continue;
+		}
+		ts.tv_sec = wakeup / 1000000000;
+		ts.tv_nsec = wakeup % 1000000000;
+		pthread_cond_timedwait(&virtual_cond, &virtual_lock, &ts);
 	}
+	usbi_mutex_static_unlock(&virtual_lock);
 
-	cmsg = CMSG_FIRSTHDR(&msg);
-	if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS) {
-		usbi_dbg("ignoring netlink message with no sender credentials");
-		return -1;
+	return NULL;
+}
+
+static int virtual_init(struct libusb_context *ctx)
+{
+	struct virtual_device *vdev;
+	int r = LIBUSB_SUCCESS;
+
+	usbi_mutex_static_lock(&virtual_thread_lock);
+	if (!virtual_contexts) {
+		pthread_condattr_t attr;
+
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&virtual_cond, &attr);
+		pthread_condattr_destroy(&attr);
+
+		virtual_stop = 0;
+		if (pthread_create(&virtual_thread, NULL, virtual_bus_thread, NULL)) {
+			usbi_err(ctx, "failed to create the virtual bus thread");
+			pthread_cond_destroy(&virtual_cond);
+			usbi_mutex_static_unlock(&virtual_thread_lock);
+			return LIBUSB_ERROR_OTHER;
+		}
 	}
 
-	cred = (struct ucred *)CMSG_DATA(cmsg);
-	if (cred->uid != 0) {
-		usbi_dbg("ignoring netlink message with non-zero sender UID %u", (unsigned int)cred->uid);
-		return -1;
+	usbi_mutex_static_lock(&virtual_lock);
+	virtual_contexts++;
+	list_for_each_entry(vdev, &virtual_devices, list, struct virtual_device) {
+		r = virtual_enumerate_device(ctx, vdev);
+		if (r < 0)
+			break;
 	}
+	usbi_mutex_static_unlock(&virtual_lock);
+	usbi_mutex_static_unlock(&virtual_thread_lock);
 
-	r = linux_netlink_parse(msg_buffer, (size_t)len, &detached, &sys_name, &busnum, &devaddr);
-	if (r)
-		return r;
+	/* libusb_init() calls exit on failure, which undoes the count */
+	return r;
+}
 
-	usbi_dbg("netlink hotplug found device busnum: %hhu, devaddr: %hhu, sys_name: %s, removed: %s",
-		 busnum, devaddr, sys_name, detached ? "yes" : "no");
+static void virtual_exit(void)
+{
+	int stop;
 
-	/* signal device is available (or not) to all contexts */
-	if (detached)
-		linux_device_disconnected(busnum, devaddr);
-	else
-		linux_hotplug_enumerate(busnum, devaddr, sys_name);
+	usbi_mutex_static_lock(&virtual_thread_lock);
+	usbi_mutex_static_lock(&virtual_lock);
+	stop = --virtual_contexts == 0;
+	if (stop) {
+		virtual_stop = 1;
+		pthread_cond_signal(&virtual_cond);
+	}
+	usbi_mutex_static_unlock(&virtual_lock);
 
-	return 0;
+	if (stop) {
+		pthread_join(virtual_thread, NULL);
+		pthread_cond_destroy(&virtual_cond);
+	}
+	usbi_mutex_static_unlock(&virtual_thread_lock);
 }
 
-static void *linux_netlink_event_thread_main(void *arg)
+static int virtual_get_device_descriptor(struct libusb_device *dev,
+	unsigned char *buffer, int *host_endian)
 {
-	char dummy;
-	ssize_t r;
-	struct pollfd fds[] = {
-		{ .fd = netlink_control_pipe[0],
-		  .events = POLLIN },
-		{ .fd = linux_netlink_socket,
-		  .events = POLLIN },
-	};
+	struct virtual_device *vdev = _virtual_device_priv(dev)->vdev;
 
-	UNUSED(arg);
+	*host_endian = 0;
+	memcpy(buffer, vdev->device_desc, DEVICE_DESC_LENGTH);
+	return 0;
+}
 
-	usbi_dbg("netlink event thread entering");
+static int virtual_get_config_descriptor(struct libusb_device *dev,
+	uint8_t config_index, unsigned char *buffer, size_t len, int *host_endian)
+{
+	struct virtual_device *vdev = _virtual_device_priv(dev)->vdev;
 
-	while (poll(fds, 2, -1) >= 0) {
-		if (fds[0].revents & POLLIN) {
-			/* activity on control pipe, read the byte and exit */
-			r = usbi_read(netlink_control_pipe[0], &dummy, sizeof(dummy));
-			if (r <= 0)
-				usbi_warn(NULL, "netlink control pipe read failed");
-			break;
-		}
-		if (fds[1].revents & POLLIN) {
-			usbi_mutex_static_lock(&linux_hotplug_lock);
-			linux_netlink_read_message();
-			usbi_mutex_static_unlock(&linux_hotplug_lock);
-		}
-	}
+	if (config_index)
+		return LIBUSB_ERROR_NOT_FOUND;
 
-	usbi_dbg("netlink event thread exiting");
+	*host_endian = 0;
+	if (len > (size_t)vdev->config_len)
+		len = vdev->config_len;
+	memcpy(buffer, vdev->config_desc, len);
+	return (int)len;
+}
 
-	return NULL;
+static int virtual_get_active_config_descriptor(struct libusb_device *dev,
+	unsigned char *buffer, size_t len, int *host_endian)
+{
+	return virtual_get_config_descriptor(dev, 0, buffer, len, host_endian);
 }
 
-void linux_netlink_hotplug_poll(void)
+static int virtual_get_config_descriptor_by_value(struct libusb_device *dev,
+	uint8_t value, unsigned char **buffer, int *host_endian)
 {
-	int r;
+	struct virtual_device *vdev = _virtual_device_priv(dev)->vdev;
 
-	usbi_mutex_static_lock(&linux_hotplug_lock);
-	do {
-		r = linux_netlink_read_message();
-	} while (r == 0);
-	usbi_mutex_static_unlock(&linux_hotplug_lock);
+	*buffer = NULL;
+	if (value != 1)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	*host_endian = 0;
+	*buffer = vdev->config_desc;
+	return vdev->config_len;
 }
-// line 1 "libusb/libusb/core.c"
-/* -*- Mode: C; indent-tabs-mode:t ; c-basic-offset:8 -*- */
-/*
- * Core functions for libusb
- * Copyright © 2012-2013 Nathan Hjelm <hjelmn@cs.unm.edu>
- * Copyright © 2007-2008 Daniel Drake <dsd@gentoo.org>
- * Copyright © 2001 Johannes Erdfelt <johannes@erdfelt.com>
- *
- * This library is free software; you can redistribute it and/or
- * modify it under the terms of the GNU Lesser General Public
- * License as published by the Free Software Foundation; either
- * version 2.1 of the License, or (at your option) any later version.
- *
- * This library is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
- * Lesser General Public License for more details.
- *
- * You should have received a copy of the GNU Lesser General Public
- * License along with this library; if not, write to the Free Software
- * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
- */
 
-// SKIP #include "libusb/libusb/config.h"
-// line 24 "libusb/libusb/core.c"
+static int virtual_open(struct libusb_device_handle *handle)
+{
+	struct virtual_device *vdev = _virtual_device_priv(handle->dev)->vdev;
+	int r = LIBUSB_SUCCESS;
 
-#include <errno.h>
-#include <stdarg.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#ifdef HAVE_SYS_TYPES_H
-#include <sys/types.h>
-#endif
-#ifdef HAVE_SYS_TIME_H
-#include <sys/time.h>
-#endif
-#ifdef HAVE_SYSLOG_H
-#include <syslog.h>
-#endif
+	usbi_mutex_static_lock(&virtual_lock);
+	if (!vdev->attached)
+		r = LIBUSB_ERROR_NO_DEVICE;
+	usbi_mutex_static_unlock(&virtual_lock);
 
-#ifdef __ANDROID__
-#include <android/log.h>
-#endif
+	return r;
+}
 
-// SKIP #include "libusb/libusb/libusbi.h"
-// line 45 "libusb/libusb/core.c"
-// line 1 "libusb/libusb/hotplug.h"
-/* -*- Mode: C; indent-tabs-mode:t ; c-basic-offset:8 -*- */
-/*
- * Hotplug support for libusb
- * Copyright © 2012-2013 Nathan Hjelm <hjelmn@mac.com>
- * Copyright © 2012-2013 Peter Stuge <peter@stuge.se>
- *
- * This library is free software; you can redistribute it and/or
- * modify it under the terms of the GNU Lesser General Public
- * License as published by the Free Software Foundation; either
- * version 2.1 of the License, or (at your option) any later version.
- *
- * This library is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
- * Lesser General Public License for more details.
- *
- * You should have received a copy of the GNU Lesser General Public
- * License along with this library; if not, write to the Free Software
- * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
- */
+static void virtual_close(struct libusb_device_handle *handle)
+{
+	UNUSED(handle);
+}
 
-#if !defined(USBI_HOTPLUG_H)
-#define USBI_HOTPLUG_H
+static int virtual_get_configuration(struct libusb_device_handle *handle,
+	int *config)
+{
+	UNUSED(handle);
+	*config = 1;
+	return 0;
+}
 
-#ifndef LIBUSBI_H
-// SKIP #include "libusb/libusb/libusbi.h"
-// line 27 "libusb/libusb/hotplug.h"
-#endif
+static int virtual_set_configuration(struct libusb_device_handle *handle,
+	int config)
+{
+	UNUSED(handle);
+	return config == 1 || config == -1 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
 
-/** \ingroup hotplug
- * The hotplug callback structure. The user populates this structure with
- * libusb_hotplug_prepare_callback() and then calls libusb_hotplug_register_callback()
- * to receive notification of hotplug events.
- */
-struct libusb_hotplug_callback {
-	/** Context this callback is associated with */
-	struct libusb_context *ctx;
+static int virtual_claim_interface(struct libusb_device_handle *handle,
+	int iface)
+{
+	struct virtual_device *vdev = _virtual_device_priv(handle->dev)->vdev;
 
-	/** Vendor ID to match or LIBUSB_HOTPLUG_MATCH_ANY */
-	int vendor_id;
+	return iface < vdev->desc.num_interfaces ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
 
-	/** Product ID to match or LIBUSB_HOTPLUG_MATCH_ANY */
-	int product_id;
+static int virtual_set_interface(struct libusb_device_handle *handle,
+	int iface, int altsetting)
+{
+	struct virtual_device *vdev = _virtual_device_priv(handle->dev)->vdev;
 
-	/** Device class to match or LIBUSB_HOTPLUG_MATCH_ANY */
-	int dev_class;
+	return iface < vdev->desc.num_interfaces && altsetting == 0 ?
+		0 : LIBUSB_ERROR_NOT_FOUND;
+}
 
-	/** Hotplug callback flags */
-	libusb_hotplug_flag flags;
+static int virtual_clear_halt(struct libusb_device_handle *handle,
+	unsigned char endpoint)
+{
+	UNUSED(handle);
+	UNUSED(endpoint);
+	return 0;
+}
 
-	/** Event(s) that will trigger this callback */
-	libusb_hotplug_event events;
+static int virtual_reset_device(struct libusb_device_handle *handle)
+{
+	UNUSED(handle);
+	return 0;
+}
 
-	/** Callback function to invoke for matching event/device */
-	libusb_hotplug_callback_fn cb;
+/* Device memory is plain heap on the simulated bus, which lets the users of
+   device memory be exercised */
+static unsigned char *virtual_dev_mem_alloc(struct libusb_device_handle *handle,
+	size_t len)
+{
+	UNUSED(handle);
+	return calloc(1, len);
+}
 
-	/** Handle for this callback (used to match on deregister) */
-	libusb_hotplug_callback_handle handle;
+static int virtual_dev_mem_free(struct libusb_device_handle *handle,
+	unsigned char *buffer, size_t len)
+{
+	UNUSED(handle);
+	UNUSED(len);
+	free(buffer);
+	return LIBUSB_SUCCESS;
+}
 
-	/** User data that will be passed to the callback function */
-	void *user_data;
+static int virtual_kernel_driver_active(struct libusb_device_handle *handle,
+	int iface)
+{
+	UNUSED(handle);
+	UNUSED(iface);
+	return 0;
+}
 
-	/** Callback is marked for deletion */
-	int needs_free;
+static void virtual_destroy_device(struct libusb_device *dev)
+{
+	struct virtual_device_priv *priv = _virtual_device_priv(dev);
 
-	/** List this callback is registered in (ctx->hotplug_cbs) */
-	struct list_head list;
-};
+	if (priv->vdev)
+		virtual_unref_device(priv->vdev);
+}
 
-typedef struct libusb_hotplug_callback libusb_hotplug_callback;
+static int virtual_submit_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct virtual_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct virtual_device *vdev = _virtual_device_priv(transfer->dev_handle->dev)->vdev;
+	int is_in = transfer->endpoint & LIBUSB_ENDPOINT_IN;
 
-struct libusb_hotplug_message {
-	/** The hotplug event that occurred */
-	libusb_hotplug_event event;
+	switch (transfer->type) {
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		if (transfer->length < (int)LIBUSB_CONTROL_SETUP_SIZE)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		break;
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		if ((transfer->endpoint & 0x0f) < 1 ||
+		    (transfer->endpoint & 0x0f) > vdev->desc.num_interfaces ||
+		    (!is_in && !vdev->desc.output_report_size))
+			return LIBUSB_ERROR_NOT_FOUND;
+		break;
+	default:
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
 
-	/** The device for which this hotplug event occurred */
-	struct libusb_device *device;
+	tpriv->itransfer = itransfer;
+	tpriv->vdev = vdev;
+	tpriv->interface = (transfer->endpoint & 0x0f) - 1;
+	tpriv->cancelled = 0;
+	tpriv->status = LIBUSB_TRANSFER_COMPLETED;
 
-	/** List this message is contained in (ctx->hotplug_msgs) */
-	struct list_head list;
-};
+	usbi_mutex_static_lock(&virtual_lock);
+	if (!vdev->attached) {
+		usbi_mutex_static_unlock(&virtual_lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_INTERRUPT && is_in) {
+		list_add_tail(&tpriv->list, &vdev->in_transfers);
+	} else {
+		tpriv->due_ns = virtual_now_ns() +
+			(uint64_t)vdev->desc.latency_us * 1000;
+		list_add_tail(&tpriv->list, &virtual_pending);
+	}
+	tpriv->queued = 1;
+	pthread_cond_signal(&virtual_cond);
+	usbi_mutex_static_unlock(&virtual_lock);
 
-typedef struct libusb_hotplug_message libusb_hotplug_message;
+	return LIBUSB_SUCCESS;
+}
 
-void usbi_hotplug_deregister_all(struct libusb_context *ctx);
-void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
-			libusb_hotplug_event event);
-void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device *dev,
-			libusb_hotplug_event event);
+static int virtual_cancel_transfer(struct usbi_transfer *itransfer)
+{
+	struct virtual_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	int queued, r = LIBUSB_SUCCESS;
 
-#endif
-// line 46 "libusb/libusb/core.c"
+	usbi_mutex_static_lock(&virtual_lock);
+	queued = tpriv->queued;
+	if (queued) {
+		list_del(&tpriv->list);
+		tpriv->queued = 0;
+		tpriv->completing = 1;
+		tpriv->cancelled = 1;
+	} else if (tpriv->completing) {
+		/* like a reaped URB being discarded, the completion on its
+		 * way reports the cancellation */
+		tpriv->cancelled = 1;
+	} else {
+		r = LIBUSB_ERROR_NOT_FOUND;
+	}
+	usbi_mutex_static_unlock(&virtual_lock);
 
-#if defined(OS_LINUX)
-const struct usbi_os_backend * const usbi_backend = &linux_usbfs_backend;
-#elif defined(OS_DARWIN)
-const struct usbi_os_backend * const usbi_backend = &darwin_backend;
-#elif defined(OS_OPENBSD)
-const struct usbi_os_backend * const usbi_backend = &openbsd_backend;
-#elif defined(OS_NETBSD)
-const struct usbi_os_backend * const usbi_backend = &netbsd_backend;
-#elif defined(OS_WINDOWS)
+	if (queued)
+		usbi_signal_transfer_completion(itransfer);
+	return r;
+}
 
-#if defined(USE_USBDK)
-const struct usbi_os_backend * const usbi_backend = &usbdk_backend;
-#else
-const struct usbi_os_backend * const usbi_backend = &windows_backend;
-#endif
+static void virtual_clear_transfer_priv(struct usbi_transfer *itransfer)
+{
+	UNUSED(itransfer);
+}
 
-#elif defined(OS_WINCE)
-const struct usbi_os_backend * const usbi_backend = &wince_backend;
-#elif defined(OS_HAIKU)
-const struct usbi_os_backend * const usbi_backend = &haiku_usb_raw_backend;
-#elif defined (OS_SUNOS)
-const struct usbi_os_backend * const usbi_backend = &sunos_backend;
-#else
-#error "Unsupported OS"
+static int virtual_handle_events(struct libusb_context *ctx,
+	struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready)
+{
+	UNUSED(ctx);
+	UNUSED(fds);
+	UNUSED(nfds);
+	UNUSED(num_ready);
+	return LIBUSB_SUCCESS;
+}
+
+static int virtual_handle_transfer_completion(struct usbi_transfer *itransfer)
+{
+	struct virtual_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	int cancelled;
+
+	usbi_mutex_static_lock(&virtual_lock);
+	tpriv->completing = 0;
+	cancelled = tpriv->cancelled;
+	usbi_mutex_static_unlock(&virtual_lock);
+
+	if (cancelled)
+		return usbi_handle_transfer_cancellation(itransfer);
+	return usbi_handle_transfer_completion(itransfer, tpriv->status);
+}
+
+static int virtual_clock_gettime(int clk_id, struct timespec *tp)
+{
+	switch (clk_id) {
+	case USBI_CLOCK_MONOTONIC:
+		return clock_gettime(CLOCK_MONOTONIC, tp);
+	case USBI_CLOCK_REALTIME:
+		return clock_gettime(CLOCK_REALTIME, tp);
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+}
+
+#ifdef USBI_TIMERFD_AVAILABLE
+static clockid_t virtual_get_timerfd_clockid(void)
+{
+	return CLOCK_MONOTONIC;
+}
 #endif
 
-struct libusb_context *usbi_default_context = NULL;
-static const struct libusb_version libusb_version_internal =
-	{ LIBUSB_MAJOR, LIBUSB_MINOR, LIBUSB_MICRO, LIBUSB_NANO,
-	  LIBUSB_RC, "http://libusb.info" };
-static int default_context_refcnt = 0;
-static usbi_mutex_static_t default_context_lock = USBI_MUTEX_INITIALIZER;
-static struct timespec timestamp_origin = { 0, 0 };
+/** \ingroup libusb_dev
+ * Plug a virtual device into the simulated bus of the "virtual" backend,
+ * see libusb_set_backend().
+ *
+ * The device shows up in every context using the backend, raising hotplug
+ * arrival events, and in the contexts created later. It can be added before
+ * the backend is selected.
+ *
+ * \param device the description of the device. The strings are copied, the
+ * callbacks must stay valid until the device is removed.
+ * \returns the ID of the device, to pass to libusb_virtual_remove_device()
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a report size is out of range
+ * \returns LIBUSB_ERROR_NO_MEM if the bus is full or on allocation failure
+ */
+int API_EXPORTED libusb_virtual_add_device(
+	const struct libusb_virtual_device *device)
+{
+	struct libusb_context *ctx;
+	struct virtual_device *vdev, *other;
+	int devaddr, id;
 
-usbi_mutex_static_t active_contexts_lock = USBI_MUTEX_INITIALIZER;
-struct list_head active_contexts_list;
+	if (!device || device->input_report_size > VIRTUAL_MAX_REPORT ||
+	    device->output_report_size > VIRTUAL_MAX_REPORT ||
+	    device->feature_report_size > VIRTUAL_MAX_REPORT ||
+	    device->num_interfaces > VIRTUAL_MAX_INTERFACES)
+		return LIBUSB_ERROR_INVALID_PARAM;
 
-/**
- * \mainpage libusb-1.0 API Reference
+	vdev = calloc(1, sizeof(*vdev));
+	if (!vdev)
+		return LIBUSB_ERROR_NO_MEM;
+	vdev->refcnt = 1;
+	vdev->desc = *device;
+	if (!vdev->desc.input_report_size)
+		vdev->desc.input_report_size = 64;
+	if (!vdev->desc.num_interfaces)
+		vdev->desc.num_interfaces = 1;
+	list_init(&vdev->in_transfers);
+	list_init(&vdev->echoes);
+	list_init(&vdev->features);
+	virtual_build_descriptors(vdev);
+	/* the strings now live in the descriptors */
+	vdev->desc.manufacturer = NULL;
+	vdev->desc.product = NULL;
+	vdev->desc.serial_number = NULL;
+
+	usbi_mutex_static_lock(&virtual_lock);
+	for (devaddr = 1; devaddr < 128; devaddr++) {
+		int used = 0;
+
+		list_for_each_entry(other, &virtual_devices, list, struct virtual_device) {
+			if (other->devaddr == devaddr)
+				used = 1;
+		}
+		if (!used)
+			break;
+	}
+	if (devaddr == 128) {
+		usbi_mutex_static_unlock(&virtual_lock);
+		free(vdev);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	id = ++virtual_last_id;
+	vdev->id = id;
+	vdev->devaddr = (uint8_t)devaddr;
+	vdev->attached = 1;
+	vdev->next_report_ns = virtual_now_ns() +
+		(uint64_t)vdev->desc.report_interval_us * 1000;
+	list_add_tail(&vdev->list, &virtual_devices);
+
+	/* contexts only exist on the bus while the backend is in use */
+	if (virtual_contexts) {
+		usbi_mutex_static_lock(&active_contexts_lock);
+		list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
+			virtual_enumerate_device(ctx, vdev);
+		}
+		usbi_mutex_static_unlock(&active_contexts_lock);
+		pthread_cond_signal(&virtual_cond);
+	}
+	usbi_mutex_static_unlock(&virtual_lock);
+
+	return id;
+}
+
+/** \ingroup libusb_dev
+ * Unplug a device added with libusb_virtual_add_device().
  *
- * \section intro Introduction
+ * Transfers in flight on the device complete with
+ * LIBUSB_TRANSFER_NO_DEVICE, and every context using the backend raises a
+ * hotplug departure event.
  *
- * libusb is an open source library that allows you to communicate with USB
- * devices from userspace. For more info, see the
+ * \param id the ID of the device
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if there is no device with that ID
+ */
+int API_EXPORTED libusb_virtual_remove_device(int id)
+{
+	struct libusb_context *ctx;
+	struct libusb_device *dev;
+	struct virtual_device *vdev, *found = NULL;
+	struct virtual_transfer_priv *tpriv, *next;
+	struct list_head done;
+
+	usbi_mutex_static_lock(&virtual_lock);
+	list_for_each_entry(vdev, &virtual_devices, list, struct virtual_device) {
+		if (vdev->id == id) {
+			found = vdev;
+			break;
+		}
+	}
+	if (!found) {
+		usbi_mutex_static_unlock(&virtual_lock);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	vdev = found;
+	list_del(&vdev->list);
+	vdev->attached = 0;
+
+	list_init(&done);
+	list_for_each_entry_safe(tpriv, next, &virtual_pending, list, struct virtual_transfer_priv) {
+		if (tpriv->vdev != vdev)
+			continue;
+		tpriv->itransfer->transferred = 0;
+		tpriv->status = LIBUSB_TRANSFER_NO_DEVICE;
+		virtual_complete(tpriv, &done);
+	}
+	list_for_each_entry_safe(tpriv, next, &vdev->in_transfers, list, struct virtual_transfer_priv) {
+		tpriv->itransfer->transferred = 0;
+		tpriv->status = LIBUSB_TRANSFER_NO_DEVICE;
+		virtual_complete(tpriv, &done);
+	}
+
+	if (virtual_contexts) {
+		unsigned long session_id = VIRTUAL_BUSNUM << 8 | vdev->devaddr;
+
+		usbi_mutex_static_lock(&active_contexts_lock);
+		list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
+			dev = usbi_get_device_by_session_id(ctx, session_id);
+			if (dev) {
+				usbi_disconnect_device(dev);
+				libusb_unref_device(dev);
+			}
+		}
+		usbi_mutex_static_unlock(&active_contexts_lock);
+	}
+	usbi_mutex_static_unlock(&virtual_lock);
+
+	virtual_signal_completions(&done);
+	virtual_unref_device(vdev);
+	return LIBUSB_SUCCESS;
+}
+
+const struct usbi_os_backend virtual_backend = {
+	.name = "Virtual",
+	.caps = USBI_CAP_HAS_HID_ACCESS,
+	.init = virtual_init,
+	.exit = virtual_exit,
+	.get_device_list = NULL,
+	.hotplug_poll = NULL,
+	.get_device_descriptor = virtual_get_device_descriptor,
+	.get_active_config_descriptor = virtual_get_active_config_descriptor,
+	.get_config_descriptor = virtual_get_config_descriptor,
+	.get_config_descriptor_by_value = virtual_get_config_descriptor_by_value,
+
+	.open = virtual_open,
+	.close = virtual_close,
+	.get_configuration = virtual_get_configuration,
+	.set_configuration = virtual_set_configuration,
+	.claim_interface = virtual_claim_interface,
+	.release_interface = virtual_claim_interface,
+
+	.set_interface_altsetting = virtual_set_interface,
+	.clear_halt = virtual_clear_halt,
+	.reset_device = virtual_reset_device,
+
+	.dev_mem_alloc = virtual_dev_mem_alloc,
+	.dev_mem_free = virtual_dev_mem_free,
+
+	.kernel_driver_active = virtual_kernel_driver_active,
+
+	.destroy_device = virtual_destroy_device,
+
+	.submit_transfer = virtual_submit_transfer,
+	.cancel_transfer = virtual_cancel_transfer,
+	.clear_transfer_priv = virtual_clear_transfer_priv,
+
+	.handle_events = virtual_handle_events,
+	.handle_transfer_completion = virtual_handle_transfer_completion,
+
+	.clock_gettime = virtual_clock_gettime,
+
+#ifdef USBI_TIMERFD_AVAILABLE
+	.get_timerfd_clockid = virtual_get_timerfd_clockid,
+#endif
+
+	.device_priv_size = sizeof(struct virtual_device_priv),
+	.device_handle_priv_size = 0,
+	.transfer_priv_size = sizeof(struct virtual_transfer_priv),
+};
+// line 1 "libusb/libusb/os/linux_netlink.c"
+/* -*- Mode: C; c-basic-offset:8 ; indent-tabs-mode:t -*- */
+/*
+ * Linux usbfs backend for libusb
+ * Copyright (C) 2007-2009 Daniel Drake <dsd@gentoo.org>
+ * Copyright (c) 2001 Johannes Erdfelt <johannes@erdfelt.com>
+ * Copyright (c) 2013 Nathan Hjelm <hjelmn@mac.com>
+ * Copyright (c) 2016 Chris Dickens <christopher.a.dickens@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// SKIP #include "libusb/libusb/config.h"
+// line 25 "libusb/libusb/os/linux_netlink.c"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#ifdef HAVE_ASM_TYPES_H
+#include <asm/types.h>
+#endif
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+// SKIP #include "libusb/libusb/libusbi.h"
+// line 44 "libusb/libusb/os/linux_netlink.c"
+// SKIP #include "libusb/libusb/os/linux_usbfs.h"
+// line 45 "libusb/libusb/os/linux_netlink.c"
+
+#define NL_GROUP_KERNEL 1
+
+static int linux_netlink_socket = -1;
+static int netlink_control_pipe[2] = { -1, -1 };
+static pthread_t libusb_linux_event_thread;
+
+/* The net effect of the netlink messages about one device which have not been
+ * applied yet. Messages are collected for usbi_hotplug_debounce_ms and then
+ * applied to every context as one batch, so that the remove/add storm of a
+ * hub reset turns into at most one removal and one arrival per device.
+ * Protected by linux_hotplug_lock. */
+struct netlink_change {
+	char sys_name[NAME_MAX + 1];	/* empty if the message had no DEVPATH */
+	int removed;			/* the first message was a removal */
+	uint8_t removed_busnum;
+	uint8_t removed_devaddr;
+	int attached;			/* the state after the last message */
+	uint8_t busnum;
+	uint8_t devaddr;
+};
+
+static struct netlink_change *netlink_changes;
+static int netlink_changes_len;
+static int netlink_changes_size;
+static int netlink_messages;
+static uint64_t netlink_flush_ns;
+
+static uint64_t netlink_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void netlink_queue_change(int detached, uint8_t busnum,
+	uint8_t devaddr, const char *sys_name)
+{
+	struct netlink_change *change = NULL;
+	int i;
+
+	if (sys_name) {
+		for (i = 0; i < netlink_changes_len; i++) {
+			if (!strcmp(netlink_changes[i].sys_name, sys_name)) {
+				change = &netlink_changes[i];
+				break;
+			}
+		}
+	}
+
+	if (!change) {
+		if (netlink_changes_len == netlink_changes_size) {
+			int size = netlink_changes_size ? netlink_changes_size * 2 : 16;
+			struct netlink_change *changes = realloc(netlink_changes,
+				size * sizeof(*changes));
+
+			if (!changes) {
+				usbi_err(NULL, "dropping hotplug message, out of memory");
+				return;
+			}
+			netlink_changes = changes;
+			netlink_changes_size = size;
+		}
+		change = &netlink_changes[netlink_changes_len++];
+		memset(change, 0, sizeof(*change));
+		if (sys_name) {
+			size_t len = strnlen(sys_name, NAME_MAX);
+
+			memcpy(change->sys_name, sys_name, len);
+		}
+		change->removed = detached;
+		change->removed_busnum = busnum;
+		change->removed_devaddr = devaddr;
+	}
+
+	change->attached = !detached;
+	change->busnum = busnum;
+	change->devaddr = devaddr;
+
+	if (!netlink_messages++)
+		netlink_flush_ns = netlink_now_ns() +
+			(uint64_t)__atomic_load_n(&usbi_hotplug_debounce_ms,
+				__ATOMIC_RELAXED) * 1000000;
+}
+
+/* call apply with every removal and arrival the queued messages amount to */
+static void netlink_fold_changes(void (*apply)(void *arg,
+	const struct linux_hotplug_change *change), void *arg)
+{
+	struct linux_hotplug_change folded;
+	int i;
+
+	for (i = 0; i < netlink_changes_len; i++) {
+		struct netlink_change *change = &netlink_changes[i];
+
+		/* removed and back at the same address: nothing changed */
+		if (change->removed && change->attached &&
+				change->removed_busnum == change->busnum &&
+				change->removed_devaddr == change->devaddr)
+			continue;
+
+		folded.sys_name = change->sys_name[0] ? change->sys_name : NULL;
+		if (change->removed) {
+			folded.detached = 1;
+			folded.busnum = change->removed_busnum;
+			folded.devaddr = change->removed_devaddr;
+			apply(arg, &folded);
+		}
+		if (change->attached) {
+			folded.detached = 0;
+			folded.busnum = change->busnum;
+			folded.devaddr = change->devaddr;
+			apply(arg, &folded);
+		}
+	}
+}
+
+static void netlink_apply_change(void *arg,
+	const struct linux_hotplug_change *change)
+{
+	struct libusb_context *ctx = arg;
+
+	if (change->detached)
+		linux_disconnect_device(ctx, change->busnum, change->devaddr);
+	else
+		linux_enumerate_device(ctx, change->busnum, change->devaddr,
+			change->sys_name);
+}
+
+/* apply the queued changes to all contexts */
+static void netlink_apply_changes(void)
+{
+	struct libusb_context *ctx;
+
+	if (!netlink_messages)
+		return;
+
+	usbi_dbg("applying %d netlink messages as %d device changes",
+		 netlink_messages, netlink_changes_len);
+
+	usbi_mutex_static_lock(&active_contexts_lock);
+	list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
+		usbi_hotplug_batch_begin(ctx);
+		netlink_fold_changes(netlink_apply_change, ctx);
+		usbi_hotplug_batch_end(ctx);
+	}
+	usbi_mutex_static_unlock(&active_contexts_lock);
+
+	netlink_changes_len = 0;
+	netlink_messages = 0;
+}
+
+struct netlink_fold_result {
+	struct linux_hotplug_change *changes;
+	int count;
+	int max;
+};
+
+static void netlink_collect_change(void *arg,
+	const struct linux_hotplug_change *change)
+{
+	struct netlink_fold_result *result = arg;
+
+	if (result->count < result->max) {
+		result->changes[result->count] = *change;
+		/* the name does not outlive the queue */
+		result->changes[result->count].sys_name = NULL;
+	}
+	result->count++;
+}
+
+/* queue the given messages and fold them as the event thread does, without a
+ * netlink socket, for testing. Only possible while no context uses the
+ * backend, so that the monitor is stopped.
+ * returns the number of changes, the first max of which are stored in
+ * changes without their sys_name, or an error code */
+int linux_netlink_fold_changes(const struct linux_hotplug_change *messages,
+	int count, struct linux_hotplug_change *changes, int max)
+{
+	struct netlink_fold_result result = { changes, 0, max };
+	int i;
+
+	usbi_mutex_static_lock(&linux_hotplug_startstop_lock);
+	if (init_count) {
+		usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	for (i = 0; i < count; i++)
+		netlink_queue_change(messages[i].detached, messages[i].busnum,
+			messages[i].devaddr, messages[i].sys_name);
+	netlink_fold_changes(netlink_collect_change, &result);
+	netlink_changes_len = 0;
+	netlink_messages = 0;
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
+	usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
+
+	return result.count;
+}
+
+static void *linux_netlink_event_thread_main(void *arg);
+
+static int set_fd_cloexec_nb(int fd)
+{
+	int flags;
+
+#if defined(FD_CLOEXEC)
+	flags = fcntl(fd, F_GETFD);
+	if (flags == -1) {
+		usbi_err(NULL, "failed to get netlink fd flags (%d)", errno);
+		return -1;
+	}
+
+	if (!(flags & FD_CLOEXEC)) {
+		if (fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
+			usbi_err(NULL, "failed to set netlink fd flags (%d)", errno);
+			return -1;
+		}
+	}
+#endif
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1) {
+		usbi_err(NULL, "failed to get netlink fd status flags (%d)", errno);
+		return -1;
+	}
+
+	if (!(flags & O_NONBLOCK)) {
+		if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+			usbi_err(NULL, "failed to set netlink fd status flags (%d)", errno);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int linux_netlink_start_event_monitor(void)
+{
+	struct sockaddr_nl sa_nl = { .nl_family = AF_NETLINK, .nl_groups = NL_GROUP_KERNEL };
+	int socktype = SOCK_RAW;
+	int opt = 1;
+	int ret;
+
+#if defined(SOCK_CLOEXEC)
+	socktype |= SOCK_CLOEXEC;
+#endif
+#if defined(SOCK_NONBLOCK)
+	socktype |= SOCK_NONBLOCK;
+#endif
+
+	linux_netlink_socket = socket(PF_NETLINK, socktype, NETLINK_KOBJECT_UEVENT);
+	if (linux_netlink_socket == -1 && errno == EINVAL) {
+		usbi_dbg("failed to create netlink socket of type %d, attempting SOCK_RAW", socktype);
+		linux_netlink_socket = socket(PF_NETLINK, SOCK_RAW, NETLINK_KOBJECT_UEVENT);
+	}
+
+	if (linux_netlink_socket == -1) {
+		usbi_err(NULL, "failed to create netlink socket (%d)", errno);
+		goto err;
+	}
+
+	ret = set_fd_cloexec_nb(linux_netlink_socket);
+	if (ret == -1)
+		goto err_close_socket;
+
+	ret = bind(linux_netlink_socket, (struct sockaddr *)&sa_nl, sizeof(sa_nl));
+	if (ret == -1) {
+		usbi_err(NULL, "failed to bind netlink socket (%d)", errno);
+		goto err_close_socket;
+	}
+
+	ret = setsockopt(linux_netlink_socket, SOL_SOCKET, SO_PASSCRED, &opt, sizeof(opt));
+	if (ret == -1) {
+		usbi_err(NULL, "failed to set netlink socket SO_PASSCRED option (%d)", errno);
+		goto err_close_socket;
+	}
+
+	ret = usbi_pipe(netlink_control_pipe);
+	if (ret) {
+		usbi_err(NULL, "failed to create netlink control pipe");
+		goto err_close_socket;
+	}
+
+	ret = pthread_create(&libusb_linux_event_thread, NULL, linux_netlink_event_thread_main, NULL);
+	if (ret != 0) {
+		usbi_err(NULL, "failed to create netlink event thread (%d)", ret);
+		goto err_close_pipe;
+	}
+
+	return LIBUSB_SUCCESS;
+
+err_close_pipe:
+	close(netlink_control_pipe[0]);
+	close(netlink_control_pipe[1]);
+	netlink_control_pipe[0] = -1;
+	netlink_control_pipe[1] = -1;
+err_close_socket:
+	close(linux_netlink_socket);
+	linux_netlink_socket = -1;
+err:
+	return LIBUSB_ERROR_OTHER;
+}
+
+int linux_netlink_stop_event_monitor(void)
+{
+	char dummy = 1;
+	ssize_t r;
+
+	assert(linux_netlink_socket != -1);
+
+	/* Write some dummy data to the control pipe and
+	 * wait for the thread to exit */
+	r = usbi_write(netlink_control_pipe[1], &dummy, sizeof(dummy));
+	if (r <= 0)
+		usbi_warn(NULL, "netlink control pipe signal failed");
+
+	pthread_join(libusb_linux_event_thread, NULL);
+
+	close(linux_netlink_socket);
+	linux_netlink_socket = -1;
+
+	/* drop the changes still waiting out the debounce window */
+	free(netlink_changes);
+	netlink_changes = NULL;
+	netlink_changes_len = netlink_changes_size = 0;
+	netlink_messages = 0;
+
+	/* close and reset control pipe */
+	close(netlink_control_pipe[0]);
+	close(netlink_control_pipe[1]);
+	netlink_control_pipe[0] = -1;
+	netlink_control_pipe[1] = -1;
+
+	return LIBUSB_SUCCESS;
+}
+
+static const char *netlink_message_parse(const char *buffer, size_t len, const char *key)
+{
+	const char *end = buffer + len;
+	size_t keylen = strlen(key);
+
+	while (buffer < end && *buffer) {
+		if (strncmp(buffer, key, keylen) == 0 && buffer[keylen] == '=')
+			return buffer + keylen + 1;
+		buffer += strlen(buffer) + 1;
+	}
+
+	return NULL;
+}
+
+/* parse parts of netlink message common to both libudev and the kernel */
+static int linux_netlink_parse(const char *buffer, size_t len, int *detached,
+	const char **sys_name, uint8_t *busnum, uint8_t *devaddr)
+{
+	const char *tmp, *slash;
+
+	errno = 0;
+
+	*sys_name = NULL;
+	*detached = 0;
+	*busnum   = 0;
+	*devaddr  = 0;
+
+	tmp = netlink_message_parse(buffer, len, "ACTION");
+	if (!tmp) {
+		return -1;
+	} else if (strcmp(tmp, "remove") == 0) {
+		*detached = 1;
+	} else if (strcmp(tmp, "add") != 0) {
+		usbi_dbg("unknown device action %s", tmp);
+		return -1;
+	}
+
+	/* check that this is a usb message */
+	tmp = netlink_message_parse(buffer, len, "SUBSYSTEM");
+	if (!tmp || strcmp(tmp, "usb") != 0) {
+		/* not usb. ignore */
+		return -1;
+	}
+
+	/* check that this is an actual usb device */
+	tmp = netlink_message_parse(buffer, len, "DEVTYPE");
+	if (!tmp || strcmp(tmp, "usb_device") != 0) {
+		/* not usb. ignore */
+		return -1;
+	}
+
+	tmp = netlink_message_parse(buffer, len, "BUSNUM");
+	if (tmp) {
+		*busnum = (uint8_t)(strtoul(tmp, NULL, 10) & 0xff);
+		if (errno) {
+			errno = 0;
+			return -1;
+		}
+
+		tmp = netlink_message_parse(buffer, len, "DEVNUM");
+		if (NULL == tmp)
+			return -1;
+
+		*devaddr = (uint8_t)(strtoul(tmp, NULL, 10) & 0xff);
+		if (errno) {
+			errno = 0;
+			return -1;
+		}
+	} else {
+		/* no bus number. try "DEVICE" */
+		tmp = netlink_message_parse(buffer, len, "DEVICE");
+		if (!tmp) {
+			/* not usb. ignore */
+			return -1;
+		}
+
+		/* Parse a device path such as /dev/bus/usb/003/004 */
+		slash = strrchr(tmp, '/');
+		if (!slash)
+			return -1;
+
+		*busnum = (uint8_t)(strtoul(slash - 3, NULL, 10) & 0xff);
+		if (errno) {
+			errno = 0;
+			return -1;
+		}
+
+		*devaddr = (uint8_t)(strtoul(slash + 1, NULL, 10) & 0xff);
+		if (errno) {
+			errno = 0;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	tmp = netlink_message_parse(buffer, len, "DEVPATH");
+	if (!tmp)
+		return -1;
+
+	slash = strrchr(tmp, '/');
+	if (slash)
+		*sys_name = slash + 1;
+
+	/* found a usb device */
+	return 0;
+}
+
+/* Read one message and queue the change it announces. Returns 0 if a message
+ * was consumed, even one which is ignored, and -1 once there is none left. */
+static int linux_netlink_read_message(void)
+{
+	char cred_buffer[CMSG_SPACE(sizeof(struct ucred))];
+	char msg_buffer[2048];
+	const char *sys_name = NULL;
+	uint8_t busnum, devaddr;
+	int detached, r;
+	ssize_t len;
+	struct cmsghdr *cmsg;
+	struct ucred *cred;
+	struct sockaddr_nl sa_nl;
+	struct iovec iov = { .iov_base = msg_buffer, .iov_len = sizeof(msg_buffer) };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cred_buffer, .msg_controllen = sizeof(cred_buffer),
+		.msg_name = &sa_nl, .msg_namelen = sizeof(sa_nl)
+	};
+
+	/* read netlink message */
+	len = recvmsg(linux_netlink_socket, &msg, 0);
+	if (len == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			usbi_err(NULL, "error receiving message from netlink (%d)", errno);
+		return -1;
+	}
+
+	if (len < 32 || (msg.msg_flags & MSG_TRUNC)) {
+		usbi_err(NULL, "invalid netlink message length");
+		return 0;
+	}
+
+	if (sa_nl.nl_groups != NL_GROUP_KERNEL || sa_nl.nl_pid != 0) {
+		usbi_dbg("ignoring netlink message from unknown group/PID (%u/%u)",
+			 (unsigned int)sa_nl.nl_groups, (unsigned int)sa_nl.nl_pid);
+		return 0;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS) {
+		usbi_dbg("ignoring netlink message with no sender credentials");
+		return 0;
+	}
+
+	cred = (struct ucred *)CMSG_DATA(cmsg);
+	if (cred->uid != 0) {
+		usbi_dbg("ignoring netlink message with non-zero sender UID %u", (unsigned int)cred->uid);
+		return 0;
+	}
+
+	r = linux_netlink_parse(msg_buffer, (size_t)len, &detached, &sys_name, &busnum, &devaddr);
+	if (r)
+		return 0;
+
+	usbi_dbg("netlink hotplug found device busnum: %hhu, devaddr: %hhu, sys_name: %s, removed: %s",
+		 busnum, devaddr, sys_name, detached ? "yes" : "no");
+
+	netlink_queue_change(detached, busnum, devaddr, sys_name);
+
+	return 0;
+}
+
+static void *linux_netlink_event_thread_main(void *arg)
+{
+	char dummy;
+	ssize_t r;
+	struct pollfd fds[] = {
+		{ .fd = netlink_control_pipe[0],
+		  .events = POLLIN },
+		{ .fd = linux_netlink_socket,
+		  .events = POLLIN },
+	};
+
+	UNUSED(arg);
+
+	usbi_dbg("netlink event thread entering");
+
+	for (;;) {
+		int timeout = -1;
+
+		/* sleep until the debounce window of queued changes closes */
+		usbi_mutex_static_lock(&linux_hotplug_lock);
+		if (netlink_messages) {
+			uint64_t now = netlink_now_ns();
+			timeout = now >= netlink_flush_ns ? 0 :
+				(int)((netlink_flush_ns - now + 999999) / 1000000);
+		}
+		usbi_mutex_static_unlock(&linux_hotplug_lock);
+
+		if (poll(fds, 2, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[0].revents & POLLIN) {
+			/* activity on control pipe, read the byte and exit */
+			r = usbi_read(netlink_control_pipe[0], &dummy, sizeof(dummy));
+			if (r <= 0)
+				usbi_warn(NULL, "netlink control pipe read failed");
+			break;
+		}
+
+		usbi_mutex_static_lock(&linux_hotplug_lock);
+		if (fds[1].revents & POLLIN) {
+			/* drain everything that arrived since the last wakeup */
+			while (linux_netlink_read_message() == 0)
+				;
+		}
+		if (netlink_messages && netlink_now_ns() >= netlink_flush_ns)
+			netlink_apply_changes();
+		usbi_mutex_static_unlock(&linux_hotplug_lock);
+	}
+
+	usbi_dbg("netlink event thread exiting");
+
+	return NULL;
+}
+
+void linux_netlink_hotplug_poll(void)
+{
+	int r;
+
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	do {
+		r = linux_netlink_read_message();
+	} while (r == 0);
+	/* the caller wants an up to date device list, don't wait for the
+	 * debounce window */
+	netlink_apply_changes();
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
+}
+// line 1 "libusb/libusb/core.c"
+/* -*- Mode: C; indent-tabs-mode:t ; c-basic-offset:8 -*- */
+/*
+ * Core functions for libusb
+ * Copyright © 2012-2013 Nathan Hjelm <hjelmn@cs.unm.edu>
+ * Copyright © 2007-2008 Daniel Drake <dsd@gentoo.org>
+ * Copyright © 2001 Johannes Erdfelt <johannes@erdfelt.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// SKIP #include "libusb/libusb/config.h"
+// line 24 "libusb/libusb/core.c"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_SYSLOG_H
+#include <syslog.h>
+#endif
+
+#ifdef __ANDROID__
+#include <android/log.h>
+#endif
+
+// SKIP #include "libusb/libusb/libusbi.h"
+// line 45 "libusb/libusb/core.c"
+// line 1 "libusb/libusb/hotplug.h"
+/* -*- Mode: C; indent-tabs-mode:t ; c-basic-offset:8 -*- */
+/*
+ * Hotplug support for libusb
+ * Copyright © 2012-2013 Nathan Hjelm <hjelmn@mac.com>
+ * Copyright © 2012-2013 Peter Stuge <peter@stuge.se>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if !defined(USBI_HOTPLUG_H)
+#define USBI_HOTPLUG_H
+
+#ifndef LIBUSBI_H
+// SKIP #include "libusb/libusb/libusbi.h"
+// line 27 "libusb/libusb/hotplug.h"
+#endif
+
+/** \ingroup hotplug
+ * The hotplug callback structure. The user populates this structure with
+ * libusb_hotplug_prepare_callback() and then calls libusb_hotplug_register_callback()
+ * to receive notification of hotplug events.
+ */
+struct libusb_hotplug_callback {
+	/** Context this callback is associated with */
+	struct libusb_context *ctx;
+
+	/** Vendor ID to match or LIBUSB_HOTPLUG_MATCH_ANY */
+	int vendor_id;
+
+	/** Product ID to match or LIBUSB_HOTPLUG_MATCH_ANY */
+	int product_id;
+
+	/** Device class to match or LIBUSB_HOTPLUG_MATCH_ANY */
+	int dev_class;
+
+	/** Hotplug callback flags */
+	libusb_hotplug_flag flags;
+
+	/** Event(s) that will trigger this callback */
+	libusb_hotplug_event events;
+
+	/** Callback function to invoke for matching event/device */
+	libusb_hotplug_callback_fn cb;
+
+	/** Handle for this callback (used to match on deregister) */
+	libusb_hotplug_callback_handle handle;
+
+	/** User data that will be passed to the callback function */
+	void *user_data;
+
+	/** Callback is marked for deletion */
+	int needs_free;
+
+	/** List this callback is registered in (ctx->hotplug_cbs) */
+	struct list_head list;
+};
+
+typedef struct libusb_hotplug_callback libusb_hotplug_callback;
+
+struct libusb_hotplug_message {
+	/** The hotplug event that occurred */
+	libusb_hotplug_event event;
+
+	/** The device for which this hotplug event occurred */
+	struct libusb_device *device;
+
+	/** List this message is contained in (ctx->hotplug_msgs) */
+	struct list_head list;
+};
+
+typedef struct libusb_hotplug_message libusb_hotplug_message;
+
+void usbi_hotplug_deregister_all(struct libusb_context *ctx);
+void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
+			libusb_hotplug_event event);
+void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device *dev,
+			libusb_hotplug_event event);
+
+#endif
+// line 46 "libusb/libusb/core.c"
+
+#if defined(OS_LINUX)
+const struct usbi_os_backend *usbi_backend = &linux_usbfs_backend;
+#elif defined(OS_DARWIN)
+const struct usbi_os_backend *usbi_backend = &darwin_backend;
+#elif defined(OS_OPENBSD)
+const struct usbi_os_backend *usbi_backend = &openbsd_backend;
+#elif defined(OS_NETBSD)
+const struct usbi_os_backend *usbi_backend = &netbsd_backend;
+#elif defined(OS_WINDOWS)
+
+#if defined(USE_USBDK)
+const struct usbi_os_backend *usbi_backend = &usbdk_backend;
+#else
+const struct usbi_os_backend *usbi_backend = &windows_backend;
+#endif
+
+#elif defined(OS_WINCE)
+const struct usbi_os_backend *usbi_backend = &wince_backend;
+#elif defined(OS_HAIKU)
+const struct usbi_os_backend *usbi_backend = &haiku_usb_raw_backend;
+#elif defined (OS_SUNOS)
+const struct usbi_os_backend *usbi_backend = &sunos_backend;
+#else
+#error "Unsupported OS"
+#endif
+
+unsigned int usbi_scan_threads = 0;
+unsigned int usbi_hotplug_debounce_ms = 0;
+
+struct libusb_context *usbi_default_context = NULL;
+static const struct libusb_version libusb_version_internal =
+	{ LIBUSB_MAJOR, LIBUSB_MINOR, LIBUSB_MICRO, LIBUSB_NANO,
+	  LIBUSB_RC, "http://libusb.info" };
+static int default_context_refcnt = 0;
+static usbi_mutex_static_t default_context_lock = USBI_MUTEX_INITIALIZER;
+static struct timespec timestamp_origin = { 0, 0 };
+
+usbi_mutex_static_t active_contexts_lock = USBI_MUTEX_INITIALIZER;
+struct list_head active_contexts_list;
+
+/**
+ * \mainpage libusb-1.0 API Reference
+ *
+ * \section intro Introduction
+ *
+ * libusb is an open source library that allows you to communicate with USB
+ * devices from userspace. For more info, see the
  * <a href="http://libusb.info">libusb homepage</a>.
  *
  * This documentation is aimed at application developers wishing to
@@ -7739,6 +9853,40 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	return dev;
 }
 
+static unsigned int usbi_devs_hash(unsigned long key)
+{
+	key ^= key >> 16;
+	key *= 0x45d9f3bUL;
+	key ^= key >> 16;
+	return (unsigned int) key & (USBI_DEVS_HASH_SIZE - 1);
+}
+
+static unsigned long usbi_address_key(uint8_t bus_number,
+	uint8_t device_address)
+{
+	return (unsigned long) bus_number << 8 | device_address;
+}
+
+/* add dev to the device list and indexes of ctx, with usb_devs_lock held */
+static void usbi_link_device(struct libusb_context *ctx,
+	struct libusb_device *dev)
+{
+	list_add(&dev->list, &ctx->usb_devs);
+	list_add(&dev->session_list,
+		&ctx->usb_devs_by_session[usbi_devs_hash(dev->session_data)]);
+	list_add(&dev->address_list, &ctx->usb_devs_by_address[usbi_devs_hash(
+		usbi_address_key(dev->bus_number, dev->device_address))]);
+}
+
+/* remove dev from the device list and indexes of its context, with
+ * usb_devs_lock held */
+static void usbi_unlink_device(struct libusb_device *dev)
+{
+	list_del(&dev->list);
+	list_del(&dev->session_list);
+	list_del(&dev->address_list);
+}
+
 void usbi_connect_device(struct libusb_device *dev)
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
@@ -7746,7 +9894,7 @@ void usbi_connect_device(struct libusb_device *dev)
 	dev->attached = 1;
 
 	usbi_mutex_lock(&dev->ctx->usb_devs_lock);
-	list_add(&dev->list, &dev->ctx->usb_devs);
+	usbi_link_device(ctx, dev);
 	usbi_mutex_unlock(&dev->ctx->usb_devs_lock);
 
 	/* Signal that an event has occurred for this device if we support hotplug AND
@@ -7766,7 +9914,7 @@ void usbi_disconnect_device(struct libusb_device *dev)
 	usbi_mutex_unlock(&dev->lock);
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
-	list_del(&dev->list);
+	usbi_unlink_device(dev);
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
 
 	/* Signal that an event has occurred for this device if we support hotplug AND
@@ -7807,11 +9955,13 @@ int usbi_sanitize_device(struct libusb_device *dev)
 struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	unsigned long session_id)
 {
+	struct list_head *bucket =
+		&ctx->usb_devs_by_session[usbi_devs_hash(session_id)];
 	struct libusb_device *dev;
 	struct libusb_device *ret = NULL;
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
-	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device)
+	list_for_each_entry(dev, bucket, session_list, struct libusb_device)
 		if (dev->session_data == session_id) {
 			ret = libusb_ref_device(dev);
 			break;
@@ -7902,6 +10052,139 @@ out:
 	return len;
 }
 
+/** \ingroup libusb_dev
+ * Look up the attached device with a given bus number and device address,
+ * as returned by libusb_get_bus_number() and libusb_get_device_address().
+ * With a backend supporting hotplug this is a hash lookup which does not
+ * build a device list.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param bus_number the bus number of the device
+ * \param device_address the address of the device on the bus
+ * \returns the device with its reference count incremented, which must be
+ * released with libusb_unref_device(), or NULL if there is no such device
+ */
+libusb_device * API_EXPORTED libusb_get_device_by_address(libusb_context *ctx,
+	uint8_t bus_number, uint8_t device_address)
+{
+	unsigned long key = usbi_address_key(bus_number, device_address);
+	struct libusb_device *dev;
+	struct libusb_device *ret = NULL;
+	USBI_GET_CONTEXT(ctx);
+
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		if (usbi_backend->hotplug_poll)
+			usbi_backend->hotplug_poll();
+
+		usbi_mutex_lock(&ctx->usb_devs_lock);
+		list_for_each_entry(dev, &ctx->usb_devs_by_address[usbi_devs_hash(key)],
+				address_list, struct libusb_device) {
+			if (dev->bus_number == bus_number &&
+					dev->device_address == device_address) {
+				ret = libusb_ref_device(dev);
+				break;
+			}
+		}
+		usbi_mutex_unlock(&ctx->usb_devs_lock);
+	} else {
+		libusb_device **devs;
+		ssize_t i, len;
+
+		/* the backend only knows its devices while listing them */
+		len = libusb_get_device_list(ctx, &devs);
+		for (i = 0; i < len && !ret; i++) {
+			if (devs[i]->bus_number == bus_number &&
+					devs[i]->device_address == device_address)
+				ret = libusb_ref_device(devs[i]);
+		}
+		if (len >= 0)
+			libusb_free_device_list(devs, 1);
+	}
+
+	return ret;
+}
+
+static int usbi_device_filter_match(struct libusb_device *dev,
+	const struct libusb_device_filter *filter)
+{
+	if (!filter)
+		return 1;
+
+	if (filter->vendor_id != LIBUSB_DEVICE_MATCH_ANY &&
+			filter->vendor_id != dev->device_descriptor.idVendor)
+		return 0;
+	if (filter->product_id != LIBUSB_DEVICE_MATCH_ANY &&
+			filter->product_id != dev->device_descriptor.idProduct)
+		return 0;
+	if (filter->dev_class != LIBUSB_DEVICE_MATCH_ANY &&
+			filter->dev_class != dev->device_descriptor.bDeviceClass)
+		return 0;
+
+	return 1;
+}
+
+/** \ingroup libusb_dev
+ * Visit the attached devices matching a filter. Unlike
+ * libusb_get_device_list(), this neither allocates a list nor references
+ * the devices: the callback sees each device in place, with the device list
+ * locked, and can stop the walk early. A device the caller wants to keep
+ * using after the callback must be referenced with libusb_ref_device().
+ *
+ * Backends without hotplug support only know their devices while listing
+ * them, so for them this is built on libusb_get_device_list().
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param filter the devices to visit, or NULL to visit them all
+ * \param callback invoked for each matching device, see
+ * \ref libusb_device_visitor_fn
+ * \param user_data passed to the callback
+ * \returns the number of devices passed to the callback, or a
+ * \ref libusb_error on failure
+ */
+int API_EXPORTED libusb_foreach_device(libusb_context *ctx,
+	const struct libusb_device_filter *filter,
+	libusb_device_visitor_fn callback, void *user_data)
+{
+	struct libusb_device *dev;
+	int visited = 0;
+	USBI_GET_CONTEXT(ctx);
+
+	if (!callback)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		if (usbi_backend->hotplug_poll)
+			usbi_backend->hotplug_poll();
+
+		usbi_mutex_lock(&ctx->usb_devs_lock);
+		list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device) {
+			if (!usbi_device_filter_match(dev, filter))
+				continue;
+			visited++;
+			if (callback(dev, user_data))
+				break;
+		}
+		usbi_mutex_unlock(&ctx->usb_devs_lock);
+	} else {
+		libusb_device **devs;
+		ssize_t i, len;
+
+		len = libusb_get_device_list(ctx, &devs);
+		if (len < 0)
+			return (int)len;
+		for (i = 0; i < len; i++) {
+			if (!usbi_device_filter_match(devs[i], filter))
+				continue;
+			visited++;
+			if (callback(devs[i], user_data))
+				break;
+		}
+		libusb_free_device_list(devs, 1);
+	}
+
+	return visited;
+}
+
 /** \ingroup libusb_dev
  * Frees a list of devices previously discovered using
  * libusb_get_device_list(). If the unref_devices parameter is set, the
@@ -8203,6 +10486,7 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 
 		if (usbi_backend->destroy_device)
 			usbi_backend->destroy_device(dev);
+		usbi_clear_config_cache(dev);
 
 		if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 			/* backend does not support hotplug */
@@ -8220,7 +10504,11 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
  */
 int usbi_signal_event(struct libusb_context *ctx)
 {
+#ifdef USBI_EPOLL_AVAILABLE
+	uint64_t dummy = 1;
+#else
 	unsigned char dummy = 1;
+#endif
 	ssize_t r;
 
 	/* write some data on event pipe to interrupt event handlers */
@@ -8239,7 +10527,11 @@ int usbi_signal_event(struct libusb_context *ctx)
  */
 int usbi_clear_event(struct libusb_context *ctx)
 {
+#ifdef USBI_EPOLL_AVAILABLE
+	uint64_t dummy;
+#else
 	unsigned char dummy;
+#endif
 	ssize_t r;
 
 	/* read some data on event pipe to clear it */
@@ -8332,39 +10624,31 @@ int API_EXPORTED libusb_open(libusb_device *dev,
  * \param product_id the idProduct value to search for
  * \returns a device handle for the first found device, or NULL on error
  * or if the device could not be found. */
+static int LIBUSB_CALL ref_first_device(libusb_device *dev, void *user_data)
+{
+	*(libusb_device **)user_data = libusb_ref_device(dev);
+	return 1;
+}
+
 DEFAULT_VISIBILITY
 libusb_device_handle * LIBUSB_CALL libusb_open_device_with_vid_pid(
 	libusb_context *ctx, uint16_t vendor_id, uint16_t product_id)
 {
-	struct libusb_device **devs;
+	struct libusb_device_filter filter = {
+		vendor_id, product_id, LIBUSB_DEVICE_MATCH_ANY
+	};
 	struct libusb_device *found = NULL;
-	struct libusb_device *dev;
 	struct libusb_device_handle *dev_handle = NULL;
-	size_t i = 0;
 	int r;
 
-	if (libusb_get_device_list(ctx, &devs) < 0)
+	if (libusb_foreach_device(ctx, &filter, ref_first_device, &found) <= 0)
 		return NULL;
 
-	while ((dev = devs[i++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		r = libusb_get_device_descriptor(dev, &desc);
-		if (r < 0)
-			goto out;
-		if (desc.idVendor == vendor_id && desc.idProduct == product_id) {
-			found = dev;
-			break;
-		}
-	}
-
-	if (found) {
-		r = libusb_open(found, &dev_handle);
-		if (r < 0)
-			dev_handle = NULL;
-	}
+	r = libusb_open(found, &dev_handle);
+	if (r < 0)
+		dev_handle = NULL;
 
-out:
-	libusb_free_device_list(devs, 1);
+	libusb_unref_device(found);
 	return dev_handle;
 }
 
@@ -8401,6 +10685,7 @@ static void do_close(struct libusb_context *ctx,
 		 * (or that such accesses will be easily caught and identified as a crash)
 		 */
 		list_del(&itransfer->list);
+		usbi_timeout_heap_remove(ctx, itransfer);
 		transfer->dev_handle = NULL;
 
 		/* it is up to the user to free up the actual transfer struct.  this is
@@ -9038,46 +11323,311 @@ int API_EXPORTED libusb_attach_kernel_driver(libusb_device_handle *dev_handle,
  * \see libusb_release_interface()
  * \see libusb_set_configuration()
  */
-int API_EXPORTED libusb_set_auto_detach_kernel_driver(
-	libusb_device_handle *dev_handle, int enable)
+int API_EXPORTED libusb_set_auto_detach_kernel_driver(
+	libusb_device_handle *dev_handle, int enable)
+{
+	if (!(usbi_backend->caps & USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER))
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	dev_handle->auto_detach_kernel_driver = enable;
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_lib
+ * Set log message verbosity.
+ *
+ * The default level is LIBUSB_LOG_LEVEL_NONE, which means no messages are ever
+ * printed. If you choose to increase the message verbosity level, ensure
+ * that your application does not close the stdout/stderr file descriptors.
+ *
+ * You are advised to use level LIBUSB_LOG_LEVEL_WARNING. libusb is conservative
+ * with its message logging and most of the time, will only log messages that
+ * explain error conditions and other oddities. This will help you debug
+ * your software.
+ *
+ * If the LIBUSB_DEBUG environment variable was set when libusb was
+ * initialized, this function does nothing: the message verbosity is fixed
+ * to the value in the environment variable.
+ *
+ * If libusb was compiled without any message logging, this function does
+ * nothing: you'll never get any messages.
+ *
+ * If libusb was compiled with verbose debug message logging, this function
+ * does nothing: you'll always get messages from all levels.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param level debug level to set
+ */
+void API_EXPORTED libusb_set_debug(libusb_context *ctx, int level)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (!ctx->debug_fixed)
+		ctx->debug = level;
+}
+
+/** \ingroup libusb_lib
+ * Enable or disable busy-poll reaping on a context.
+ *
+ * By default the event handling thread goes back to sleep in poll() as soon
+ * as it has reaped the completed transfers of a device. With busy polling,
+ * it instead keeps reaping the device without blocking until no transfer
+ * has completed for window_us microseconds. This trades CPU time on the
+ * event handling thread for the wakeup latency of poll(), which matters for
+ * devices completing transfers every millisecond or so.
+ *
+ * A spin lasts two windows at most, and ends early when the event handling
+ * thread has anything else to attend to, such as another device or a device
+ * being closed. The cost of spinning can be monitored with
+ * libusb_get_busy_poll_stats(). Busy polling is only implemented on Linux.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param window_us spin window after the last completion, 0 to disable
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the backend does not busy poll
+ */
+int API_EXPORTED libusb_set_busy_poll(libusb_context *ctx, unsigned int window_us)
+{
+	USBI_GET_CONTEXT(ctx);
+#ifdef OS_LINUX
+	__atomic_store_n(&ctx->busy_poll_us, window_us, __ATOMIC_RELAXED);
+	return LIBUSB_SUCCESS;
+#else
+	UNUSED(window_us);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup libusb_lib
+ * Get the busy-poll counters of a context, see libusb_set_busy_poll().
+ * The counters keep accumulating while busy polling is turned on and off.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param stats output location for the counters
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if stats is NULL
+ */
+int API_EXPORTED libusb_get_busy_poll_stats(libusb_context *ctx,
+	struct libusb_busy_poll_stats *stats)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (!stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	*stats = ctx->busy_poll_stats;
+	usbi_mutex_unlock(&ctx->event_data_lock);
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_lib
+ * Enable or disable the transfer lifecycle trace ring of a context.
+ *
+ * While enabled, the submission, reaping, timeout, cancellation and
+ * completion of every transfer is recorded in a fixed size ring of binary
+ * records, which can be read back with libusb_trace_dump(). Recording takes
+ * no lock, so it is cheap enough to be left on in production.
+ *
+ * The ring is allocated the first time tracing is enabled, and is kept
+ * until the context is destroyed. Later calls only turn recording on and
+ * off, their capacity is ignored.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param capacity number of records kept, rounded up to a power of two, or
+ * 0 to disable tracing
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_set_trace(libusb_context *ctx, unsigned int capacity)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (!capacity) {
+		__atomic_store_n(&ctx->trace_enabled, 0, __ATOMIC_RELEASE);
+		return LIBUSB_SUCCESS;
+	}
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	if (!ctx->trace) {
+		unsigned int size = 1;
+		struct usbi_trace_ring *ring;
+
+		while (size < capacity && size < (1u << 24))
+			size <<= 1;
+		ring = calloc(1, sizeof(*ring) + size * sizeof(ring->slots[0]));
+		if (!ring) {
+			usbi_mutex_unlock(&ctx->event_data_lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		ring->mask = size - 1;
+		ctx->trace = ring;
+	}
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	/* publishes ctx->trace to the recording threads */
+	__atomic_store_n(&ctx->trace_enabled, 1, __ATOMIC_RELEASE);
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_lib
+ * Copy the records of the trace ring of a context out, oldest first.
+ *
+ * Only the most recent max_events records are copied. Records which are
+ * overwritten by newer ones while being copied are skipped. Dumping does not
+ * clear the ring.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param events output array of at least max_events records
+ * \param max_events size of the events array
+ * \returns the number of records copied
+ * \returns LIBUSB_ERROR_INVALID_PARAM if events is NULL or max_events is
+ * negative
+ */
+int API_EXPORTED libusb_trace_dump(libusb_context *ctx,
+	struct libusb_trace_event *events, int max_events)
+{
+	struct usbi_trace_ring *ring;
+	uint64_t head, seq;
+	int n = 0;
+
+	USBI_GET_CONTEXT(ctx);
+	if (!events || max_events < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	ring = ctx->trace;
+	usbi_mutex_unlock(&ctx->event_data_lock);
+	if (!ring)
+		return 0;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	seq = head > (uint64_t)ring->mask + 1 ? head - ring->mask - 1 : 0;
+	if (head - seq > (uint64_t)max_events)
+		seq = head - max_events;
+
+	for (; seq < head; seq++) {
+		struct usbi_trace_slot *slot = &ring->slots[seq & ring->mask];
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1)
+			continue;
+		events[n] = slot->event;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq + 1)
+			n++;
+	}
+	return n;
+}
+
+void usbi_trace_record(struct usbi_transfer *itransfer, uint8_t type,
+	int status, unsigned int length)
+{
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct usbi_trace_ring *ring = ITRANSFER_CTX(itransfer)->trace;
+	struct usbi_trace_slot *slot;
+	struct timespec now;
+	uint64_t seq;
+
+	seq = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+	slot = &ring->slots[seq & ring->mask];
+
+	/* mark the slot torn while it is being written */
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now);
+	slot->event.timestamp_ns = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+	slot->event.transfer = (uint64_t)(uintptr_t)transfer;
+	slot->event.length = length;
+	slot->event.status = status;
+	slot->event.type = type;
+	slot->event.endpoint = transfer->endpoint;
+	slot->event.transfer_type = transfer->type;
+	slot->event.reserved = 0;
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/** \ingroup libusb_lib
+ * Select the OS backend used by the contexts created afterwards.
+ *
+ * On Linux, "usbfs" is the default backend talking to real devices, and
+ * "virtual" a simulated bus holding the devices added with
+ * libusb_virtual_add_device(), which lets enumeration, open and transfers
+ * be exercised without hardware.
+ *
+ * The backend can only be changed while no context exists.
+ *
+ * \param name the name of the backend
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if there is no backend of that name
+ * \returns LIBUSB_ERROR_BUSY if a context exists
+ */
+int API_EXPORTED libusb_set_backend(const char *name)
+{
+	const struct usbi_os_backend *backend = NULL;
+	int r = LIBUSB_SUCCESS;
+
+	if (!name)
+		return LIBUSB_ERROR_INVALID_PARAM;
+#if defined(OS_LINUX)
+	if (!strcmp(name, "usbfs"))
+		backend = &linux_usbfs_backend;
+	else if (!strcmp(name, "virtual"))
+		backend = &virtual_backend;
+#endif
+	if (!backend)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_static_lock(&default_context_lock);
+	usbi_mutex_static_lock(&active_contexts_lock);
+	/* the list is only initialized by the first libusb_init() */
+	if (active_contexts_list.next && !list_empty(&active_contexts_list))
+		r = LIBUSB_ERROR_BUSY;
+	else
+		usbi_backend = backend;
+	usbi_mutex_static_unlock(&active_contexts_lock);
+	usbi_mutex_static_unlock(&default_context_lock);
+
+	return r;
+}
+
+/** \ingroup libusb_lib
+ * Set the number of threads reading device attributes during a full device
+ * scan, which happens when a context is created. Spreading the reads shortens
+ * the scan of hosts with many devices. The default of 0 scans on the calling
+ * thread only. Only the Linux sysfs scan uses this setting.
+ *
+ * \param threads the number of threads, including the calling one
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if threads exceeds 64
+ */
+int API_EXPORTED libusb_set_scan_threads(unsigned int threads)
 {
-	if (!(usbi_backend->caps & USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER))
-		return LIBUSB_ERROR_NOT_SUPPORTED;
+	if (threads > USBI_MAX_SCAN_THREADS)
+		return LIBUSB_ERROR_INVALID_PARAM;
 
-	dev_handle->auto_detach_kernel_driver = enable;
+	__atomic_store_n(&usbi_scan_threads, threads, __ATOMIC_RELAXED);
 	return LIBUSB_SUCCESS;
 }
 
 /** \ingroup libusb_lib
- * Set log message verbosity.
- *
- * The default level is LIBUSB_LOG_LEVEL_NONE, which means no messages are ever
- * printed. If you choose to increase the message verbosity level, ensure
- * that your application does not close the stdout/stderr file descriptors.
- *
- * You are advised to use level LIBUSB_LOG_LEVEL_WARNING. libusb is conservative
- * with its message logging and most of the time, will only log messages that
- * explain error conditions and other oddities. This will help you debug
- * your software.
- *
- * If the LIBUSB_DEBUG environment variable was set when libusb was
- * initialized, this function does nothing: the message verbosity is fixed
- * to the value in the environment variable.
- *
- * If libusb was compiled without any message logging, this function does
- * nothing: you'll never get any messages.
- *
- * If libusb was compiled with verbose debug message logging, this function
- * does nothing: you'll always get messages from all levels.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \param level debug level to set
+ * Set the window in which the hotplug monitor collects device changes before
+ * applying them. All the changes of a window are applied at once and handed
+ * to the hotplug callbacks in one pass. A device which is removed and added
+ * again within the window, as happens when a hub resets, is reported once as
+ * removed and once as arrived, and not at all if it comes back at the same
+ * address. The default of 0 still applies everything read in one wakeup of
+ * the monitor together. Only the Linux netlink monitor uses this setting.
+ *
+ * \param window_ms the window in milliseconds, at most 10000
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the window is too long
  */
-void API_EXPORTED libusb_set_debug(libusb_context *ctx, int level)
+int API_EXPORTED libusb_set_hotplug_debounce(unsigned int window_ms)
 {
-	USBI_GET_CONTEXT(ctx);
-	if (!ctx->debug_fixed)
-		ctx->debug = level;
+	if (window_ms > 10000)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	__atomic_store_n(&usbi_hotplug_debounce_ms, window_ms, __ATOMIC_RELAXED);
+	return LIBUSB_SUCCESS;
 }
 
 /** \ingroup libusb_lib
@@ -9100,6 +11650,7 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	struct libusb_context *ctx;
 	static int first_init = 1;
 	int r = 0;
+	int i;
 
 	usbi_mutex_static_lock(&default_context_lock);
 
@@ -9144,6 +11695,10 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	usbi_mutex_init(&ctx->open_devs_lock);
 	usbi_mutex_init(&ctx->hotplug_cbs_lock);
 	list_init(&ctx->usb_devs);
+	for (i = 0; i < USBI_DEVS_HASH_SIZE; i++) {
+		list_init(&ctx->usb_devs_by_session[i]);
+		list_init(&ctx->usb_devs_by_address[i]);
+	}
 	list_init(&ctx->open_devs);
 	list_init(&ctx->hotplug_cbs);
 
@@ -9187,7 +11742,7 @@ err_free_ctx:
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	list_for_each_entry_safe(dev, next, &ctx->usb_devs, list, struct libusb_device) {
-		list_del(&dev->list);
+		usbi_unlink_device(dev);
 		libusb_unref_device(dev);
 	}
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
@@ -9250,7 +11805,7 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 
 		usbi_mutex_lock(&ctx->usb_devs_lock);
 		list_for_each_entry_safe(dev, next, &ctx->usb_devs, list, struct libusb_device) {
-			list_del(&dev->list);
+			usbi_unlink_device(dev);
 			libusb_unref_device(dev);
 		}
 		usbi_mutex_unlock(&ctx->usb_devs_lock);
@@ -9652,14 +12207,118 @@ int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
 	return (int) (sp - source);
 }
 
-static void clear_endpoint(struct libusb_endpoint_descriptor *endpoint)
+/* A parsed configuration lives in a single allocation: this header, the
+ * configuration descriptor handed to callers, then the interface, altsetting
+ * and endpoint arrays and every extra descriptor block, carved out in parse
+ * order. The size is computed up front from the raw descriptors so a parse
+ * normally never allocates again; malformed descriptors that defeat the
+ * estimate spill into overflow blocks chained off the header.
+ *
+ * Parsed configurations are immutable once built and are shared between the
+ * device's cache and every caller, so they are reference counted. */
+struct config_arena_block {
+	struct config_arena_block *next;
+};
+
+struct config_arena {
+	int refcnt;
+	size_t size;
+	size_t used;
+	struct config_arena_block *overflow;
+	struct libusb_config_descriptor config;
+	unsigned char data[];
+};
+
+#define CONFIG_ARENA_ALIGN	sizeof(void *)
+#define CONFIG_ARENA_ROUND(n) \
+	(((n) + CONFIG_ARENA_ALIGN - 1) & ~(CONFIG_ARENA_ALIGN - 1))
+
+static struct config_arena *config_to_arena(
+	const struct libusb_config_descriptor *config)
+{
+	return (struct config_arena *)((unsigned char *)config -
+		offsetof(struct config_arena, config));
+}
+
+/* upper bound of the arena space needed to parse a raw configuration */
+static size_t config_arena_size(const unsigned char *buffer, int size)
+{
+	size_t total;
+
+	if (size < LIBUSB_DT_CONFIG_SIZE)
+		return 0;
+
+	total = CONFIG_ARENA_ROUND(buffer[4] * sizeof(struct libusb_interface));
+	while (size >= DESC_HEADER_LENGTH) {
+		int len = buffer[0];
+
+		if (len < DESC_HEADER_LENGTH || len > size)
+			break;
+		if (buffer[1] == LIBUSB_DT_INTERFACE) {
+			total += CONFIG_ARENA_ROUND(sizeof(struct libusb_interface_descriptor));
+			if (len >= INTERFACE_DESC_LENGTH)
+				total += CONFIG_ARENA_ROUND(buffer[4] *
+					sizeof(struct libusb_endpoint_descriptor));
+		} else {
+			/* generous: counts endpoints and the config itself as
+			 * extra bytes too */
+			total += CONFIG_ARENA_ROUND(len);
+		}
+		buffer += len;
+		size -= len;
+	}
+
+	return total;
+}
+
+static void *config_arena_alloc(struct config_arena *arena, size_t len)
+{
+	struct config_arena_block *block;
+
+	len = CONFIG_ARENA_ROUND(len);
+	if (len <= arena->size - arena->used) {
+		void *p = arena->data + arena->used;
+		arena->used += len;
+		return p;
+	}
+
+	block = calloc(1, CONFIG_ARENA_ROUND(sizeof(*block)) + len);
+	if (!block)
+		return NULL;
+	block->next = arena->overflow;
+	arena->overflow = block;
+	return (unsigned char *)block + CONFIG_ARENA_ROUND(sizeof(*block));
+}
+
+static void config_arena_free(struct config_arena *arena)
+{
+	struct config_arena_block *block, *next;
+
+	for (block = arena->overflow; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	free(arena);
+}
+
+static struct libusb_config_descriptor *config_ref(
+	struct libusb_config_descriptor *config)
+{
+	__atomic_add_fetch(&config_to_arena(config)->refcnt, 1, __ATOMIC_RELAXED);
+	return config;
+}
+
+static void config_unref(struct libusb_config_descriptor *config)
 {
-	free((void *) endpoint->extra);
+	struct config_arena *arena = config_to_arena(config);
+
+	if (!__atomic_sub_fetch(&arena->refcnt, 1, __ATOMIC_ACQ_REL))
+		config_arena_free(arena);
 }
 
 static int parse_endpoint(struct libusb_context *ctx,
-	struct libusb_endpoint_descriptor *endpoint, unsigned char *buffer,
-	int size, int host_endian)
+	struct config_arena *arena, struct libusb_endpoint_descriptor *endpoint,
+	unsigned char *buffer, int size, int host_endian)
 {
 	struct usb_descriptor_header header;
 	unsigned char *extra;
@@ -9734,7 +12393,7 @@ static int parse_endpoint(struct libusb_context *ctx,
 		return parsed;
 	}
 
-	extra = malloc(len);
+	extra = config_arena_alloc(arena, len);
 	endpoint->extra = extra;
 	if (!extra) {
 		endpoint->extra_length = 0;
@@ -9747,30 +12406,36 @@ static int parse_endpoint(struct libusb_context *ctx,
 	return parsed;
 }
 
-static void clear_interface(struct libusb_interface *usb_interface)
+/* count the interface descriptors from buffer on that share the first one's
+ * bInterfaceNumber, i.e. the most altsettings parse_interface() can find */
+static int count_altsettings(const unsigned char *buffer, int size)
 {
-	int i;
-	int j;
-
-	if (usb_interface->altsetting) {
-		for (i = 0; i < usb_interface->num_altsetting; i++) {
-			struct libusb_interface_descriptor *ifp =
-				(struct libusb_interface_descriptor *)
-				usb_interface->altsetting + i;
-			free((void *) ifp->extra);
-			if (ifp->endpoint) {
-				for (j = 0; j < ifp->bNumEndpoints; j++)
-					clear_endpoint((struct libusb_endpoint_descriptor *)
-						       ifp->endpoint + j);
-			}
-			free((void *) ifp->endpoint);
+	int count = 0;
+	int interface_number = -1;
+
+	while (size >= DESC_HEADER_LENGTH) {
+		int len = buffer[0];
+
+		if (len < DESC_HEADER_LENGTH || len > size)
+			break;
+		if (buffer[1] == LIBUSB_DT_INTERFACE && len >= INTERFACE_DESC_LENGTH) {
+			if (interface_number == -1)
+				interface_number = buffer[2];
+			else if (buffer[2] != interface_number)
+				break;
+			count++;
+		} else if (buffer[1] == LIBUSB_DT_CONFIG ||
+				buffer[1] == LIBUSB_DT_DEVICE) {
+			break;
 		}
+		buffer += len;
+		size -= len;
 	}
-	free((void *) usb_interface->altsetting);
-	usb_interface->altsetting = NULL;
+
+	return count;
 }
 
-static int parse_interface(libusb_context *ctx,
+static int parse_interface(libusb_context *ctx, struct config_arena *arena,
 	struct libusb_interface *usb_interface, unsigned char *buffer, int size,
 	int host_endian)
 {
@@ -9779,24 +12444,25 @@ static int parse_interface(libusb_context *ctx,
 	int r;
 	int parsed = 0;
 	int interface_number = -1;
+	int max_altsetting;
 	struct usb_descriptor_header header;
+	struct libusb_interface_descriptor *altsetting;
 	struct libusb_interface_descriptor *ifp;
 	unsigned char *begin;
 
 	usb_interface->num_altsetting = 0;
 
-	while (size >= INTERFACE_DESC_LENGTH) {
-		struct libusb_interface_descriptor *altsetting =
-			(struct libusb_interface_descriptor *) usb_interface->altsetting;
-		altsetting = usbi_reallocf(altsetting,
-			sizeof(struct libusb_interface_descriptor) *
-			(usb_interface->num_altsetting + 1));
-		if (!altsetting) {
-			r = LIBUSB_ERROR_NO_MEM;
-			goto err;
-		}
-		usb_interface->altsetting = altsetting;
+	max_altsetting = count_altsettings(buffer, size);
+	if (!max_altsetting)
+		max_altsetting = 1;
+	altsetting = config_arena_alloc(arena,
+		sizeof(struct libusb_interface_descriptor) * max_altsetting);
+	if (!altsetting)
+		return LIBUSB_ERROR_NO_MEM;
+	usb_interface->altsetting = altsetting;
 
+	while (size >= INTERFACE_DESC_LENGTH &&
+			usb_interface->num_altsetting < max_altsetting) {
 		ifp = altsetting + usb_interface->num_altsetting;
 		usbi_parse_descriptor(buffer, "bbbbbbbbb", ifp, 0);
 		if (ifp->bDescriptorType != LIBUSB_DT_INTERFACE) {
@@ -9807,8 +12473,7 @@ static int parse_interface(libusb_context *ctx,
 		if (ifp->bLength < INTERFACE_DESC_LENGTH) {
 			usbi_err(ctx, "invalid interface bLength (%d)",
 				 ifp->bLength);
-			r = LIBUSB_ERROR_IO;
-			goto err;
+			return LIBUSB_ERROR_IO;
 		}
 		if (ifp->bLength > size) {
 			usbi_warn(ctx, "short intf descriptor read %d/%d",
@@ -9817,8 +12482,7 @@ static int parse_interface(libusb_context *ctx,
 		}
 		if (ifp->bNumEndpoints > USB_MAXENDPOINTS) {
 			usbi_err(ctx, "too many endpoints (%d)", ifp->bNumEndpoints);
-			r = LIBUSB_ERROR_IO;
-			goto err;
+			return LIBUSB_ERROR_IO;
 		}
 
 		usb_interface->num_altsetting++;
@@ -9843,8 +12507,7 @@ static int parse_interface(libusb_context *ctx,
 				usbi_err(ctx,
 					 "invalid extra intf desc len (%d)",
 					 header.bLength);
-				r = LIBUSB_ERROR_IO;
-				goto err;
+				return LIBUSB_ERROR_IO;
 			} else if (header.bLength > size) {
 				usbi_warn(ctx,
 					  "short extra intf desc read %d/%d",
@@ -9868,32 +12531,29 @@ static int parse_interface(libusb_context *ctx,
 		/*  drivers to later parse */
 		len = (int)(buffer - begin);
 		if (len) {
-			ifp->extra = malloc(len);
-			if (!ifp->extra) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
+			ifp->extra = config_arena_alloc(arena, len);
+			if (!ifp->extra)
+				return LIBUSB_ERROR_NO_MEM;
 			memcpy((unsigned char *) ifp->extra, begin, len);
 			ifp->extra_length = len;
 		}
 
 		if (ifp->bNumEndpoints > 0) {
 			struct libusb_endpoint_descriptor *endpoint;
-			endpoint = calloc(ifp->bNumEndpoints, sizeof(struct libusb_endpoint_descriptor));
+			endpoint = config_arena_alloc(arena,
+				ifp->bNumEndpoints * sizeof(struct libusb_endpoint_descriptor));
 			ifp->endpoint = endpoint;
-			if (!endpoint) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
+			if (!endpoint)
+				return LIBUSB_ERROR_NO_MEM;
 
 			for (i = 0; i < ifp->bNumEndpoints; i++) {
-				r = parse_endpoint(ctx, endpoint + i, buffer, size,
-					host_endian);
+				r = parse_endpoint(ctx, arena, endpoint + i, buffer,
+					size, host_endian);
 				if (r < 0)
-					goto err;
+					return r;
 				if (r == 0) {
 					ifp->bNumEndpoints = (uint8_t)i;
-					break;;
+					break;
 				}
 
 				buffer += r;
@@ -9911,30 +12571,16 @@ static int parse_interface(libusb_context *ctx,
 	}
 
 	return parsed;
-err:
-	clear_interface(usb_interface);
-	return r;
-}
-
-static void clear_configuration(struct libusb_config_descriptor *config)
-{
-	int i;
-	if (config->interface) {
-		for (i = 0; i < config->bNumInterfaces; i++)
-			clear_interface((struct libusb_interface *)
-					config->interface + i);
-	}
-	free((void *) config->interface);
-	free((void *) config->extra);
 }
 
 static int parse_configuration(struct libusb_context *ctx,
-	struct libusb_config_descriptor *config, unsigned char *buffer,
-	int size, int host_endian)
+	struct config_arena *arena, unsigned char *buffer, int size,
+	int host_endian)
 {
 	int i;
 	int r;
 	struct usb_descriptor_header header;
+	struct libusb_config_descriptor *config = &arena->config;
 	struct libusb_interface *usb_interface;
 
 	if (size < LIBUSB_DT_CONFIG_SIZE) {
@@ -9963,7 +12609,8 @@ static int parse_configuration(struct libusb_context *ctx,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usb_interface = calloc(config->bNumInterfaces, sizeof(struct libusb_interface));
+	usb_interface = config_arena_alloc(arena,
+		config->bNumInterfaces * sizeof(struct libusb_interface));
 	config->interface = usb_interface;
 	if (!usb_interface)
 		return LIBUSB_ERROR_NO_MEM;
@@ -9988,8 +12635,7 @@ static int parse_configuration(struct libusb_context *ctx,
 				usbi_err(ctx,
 					 "invalid extra config desc len (%d)",
 					 header.bLength);
-				r = LIBUSB_ERROR_IO;
-				goto err;
+				return LIBUSB_ERROR_IO;
 			} else if (header.bLength > size) {
 				usbi_warn(ctx,
 					  "short extra config desc read %d/%d",
@@ -10016,20 +12662,19 @@ static int parse_configuration(struct libusb_context *ctx,
 		if (len) {
 			/* FIXME: We should realloc and append here */
 			if (!config->extra_length) {
-				config->extra = malloc(len);
-				if (!config->extra) {
-					r = LIBUSB_ERROR_NO_MEM;
-					goto err;
-				}
+				config->extra = config_arena_alloc(arena, len);
+				if (!config->extra)
+					return LIBUSB_ERROR_NO_MEM;
 
 				memcpy((unsigned char *) config->extra, begin, len);
 				config->extra_length = len;
 			}
 		}
 
-		r = parse_interface(ctx, usb_interface + i, buffer, size, host_endian);
+		r = parse_interface(ctx, arena, usb_interface + i, buffer, size,
+			host_endian);
 		if (r < 0)
-			goto err;
+			return r;
 		if (r == 0) {
 			config->bNumInterfaces = (uint8_t)i;
 			break;
@@ -10040,35 +12685,106 @@ static int parse_configuration(struct libusb_context *ctx,
 	}
 
 	return size;
-
-err:
-	clear_configuration(config);
-	return r;
 }
 
 static int raw_desc_to_config(struct libusb_context *ctx,
 	unsigned char *buf, int size, int host_endian,
 	struct libusb_config_descriptor **config)
 {
-	struct libusb_config_descriptor *_config = malloc(sizeof(*_config));
+	size_t arena_size = config_arena_size(buf, size);
+	struct config_arena *arena;
 	int r;
-	
-	if (!_config)
+
+	arena = calloc(1, sizeof(*arena) + arena_size);
+	if (!arena)
 		return LIBUSB_ERROR_NO_MEM;
+	arena->refcnt = 1;
+	arena->size = arena_size;
 
-	r = parse_configuration(ctx, _config, buf, size, host_endian);
+	r = parse_configuration(ctx, arena, buf, size, host_endian);
 	if (r < 0) {
 		usbi_err(ctx, "parse_configuration failed with error %d", r);
-		free(_config);
+		config_arena_free(arena);
 		return r;
 	} else if (r > 0) {
 		usbi_warn(ctx, "still %d bytes of descriptor data left", r);
 	}
-	
-	*config = _config;
+	if (arena->overflow)
+		usbi_dbg("config arena of %lu bytes overflowed",
+			(unsigned long) arena_size);
+
+	*config = &arena->config;
+	return LIBUSB_SUCCESS;
+}
+
+/* look up a parsed configuration in the device cache by bConfigurationValue;
+ * returns a new reference or NULL */
+static struct libusb_config_descriptor *cached_config(libusb_device *dev,
+	uint8_t bConfigurationValue, uint16_t wTotalLength)
+{
+	struct libusb_config_descriptor *config = NULL;
+	int i;
+
+	usbi_mutex_lock(&dev->lock);
+	for (i = 0; i < USB_MAXCONFIG && dev->config_cache[i]; i++) {
+		if (dev->config_cache[i]->bConfigurationValue == bConfigurationValue &&
+				(!wTotalLength ||
+				 dev->config_cache[i]->wTotalLength == wTotalLength)) {
+			config = config_ref(dev->config_cache[i]);
+			break;
+		}
+	}
+	usbi_mutex_unlock(&dev->lock);
+
+	return config;
+}
+
+/* parse a raw configuration and publish it in the device cache. If another
+ * thread got there first the copy already cached wins. */
+static int cache_config(libusb_device *dev, unsigned char *buf, int size,
+	int host_endian, struct libusb_config_descriptor **config)
+{
+	struct libusb_config_descriptor *parsed;
+	int i;
+	int r;
+
+	r = raw_desc_to_config(dev->ctx, buf, size, host_endian, &parsed);
+	if (r < 0)
+		return r;
+
+	usbi_mutex_lock(&dev->lock);
+	for (i = 0; i < USB_MAXCONFIG && dev->config_cache[i]; i++) {
+		if (dev->config_cache[i]->bConfigurationValue ==
+				parsed->bConfigurationValue &&
+				dev->config_cache[i]->wTotalLength ==
+				parsed->wTotalLength)
+			break;
+	}
+	if (i < USB_MAXCONFIG) {
+		if (dev->config_cache[i]) {
+			config_unref(parsed);
+			parsed = dev->config_cache[i];
+		} else {
+			dev->config_cache[i] = parsed;
+		}
+		config_ref(parsed);
+	}
+	usbi_mutex_unlock(&dev->lock);
+
+	*config = parsed;
 	return LIBUSB_SUCCESS;
 }
 
+void usbi_clear_config_cache(libusb_device *dev)
+{
+	int i;
+
+	for (i = 0; i < USB_MAXCONFIG && dev->config_cache[i]; i++) {
+		config_unref(dev->config_cache[i]);
+		dev->config_cache[i] = NULL;
+	}
+}
+
 int usbi_device_cache_descriptor(libusb_device *dev)
 {
 	int r, host_endian = 0;
@@ -10114,6 +12830,9 @@ int API_EXPORTED libusb_get_device_descriptor(libusb_device *dev,
  * This is a non-blocking function which does not involve any requests being
  * sent to the device.
  *
+ * The parsed descriptor is cached on the device and shared between callers,
+ * so it must be treated as read-only.
+ *
  * \param dev a device
  * \param config output location for the USB configuration descriptor. Only
  * valid if 0 was returned. Must be freed with libusb_free_config_descriptor()
@@ -10142,7 +12861,12 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usbi_parse_descriptor(tmp, "bbw", &_config, host_endian);
+	usbi_parse_descriptor(tmp, "bbwbb", &_config, host_endian);
+	*config = cached_config(dev, _config.bConfigurationValue,
+		_config.wTotalLength);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
 	buf = malloc(_config.wTotalLength);
 	if (!buf)
 		return LIBUSB_ERROR_NO_MEM;
@@ -10150,7 +12874,7 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 	r = usbi_backend->get_active_config_descriptor(dev, buf,
 		_config.wTotalLength, &host_endian);
 	if (r >= 0)
-		r = raw_desc_to_config(dev->ctx, buf, r, host_endian, config);
+		r = cache_config(dev, buf, r, host_endian, config);
 
 	free(buf);
 	return r;
@@ -10195,7 +12919,12 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usbi_parse_descriptor(tmp, "bbw", &_config, host_endian);
+	usbi_parse_descriptor(tmp, "bbwbb", &_config, host_endian);
+	*config = cached_config(dev, _config.bConfigurationValue,
+		_config.wTotalLength);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
 	buf = malloc(_config.wTotalLength);
 	if (!buf)
 		return LIBUSB_ERROR_NO_MEM;
@@ -10203,7 +12932,7 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 	r = usbi_backend->get_config_descriptor(dev, config_index, buf,
 		_config.wTotalLength, &host_endian);
 	if (r >= 0)
-		r = raw_desc_to_config(dev->ctx, buf, r, host_endian, config);
+		r = cache_config(dev, buf, r, host_endian, config);
 
 	free(buf);
 	return r;
@@ -10262,12 +12991,16 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
 	int r, idx, host_endian;
 	unsigned char *buf = NULL;
 
+	*config = cached_config(dev, bConfigurationValue, 0);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
 	if (usbi_backend->get_config_descriptor_by_value) {
 		r = usbi_backend->get_config_descriptor_by_value(dev,
 			bConfigurationValue, &buf, &host_endian);
 		if (r < 0)
 			return r;
-		return raw_desc_to_config(dev->ctx, buf, r, host_endian, config);
+		return cache_config(dev, buf, r, host_endian, config);
 	}
 
 	r = usbi_get_config_index_by_value(dev, bConfigurationValue, &idx);
@@ -10282,6 +13015,8 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
 /** \ingroup libusb_desc
  * Free a configuration descriptor obtained from
  * libusb_get_active_config_descriptor() or libusb_get_config_descriptor().
+ * This drops the caller's reference; the device keeps its cached copy until
+ * it is destroyed.
  * It is safe to call this function with a NULL config parameter, in which
  * case the function simply returns.
  *
@@ -10293,8 +13028,7 @@ void API_EXPORTED libusb_free_config_descriptor(
 	if (!config)
 		return;
 
-	clear_configuration(config);
-	free(config);
+	config_unref(config);
 }
 
 /** \ingroup libusb_desc
@@ -10983,10 +13717,44 @@ void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device
 	/* Take the event data lock and add this message to the list.
 	 * Only signal an event if there are no prior pending events. */
 	usbi_mutex_lock(&ctx->event_data_lock);
-	pending_events = usbi_pending_events(ctx);
-	list_add_tail(&message->list, &ctx->hotplug_msgs);
-	if (!pending_events)
-		usbi_signal_event(ctx);
+	if (ctx->hotplug_batching) {
+		list_add_tail(&message->list, &ctx->hotplug_batch);
+	} else {
+		pending_events = usbi_pending_events(ctx);
+		list_add_tail(&message->list, &ctx->hotplug_msgs);
+		if (!pending_events)
+			usbi_signal_event(ctx);
+	}
+	usbi_mutex_unlock(&ctx->event_data_lock);
+}
+
+/* Hold back the hotplug messages of ctx until usbi_hotplug_batch_end(), so
+ * that the event handler sees a batch of device changes at once and passes
+ * all of it to the callbacks in a single pass. */
+void usbi_hotplug_batch_begin(struct libusb_context *ctx)
+{
+	usbi_mutex_lock(&ctx->event_data_lock);
+	ctx->hotplug_batching = 1;
+	usbi_mutex_unlock(&ctx->event_data_lock);
+}
+
+void usbi_hotplug_batch_end(struct libusb_context *ctx)
+{
+	libusb_hotplug_message *message, *next;
+	int pending_events;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	ctx->hotplug_batching = 0;
+	if (!list_empty(&ctx->hotplug_batch)) {
+		pending_events = usbi_pending_events(ctx);
+		list_for_each_entry_safe(message, next, &ctx->hotplug_batch, list,
+				libusb_hotplug_message) {
+			list_del(&message->list);
+			list_add_tail(&message->list, &ctx->hotplug_msgs);
+		}
+		if (!pending_events)
+			usbi_signal_event(ctx);
+	}
 	usbi_mutex_unlock(&ctx->event_data_lock);
 }
 
@@ -11079,4512 +13847,6423 @@ void API_EXPORTED libusb_hotplug_deregister_callback (struct libusb_context *ctx
 
 	USBI_GET_CONTEXT(ctx);
 
-	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
-	list_for_each_entry(hotplug_cb, &ctx->hotplug_cbs, list,
-			    struct libusb_hotplug_callback) {
-		if (callback_handle == hotplug_cb->handle) {
-			/* Mark this callback for deregistration */
-			hotplug_cb->needs_free = 1;
-		}
-	}
-	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
+	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
+	list_for_each_entry(hotplug_cb, &ctx->hotplug_cbs, list,
+			    struct libusb_hotplug_callback) {
+		if (callback_handle == hotplug_cb->handle) {
+			/* Mark this callback for deregistration */
+			hotplug_cb->needs_free = 1;
+		}
+	}
+	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
+
+	usbi_hotplug_notification(ctx, NULL, 0);
+}
+
+void usbi_hotplug_deregister_all(struct libusb_context *ctx) {
+	struct libusb_hotplug_callback *hotplug_cb, *next;
+
+	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
+	list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_cbs, list,
+				 struct libusb_hotplug_callback) {
+		list_del(&hotplug_cb->list);
+		free(hotplug_cb);
+	}
+
+	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
+}
+// line 1 "libusb/libusb/io.c"
+/* -*- Mode: C; indent-tabs-mode:t ; c-basic-offset:8 -*- */
+/*
+ * I/O functions for libusb
+ * Copyright © 2007-2009 Daniel Drake <dsd@gentoo.org>
+ * Copyright © 2001 Johannes Erdfelt <johannes@erdfelt.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// SKIP #include "libusb/libusb/config.h"
+// line 23 "libusb/libusb/io.c"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef USBI_TIMERFD_AVAILABLE
+#include <sys/timerfd.h>
+#endif
+#ifdef USBI_EPOLL_AVAILABLE
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+// SKIP #include "libusb/libusb/libusbi.h"
+// line 38 "libusb/libusb/io.c"
+// SKIP #include "libusb/libusb/hotplug.h"
+// line 39 "libusb/libusb/io.c"
 
-	usbi_hotplug_notification(ctx, NULL, 0);
+/**
+ * \page libusb_io Synchronous and asynchronous device I/O
+ *
+ * \section io_intro Introduction
+ *
+ * If you're using libusb in your application, you're probably wanting to
+ * perform I/O with devices - you want to perform USB data transfers.
+ *
+ * libusb offers two separate interfaces for device I/O. This page aims to
+ * introduce the two in order to help you decide which one is more suitable
+ * for your application. You can also choose to use both interfaces in your
+ * application by considering each transfer on a case-by-case basis.
+ *
+ * Once you have read through the following discussion, you should consult the
+ * detailed API documentation pages for the details:
+ * - \ref libusb_syncio
+ * - \ref libusb_asyncio
+ *
+ * \section theory Transfers at a logical level
+ *
+ * At a logical level, USB transfers typically happen in two parts. For
+ * example, when reading data from a endpoint:
+ * -# A request for data is sent to the device
+ * -# Some time later, the incoming data is received by the host
+ *
+ * or when writing data to an endpoint:
+ *
+ * -# The data is sent to the device
+ * -# Some time later, the host receives acknowledgement from the device that
+ *    the data has been transferred.
+ *
+ * There may be an indefinite delay between the two steps. Consider a
+ * fictional USB input device with a button that the user can press. In order
+ * to determine when the button is pressed, you would likely submit a request
+ * to read data on a bulk or interrupt endpoint and wait for data to arrive.
+ * Data will arrive when the button is pressed by the user, which is
+ * potentially hours later.
+ *
+ * libusb offers both a synchronous and an asynchronous interface to performing
+ * USB transfers. The main difference is that the synchronous interface
+ * combines both steps indicated above into a single function call, whereas
+ * the asynchronous interface separates them.
+ *
+ * \section sync The synchronous interface
+ *
+ * The synchronous I/O interface allows you to perform a USB transfer with
+ * a single function call. When the function call returns, the transfer has
+ * completed and you can parse the results.
+ *
+ * If you have used the libusb-0.1 before, this I/O style will seem familar to
+ * you. libusb-0.1 only offered a synchronous interface.
+ *
+ * In our input device example, to read button presses you might write code
+ * in the following style:
+\code
+unsigned char data[4];
+int actual_length;
+int r = libusb_bulk_transfer(dev_handle, LIBUSB_ENDPOINT_IN, data, sizeof(data), &actual_length, 0);
+if (r == 0 && actual_length == sizeof(data)) {
+	// results of the transaction can now be found in the data buffer
+	// parse them here and report button press
+} else {
+	error();
 }
+\endcode
+ *
+ * The main advantage of this model is simplicity: you did everything with
+ * a single simple function call.
+ *
+ * However, this interface has its limitations. Your application will sleep
+ * inside libusb_bulk_transfer() until the transaction has completed. If it
+ * takes the user 3 hours to press the button, your application will be
+ * sleeping for that long. Execution will be tied up inside the library -
+ * the entire thread will be useless for that duration.
+ *
+ * Another issue is that by tieing up the thread with that single transaction
+ * there is no possibility of performing I/O with multiple endpoints and/or
+ * multiple devices simultaneously, unless you resort to creating one thread
+ * per transaction.
+ *
+ * Additionally, there is no opportunity to cancel the transfer after the
+ * request has been submitted.
+ *
+ * For details on how to use the synchronous API, see the
+ * \ref libusb_syncio "synchronous I/O API documentation" pages.
+ *
+ * \section async The asynchronous interface
+ *
+ * Asynchronous I/O is the most significant new feature in libusb-1.0.
+ * Although it is a more complex interface, it solves all the issues detailed
+ * above.
+ *
+ * Instead of providing which functions that block until the I/O has complete,
+ * libusb's asynchronous interface presents non-blocking functions which
+ * begin a transfer and then return immediately. Your application passes a
+ * callback function pointer to this non-blocking function, which libusb will
+ * call with the results of the transaction when it has completed.
+ *
+ * Transfers which have been submitted through the non-blocking functions
+ * can be cancelled with a separate function call.
+ *
+ * The non-blocking nature of this interface allows you to be simultaneously
+ * performing I/O to multiple endpoints on multiple devices, without having
+ * to use threads.
+ *
+ * This added flexibility does come with some complications though:
+ * - In the interest of being a lightweight library, libusb does not create
+ * threads and can only operate when your application is calling into it. Your
+ * application must call into libusb from it's main loop when events are ready
+ * to be handled, or you must use some other scheme to allow libusb to
+ * undertake whatever work needs to be done.
+ * - libusb also needs to be called into at certain fixed points in time in
+ * order to accurately handle transfer timeouts.
+ * - Memory handling becomes more complex. You cannot use stack memory unless
+ * the function with that stack is guaranteed not to return until the transfer
+ * callback has finished executing.
+ * - You generally lose some linearity from your code flow because submitting
+ * the transfer request is done in a separate function from where the transfer
+ * results are handled. This becomes particularly obvious when you want to
+ * submit a second transfer based on the results of an earlier transfer.
+ *
+ * Internally, libusb's synchronous interface is expressed in terms of function
+ * calls to the asynchronous interface.
+ *
+ * For details on how to use the asynchronous API, see the
+ * \ref libusb_asyncio "asynchronous I/O API" documentation pages.
+ */
 
-void usbi_hotplug_deregister_all(struct libusb_context *ctx) {
-	struct libusb_hotplug_callback *hotplug_cb, *next;
 
-	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
-	list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_cbs, list,
-				 struct libusb_hotplug_callback) {
-		list_del(&hotplug_cb->list);
-		free(hotplug_cb);
-	}
+/**
+ * \page libusb_packetoverflow Packets and overflows
+ *
+ * \section packets Packet abstraction
+ *
+ * The USB specifications describe how data is transmitted in packets, with
+ * constraints on packet size defined by endpoint descriptors. The host must
+ * not send data payloads larger than the endpoint's maximum packet size.
+ *
+ * libusb and the underlying OS abstract out the packet concept, allowing you
+ * to request transfers of any size. Internally, the request will be divided
+ * up into correctly-sized packets. You do not have to be concerned with
+ * packet sizes, but there is one exception when considering overflows.
+ *
+ * \section overflow Bulk/interrupt transfer overflows
+ *
+ * When requesting data on a bulk endpoint, libusb requires you to supply a
+ * buffer and the maximum number of bytes of data that libusb can put in that
+ * buffer. However, the size of the buffer is not communicated to the device -
+ * the device is just asked to send any amount of data.
+ *
+ * There is no problem if the device sends an amount of data that is less than
+ * or equal to the buffer size. libusb reports this condition to you through
+ * the \ref libusb_transfer::actual_length "libusb_transfer.actual_length"
+ * field.
+ *
+ * Problems may occur if the device attempts to send more data than can fit in
+ * the buffer. libusb reports LIBUSB_TRANSFER_OVERFLOW for this condition but
+ * other behaviour is largely undefined: actual_length may or may not be
+ * accurate, the chunk of data that can fit in the buffer (before overflow)
+ * may or may not have been transferred.
+ *
+ * Overflows are nasty, but can be avoided. Even though you were told to
+ * ignore packets above, think about the lower level details: each transfer is
+ * split into packets (typically small, with a maximum size of 512 bytes).
+ * Overflows can only happen if the final packet in an incoming data transfer
+ * is smaller than the actual packet that the device wants to transfer.
+ * Therefore, you will never see an overflow if your transfer buffer size is a
+ * multiple of the endpoint's packet size: the final packet will either
+ * fill up completely or will be only partially filled.
+ */
 
-	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
-}
-// line 1 "libusb/libusb/io.c"
-/* -*- Mode: C; indent-tabs-mode:t ; c-basic-offset:8 -*- */
-/*
- * I/O functions for libusb
- * Copyright © 2007-2009 Daniel Drake <dsd@gentoo.org>
- * Copyright © 2001 Johannes Erdfelt <johannes@erdfelt.com>
+/**
+ * @defgroup libusb_asyncio Asynchronous device I/O
+ *
+ * This page details libusb's asynchronous (non-blocking) API for USB device
+ * I/O. This interface is very powerful but is also quite complex - you will
+ * need to read this page carefully to understand the necessary considerations
+ * and issues surrounding use of this interface. Simplistic applications
+ * may wish to consider the \ref libusb_syncio "synchronous I/O API" instead.
+ *
+ * The asynchronous interface is built around the idea of separating transfer
+ * submission and handling of transfer completion (the synchronous model
+ * combines both of these into one). There may be a long delay between
+ * submission and completion, however the asynchronous submission function
+ * is non-blocking so will return control to your application during that
+ * potentially long delay.
+ *
+ * \section asyncabstraction Transfer abstraction
+ *
+ * For the asynchronous I/O, libusb implements the concept of a generic
+ * transfer entity for all types of I/O (control, bulk, interrupt,
+ * isochronous). The generic transfer object must be treated slightly
+ * differently depending on which type of I/O you are performing with it.
+ *
+ * This is represented by the public libusb_transfer structure type.
+ *
+ * \section asynctrf Asynchronous transfers
+ *
+ * We can view asynchronous I/O as a 5 step process:
+ * -# <b>Allocation</b>: allocate a libusb_transfer
+ * -# <b>Filling</b>: populate the libusb_transfer instance with information
+ *    about the transfer you wish to perform
+ * -# <b>Submission</b>: ask libusb to submit the transfer
+ * -# <b>Completion handling</b>: examine transfer results in the
+ *    libusb_transfer structure
+ * -# <b>Deallocation</b>: clean up resources
+ *
+ *
+ * \subsection asyncalloc Allocation
+ *
+ * This step involves allocating memory for a USB transfer. This is the
+ * generic transfer object mentioned above. At this stage, the transfer
+ * is "blank" with no details about what type of I/O it will be used for.
+ *
+ * Allocation is done with the libusb_alloc_transfer() function. You must use
+ * this function rather than allocating your own transfers.
+ *
+ * \subsection asyncfill Filling
+ *
+ * This step is where you take a previously allocated transfer and fill it
+ * with information to determine the message type and direction, data buffer,
+ * callback function, etc.
+ *
+ * You can either fill the required fields yourself or you can use the
+ * helper functions: libusb_fill_control_transfer(), libusb_fill_bulk_transfer()
+ * and libusb_fill_interrupt_transfer().
+ *
+ * \subsection asyncsubmit Submission
  *
- * This library is free software; you can redistribute it and/or
- * modify it under the terms of the GNU Lesser General Public
- * License as published by the Free Software Foundation; either
- * version 2.1 of the License, or (at your option) any later version.
+ * When you have allocated a transfer and filled it, you can submit it using
+ * libusb_submit_transfer(). This function returns immediately but can be
+ * regarded as firing off the I/O request in the background.
  *
- * This library is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
- * Lesser General Public License for more details.
+ * \subsection asynccomplete Completion handling
  *
- * You should have received a copy of the GNU Lesser General Public
- * License along with this library; if not, write to the Free Software
- * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
- */
-
-// SKIP #include "libusb/libusb/config.h"
-// line 23 "libusb/libusb/io.c"
-
-#include <assert.h>
-#include <errno.h>
-#include <stdint.h>
-#include <stdlib.h>
-#include <string.h>
-#include <time.h>
-#ifdef HAVE_SYS_TIME_H
-#include <sys/time.h>
-#endif
-#ifdef USBI_TIMERFD_AVAILABLE
-#include <sys/timerfd.h>
-#endif
-
-// SKIP #include "libusb/libusb/libusbi.h"
-// line 38 "libusb/libusb/io.c"
-// SKIP #include "libusb/libusb/hotplug.h"
-// line 39 "libusb/libusb/io.c"
-
-/**
- * \page libusb_io Synchronous and asynchronous device I/O
+ * After a transfer has been submitted, one of four things can happen to it:
  *
- * \section io_intro Introduction
+ * - The transfer completes (i.e. some data was transferred)
+ * - The transfer has a timeout and the timeout expires before all data is
+ * transferred
+ * - The transfer fails due to an error
+ * - The transfer is cancelled
  *
- * If you're using libusb in your application, you're probably wanting to
- * perform I/O with devices - you want to perform USB data transfers.
+ * Each of these will cause the user-specified transfer callback function to
+ * be invoked. It is up to the callback function to determine which of the
+ * above actually happened and to act accordingly.
+ *
+ * The user-specified callback is passed a pointer to the libusb_transfer
+ * structure which was used to setup and submit the transfer. At completion
+ * time, libusb has populated this structure with results of the transfer:
+ * success or failure reason, number of bytes of data transferred, etc. See
+ * the libusb_transfer structure documentation for more information.
+ *
+ * <b>Important Note</b>: The user-specified callback is called from an event
+ * handling context. It is therefore important that no calls are made into
+ * libusb that will attempt to perform any event handling. Examples of such
+ * functions are any listed in the \ref libusb_syncio "synchronous API" and any of
+ * the blocking functions that retrieve \ref libusb_desc "USB descriptors".
+ *
+ * \subsection Deallocation
+ *
+ * When a transfer has completed (i.e. the callback function has been invoked),
+ * you are advised to free the transfer (unless you wish to resubmit it, see
+ * below). Transfers are deallocated with libusb_free_transfer().
+ *
+ * It is undefined behaviour to free a transfer which has not completed.
+ *
+ * \section asyncresubmit Resubmission
+ *
+ * You may be wondering why allocation, filling, and submission are all
+ * separated above where they could reasonably be combined into a single
+ * operation.
+ *
+ * The reason for separation is to allow you to resubmit transfers without
+ * having to allocate new ones every time. This is especially useful for
+ * common situations dealing with interrupt endpoints - you allocate one
+ * transfer, fill and submit it, and when it returns with results you just
+ * resubmit it for the next interrupt.
+ *
+ * \section asynccancel Cancellation
+ *
+ * Another advantage of using the asynchronous interface is that you have
+ * the ability to cancel transfers which have not yet completed. This is
+ * done by calling the libusb_cancel_transfer() function.
+ *
+ * libusb_cancel_transfer() is asynchronous/non-blocking in itself. When the
+ * cancellation actually completes, the transfer's callback function will
+ * be invoked, and the callback function should check the transfer status to
+ * determine that it was cancelled.
+ *
+ * Freeing the transfer after it has been cancelled but before cancellation
+ * has completed will result in undefined behaviour.
+ *
+ * When a transfer is cancelled, some of the data may have been transferred.
+ * libusb will communicate this to you in the transfer callback. Do not assume
+ * that no data was transferred.
+ *
+ * \section bulk_overflows Overflows on device-to-host bulk/interrupt endpoints
+ *
+ * If your device does not have predictable transfer sizes (or it misbehaves),
+ * your application may submit a request for data on an IN endpoint which is
+ * smaller than the data that the device wishes to send. In some circumstances
+ * this will cause an overflow, which is a nasty condition to deal with. See
+ * the \ref libusb_packetoverflow page for discussion.
+ *
+ * \section asyncctrl Considerations for control transfers
+ *
+ * The <tt>libusb_transfer</tt> structure is generic and hence does not
+ * include specific fields for the control-specific setup packet structure.
+ *
+ * In order to perform a control transfer, you must place the 8-byte setup
+ * packet at the start of the data buffer. To simplify this, you could
+ * cast the buffer pointer to type struct libusb_control_setup, or you can
+ * use the helper function libusb_fill_control_setup().
+ *
+ * The wLength field placed in the setup packet must be the length you would
+ * expect to be sent in the setup packet: the length of the payload that
+ * follows (or the expected maximum number of bytes to receive). However,
+ * the length field of the libusb_transfer object must be the length of
+ * the data buffer - i.e. it should be wLength <em>plus</em> the size of
+ * the setup packet (LIBUSB_CONTROL_SETUP_SIZE).
+ *
+ * If you use the helper functions, this is simplified for you:
+ * -# Allocate a buffer of size LIBUSB_CONTROL_SETUP_SIZE plus the size of the
+ * data you are sending/requesting.
+ * -# Call libusb_fill_control_setup() on the data buffer, using the transfer
+ * request size as the wLength value (i.e. do not include the extra space you
+ * allocated for the control setup).
+ * -# If this is a host-to-device transfer, place the data to be transferred
+ * in the data buffer, starting at offset LIBUSB_CONTROL_SETUP_SIZE.
+ * -# Call libusb_fill_control_transfer() to associate the data buffer with
+ * the transfer (and to set the remaining details such as callback and timeout).
+ *   - Note that there is no parameter to set the length field of the transfer.
+ *     The length is automatically inferred from the wLength field of the setup
+ *     packet.
+ * -# Submit the transfer.
+ *
+ * The multi-byte control setup fields (wValue, wIndex and wLength) must
+ * be given in little-endian byte order (the endianness of the USB bus).
+ * Endianness conversion is transparently handled by
+ * libusb_fill_control_setup() which is documented to accept host-endian
+ * values.
+ *
+ * Further considerations are needed when handling transfer completion in
+ * your callback function:
+ * - As you might expect, the setup packet will still be sitting at the start
+ * of the data buffer.
+ * - If this was a device-to-host transfer, the received data will be sitting
+ * at offset LIBUSB_CONTROL_SETUP_SIZE into the buffer.
+ * - The actual_length field of the transfer structure is relative to the
+ * wLength of the setup packet, rather than the size of the data buffer. So,
+ * if your wLength was 4, your transfer's <tt>length</tt> was 12, then you
+ * should expect an <tt>actual_length</tt> of 4 to indicate that the data was
+ * transferred in entirity.
+ *
+ * To simplify parsing of setup packets and obtaining the data from the
+ * correct offset, you may wish to use the libusb_control_transfer_get_data()
+ * and libusb_control_transfer_get_setup() functions within your transfer
+ * callback.
+ *
+ * Even though control endpoints do not halt, a completed control transfer
+ * may have a LIBUSB_TRANSFER_STALL status code. This indicates the control
+ * request was not supported.
+ *
+ * \section asyncintr Considerations for interrupt transfers
+ *
+ * All interrupt transfers are performed using the polling interval presented
+ * by the bInterval value of the endpoint descriptor.
+ *
+ * \section asynciso Considerations for isochronous transfers
+ *
+ * Isochronous transfers are more complicated than transfers to
+ * non-isochronous endpoints.
+ *
+ * To perform I/O to an isochronous endpoint, allocate the transfer by calling
+ * libusb_alloc_transfer() with an appropriate number of isochronous packets.
+ *
+ * During filling, set \ref libusb_transfer::type "type" to
+ * \ref libusb_transfer_type::LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
+ * "LIBUSB_TRANSFER_TYPE_ISOCHRONOUS", and set
+ * \ref libusb_transfer::num_iso_packets "num_iso_packets" to a value less than
+ * or equal to the number of packets you requested during allocation.
+ * libusb_alloc_transfer() does not set either of these fields for you, given
+ * that you might not even use the transfer on an isochronous endpoint.
+ *
+ * Next, populate the length field for the first num_iso_packets entries in
+ * the \ref libusb_transfer::iso_packet_desc "iso_packet_desc" array. Section
+ * 5.6.3 of the USB2 specifications describe how the maximum isochronous
+ * packet length is determined by the wMaxPacketSize field in the endpoint
+ * descriptor.
+ * Two functions can help you here:
+ *
+ * - libusb_get_max_iso_packet_size() is an easy way to determine the max
+ *   packet size for an isochronous endpoint. Note that the maximum packet
+ *   size is actually the maximum number of bytes that can be transmitted in
+ *   a single microframe, therefore this function multiplies the maximum number
+ *   of bytes per transaction by the number of transaction opportunities per
+ *   microframe.
+ * - libusb_set_iso_packet_lengths() assigns the same length to all packets
+ *   within a transfer, which is usually what you want.
+ *
+ * For outgoing transfers, you'll obviously fill the buffer and populate the
+ * packet descriptors in hope that all the data gets transferred. For incoming
+ * transfers, you must ensure the buffer has sufficient capacity for
+ * the situation where all packets transfer the full amount of requested data.
+ *
+ * Completion handling requires some extra consideration. The
+ * \ref libusb_transfer::actual_length "actual_length" field of the transfer
+ * is meaningless and should not be examined; instead you must refer to the
+ * \ref libusb_iso_packet_descriptor::actual_length "actual_length" field of
+ * each individual packet.
+ *
+ * The \ref libusb_transfer::status "status" field of the transfer is also a
+ * little misleading:
+ *  - If the packets were submitted and the isochronous data microframes
+ *    completed normally, status will have value
+ *    \ref libusb_transfer_status::LIBUSB_TRANSFER_COMPLETED
+ *    "LIBUSB_TRANSFER_COMPLETED". Note that bus errors and software-incurred
+ *    delays are not counted as transfer errors; the transfer.status field may
+ *    indicate COMPLETED even if some or all of the packets failed. Refer to
+ *    the \ref libusb_iso_packet_descriptor::status "status" field of each
+ *    individual packet to determine packet failures.
+ *  - The status field will have value
+ *    \ref libusb_transfer_status::LIBUSB_TRANSFER_ERROR
+ *    "LIBUSB_TRANSFER_ERROR" only when serious errors were encountered.
+ *  - Other transfer status codes occur with normal behaviour.
+ *
+ * The data for each packet will be found at an offset into the buffer that
+ * can be calculated as if each prior packet completed in full. The
+ * libusb_get_iso_packet_buffer() and libusb_get_iso_packet_buffer_simple()
+ * functions may help you here.
+ *
+ * <b>Note</b>: Some operating systems (e.g. Linux) may impose limits on the
+ * length of individual isochronous packets and/or the total length of the
+ * isochronous transfer. Such limits can be difficult for libusb to detect,
+ * so the library will simply try and submit the transfer as set up by you.
+ * If the transfer fails to submit because it is too large,
+ * libusb_submit_transfer() will return
+ * \ref libusb_error::LIBUSB_ERROR_INVALID_PARAM "LIBUSB_ERROR_INVALID_PARAM".
+ *
+ * \section asyncmem Memory caveats
+ *
+ * In most circumstances, it is not safe to use stack memory for transfer
+ * buffers. This is because the function that fired off the asynchronous
+ * transfer may return before libusb has finished using the buffer, and when
+ * the function returns it's stack gets destroyed. This is true for both
+ * host-to-device and device-to-host transfers.
+ *
+ * The only case in which it is safe to use stack memory is where you can
+ * guarantee that the function owning the stack space for the buffer does not
+ * return until after the transfer's callback function has completed. In every
+ * other case, you need to use heap memory instead.
  *
- * libusb offers two separate interfaces for device I/O. This page aims to
- * introduce the two in order to help you decide which one is more suitable
- * for your application. You can also choose to use both interfaces in your
- * application by considering each transfer on a case-by-case basis.
+ * \section asyncflags Fine control
  *
- * Once you have read through the following discussion, you should consult the
- * detailed API documentation pages for the details:
- * - \ref libusb_syncio
- * - \ref libusb_asyncio
+ * Through using this asynchronous interface, you may find yourself repeating
+ * a few simple operations many times. You can apply a bitwise OR of certain
+ * flags to a transfer to simplify certain things:
+ * - \ref libusb_transfer_flags::LIBUSB_TRANSFER_SHORT_NOT_OK
+ *   "LIBUSB_TRANSFER_SHORT_NOT_OK" results in transfers which transferred
+ *   less than the requested amount of data being marked with status
+ *   \ref libusb_transfer_status::LIBUSB_TRANSFER_ERROR "LIBUSB_TRANSFER_ERROR"
+ *   (they would normally be regarded as COMPLETED)
+ * - \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
+ *   "LIBUSB_TRANSFER_FREE_BUFFER" allows you to ask libusb to free the transfer
+ *   buffer when freeing the transfer.
+ * - \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+ *   "LIBUSB_TRANSFER_FREE_TRANSFER" causes libusb to automatically free the
+ *   transfer after the transfer callback returns.
  *
- * \section theory Transfers at a logical level
+ * \section asyncevent Event handling
  *
- * At a logical level, USB transfers typically happen in two parts. For
- * example, when reading data from a endpoint:
- * -# A request for data is sent to the device
- * -# Some time later, the incoming data is received by the host
+ * An asynchronous model requires that libusb perform work at various
+ * points in time - namely processing the results of previously-submitted
+ * transfers and invoking the user-supplied callback function.
  *
- * or when writing data to an endpoint:
+ * This gives rise to the libusb_handle_events() function which your
+ * application must call into when libusb has work do to. This gives libusb
+ * the opportunity to reap pending transfers, invoke callbacks, etc.
  *
- * -# The data is sent to the device
- * -# Some time later, the host receives acknowledgement from the device that
- *    the data has been transferred.
+ * There are 2 different approaches to dealing with libusb_handle_events:
  *
- * There may be an indefinite delay between the two steps. Consider a
- * fictional USB input device with a button that the user can press. In order
- * to determine when the button is pressed, you would likely submit a request
- * to read data on a bulk or interrupt endpoint and wait for data to arrive.
- * Data will arrive when the button is pressed by the user, which is
- * potentially hours later.
+ * -# Repeatedly call libusb_handle_events() in blocking mode from a dedicated
+ *    thread.
+ * -# Integrate libusb with your application's main event loop. libusb
+ *    exposes a set of file descriptors which allow you to do this.
  *
- * libusb offers both a synchronous and an asynchronous interface to performing
- * USB transfers. The main difference is that the synchronous interface
- * combines both steps indicated above into a single function call, whereas
- * the asynchronous interface separates them.
+ * The first approach has the big advantage that it will also work on Windows
+ * were libusb' poll API for select / poll integration is not available. So
+ * if you want to support Windows and use the async API, you must use this
+ * approach, see the \ref eventthread "Using an event handling thread" section
+ * below for details.
  *
- * \section sync The synchronous interface
+ * If you prefer a single threaded approach with a single central event loop,
+ * see the \ref libusb_poll "polling and timing" section for how to integrate libusb
+ * into your application's main event loop.
  *
- * The synchronous I/O interface allows you to perform a USB transfer with
- * a single function call. When the function call returns, the transfer has
- * completed and you can parse the results.
+ * \section eventthread Using an event handling thread
  *
- * If you have used the libusb-0.1 before, this I/O style will seem familar to
- * you. libusb-0.1 only offered a synchronous interface.
+ * Lets begin with stating the obvious: If you're going to use a separate
+ * thread for libusb event handling, your callback functions MUST be
+ * threadsafe.
  *
- * In our input device example, to read button presses you might write code
- * in the following style:
+ * Other then that doing event handling from a separate thread, is mostly
+ * simple. You can use an event thread function as follows:
 \code
-unsigned char data[4];
-int actual_length;
-int r = libusb_bulk_transfer(dev_handle, LIBUSB_ENDPOINT_IN, data, sizeof(data), &actual_length, 0);
-if (r == 0 && actual_length == sizeof(data)) {
-	// results of the transaction can now be found in the data buffer
-	// parse them here and report button press
-} else {
-	error();
+void *event_thread_func(void *ctx)
+{
+    while (event_thread_run)
+        libusb_handle_events(ctx);
+
+    return NULL;
 }
 \endcode
  *
- * The main advantage of this model is simplicity: you did everything with
- * a single simple function call.
+ * There is one caveat though, stopping this thread requires setting the
+ * event_thread_run variable to 0, and after that libusb_handle_events() needs
+ * to return control to event_thread_func. But unless some event happens,
+ * libusb_handle_events() will not return.
  *
- * However, this interface has its limitations. Your application will sleep
- * inside libusb_bulk_transfer() until the transaction has completed. If it
- * takes the user 3 hours to press the button, your application will be
- * sleeping for that long. Execution will be tied up inside the library -
- * the entire thread will be useless for that duration.
+ * There are 2 different ways of dealing with this, depending on if your
+ * application uses libusb' \ref libusb_hotplug "hotplug" support or not.
  *
- * Another issue is that by tieing up the thread with that single transaction
- * there is no possibility of performing I/O with multiple endpoints and/or
- * multiple devices simultaneously, unless you resort to creating one thread
- * per transaction.
+ * Applications which do not use hotplug support, should not start the event
+ * thread until after their first call to libusb_open(), and should stop the
+ * thread when closing the last open device as follows:
+\code
+void my_close_handle(libusb_device_handle *dev_handle)
+{
+    if (open_devs == 1)
+        event_thread_run = 0;
+
+    libusb_close(dev_handle); // This wakes up libusb_handle_events()
+
+    if (open_devs == 1)
+        pthread_join(event_thread);
+
+    open_devs--;
+}
+\endcode
  *
- * Additionally, there is no opportunity to cancel the transfer after the
- * request has been submitted.
+ * Applications using hotplug support should start the thread at program init,
+ * after having successfully called libusb_hotplug_register_callback(), and
+ * should stop the thread at program exit as follows:
+\code
+void my_libusb_exit(void)
+{
+    event_thread_run = 0;
+    libusb_hotplug_deregister_callback(ctx, hotplug_cb_handle); // This wakes up libusb_handle_events()
+    pthread_join(event_thread);
+    libusb_exit(ctx);
+}
+\endcode
+ */
+
+/**
+ * @defgroup libusb_poll Polling and timing
  *
- * For details on how to use the synchronous API, see the
- * \ref libusb_syncio "synchronous I/O API documentation" pages.
+ * This page documents libusb's functions for polling events and timing.
+ * These functions are only necessary for users of the
+ * \ref libusb_asyncio "asynchronous API". If you are only using the simpler
+ * \ref libusb_syncio "synchronous API" then you do not need to ever call these
+ * functions.
  *
- * \section async The asynchronous interface
+ * The justification for the functionality described here has already been
+ * discussed in the \ref asyncevent "event handling" section of the
+ * asynchronous API documentation. In summary, libusb does not create internal
+ * threads for event processing and hence relies on your application calling
+ * into libusb at certain points in time so that pending events can be handled.
  *
- * Asynchronous I/O is the most significant new feature in libusb-1.0.
- * Although it is a more complex interface, it solves all the issues detailed
- * above.
+ * Your main loop is probably already calling poll() or select() or a
+ * variant on a set of file descriptors for other event sources (e.g. keyboard
+ * button presses, mouse movements, network sockets, etc). You then add
+ * libusb's file descriptors to your poll()/select() calls, and when activity
+ * is detected on such descriptors you know it is time to call
+ * libusb_handle_events().
  *
- * Instead of providing which functions that block until the I/O has complete,
- * libusb's asynchronous interface presents non-blocking functions which
- * begin a transfer and then return immediately. Your application passes a
- * callback function pointer to this non-blocking function, which libusb will
- * call with the results of the transaction when it has completed.
+ * There is one final event handling complication. libusb supports
+ * asynchronous transfers which time out after a specified time period.
  *
- * Transfers which have been submitted through the non-blocking functions
- * can be cancelled with a separate function call.
+ * On some platforms a timerfd is used, so the timeout handling is just another
+ * fd, on other platforms this requires that libusb is called into at or after
+ * the timeout to handle it. So, in addition to considering libusb's file
+ * descriptors in your main event loop, you must also consider that libusb
+ * sometimes needs to be called into at fixed points in time even when there
+ * is no file descriptor activity, see \ref polltime details.
  *
- * The non-blocking nature of this interface allows you to be simultaneously
- * performing I/O to multiple endpoints on multiple devices, without having
- * to use threads.
+ * In order to know precisely when libusb needs to be called into, libusb
+ * offers you a set of pollable file descriptors and information about when
+ * the next timeout expires.
  *
- * This added flexibility does come with some complications though:
- * - In the interest of being a lightweight library, libusb does not create
- * threads and can only operate when your application is calling into it. Your
- * application must call into libusb from it's main loop when events are ready
- * to be handled, or you must use some other scheme to allow libusb to
- * undertake whatever work needs to be done.
- * - libusb also needs to be called into at certain fixed points in time in
- * order to accurately handle transfer timeouts.
- * - Memory handling becomes more complex. You cannot use stack memory unless
- * the function with that stack is guaranteed not to return until the transfer
- * callback has finished executing.
- * - You generally lose some linearity from your code flow because submitting
- * the transfer request is done in a separate function from where the transfer
- * results are handled. This becomes particularly obvious when you want to
- * submit a second transfer based on the results of an earlier transfer.
+ * If you are using the asynchronous I/O API, you must take one of the two
+ * following options, otherwise your I/O will not complete.
  *
- * Internally, libusb's synchronous interface is expressed in terms of function
- * calls to the asynchronous interface.
+ * \section pollsimple The simple option
  *
- * For details on how to use the asynchronous API, see the
- * \ref libusb_asyncio "asynchronous I/O API" documentation pages.
- */
+ * If your application revolves solely around libusb and does not need to
+ * handle other event sources, you can have a program structure as follows:
+\code
+// initialize libusb
+// find and open device
+// maybe fire off some initial async I/O
 
+while (user_has_not_requested_exit)
+	libusb_handle_events(ctx);
 
-/**
- * \page libusb_packetoverflow Packets and overflows
+// clean up and exit
+\endcode
  *
- * \section packets Packet abstraction
+ * With such a simple main loop, you do not have to worry about managing
+ * sets of file descriptors or handling timeouts. libusb_handle_events() will
+ * handle those details internally.
  *
- * The USB specifications describe how data is transmitted in packets, with
- * constraints on packet size defined by endpoint descriptors. The host must
- * not send data payloads larger than the endpoint's maximum packet size.
+ * \section libusb_pollmain The more advanced option
  *
- * libusb and the underlying OS abstract out the packet concept, allowing you
- * to request transfers of any size. Internally, the request will be divided
- * up into correctly-sized packets. You do not have to be concerned with
- * packet sizes, but there is one exception when considering overflows.
+ * \note This functionality is currently only available on Unix-like platforms.
+ * On Windows, libusb_get_pollfds() simply returns NULL. Applications which
+ * want to support Windows are advised to use an \ref eventthread
+ * "event handling thread" instead.
+ *
+ * In more advanced applications, you will already have a main loop which
+ * is monitoring other event sources: network sockets, X11 events, mouse
+ * movements, etc. Through exposing a set of file descriptors, libusb is
+ * designed to cleanly integrate into such main loops.
+ *
+ * In addition to polling file descriptors for the other event sources, you
+ * take a set of file descriptors from libusb and monitor those too. When you
+ * detect activity on libusb's file descriptors, you call
+ * libusb_handle_events_timeout() in non-blocking mode.
+ *
+ * What's more, libusb may also need to handle events at specific moments in
+ * time. No file descriptor activity is generated at these times, so your
+ * own application needs to be continually aware of when the next one of these
+ * moments occurs (through calling libusb_get_next_timeout()), and then it
+ * needs to call libusb_handle_events_timeout() in non-blocking mode when
+ * these moments occur. This means that you need to adjust your
+ * poll()/select() timeout accordingly.
  *
- * \section overflow Bulk/interrupt transfer overflows
+ * libusb provides you with a set of file descriptors to poll and expects you
+ * to poll all of them, treating them as a single entity. The meaning of each
+ * file descriptor in the set is an internal implementation detail,
+ * platform-dependent and may vary from release to release. Don't try and
+ * interpret the meaning of the file descriptors, just do as libusb indicates,
+ * polling all of them at once.
  *
- * When requesting data on a bulk endpoint, libusb requires you to supply a
- * buffer and the maximum number of bytes of data that libusb can put in that
- * buffer. However, the size of the buffer is not communicated to the device -
- * the device is just asked to send any amount of data.
+ * In pseudo-code, you want something that looks like:
+\code
+// initialise libusb
+
+libusb_get_pollfds(ctx)
+while (user has not requested application exit) {
+	libusb_get_next_timeout(ctx);
+	poll(on libusb file descriptors plus any other event sources of interest,
+		using a timeout no larger than the value libusb just suggested)
+	if (poll() indicated activity on libusb file descriptors)
+		libusb_handle_events_timeout(ctx, &zero_tv);
+	if (time has elapsed to or beyond the libusb timeout)
+		libusb_handle_events_timeout(ctx, &zero_tv);
+	// handle events from other sources here
+}
+
+// clean up and exit
+\endcode
  *
- * There is no problem if the device sends an amount of data that is less than
- * or equal to the buffer size. libusb reports this condition to you through
- * the \ref libusb_transfer::actual_length "libusb_transfer.actual_length"
- * field.
+ * \subsection polltime Notes on time-based events
  *
- * Problems may occur if the device attempts to send more data than can fit in
- * the buffer. libusb reports LIBUSB_TRANSFER_OVERFLOW for this condition but
- * other behaviour is largely undefined: actual_length may or may not be
- * accurate, the chunk of data that can fit in the buffer (before overflow)
- * may or may not have been transferred.
+ * The above complication with having to track time and call into libusb at
+ * specific moments is a bit of a headache. For maximum compatibility, you do
+ * need to write your main loop as above, but you may decide that you can
+ * restrict the supported platforms of your application and get away with
+ * a more simplistic scheme.
  *
- * Overflows are nasty, but can be avoided. Even though you were told to
- * ignore packets above, think about the lower level details: each transfer is
- * split into packets (typically small, with a maximum size of 512 bytes).
- * Overflows can only happen if the final packet in an incoming data transfer
- * is smaller than the actual packet that the device wants to transfer.
- * Therefore, you will never see an overflow if your transfer buffer size is a
- * multiple of the endpoint's packet size: the final packet will either
- * fill up completely or will be only partially filled.
- */
+ * These time-based event complications are \b not required on the following
+ * platforms:
+ *  - Darwin
+ *  - Linux, provided that the following version requirements are satisfied:
+ *   - Linux v2.6.27 or newer, compiled with timerfd support
+ *   - glibc v2.9 or newer
+ *   - libusb v1.0.5 or newer
+ *
+ * Under these configurations, libusb_get_next_timeout() will \em always return
+ * 0, so your main loop can be simplified to:
+\code
+// initialise libusb
 
-/**
- * @defgroup libusb_asyncio Asynchronous device I/O
+libusb_get_pollfds(ctx)
+while (user has not requested application exit) {
+	poll(on libusb file descriptors plus any other event sources of interest,
+		using any timeout that you like)
+	if (poll() indicated activity on libusb file descriptors)
+		libusb_handle_events_timeout(ctx, &zero_tv);
+	// handle events from other sources here
+}
+
+// clean up and exit
+\endcode
  *
- * This page details libusb's asynchronous (non-blocking) API for USB device
- * I/O. This interface is very powerful but is also quite complex - you will
- * need to read this page carefully to understand the necessary considerations
- * and issues surrounding use of this interface. Simplistic applications
- * may wish to consider the \ref libusb_syncio "synchronous I/O API" instead.
+ * Do remember that if you simplify your main loop to the above, you will
+ * lose compatibility with some platforms (including legacy Linux platforms,
+ * and <em>any future platforms supported by libusb which may have time-based
+ * event requirements</em>). The resultant problems will likely appear as
+ * strange bugs in your application.
  *
- * The asynchronous interface is built around the idea of separating transfer
- * submission and handling of transfer completion (the synchronous model
- * combines both of these into one). There may be a long delay between
- * submission and completion, however the asynchronous submission function
- * is non-blocking so will return control to your application during that
- * potentially long delay.
+ * You can use the libusb_pollfds_handle_timeouts() function to do a runtime
+ * check to see if it is safe to ignore the time-based event complications.
+ * If your application has taken the shortcut of ignoring libusb's next timeout
+ * in your main loop, then you are advised to check the return value of
+ * libusb_pollfds_handle_timeouts() during application startup, and to abort
+ * if the platform does suffer from these timing complications.
  *
- * \section asyncabstraction Transfer abstraction
+ * \subsection fdsetchange Changes in the file descriptor set
  *
- * For the asynchronous I/O, libusb implements the concept of a generic
- * transfer entity for all types of I/O (control, bulk, interrupt,
- * isochronous). The generic transfer object must be treated slightly
- * differently depending on which type of I/O you are performing with it.
+ * The set of file descriptors that libusb uses as event sources may change
+ * during the life of your application. Rather than having to repeatedly
+ * call libusb_get_pollfds(), you can set up notification functions for when
+ * the file descriptor set changes using libusb_set_pollfd_notifiers().
  *
- * This is represented by the public libusb_transfer structure type.
+ * \subsection mtissues Multi-threaded considerations
  *
- * \section asynctrf Asynchronous transfers
+ * Unfortunately, the situation is complicated further when multiple threads
+ * come into play. If two threads are monitoring the same file descriptors,
+ * the fact that only one thread will be woken up when an event occurs causes
+ * some headaches.
  *
- * We can view asynchronous I/O as a 5 step process:
- * -# <b>Allocation</b>: allocate a libusb_transfer
- * -# <b>Filling</b>: populate the libusb_transfer instance with information
- *    about the transfer you wish to perform
- * -# <b>Submission</b>: ask libusb to submit the transfer
- * -# <b>Completion handling</b>: examine transfer results in the
- *    libusb_transfer structure
- * -# <b>Deallocation</b>: clean up resources
+ * The events lock, event waiters lock, and libusb_handle_events_locked()
+ * entities are added to solve these problems. You do not need to be concerned
+ * with these entities otherwise.
  *
+ * See the extra documentation: \ref libusb_mtasync
+ */
+
+/** \page libusb_mtasync Multi-threaded applications and asynchronous I/O
  *
- * \subsection asyncalloc Allocation
+ * libusb is a thread-safe library, but extra considerations must be applied
+ * to applications which interact with libusb from multiple threads.
  *
- * This step involves allocating memory for a USB transfer. This is the
- * generic transfer object mentioned above. At this stage, the transfer
- * is "blank" with no details about what type of I/O it will be used for.
+ * The underlying issue that must be addressed is that all libusb I/O
+ * revolves around monitoring file descriptors through the poll()/select()
+ * system calls. This is directly exposed at the
+ * \ref libusb_asyncio "asynchronous interface" but it is important to note that the
+ * \ref libusb_syncio "synchronous interface" is implemented on top of the
+ * asynchonrous interface, therefore the same considerations apply.
  *
- * Allocation is done with the libusb_alloc_transfer() function. You must use
- * this function rather than allocating your own transfers.
+ * The issue is that if two or more threads are concurrently calling poll()
+ * or select() on libusb's file descriptors then only one of those threads
+ * will be woken up when an event arrives. The others will be completely
+ * oblivious that anything has happened.
  *
- * \subsection asyncfill Filling
+ * Consider the following pseudo-code, which submits an asynchronous transfer
+ * then waits for its completion. This style is one way you could implement a
+ * synchronous interface on top of the asynchronous interface (and libusb
+ * does something similar, albeit more advanced due to the complications
+ * explained on this page).
  *
- * This step is where you take a previously allocated transfer and fill it
- * with information to determine the message type and direction, data buffer,
- * callback function, etc.
+\code
+void cb(struct libusb_transfer *transfer)
+{
+	int *completed = transfer->user_data;
+	*completed = 1;
+}
+
+void myfunc() {
+	struct libusb_transfer *transfer;
+	unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE] __attribute__ ((aligned (2)));
+	int completed = 0;
+
+	transfer = libusb_alloc_transfer(0);
+	libusb_fill_control_setup(buffer,
+		LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x04, 0x01, 0, 0);
+	libusb_fill_control_transfer(transfer, dev, buffer, cb, &completed, 1000);
+	libusb_submit_transfer(transfer);
+
+	while (!completed) {
+		poll(libusb file descriptors, 120*1000);
+		if (poll indicates activity)
+			libusb_handle_events_timeout(ctx, &zero_tv);
+	}
+	printf("completed!");
+	// other code here
+}
+\endcode
  *
- * You can either fill the required fields yourself or you can use the
- * helper functions: libusb_fill_control_transfer(), libusb_fill_bulk_transfer()
- * and libusb_fill_interrupt_transfer().
+ * Here we are <em>serializing</em> completion of an asynchronous event
+ * against a condition - the condition being completion of a specific transfer.
+ * The poll() loop has a long timeout to minimize CPU usage during situations
+ * when nothing is happening (it could reasonably be unlimited).
  *
- * \subsection asyncsubmit Submission
+ * If this is the only thread that is polling libusb's file descriptors, there
+ * is no problem: there is no danger that another thread will swallow up the
+ * event that we are interested in. On the other hand, if there is another
+ * thread polling the same descriptors, there is a chance that it will receive
+ * the event that we were interested in. In this situation, <tt>myfunc()</tt>
+ * will only realise that the transfer has completed on the next iteration of
+ * the loop, <em>up to 120 seconds later.</em> Clearly a two-minute delay is
+ * undesirable, and don't even think about using short timeouts to circumvent
+ * this issue!
  *
- * When you have allocated a transfer and filled it, you can submit it using
- * libusb_submit_transfer(). This function returns immediately but can be
- * regarded as firing off the I/O request in the background.
+ * The solution here is to ensure that no two threads are ever polling the
+ * file descriptors at the same time. A naive implementation of this would
+ * impact the capabilities of the library, so libusb offers the scheme
+ * documented below to ensure no loss of functionality.
  *
- * \subsection asynccomplete Completion handling
+ * Before we go any further, it is worth mentioning that all libusb-wrapped
+ * event handling procedures fully adhere to the scheme documented below.
+ * This includes libusb_handle_events() and its variants, and all the
+ * synchronous I/O functions - libusb hides this headache from you.
  *
- * After a transfer has been submitted, one of four things can happen to it:
+ * \section Using libusb_handle_events() from multiple threads
  *
- * - The transfer completes (i.e. some data was transferred)
- * - The transfer has a timeout and the timeout expires before all data is
- * transferred
- * - The transfer fails due to an error
- * - The transfer is cancelled
+ * Even when only using libusb_handle_events() and synchronous I/O functions,
+ * you can still have a race condition. You might be tempted to solve the
+ * above with libusb_handle_events() like so:
  *
- * Each of these will cause the user-specified transfer callback function to
- * be invoked. It is up to the callback function to determine which of the
- * above actually happened and to act accordingly.
+\code
+	libusb_submit_transfer(transfer);
+
+	while (!completed) {
+		libusb_handle_events(ctx);
+	}
+	printf("completed!");
+\endcode
  *
- * The user-specified callback is passed a pointer to the libusb_transfer
- * structure which was used to setup and submit the transfer. At completion
- * time, libusb has populated this structure with results of the transfer:
- * success or failure reason, number of bytes of data transferred, etc. See
- * the libusb_transfer structure documentation for more information.
+ * This however has a race between the checking of completed and
+ * libusb_handle_events() acquiring the events lock, so another thread
+ * could have completed the transfer, resulting in this thread hanging
+ * until either a timeout or another event occurs. See also commit
+ * 6696512aade99bb15d6792af90ae329af270eba6 which fixes this in the
+ * synchronous API implementation of libusb.
  *
- * <b>Important Note</b>: The user-specified callback is called from an event
- * handling context. It is therefore important that no calls are made into
- * libusb that will attempt to perform any event handling. Examples of such
- * functions are any listed in the \ref libusb_syncio "synchronous API" and any of
- * the blocking functions that retrieve \ref libusb_desc "USB descriptors".
+ * Fixing this race requires checking the variable completed only after
+ * taking the event lock, which defeats the concept of just calling
+ * libusb_handle_events() without worrying about locking. This is why
+ * libusb-1.0.9 introduces the new libusb_handle_events_timeout_completed()
+ * and libusb_handle_events_completed() functions, which handles doing the
+ * completion check for you after they have acquired the lock:
  *
- * \subsection Deallocation
+\code
+	libusb_submit_transfer(transfer);
+
+	while (!completed) {
+		libusb_handle_events_completed(ctx, &completed);
+	}
+	printf("completed!");
+\endcode
  *
- * When a transfer has completed (i.e. the callback function has been invoked),
- * you are advised to free the transfer (unless you wish to resubmit it, see
- * below). Transfers are deallocated with libusb_free_transfer().
+ * This nicely fixes the race in our example. Note that if all you want to
+ * do is submit a single transfer and wait for its completion, then using
+ * one of the synchronous I/O functions is much easier.
  *
- * It is undefined behaviour to free a transfer which has not completed.
+ * \section eventlock The events lock
  *
- * \section asyncresubmit Resubmission
+ * The problem is when we consider the fact that libusb exposes file
+ * descriptors to allow for you to integrate asynchronous USB I/O into
+ * existing main loops, effectively allowing you to do some work behind
+ * libusb's back. If you do take libusb's file descriptors and pass them to
+ * poll()/select() yourself, you need to be aware of the associated issues.
  *
- * You may be wondering why allocation, filling, and submission are all
- * separated above where they could reasonably be combined into a single
- * operation.
+ * The first concept to be introduced is the events lock. The events lock
+ * is used to serialize threads that want to handle events, such that only
+ * one thread is handling events at any one time.
  *
- * The reason for separation is to allow you to resubmit transfers without
- * having to allocate new ones every time. This is especially useful for
- * common situations dealing with interrupt endpoints - you allocate one
- * transfer, fill and submit it, and when it returns with results you just
- * resubmit it for the next interrupt.
+ * You must take the events lock before polling libusb file descriptors,
+ * using libusb_lock_events(). You must release the lock as soon as you have
+ * aborted your poll()/select() loop, using libusb_unlock_events().
  *
- * \section asynccancel Cancellation
+ * \section threadwait Letting other threads do the work for you
  *
- * Another advantage of using the asynchronous interface is that you have
- * the ability to cancel transfers which have not yet completed. This is
- * done by calling the libusb_cancel_transfer() function.
+ * Although the events lock is a critical part of the solution, it is not
+ * enough on it's own. You might wonder if the following is sufficient...
+\code
+	libusb_lock_events(ctx);
+	while (!completed) {
+		poll(libusb file descriptors, 120*1000);
+		if (poll indicates activity)
+			libusb_handle_events_timeout(ctx, &zero_tv);
+	}
+	libusb_unlock_events(ctx);
+\endcode
+ * ...and the answer is that it is not. This is because the transfer in the
+ * code shown above may take a long time (say 30 seconds) to complete, and
+ * the lock is not released until the transfer is completed.
  *
- * libusb_cancel_transfer() is asynchronous/non-blocking in itself. When the
- * cancellation actually completes, the transfer's callback function will
- * be invoked, and the callback function should check the transfer status to
- * determine that it was cancelled.
+ * Another thread with similar code that wants to do event handling may be
+ * working with a transfer that completes after a few milliseconds. Despite
+ * having such a quick completion time, the other thread cannot check that
+ * status of its transfer until the code above has finished (30 seconds later)
+ * due to contention on the lock.
  *
- * Freeing the transfer after it has been cancelled but before cancellation
- * has completed will result in undefined behaviour.
+ * To solve this, libusb offers you a mechanism to determine when another
+ * thread is handling events. It also offers a mechanism to block your thread
+ * until the event handling thread has completed an event (and this mechanism
+ * does not involve polling of file descriptors).
  *
- * When a transfer is cancelled, some of the data may have been transferred.
- * libusb will communicate this to you in the transfer callback. Do not assume
- * that no data was transferred.
+ * After determining that another thread is currently handling events, you
+ * obtain the <em>event waiters</em> lock using libusb_lock_event_waiters().
+ * You then re-check that some other thread is still handling events, and if
+ * so, you call libusb_wait_for_event().
  *
- * \section bulk_overflows Overflows on device-to-host bulk/interrupt endpoints
+ * libusb_wait_for_event() puts your application to sleep until an event
+ * occurs, or until a thread releases the events lock. When either of these
+ * things happen, your thread is woken up, and should re-check the condition
+ * it was waiting on. It should also re-check that another thread is handling
+ * events, and if not, it should start handling events itself.
  *
- * If your device does not have predictable transfer sizes (or it misbehaves),
- * your application may submit a request for data on an IN endpoint which is
- * smaller than the data that the device wishes to send. In some circumstances
- * this will cause an overflow, which is a nasty condition to deal with. See
- * the \ref libusb_packetoverflow page for discussion.
+ * This looks like the following, as pseudo-code:
+\code
+retry:
+if (libusb_try_lock_events(ctx) == 0) {
+	// we obtained the event lock: do our own event handling
+	while (!completed) {
+		if (!libusb_event_handling_ok(ctx)) {
+			libusb_unlock_events(ctx);
+			goto retry;
+		}
+		poll(libusb file descriptors, 120*1000);
+		if (poll indicates activity)
+			libusb_handle_events_locked(ctx, 0);
+	}
+	libusb_unlock_events(ctx);
+} else {
+	// another thread is doing event handling. wait for it to signal us that
+	// an event has completed
+	libusb_lock_event_waiters(ctx);
+
+	while (!completed) {
+		// now that we have the event waiters lock, double check that another
+		// thread is still handling events for us. (it may have ceased handling
+		// events in the time it took us to reach this point)
+		if (!libusb_event_handler_active(ctx)) {
+			// whoever was handling events is no longer doing so, try again
+			libusb_unlock_event_waiters(ctx);
+			goto retry;
+		}
+
+		libusb_wait_for_event(ctx, NULL);
+	}
+	libusb_unlock_event_waiters(ctx);
+}
+printf("completed!\n");
+\endcode
  *
- * \section asyncctrl Considerations for control transfers
+ * A naive look at the above code may suggest that this can only support
+ * one event waiter (hence a total of 2 competing threads, the other doing
+ * event handling), because the event waiter seems to have taken the event
+ * waiters lock while waiting for an event. However, the system does support
+ * multiple event waiters, because libusb_wait_for_event() actually drops
+ * the lock while waiting, and reaquires it before continuing.
  *
- * The <tt>libusb_transfer</tt> structure is generic and hence does not
- * include specific fields for the control-specific setup packet structure.
+ * We have now implemented code which can dynamically handle situations where
+ * nobody is handling events (so we should do it ourselves), and it can also
+ * handle situations where another thread is doing event handling (so we can
+ * piggyback onto them). It is also equipped to handle a combination of
+ * the two, for example, another thread is doing event handling, but for
+ * whatever reason it stops doing so before our condition is met, so we take
+ * over the event handling.
  *
- * In order to perform a control transfer, you must place the 8-byte setup
- * packet at the start of the data buffer. To simplify this, you could
- * cast the buffer pointer to type struct libusb_control_setup, or you can
- * use the helper function libusb_fill_control_setup().
+ * Four functions were introduced in the above pseudo-code. Their importance
+ * should be apparent from the code shown above.
+ * -# libusb_try_lock_events() is a non-blocking function which attempts
+ *    to acquire the events lock but returns a failure code if it is contended.
+ * -# libusb_event_handling_ok() checks that libusb is still happy for your
+ *    thread to be performing event handling. Sometimes, libusb needs to
+ *    interrupt the event handler, and this is how you can check if you have
+ *    been interrupted. If this function returns 0, the correct behaviour is
+ *    for you to give up the event handling lock, and then to repeat the cycle.
+ *    The following libusb_try_lock_events() will fail, so you will become an
+ *    events waiter. For more information on this, read \ref fullstory below.
+ * -# libusb_handle_events_locked() is a variant of
+ *    libusb_handle_events_timeout() that you can call while holding the
+ *    events lock. libusb_handle_events_timeout() itself implements similar
+ *    logic to the above, so be sure not to call it when you are
+ *    "working behind libusb's back", as is the case here.
+ * -# libusb_event_handler_active() determines if someone is currently
+ *    holding the events lock
  *
- * The wLength field placed in the setup packet must be the length you would
- * expect to be sent in the setup packet: the length of the payload that
- * follows (or the expected maximum number of bytes to receive). However,
- * the length field of the libusb_transfer object must be the length of
- * the data buffer - i.e. it should be wLength <em>plus</em> the size of
- * the setup packet (LIBUSB_CONTROL_SETUP_SIZE).
+ * You might be wondering why there is no function to wake up all threads
+ * blocked on libusb_wait_for_event(). This is because libusb can do this
+ * internally: it will wake up all such threads when someone calls
+ * libusb_unlock_events() or when a transfer completes (at the point after its
+ * callback has returned).
  *
- * If you use the helper functions, this is simplified for you:
- * -# Allocate a buffer of size LIBUSB_CONTROL_SETUP_SIZE plus the size of the
- * data you are sending/requesting.
- * -# Call libusb_fill_control_setup() on the data buffer, using the transfer
- * request size as the wLength value (i.e. do not include the extra space you
- * allocated for the control setup).
- * -# If this is a host-to-device transfer, place the data to be transferred
- * in the data buffer, starting at offset LIBUSB_CONTROL_SETUP_SIZE.
- * -# Call libusb_fill_control_transfer() to associate the data buffer with
- * the transfer (and to set the remaining details such as callback and timeout).
- *   - Note that there is no parameter to set the length field of the transfer.
- *     The length is automatically inferred from the wLength field of the setup
- *     packet.
- * -# Submit the transfer.
+ * \subsection fullstory The full story
  *
- * The multi-byte control setup fields (wValue, wIndex and wLength) must
- * be given in little-endian byte order (the endianness of the USB bus).
- * Endianness conversion is transparently handled by
- * libusb_fill_control_setup() which is documented to accept host-endian
- * values.
+ * The above explanation should be enough to get you going, but if you're
+ * really thinking through the issues then you may be left with some more
+ * questions regarding libusb's internals. If you're curious, read on, and if
+ * not, skip to the next section to avoid confusing yourself!
  *
- * Further considerations are needed when handling transfer completion in
- * your callback function:
- * - As you might expect, the setup packet will still be sitting at the start
- * of the data buffer.
- * - If this was a device-to-host transfer, the received data will be sitting
- * at offset LIBUSB_CONTROL_SETUP_SIZE into the buffer.
- * - The actual_length field of the transfer structure is relative to the
- * wLength of the setup packet, rather than the size of the data buffer. So,
- * if your wLength was 4, your transfer's <tt>length</tt> was 12, then you
- * should expect an <tt>actual_length</tt> of 4 to indicate that the data was
- * transferred in entirity.
+ * The immediate question that may spring to mind is: what if one thread
+ * modifies the set of file descriptors that need to be polled while another
+ * thread is doing event handling?
  *
- * To simplify parsing of setup packets and obtaining the data from the
- * correct offset, you may wish to use the libusb_control_transfer_get_data()
- * and libusb_control_transfer_get_setup() functions within your transfer
- * callback.
+ * There are 2 situations in which this may happen.
+ * -# libusb_open() will add another file descriptor to the poll set,
+ *    therefore it is desirable to interrupt the event handler so that it
+ *    restarts, picking up the new descriptor.
+ * -# libusb_close() will remove a file descriptor from the poll set. There
+ *    are all kinds of race conditions that could arise here, so it is
+ *    important that nobody is doing event handling at this time.
  *
- * Even though control endpoints do not halt, a completed control transfer
- * may have a LIBUSB_TRANSFER_STALL status code. This indicates the control
- * request was not supported.
+ * libusb handles these issues internally, so application developers do not
+ * have to stop their event handlers while opening/closing devices. Here's how
+ * it works, focusing on the libusb_close() situation first:
  *
- * \section asyncintr Considerations for interrupt transfers
+ * -# During initialization, libusb opens an internal pipe, and it adds the read
+ *    end of this pipe to the set of file descriptors to be polled.
+ * -# During libusb_close(), libusb writes some dummy data on this event pipe.
+ *    This immediately interrupts the event handler. libusb also records
+ *    internally that it is trying to interrupt event handlers for this
+ *    high-priority event.
+ * -# At this point, some of the functions described above start behaving
+ *    differently:
+ *   - libusb_event_handling_ok() starts returning 1, indicating that it is NOT
+ *     OK for event handling to continue.
+ *   - libusb_try_lock_events() starts returning 1, indicating that another
+ *     thread holds the event handling lock, even if the lock is uncontended.
+ *   - libusb_event_handler_active() starts returning 1, indicating that
+ *     another thread is doing event handling, even if that is not true.
+ * -# The above changes in behaviour result in the event handler stopping and
+ *    giving up the events lock very quickly, giving the high-priority
+ *    libusb_close() operation a "free ride" to acquire the events lock. All
+ *    threads that are competing to do event handling become event waiters.
+ * -# With the events lock held inside libusb_close(), libusb can safely remove
+ *    a file descriptor from the poll set, in the safety of knowledge that
+ *    nobody is polling those descriptors or trying to access the poll set.
+ * -# After obtaining the events lock, the close operation completes very
+ *    quickly (usually a matter of milliseconds) and then immediately releases
+ *    the events lock.
+ * -# At the same time, the behaviour of libusb_event_handling_ok() and friends
+ *    reverts to the original, documented behaviour.
+ * -# The release of the events lock causes the threads that are waiting for
+ *    events to be woken up and to start competing to become event handlers
+ *    again. One of them will succeed; it will then re-obtain the list of poll
+ *    descriptors, and USB I/O will then continue as normal.
  *
- * All interrupt transfers are performed using the polling interval presented
- * by the bInterval value of the endpoint descriptor.
+ * libusb_open() is similar, and is actually a more simplistic case. Upon a
+ * call to libusb_open():
  *
- * \section asynciso Considerations for isochronous transfers
+ * -# The device is opened and a file descriptor is added to the poll set.
+ * -# libusb sends some dummy data on the event pipe, and records that it
+ *    is trying to modify the poll descriptor set.
+ * -# The event handler is interrupted, and the same behaviour change as for
+ *    libusb_close() takes effect, causing all event handling threads to become
+ *    event waiters.
+ * -# The libusb_open() implementation takes its free ride to the events lock.
+ * -# Happy that it has successfully paused the events handler, libusb_open()
+ *    releases the events lock.
+ * -# The event waiter threads are all woken up and compete to become event
+ *    handlers again. The one that succeeds will obtain the list of poll
+ *    descriptors again, which will include the addition of the new device.
  *
- * Isochronous transfers are more complicated than transfers to
- * non-isochronous endpoints.
+ * \subsection concl Closing remarks
  *
- * To perform I/O to an isochronous endpoint, allocate the transfer by calling
- * libusb_alloc_transfer() with an appropriate number of isochronous packets.
+ * The above may seem a little complicated, but hopefully I have made it clear
+ * why such complications are necessary. Also, do not forget that this only
+ * applies to applications that take libusb's file descriptors and integrate
+ * them into their own polling loops.
  *
- * During filling, set \ref libusb_transfer::type "type" to
- * \ref libusb_transfer_type::LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
- * "LIBUSB_TRANSFER_TYPE_ISOCHRONOUS", and set
- * \ref libusb_transfer::num_iso_packets "num_iso_packets" to a value less than
- * or equal to the number of packets you requested during allocation.
- * libusb_alloc_transfer() does not set either of these fields for you, given
- * that you might not even use the transfer on an isochronous endpoint.
+ * You may decide that it is OK for your multi-threaded application to ignore
+ * some of the rules and locks detailed above, because you don't think that
+ * two threads can ever be polling the descriptors at the same time. If that
+ * is the case, then that's good news for you because you don't have to worry.
+ * But be careful here; remember that the synchronous I/O functions do event
+ * handling internally. If you have one thread doing event handling in a loop
+ * (without implementing the rules and locking semantics documented above)
+ * and another trying to send a synchronous USB transfer, you will end up with
+ * two threads monitoring the same descriptors, and the above-described
+ * undesirable behaviour occurring. The solution is for your polling thread to
+ * play by the rules; the synchronous I/O functions do so, and this will result
+ * in them getting along in perfect harmony.
  *
- * Next, populate the length field for the first num_iso_packets entries in
- * the \ref libusb_transfer::iso_packet_desc "iso_packet_desc" array. Section
- * 5.6.3 of the USB2 specifications describe how the maximum isochronous
- * packet length is determined by the wMaxPacketSize field in the endpoint
- * descriptor.
- * Two functions can help you here:
+ * If you do have a dedicated thread doing event handling, it is perfectly
+ * legal for it to take the event handling lock for long periods of time. Any
+ * synchronous I/O functions you call from other threads will transparently
+ * fall back to the "event waiters" mechanism detailed above. The only
+ * consideration that your event handling thread must apply is the one related
+ * to libusb_event_handling_ok(): you must call this before every poll(), and
+ * give up the events lock if instructed.
+ */
+
+/* Close the internal event pipe, and the epoll instance watching it. */
+static void usbi_close_event_pipe(struct libusb_context *ctx)
+{
+#ifdef USBI_EPOLL_AVAILABLE
+	usbi_close(ctx->event_pipe[0]);
+	usbi_close(ctx->epoll_fd);
+#else
+	usbi_close(ctx->event_pipe[0]);
+	usbi_close(ctx->event_pipe[1]);
+#endif
+}
+
+int usbi_io_init(struct libusb_context *ctx)
+{
+	int r;
+
+	usbi_mutex_init(&ctx->flying_transfers_lock);
+	usbi_mutex_init(&ctx->events_lock);
+	usbi_mutex_init(&ctx->event_waiters_lock);
+	usbi_cond_init(&ctx->event_waiters_cond);
+	usbi_mutex_init(&ctx->event_data_lock);
+	usbi_tls_key_create(&ctx->event_handling_key);
+	list_init(&ctx->flying_transfers);
+	ctx->timeout_heap = NULL;
+	ctx->timeout_heap_len = ctx->timeout_heap_size = 0;
+	list_init(&ctx->ipollfds);
+	list_init(&ctx->hotplug_msgs);
+	list_init(&ctx->hotplug_batch);
+	list_init(&ctx->completed_transfers);
+
+#ifdef USBI_EPOLL_AVAILABLE
+	ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctx->epoll_fd < 0) {
+		usbi_err(ctx, "failed to create epoll instance, errno=%d", errno);
+		r = LIBUSB_ERROR_OTHER;
+		goto err;
+	}
+
+	r = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r < 0) {
+		usbi_err(ctx, "failed to create eventfd, errno=%d", errno);
+		close(ctx->epoll_fd);
+		r = LIBUSB_ERROR_OTHER;
+		goto err;
+	}
+	ctx->event_pipe[0] = ctx->event_pipe[1] = r;
+#else
+	/* FIXME should use an eventfd on kernels that support it */
+	r = usbi_pipe(ctx->event_pipe);
+	if (r < 0) {
+		r = LIBUSB_ERROR_OTHER;
+		goto err;
+	}
+#endif
+
+	r = usbi_add_pollfd(ctx, ctx->event_pipe[0], POLLIN);
+	if (r < 0)
+		goto err_close_pipe;
+
+#ifdef USBI_TIMERFD_AVAILABLE
+	ctx->timerfd = timerfd_create(usbi_backend->get_timerfd_clockid(),
+		TFD_NONBLOCK);
+	if (ctx->timerfd >= 0) {
+		usbi_dbg("using timerfd for timeouts");
+		r = usbi_add_pollfd(ctx, ctx->timerfd, POLLIN);
+		if (r < 0)
+			goto err_close_timerfd;
+	} else {
+		usbi_dbg("timerfd not available (code %d error %d)", ctx->timerfd, errno);
+		ctx->timerfd = -1;
+	}
+#endif
+
+	return 0;
+
+#ifdef USBI_TIMERFD_AVAILABLE
+err_close_timerfd:
+	close(ctx->timerfd);
+	usbi_remove_pollfd(ctx, ctx->event_pipe[0]);
+#endif
+err_close_pipe:
+	usbi_close_event_pipe(ctx);
+err:
+	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+	usbi_mutex_destroy(&ctx->events_lock);
+	usbi_mutex_destroy(&ctx->event_waiters_lock);
+	usbi_cond_destroy(&ctx->event_waiters_cond);
+	usbi_mutex_destroy(&ctx->event_data_lock);
+	usbi_tls_key_delete(ctx->event_handling_key);
+	return r;
+}
+
+void usbi_io_exit(struct libusb_context *ctx)
+{
+	usbi_remove_pollfd(ctx, ctx->event_pipe[0]);
+#ifdef USBI_TIMERFD_AVAILABLE
+	if (usbi_using_timerfd(ctx)) {
+		usbi_remove_pollfd(ctx, ctx->timerfd);
+		close(ctx->timerfd);
+	}
+#endif
+	usbi_close_event_pipe(ctx);
+	free(ctx->timeout_heap);
+	ctx->timeout_heap = NULL;
+	free(ctx->trace);
+	ctx->trace = NULL;
+	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+	usbi_mutex_destroy(&ctx->events_lock);
+	usbi_mutex_destroy(&ctx->event_waiters_lock);
+	usbi_cond_destroy(&ctx->event_waiters_cond);
+	usbi_mutex_destroy(&ctx->event_data_lock);
+	usbi_tls_key_delete(ctx->event_handling_key);
+	if (ctx->pollfds)
+		free(ctx->pollfds);
+}
+
+static int calculate_timeout(struct usbi_transfer *transfer)
+{
+	int r;
+	struct timespec current_time;
+	unsigned int timeout =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout;
+
+	if (!timeout)
+		return 0;
+
+	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &current_time);
+	if (r < 0) {
+		usbi_err(ITRANSFER_CTX(transfer),
+			"failed to read monotonic clock, errno=%d", errno);
+		return r;
+	}
+
+	current_time.tv_sec += timeout / 1000;
+	current_time.tv_nsec += (timeout % 1000) * 1000000;
+
+	while (current_time.tv_nsec >= 1000000000) {
+		current_time.tv_nsec -= 1000000000;
+		current_time.tv_sec++;
+	}
+
+	TIMESPEC_TO_TIMEVAL(&transfer->timeout, &current_time);
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Allocate a libusb transfer with a specified number of isochronous packet
+ * descriptors. The returned transfer is pre-initialized for you. When the new
+ * transfer is no longer needed, it should be freed with
+ * libusb_free_transfer().
  *
- * - libusb_get_max_iso_packet_size() is an easy way to determine the max
- *   packet size for an isochronous endpoint. Note that the maximum packet
- *   size is actually the maximum number of bytes that can be transmitted in
- *   a single microframe, therefore this function multiplies the maximum number
- *   of bytes per transaction by the number of transaction opportunities per
- *   microframe.
- * - libusb_set_iso_packet_lengths() assigns the same length to all packets
- *   within a transfer, which is usually what you want.
+ * Transfers intended for non-isochronous endpoints (e.g. control, bulk,
+ * interrupt) should specify an iso_packets count of zero.
  *
- * For outgoing transfers, you'll obviously fill the buffer and populate the
- * packet descriptors in hope that all the data gets transferred. For incoming
- * transfers, you must ensure the buffer has sufficient capacity for
- * the situation where all packets transfer the full amount of requested data.
+ * For transfers intended for isochronous endpoints, specify an appropriate
+ * number of packet descriptors to be allocated as part of the transfer.
+ * The returned transfer is not specially initialized for isochronous I/O;
+ * you are still required to set the
+ * \ref libusb_transfer::num_iso_packets "num_iso_packets" and
+ * \ref libusb_transfer::type "type" fields accordingly.
  *
- * Completion handling requires some extra consideration. The
- * \ref libusb_transfer::actual_length "actual_length" field of the transfer
- * is meaningless and should not be examined; instead you must refer to the
- * \ref libusb_iso_packet_descriptor::actual_length "actual_length" field of
- * each individual packet.
+ * It is safe to allocate a transfer with some isochronous packets and then
+ * use it on a non-isochronous endpoint. If you do this, ensure that at time
+ * of submission, num_iso_packets is 0 and that type is set appropriately.
  *
- * The \ref libusb_transfer::status "status" field of the transfer is also a
- * little misleading:
- *  - If the packets were submitted and the isochronous data microframes
- *    completed normally, status will have value
- *    \ref libusb_transfer_status::LIBUSB_TRANSFER_COMPLETED
- *    "LIBUSB_TRANSFER_COMPLETED". Note that bus errors and software-incurred
- *    delays are not counted as transfer errors; the transfer.status field may
- *    indicate COMPLETED even if some or all of the packets failed. Refer to
- *    the \ref libusb_iso_packet_descriptor::status "status" field of each
- *    individual packet to determine packet failures.
- *  - The status field will have value
- *    \ref libusb_transfer_status::LIBUSB_TRANSFER_ERROR
- *    "LIBUSB_TRANSFER_ERROR" only when serious errors were encountered.
- *  - Other transfer status codes occur with normal behaviour.
+ * \param iso_packets number of isochronous packet descriptors to allocate
+ * \returns a newly allocated transfer, or NULL on error
+ */
+DEFAULT_VISIBILITY
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
+	int iso_packets)
+{
+	struct libusb_transfer *transfer;
+	size_t os_alloc_size = usbi_backend->transfer_priv_size;
+	size_t alloc_size = sizeof(struct usbi_transfer)
+		+ sizeof(struct libusb_transfer)
+		+ (sizeof(struct libusb_iso_packet_descriptor) * iso_packets)
+		+ os_alloc_size;
+	struct usbi_transfer *itransfer = calloc(1, alloc_size);
+	if (!itransfer)
+		return NULL;
+
+	itransfer->num_iso_packets = iso_packets;
+	itransfer->timeout_pos = -1;
+	usbi_mutex_init(&itransfer->lock);
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	usbi_dbg("transfer %p", transfer);
+	return transfer;
+}
+
+/** \ingroup libusb_asyncio
+ * Free a transfer structure. This should be called for all transfers
+ * allocated with libusb_alloc_transfer().
  *
- * The data for each packet will be found at an offset into the buffer that
- * can be calculated as if each prior packet completed in full. The
- * libusb_get_iso_packet_buffer() and libusb_get_iso_packet_buffer_simple()
- * functions may help you here.
+ * If the \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
+ * "LIBUSB_TRANSFER_FREE_BUFFER" flag is set and the transfer buffer is
+ * non-NULL, this function will also free the transfer buffer using the
+ * standard system memory allocator (e.g. free()).
  *
- * <b>Note</b>: Some operating systems (e.g. Linux) may impose limits on the
- * length of individual isochronous packets and/or the total length of the
- * isochronous transfer. Such limits can be difficult for libusb to detect,
- * so the library will simply try and submit the transfer as set up by you.
- * If the transfer fails to submit because it is too large,
- * libusb_submit_transfer() will return
- * \ref libusb_error::LIBUSB_ERROR_INVALID_PARAM "LIBUSB_ERROR_INVALID_PARAM".
+ * It is legal to call this function with a NULL transfer. In this case,
+ * the function will simply return safely.
  *
- * \section asyncmem Memory caveats
+ * It is not legal to free an active transfer (one which has been submitted
+ * and has not yet completed).
  *
- * In most circumstances, it is not safe to use stack memory for transfer
- * buffers. This is because the function that fired off the asynchronous
- * transfer may return before libusb has finished using the buffer, and when
- * the function returns it's stack gets destroyed. This is true for both
- * host-to-device and device-to-host transfers.
+ * \param transfer the transfer to free
+ */
+void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer;
+	if (!transfer)
+		return;
+
+	usbi_dbg("transfer %p", transfer);
+	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER && transfer->buffer)
+		free(transfer->buffer);
+
+	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	usbi_mutex_destroy(&itransfer->lock);
+	free(itransfer);
+}
+
+/* the timeout heap: a binary min-heap over the flying transfers that have a
+ * finite timeout, keyed on their expiration time. each transfer remembers
+ * its own position so it can be removed in O(log n) when it completes.
+ * all of these must be called with the flying_transfers_lock held. */
+static void timeout_heap_place(struct libusb_context *ctx,
+	struct usbi_transfer *transfer, unsigned int pos)
+{
+	ctx->timeout_heap[pos] = transfer;
+	transfer->timeout_pos = (int)pos;
+}
+
+static void timeout_heap_sift_up(struct libusb_context *ctx, unsigned int pos)
+{
+	struct usbi_transfer *transfer = ctx->timeout_heap[pos];
+
+	while (pos > 0) {
+		unsigned int parent = (pos - 1) / 2;
+
+		if (!timercmp(&transfer->timeout, &ctx->timeout_heap[parent]->timeout, <))
+			break;
+		timeout_heap_place(ctx, ctx->timeout_heap[parent], pos);
+		pos = parent;
+	}
+	timeout_heap_place(ctx, transfer, pos);
+}
+
+static void timeout_heap_sift_down(struct libusb_context *ctx, unsigned int pos)
+{
+	struct usbi_transfer *transfer = ctx->timeout_heap[pos];
+	unsigned int len = ctx->timeout_heap_len;
+
+	while (2 * pos + 1 < len) {
+		unsigned int child = 2 * pos + 1;
+
+		if (child + 1 < len && timercmp(&ctx->timeout_heap[child + 1]->timeout,
+				&ctx->timeout_heap[child]->timeout, <))
+			child++;
+		if (!timercmp(&ctx->timeout_heap[child]->timeout, &transfer->timeout, <))
+			break;
+		timeout_heap_place(ctx, ctx->timeout_heap[child], pos);
+		pos = child;
+	}
+	timeout_heap_place(ctx, transfer, pos);
+}
+
+static int timeout_heap_insert(struct libusb_context *ctx,
+	struct usbi_transfer *transfer)
+{
+	if (ctx->timeout_heap_len == ctx->timeout_heap_size) {
+		unsigned int size = ctx->timeout_heap_size ? 2 * ctx->timeout_heap_size : 16;
+		struct usbi_transfer **heap = realloc(ctx->timeout_heap,
+			size * sizeof(*heap));
+
+		if (!heap)
+			return LIBUSB_ERROR_NO_MEM;
+		ctx->timeout_heap = heap;
+		ctx->timeout_heap_size = size;
+	}
+
+	ctx->timeout_heap[ctx->timeout_heap_len++] = transfer;
+	timeout_heap_sift_up(ctx, ctx->timeout_heap_len - 1);
+	return 0;
+}
+
+void usbi_timeout_heap_remove(struct libusb_context *ctx,
+	struct usbi_transfer *transfer)
+{
+	struct usbi_transfer *last;
+	unsigned int pos;
+
+	if (transfer->timeout_pos < 0)
+		return;
+
+	pos = (unsigned int)transfer->timeout_pos;
+	transfer->timeout_pos = -1;
+	last = ctx->timeout_heap[--ctx->timeout_heap_len];
+	if (last == transfer)
+		return;
+
+	/* move the last entry into the hole and restore the heap order */
+	timeout_heap_place(ctx, last, pos);
+	if (pos > 0 && timercmp(&last->timeout,
+			&ctx->timeout_heap[(pos - 1) / 2]->timeout, <))
+		timeout_heap_sift_up(ctx, pos);
+	else
+		timeout_heap_sift_down(ctx, pos);
+}
+
+/* returns the flying transfer with the earliest timeout that still has to
+ * be handled by us, or NULL if there is none. transfers whose timeout was
+ * already handled, or is handled by the OS, are dropped from the heap. */
+static struct usbi_transfer *next_timeout_transfer(struct libusb_context *ctx)
+{
+	while (ctx->timeout_heap_len) {
+		struct usbi_transfer *transfer = ctx->timeout_heap[0];
+
+		if (!(transfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT)))
+			return transfer;
+		usbi_timeout_heap_remove(ctx, transfer);
+	}
+	return NULL;
+}
+
+#ifdef USBI_TIMERFD_AVAILABLE
+static int disarm_timerfd(struct libusb_context *ctx)
+{
+	const struct itimerspec disarm_timer = { { 0, 0 }, { 0, 0 } };
+	int r;
+
+	usbi_dbg("");
+	r = timerfd_settime(ctx->timerfd, 0, &disarm_timer, NULL);
+	if (r < 0)
+		return LIBUSB_ERROR_OTHER;
+	else
+		return 0;
+}
+
+/* rearms the timerfd based on the next upcoming timeout, taken from the
+ * top of the timeout heap.
+ * must be called with flying_list locked.
+ * returns 0 on success or a LIBUSB_ERROR code on failure.
+ */
+static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+{
+	struct usbi_transfer *transfer = next_timeout_transfer(ctx);
+	struct itimerspec it = { {0, 0}, {0, 0} };
+	int r;
+
+	/* no transfers with a timeout left to handle, nothing to arm */
+	if (!transfer)
+		return disarm_timerfd(ctx);
+
+	it.it_value.tv_sec = transfer->timeout.tv_sec;
+	it.it_value.tv_nsec = transfer->timeout.tv_usec * 1000;
+	usbi_dbg("next timeout originally %dms", USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
+	r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
+	if (r < 0)
+		return LIBUSB_ERROR_OTHER;
+	return 0;
+}
+#else
+static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+{
+	UNUSED(ctx);
+	return 0;
+}
+#endif
+
+/* add a transfer to the active transfers list, and to the timeout heap if
+ * it has a finite timeout.
+ * This function will return non 0 if fails to update the timer,
+ * in which case the transfer is *not* on the flying_transfers list. */
+static int add_to_flying_list(struct usbi_transfer *transfer)
+{
+	struct timeval *timeout = &transfer->timeout;
+	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+	int r;
+	int first = 0;
+
+	r = calculate_timeout(transfer);
+	if (r)
+		return r;
+
+	transfer->timeout_pos = -1;
+	if (timerisset(timeout)) {
+		r = timeout_heap_insert(ctx, transfer);
+		if (r)
+			return r;
+		first = (transfer->timeout_pos == 0);
+	}
+	list_add_tail(&transfer->list, &ctx->flying_transfers);
+
+#ifdef USBI_TIMERFD_AVAILABLE
+	if (first && usbi_using_timerfd(ctx)) {
+		/* if this transfer has the lowest timeout of all active transfers,
+		 * rearm the timerfd with this transfer's timeout */
+		const struct itimerspec it = { {0, 0},
+			{ timeout->tv_sec, timeout->tv_usec * 1000 } };
+		usbi_dbg("arm timerfd for timeout in %dms (first in line)",
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
+		r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
+		if (r < 0) {
+			usbi_warn(ctx, "failed to arm first timerfd (errno %d)", errno);
+			r = LIBUSB_ERROR_OTHER;
+		}
+	}
+#else
+	UNUSED(first);
+#endif
+
+	if (r) {
+		list_del(&transfer->list);
+		usbi_timeout_heap_remove(ctx, transfer);
+	}
+
+	return r;
+}
+
+/* remove a transfer from the active transfers list.
+ * This function will *always* remove the transfer from the
+ * flying_transfers list. It will return a LIBUSB_ERROR code
+ * if it fails to update the timer for the next timeout. */
+static int remove_from_flying_list(struct usbi_transfer *transfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+	int rearm_timerfd;
+	int r = 0;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	rearm_timerfd = (transfer->timeout_pos == 0);
+	list_del(&transfer->list);
+	usbi_timeout_heap_remove(ctx, transfer);
+	if (usbi_using_timerfd(ctx) && rearm_timerfd)
+		r = arm_timerfd_for_next_timeout(ctx);
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Submit a transfer. This function will fire off the USB transfer and then
+ * return immediately.
  *
- * The only case in which it is safe to use stack memory is where you can
- * guarantee that the function owning the stack space for the buffer does not
- * return until after the transfer's callback function has completed. In every
- * other case, you need to use heap memory instead.
+ * \param transfer the transfer to submit
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
+ * by the operating system.
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer size is larger than
+ * the operating system and/or hardware can support
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
+	int r;
+
+	usbi_dbg("transfer %p", transfer);
+
+	/*
+	 * Important note on locking, this function takes / releases locks
+	 * in the following order:
+	 *  take flying_transfers_lock
+	 *  take itransfer->lock
+	 *  clear transfer
+	 *  add to flying_transfers list
+	 *  release flying_transfers_lock
+	 *  submit transfer
+	 *  release itransfer->lock
+	 *  if submit failed:
+	 *   take flying_transfers_lock
+	 *   remove from flying_transfers list
+	 *   release flying_transfers_lock
+	 *
+	 * Note that it takes locks in the order a-b and then releases them
+	 * in the same order a-b. This is somewhat unusual but not wrong,
+	 * release order is not important as long as *all* locks are released
+	 * before re-acquiring any locks.
+	 *
+	 * This means that the ordering of first releasing itransfer->lock
+	 * and then re-acquiring the flying_transfers_list on error is
+	 * important and must not be changed!
+	 *
+	 * This is done this way because when we take both locks we must always
+	 * take flying_transfers_lock first to avoid ab-ba style deadlocks with
+	 * the timeout handling and usbi_handle_disconnect paths.
+	 *
+	 * And we cannot release itransfer->lock before the submission is
+	 * complete otherwise timeout handling for transfers with short
+	 * timeouts may run before submission.
+	 */
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&itransfer->lock);
+	if (itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT) {
+		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		usbi_mutex_unlock(&itransfer->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+	itransfer->transferred = 0;
+	itransfer->state_flags = 0;
+	itransfer->timeout_flags = 0;
+	r = add_to_flying_list(itransfer);
+	if (r) {
+		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		usbi_mutex_unlock(&itransfer->lock);
+		return r;
+	}
+	/*
+	 * We must release the flying transfers lock here, because with
+	 * some backends the submit_transfer method is synchroneous.
+	 */
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	r = usbi_backend->submit_transfer(itransfer);
+	usbi_trace(itransfer, LIBUSB_TRACE_SUBMIT, r, transfer->length);
+	if (r == LIBUSB_SUCCESS) {
+		itransfer->state_flags |= USBI_TRANSFER_IN_FLIGHT;
+		/* keep a reference to this device */
+		libusb_ref_device(transfer->dev_handle->dev);
+	}
+	usbi_mutex_unlock(&itransfer->lock);
+
+	if (r != LIBUSB_SUCCESS)
+		remove_from_flying_list(itransfer);
+
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Asynchronously cancel a previously submitted transfer.
+ * This function returns immediately, but this does not indicate cancellation
+ * is complete. Your callback function will be invoked at some later time
+ * with a transfer status of
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED."
  *
- * \section asyncflags Fine control
+ * \param transfer the transfer to cancel
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the transfer is not in progress,
+ * already complete, or already cancelled.
+ * \returns a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int r;
+
+	usbi_dbg("transfer %p", transfer );
+	usbi_mutex_lock(&itransfer->lock);
+	if (!(itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT)
+			|| (itransfer->state_flags & USBI_TRANSFER_CANCELLING)) {
+		r = LIBUSB_ERROR_NOT_FOUND;
+		goto out;
+	}
+	r = usbi_backend->cancel_transfer(itransfer);
+	if (r < 0) {
+		if (r != LIBUSB_ERROR_NOT_FOUND &&
+		    r != LIBUSB_ERROR_NO_DEVICE)
+			usbi_err(TRANSFER_CTX(transfer),
+				"cancel transfer failed error %d", r);
+		else
+			usbi_dbg("cancel transfer failed error %d", r);
+
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			itransfer->state_flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
+	}
+
+	itransfer->state_flags |= USBI_TRANSFER_CANCELLING;
+	usbi_trace(itransfer, LIBUSB_TRACE_CANCEL, r, 0);
+
+out:
+	usbi_mutex_unlock(&itransfer->lock);
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Set a transfers bulk stream id. Note users are advised to use
+ * libusb_fill_bulk_stream_transfer() instead of calling this function
+ * directly.
  *
- * Through using this asynchronous interface, you may find yourself repeating
- * a few simple operations many times. You can apply a bitwise OR of certain
- * flags to a transfer to simplify certain things:
- * - \ref libusb_transfer_flags::LIBUSB_TRANSFER_SHORT_NOT_OK
- *   "LIBUSB_TRANSFER_SHORT_NOT_OK" results in transfers which transferred
- *   less than the requested amount of data being marked with status
- *   \ref libusb_transfer_status::LIBUSB_TRANSFER_ERROR "LIBUSB_TRANSFER_ERROR"
- *   (they would normally be regarded as COMPLETED)
- * - \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
- *   "LIBUSB_TRANSFER_FREE_BUFFER" allows you to ask libusb to free the transfer
- *   buffer when freeing the transfer.
- * - \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
- *   "LIBUSB_TRANSFER_FREE_TRANSFER" causes libusb to automatically free the
- *   transfer after the transfer callback returns.
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
  *
- * \section asyncevent Event handling
+ * \param transfer the transfer to set the stream id for
+ * \param stream_id the stream id to set
+ * \see libusb_alloc_streams()
+ */
+void API_EXPORTED libusb_transfer_set_stream_id(
+	struct libusb_transfer *transfer, uint32_t stream_id)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->stream_id = stream_id;
+}
+
+/** \ingroup libusb_asyncio
+ * Get a transfers bulk stream id.
  *
- * An asynchronous model requires that libusb perform work at various
- * points in time - namely processing the results of previously-submitted
- * transfers and invoking the user-supplied callback function.
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
  *
- * This gives rise to the libusb_handle_events() function which your
- * application must call into when libusb has work do to. This gives libusb
- * the opportunity to reap pending transfers, invoke callbacks, etc.
+ * \param transfer the transfer to get the stream id for
+ * \returns the stream id for the transfer
+ */
+uint32_t API_EXPORTED libusb_transfer_get_stream_id(
+	struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	return itransfer->stream_id;
+}
+
+/* Handle completion of a transfer (completion might be an error condition).
+ * This will invoke the user-supplied callback function, which may end up
+ * freeing the transfer. Therefore you cannot use the transfer structure
+ * after calling this function, and you should free all backend-specific
+ * data before calling it.
+ * Do not call this function with the usbi_transfer lock held. User-specified
+ * callback functions may attempt to directly resubmit the transfer, which
+ * will attempt to take the lock. */
+int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	uint8_t flags;
+	int r;
+
+	r = remove_from_flying_list(itransfer);
+	if (r < 0)
+		usbi_err(ITRANSFER_CTX(itransfer), "failed to set timer for next timeout, errno=%d", errno);
+
+	usbi_mutex_lock(&itransfer->lock);
+	itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
+	usbi_mutex_unlock(&itransfer->lock);
+
+	if (status == LIBUSB_TRANSFER_COMPLETED
+			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
+		int rqlen = transfer->length;
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
+		if (rqlen != itransfer->transferred) {
+			usbi_dbg("interpreting short transfer as error");
+			status = LIBUSB_TRANSFER_ERROR;
+		}
+	}
+
+	flags = transfer->flags;
+	transfer->status = status;
+	transfer->actual_length = itransfer->transferred;
+	usbi_trace(itransfer, LIBUSB_TRACE_COMPLETE, status, itransfer->transferred);
+	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
+	if (transfer->callback)
+		transfer->callback(transfer);
+	/* transfer might have been freed by the above call, do not use from
+	 * this point. */
+	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+	libusb_unref_device(dev_handle->dev);
+	return r;
+}
+
+/* Similar to usbi_handle_transfer_completion() but exclusively for transfers
+ * that were asynchronously cancelled. The same concerns w.r.t. freeing of
+ * transfers exist here.
+ * Do not call this function with the usbi_transfer lock held. User-specified
+ * callback functions may attempt to directly resubmit the transfer, which
+ * will attempt to take the lock. */
+int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+	uint8_t timed_out;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	timed_out = transfer->timeout_flags & USBI_TRANSFER_TIMED_OUT;
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	/* if the URB was cancelled due to timeout, report timeout to the user */
+	if (timed_out) {
+		usbi_dbg("detected timeout cancellation");
+		return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_TIMED_OUT);
+	}
+
+	/* otherwise its a normal async cancel */
+	return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_CANCELLED);
+}
+
+/* Add a completed transfer to the completed_transfers list of the
+ * context and signal the event. The backend's handle_transfer_completion()
+ * function will be called the next time an event handler runs. */
+void usbi_signal_transfer_completion(struct usbi_transfer *transfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+	int pending_events;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	pending_events = usbi_pending_events(ctx);
+	list_add_tail(&transfer->completed_list, &ctx->completed_transfers);
+	if (!pending_events)
+		usbi_signal_event(ctx);
+	usbi_mutex_unlock(&ctx->event_data_lock);
+}
+
+/** \ingroup libusb_poll
+ * Attempt to acquire the event handling lock. This lock is used to ensure that
+ * only one thread is monitoring libusb event sources at any one time.
  *
- * There are 2 different approaches to dealing with libusb_handle_events:
+ * You only need to use this lock if you are developing an application
+ * which calls poll() or select() on libusb's file descriptors directly.
+ * If you stick to libusb's event handling loop functions (e.g.
+ * libusb_handle_events()) then you do not need to be concerned with this
+ * locking.
  *
- * -# Repeatedly call libusb_handle_events() in blocking mode from a dedicated
- *    thread.
- * -# Integrate libusb with your application's main event loop. libusb
- *    exposes a set of file descriptors which allow you to do this.
+ * While holding this lock, you are trusted to actually be handling events.
+ * If you are no longer handling events, you must call libusb_unlock_events()
+ * as soon as possible.
  *
- * The first approach has the big advantage that it will also work on Windows
- * were libusb' poll API for select / poll integration is not available. So
- * if you want to support Windows and use the async API, you must use this
- * approach, see the \ref eventthread "Using an event handling thread" section
- * below for details.
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 if the lock was obtained successfully
+ * \returns 1 if the lock was not obtained (i.e. another thread holds the lock)
+ * \ref libusb_mtasync
+ */
+int API_EXPORTED libusb_try_lock_events(libusb_context *ctx)
+{
+	int r;
+	unsigned int ru;
+	USBI_GET_CONTEXT(ctx);
+
+	/* is someone else waiting to close a device? if so, don't let this thread
+	 * start event handling */
+	usbi_mutex_lock(&ctx->event_data_lock);
+	ru = ctx->device_close;
+	usbi_mutex_unlock(&ctx->event_data_lock);
+	if (ru) {
+		usbi_dbg("someone else is closing a device");
+		return 1;
+	}
+
+	r = usbi_mutex_trylock(&ctx->events_lock);
+	if (r)
+		return 1;
+
+	ctx->event_handler_active = 1;
+	return 0;
+}
+
+/** \ingroup libusb_poll
+ * Acquire the event handling lock, blocking until successful acquisition if
+ * it is contended. This lock is used to ensure that only one thread is
+ * monitoring libusb event sources at any one time.
  *
- * If you prefer a single threaded approach with a single central event loop,
- * see the \ref libusb_poll "polling and timing" section for how to integrate libusb
- * into your application's main event loop.
+ * You only need to use this lock if you are developing an application
+ * which calls poll() or select() on libusb's file descriptors directly.
+ * If you stick to libusb's event handling loop functions (e.g.
+ * libusb_handle_events()) then you do not need to be concerned with this
+ * locking.
  *
- * \section eventthread Using an event handling thread
+ * While holding this lock, you are trusted to actually be handling events.
+ * If you are no longer handling events, you must call libusb_unlock_events()
+ * as soon as possible.
  *
- * Lets begin with stating the obvious: If you're going to use a separate
- * thread for libusb event handling, your callback functions MUST be
- * threadsafe.
+ * \param ctx the context to operate on, or NULL for the default context
+ * \ref libusb_mtasync
+ */
+void API_EXPORTED libusb_lock_events(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->events_lock);
+	ctx->event_handler_active = 1;
+}
+
+/** \ingroup libusb_poll
+ * Release the lock previously acquired with libusb_try_lock_events() or
+ * libusb_lock_events(). Releasing this lock will wake up any threads blocked
+ * on libusb_wait_for_event().
  *
- * Other then that doing event handling from a separate thread, is mostly
- * simple. You can use an event thread function as follows:
-\code
-void *event_thread_func(void *ctx)
+ * \param ctx the context to operate on, or NULL for the default context
+ * \ref libusb_mtasync
+ */
+void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
 {
-    while (event_thread_run)
-        libusb_handle_events(ctx);
+	USBI_GET_CONTEXT(ctx);
+	ctx->event_handler_active = 0;
+	usbi_mutex_unlock(&ctx->events_lock);
 
-    return NULL;
+	/* FIXME: perhaps we should be a bit more efficient by not broadcasting
+	 * the availability of the events lock when we are modifying pollfds
+	 * (check ctx->device_close)? */
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
 }
-\endcode
+
+/** \ingroup libusb_poll
+ * Determine if it is still OK for this thread to be doing event handling.
  *
- * There is one caveat though, stopping this thread requires setting the
- * event_thread_run variable to 0, and after that libusb_handle_events() needs
- * to return control to event_thread_func. But unless some event happens,
- * libusb_handle_events() will not return.
+ * Sometimes, libusb needs to temporarily pause all event handlers, and this
+ * is the function you should use before polling file descriptors to see if
+ * this is the case.
  *
- * There are 2 different ways of dealing with this, depending on if your
- * application uses libusb' \ref libusb_hotplug "hotplug" support or not.
+ * If this function instructs your thread to give up the events lock, you
+ * should just continue the usual logic that is documented in \ref libusb_mtasync.
+ * On the next iteration, your thread will fail to obtain the events lock,
+ * and will hence become an event waiter.
  *
- * Applications which do not use hotplug support, should not start the event
- * thread until after their first call to libusb_open(), and should stop the
- * thread when closing the last open device as follows:
-\code
-void my_close_handle(libusb_device_handle *dev_handle)
+ * This function should be called while the events lock is held: you don't
+ * need to worry about the results of this function if your thread is not
+ * the current event handler.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 1 if event handling can start or continue
+ * \returns 0 if this thread must give up the events lock
+ * \ref fullstory "Multi-threaded I/O: the full story"
+ */
+int API_EXPORTED libusb_event_handling_ok(libusb_context *ctx)
 {
-    if (open_devs == 1)
-        event_thread_run = 0;
-
-    libusb_close(dev_handle); // This wakes up libusb_handle_events()
+	unsigned int r;
+	USBI_GET_CONTEXT(ctx);
 
-    if (open_devs == 1)
-        pthread_join(event_thread);
+	/* is someone else waiting to close a device? if so, don't let this thread
+	 * continue event handling */
+	usbi_mutex_lock(&ctx->event_data_lock);
+	r = ctx->device_close;
+	usbi_mutex_unlock(&ctx->event_data_lock);
+	if (r) {
+		usbi_dbg("someone else is closing a device");
+		return 0;
+	}
 
-    open_devs--;
+	return 1;
 }
-\endcode
+
+
+/** \ingroup libusb_poll
+ * Determine if an active thread is handling events (i.e. if anyone is holding
+ * the event handling lock).
  *
- * Applications using hotplug support should start the thread at program init,
- * after having successfully called libusb_hotplug_register_callback(), and
- * should stop the thread at program exit as follows:
-\code
-void my_libusb_exit(void)
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 1 if a thread is handling events
+ * \returns 0 if there are no threads currently handling events
+ * \ref libusb_mtasync
+ */
+int API_EXPORTED libusb_event_handler_active(libusb_context *ctx)
 {
-    event_thread_run = 0;
-    libusb_hotplug_deregister_callback(ctx, hotplug_cb_handle); // This wakes up libusb_handle_events()
-    pthread_join(event_thread);
-    libusb_exit(ctx);
+	unsigned int r;
+	USBI_GET_CONTEXT(ctx);
+
+	/* is someone else waiting to close a device? if so, don't let this thread
+	 * start event handling -- indicate that event handling is happening */
+	usbi_mutex_lock(&ctx->event_data_lock);
+	r = ctx->device_close;
+	usbi_mutex_unlock(&ctx->event_data_lock);
+	if (r) {
+		usbi_dbg("someone else is closing a device");
+		return 1;
+	}
+
+	return ctx->event_handler_active;
 }
-\endcode
- */
 
-/**
- * @defgroup libusb_poll Polling and timing
- *
- * This page documents libusb's functions for polling events and timing.
- * These functions are only necessary for users of the
- * \ref libusb_asyncio "asynchronous API". If you are only using the simpler
- * \ref libusb_syncio "synchronous API" then you do not need to ever call these
- * functions.
- *
- * The justification for the functionality described here has already been
- * discussed in the \ref asyncevent "event handling" section of the
- * asynchronous API documentation. In summary, libusb does not create internal
- * threads for event processing and hence relies on your application calling
- * into libusb at certain points in time so that pending events can be handled.
- *
- * Your main loop is probably already calling poll() or select() or a
- * variant on a set of file descriptors for other event sources (e.g. keyboard
- * button presses, mouse movements, network sockets, etc). You then add
- * libusb's file descriptors to your poll()/select() calls, and when activity
- * is detected on such descriptors you know it is time to call
- * libusb_handle_events().
- *
- * There is one final event handling complication. libusb supports
- * asynchronous transfers which time out after a specified time period.
- *
- * On some platforms a timerfd is used, so the timeout handling is just another
- * fd, on other platforms this requires that libusb is called into at or after
- * the timeout to handle it. So, in addition to considering libusb's file
- * descriptors in your main event loop, you must also consider that libusb
- * sometimes needs to be called into at fixed points in time even when there
- * is no file descriptor activity, see \ref polltime details.
- *
- * In order to know precisely when libusb needs to be called into, libusb
- * offers you a set of pollable file descriptors and information about when
- * the next timeout expires.
- *
- * If you are using the asynchronous I/O API, you must take one of the two
- * following options, otherwise your I/O will not complete.
+/** \ingroup libusb_poll
+ * Interrupt any active thread that is handling events. This is mainly useful
+ * for interrupting a dedicated event handling thread when an application
+ * wishes to call libusb_exit().
  *
- * \section pollsimple The simple option
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
  *
- * If your application revolves solely around libusb and does not need to
- * handle other event sources, you can have a program structure as follows:
-\code
-// initialize libusb
-// find and open device
-// maybe fire off some initial async I/O
+ * \param ctx the context to operate on, or NULL for the default context
+ * \ref libusb_mtasync
+ */
+void API_EXPORTED libusb_interrupt_event_handler(libusb_context *ctx)
+{
+	int pending_events;
+	USBI_GET_CONTEXT(ctx);
 
-while (user_has_not_requested_exit)
-	libusb_handle_events(ctx);
+	usbi_dbg("");
+	usbi_mutex_lock(&ctx->event_data_lock);
 
-// clean up and exit
-\endcode
- *
- * With such a simple main loop, you do not have to worry about managing
- * sets of file descriptors or handling timeouts. libusb_handle_events() will
- * handle those details internally.
- *
- * \section libusb_pollmain The more advanced option
- *
- * \note This functionality is currently only available on Unix-like platforms.
- * On Windows, libusb_get_pollfds() simply returns NULL. Applications which
- * want to support Windows are advised to use an \ref eventthread
- * "event handling thread" instead.
- *
- * In more advanced applications, you will already have a main loop which
- * is monitoring other event sources: network sockets, X11 events, mouse
- * movements, etc. Through exposing a set of file descriptors, libusb is
- * designed to cleanly integrate into such main loops.
- *
- * In addition to polling file descriptors for the other event sources, you
- * take a set of file descriptors from libusb and monitor those too. When you
- * detect activity on libusb's file descriptors, you call
- * libusb_handle_events_timeout() in non-blocking mode.
- *
- * What's more, libusb may also need to handle events at specific moments in
- * time. No file descriptor activity is generated at these times, so your
- * own application needs to be continually aware of when the next one of these
- * moments occurs (through calling libusb_get_next_timeout()), and then it
- * needs to call libusb_handle_events_timeout() in non-blocking mode when
- * these moments occur. This means that you need to adjust your
- * poll()/select() timeout accordingly.
- *
- * libusb provides you with a set of file descriptors to poll and expects you
- * to poll all of them, treating them as a single entity. The meaning of each
- * file descriptor in the set is an internal implementation detail,
- * platform-dependent and may vary from release to release. Don't try and
- * interpret the meaning of the file descriptors, just do as libusb indicates,
- * polling all of them at once.
- *
- * In pseudo-code, you want something that looks like:
-\code
-// initialise libusb
+	pending_events = usbi_pending_events(ctx);
+	ctx->event_flags |= USBI_EVENT_USER_INTERRUPT;
+	if (!pending_events)
+		usbi_signal_event(ctx);
 
-libusb_get_pollfds(ctx)
-while (user has not requested application exit) {
-	libusb_get_next_timeout(ctx);
-	poll(on libusb file descriptors plus any other event sources of interest,
-		using a timeout no larger than the value libusb just suggested)
-	if (poll() indicated activity on libusb file descriptors)
-		libusb_handle_events_timeout(ctx, &zero_tv);
-	if (time has elapsed to or beyond the libusb timeout)
-		libusb_handle_events_timeout(ctx, &zero_tv);
-	// handle events from other sources here
+	usbi_mutex_unlock(&ctx->event_data_lock);
 }
 
-// clean up and exit
-\endcode
- *
- * \subsection polltime Notes on time-based events
+/** \ingroup libusb_poll
+ * Acquire the event waiters lock. This lock is designed to be obtained under
+ * the situation where you want to be aware when events are completed, but
+ * some other thread is event handling so calling libusb_handle_events() is not
+ * allowed.
  *
- * The above complication with having to track time and call into libusb at
- * specific moments is a bit of a headache. For maximum compatibility, you do
- * need to write your main loop as above, but you may decide that you can
- * restrict the supported platforms of your application and get away with
- * a more simplistic scheme.
+ * You then obtain this lock, re-check that another thread is still handling
+ * events, then call libusb_wait_for_event().
  *
- * These time-based event complications are \b not required on the following
- * platforms:
- *  - Darwin
- *  - Linux, provided that the following version requirements are satisfied:
- *   - Linux v2.6.27 or newer, compiled with timerfd support
- *   - glibc v2.9 or newer
- *   - libusb v1.0.5 or newer
+ * You only need to use this lock if you are developing an application
+ * which calls poll() or select() on libusb's file descriptors directly,
+ * <b>and</b> may potentially be handling events from 2 threads simultaenously.
+ * If you stick to libusb's event handling loop functions (e.g.
+ * libusb_handle_events()) then you do not need to be concerned with this
+ * locking.
  *
- * Under these configurations, libusb_get_next_timeout() will \em always return
- * 0, so your main loop can be simplified to:
-\code
-// initialise libusb
+ * \param ctx the context to operate on, or NULL for the default context
+ * \ref libusb_mtasync
+ */
+void API_EXPORTED libusb_lock_event_waiters(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+}
 
-libusb_get_pollfds(ctx)
-while (user has not requested application exit) {
-	poll(on libusb file descriptors plus any other event sources of interest,
-		using any timeout that you like)
-	if (poll() indicated activity on libusb file descriptors)
-		libusb_handle_events_timeout(ctx, &zero_tv);
-	// handle events from other sources here
+/** \ingroup libusb_poll
+ * Release the event waiters lock.
+ * \param ctx the context to operate on, or NULL for the default context
+ * \ref libusb_mtasync
+ */
+void API_EXPORTED libusb_unlock_event_waiters(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
 }
 
-// clean up and exit
-\endcode
- *
- * Do remember that if you simplify your main loop to the above, you will
- * lose compatibility with some platforms (including legacy Linux platforms,
- * and <em>any future platforms supported by libusb which may have time-based
- * event requirements</em>). The resultant problems will likely appear as
- * strange bugs in your application.
- *
- * You can use the libusb_pollfds_handle_timeouts() function to do a runtime
- * check to see if it is safe to ignore the time-based event complications.
- * If your application has taken the shortcut of ignoring libusb's next timeout
- * in your main loop, then you are advised to check the return value of
- * libusb_pollfds_handle_timeouts() during application startup, and to abort
- * if the platform does suffer from these timing complications.
- *
- * \subsection fdsetchange Changes in the file descriptor set
- *
- * The set of file descriptors that libusb uses as event sources may change
- * during the life of your application. Rather than having to repeatedly
- * call libusb_get_pollfds(), you can set up notification functions for when
- * the file descriptor set changes using libusb_set_pollfd_notifiers().
+/** \ingroup libusb_poll
+ * Wait for another thread to signal completion of an event. Must be called
+ * with the event waiters lock held, see libusb_lock_event_waiters().
  *
- * \subsection mtissues Multi-threaded considerations
+ * This function will block until any of the following conditions are met:
+ * -# The timeout expires
+ * -# A transfer completes
+ * -# A thread releases the event handling lock through libusb_unlock_events()
  *
- * Unfortunately, the situation is complicated further when multiple threads
- * come into play. If two threads are monitoring the same file descriptors,
- * the fact that only one thread will be woken up when an event occurs causes
- * some headaches.
+ * Condition 1 is obvious. Condition 2 unblocks your thread <em>after</em>
+ * the callback for the transfer has completed. Condition 3 is important
+ * because it means that the thread that was previously handling events is no
+ * longer doing so, so if any events are to complete, another thread needs to
+ * step up and start event handling.
  *
- * The events lock, event waiters lock, and libusb_handle_events_locked()
- * entities are added to solve these problems. You do not need to be concerned
- * with these entities otherwise.
+ * This function releases the event waiters lock before putting your thread
+ * to sleep, and reacquires the lock as it is being woken up.
  *
- * See the extra documentation: \ref libusb_mtasync
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param tv maximum timeout for this blocking function. A NULL value
+ * indicates unlimited timeout.
+ * \returns 0 after a transfer completes or another thread stops event handling
+ * \returns 1 if the timeout expired
+ * \ref libusb_mtasync
  */
+int API_EXPORTED libusb_wait_for_event(libusb_context *ctx, struct timeval *tv)
+{
+	int r;
 
-/** \page libusb_mtasync Multi-threaded applications and asynchronous I/O
- *
- * libusb is a thread-safe library, but extra considerations must be applied
- * to applications which interact with libusb from multiple threads.
- *
- * The underlying issue that must be addressed is that all libusb I/O
- * revolves around monitoring file descriptors through the poll()/select()
- * system calls. This is directly exposed at the
- * \ref libusb_asyncio "asynchronous interface" but it is important to note that the
- * \ref libusb_syncio "synchronous interface" is implemented on top of the
- * asynchonrous interface, therefore the same considerations apply.
- *
- * The issue is that if two or more threads are concurrently calling poll()
- * or select() on libusb's file descriptors then only one of those threads
- * will be woken up when an event arrives. The others will be completely
- * oblivious that anything has happened.
- *
- * Consider the following pseudo-code, which submits an asynchronous transfer
- * then waits for its completion. This style is one way you could implement a
- * synchronous interface on top of the asynchronous interface (and libusb
- * does something similar, albeit more advanced due to the complications
- * explained on this page).
- *
-\code
-void cb(struct libusb_transfer *transfer)
+	USBI_GET_CONTEXT(ctx);
+	if (tv == NULL) {
+		usbi_cond_wait(&ctx->event_waiters_cond, &ctx->event_waiters_lock);
+		return 0;
+	}
+
+	r = usbi_cond_timedwait(&ctx->event_waiters_cond,
+		&ctx->event_waiters_lock, tv);
+
+	if (r < 0)
+		return r;
+	else
+		return (r == ETIMEDOUT);
+}
+
+static void handle_timeout(struct usbi_transfer *itransfer)
 {
-	int *completed = transfer->user_data;
-	*completed = 1;
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int r;
+
+	itransfer->timeout_flags |= USBI_TRANSFER_TIMEOUT_HANDLED;
+	usbi_trace(itransfer, LIBUSB_TRACE_TIMEOUT, 0, 0);
+	r = libusb_cancel_transfer(transfer);
+	if (r == LIBUSB_SUCCESS)
+		itransfer->timeout_flags |= USBI_TRANSFER_TIMED_OUT;
+	else
+		usbi_warn(TRANSFER_CTX(transfer),
+			"async cancel failed %d errno=%d", r, errno);
+}
+
+static int handle_timeouts_locked(struct libusb_context *ctx)
+{
+	int r;
+	struct timespec systime_ts;
+	struct timeval systime;
+	struct usbi_transfer *transfer;
+
+	if (!ctx->timeout_heap_len)
+		return 0;
+
+	/* get current time */
+	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &systime_ts);
+	if (r < 0)
+		return r;
+
+	TIMESPEC_TO_TIMEVAL(&systime, &systime_ts);
+
+	/* pop transfers off the timeout heap for as long as the earliest
+	 * remaining timeout has expired */
+	while ((transfer = next_timeout_transfer(ctx)) != NULL) {
+		/* if transfer has non-expired timeout, nothing more to do */
+		if (timercmp(&transfer->timeout, &systime, >))
+			return 0;
+
+		/* otherwise, we've got an expired timeout to handle */
+		usbi_timeout_heap_remove(ctx, transfer);
+		handle_timeout(transfer);
+	}
+	return 0;
+}
+
+static int handle_timeouts(struct libusb_context *ctx)
+{
+	int r;
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	r = handle_timeouts_locked(ctx);
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	return r;
+}
+
+#ifdef USBI_TIMERFD_AVAILABLE
+static int handle_timerfd_trigger(struct libusb_context *ctx)
+{
+	int r;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+
+	/* process the timeout that just happened */
+	r = handle_timeouts_locked(ctx);
+	if (r < 0)
+		goto out;
+
+	/* arm for next timeout*/
+	r = arm_timerfd_for_next_timeout(ctx);
+
+out:
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	return r;
+}
+#endif
+
+/* do the actual event handling. assumes that no other thread is concurrently
+ * doing the same thing. */
+#ifdef USBI_EPOLL_AVAILABLE
+/* maximum number of ready fds collected by a single epoll_wait() */
+#define USBI_EPOLL_MAX_EVENTS 64
+
+/* Wait for events on the epoll instance and lay the ready fds out the way the
+ * poll() path does: the internal fds first, at their fixed positions, followed
+ * by the ready backend fds only. Returns what poll() would have returned, and
+ * the length of the resulting array in nfds. */
+static int epoll_ready_fds(struct libusb_context *ctx, struct pollfd *fds,
+	POLL_NFDS_TYPE internal_nfds, POLL_NFDS_TYPE *nfds, int timeout_ms)
+{
+	struct epoll_event events[USBI_EPOLL_MAX_EVENTS];
+	POLL_NFDS_TYPE n = internal_nfds;
+	int i, r;
+
+	fds[0].fd = ctx->event_pipe[0];
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+#ifdef USBI_TIMERFD_AVAILABLE
+	if (usbi_using_timerfd(ctx)) {
+		fds[1].fd = ctx->timerfd;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+	}
+#endif
+
+	r = epoll_wait(ctx->epoll_fd, events, USBI_EPOLL_MAX_EVENTS, timeout_ms);
+	for (i = 0; i < r; i++) {
+		int fd = events[i].data.fd;
+		short revents = (short)events[i].events;
+
+		if (fd == ctx->event_pipe[0]) {
+			fds[0].revents = revents;
+			continue;
+		}
+#ifdef USBI_TIMERFD_AVAILABLE
+		if (usbi_using_timerfd(ctx) && fd == ctx->timerfd) {
+			fds[1].revents = revents;
+			continue;
+		}
+#endif
+		fds[n].fd = fd;
+		fds[n].events = revents;
+		fds[n].revents = revents;
+		n++;
+	}
+
+	*nfds = n;
+	return r;
+}
+#endif
+
+/* busy-poll spins never last longer than this many windows, so that a device
+ * completing transfers faster than the window can't keep the event handling
+ * thread away from poll() */
+#define USBI_BUSY_POLL_MAX_WINDOWS 2
+
+static uint64_t busy_poll_now(void)
+{
+	struct timespec ts;
+
+	usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
 }
 
-void myfunc() {
-	struct libusb_transfer *transfer;
-	unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE] __attribute__ ((aligned (2)));
-	int completed = 0;
+/* returns nonzero if the event handler has to attend to something else than
+ * the completions behind own_fd: an internal event, such as a device being
+ * closed, or another ready fd */
+static int busy_poll_interrupted(struct libusb_context *ctx, int own_fd)
+{
+	int r;
+#ifdef USBI_EPOLL_AVAILABLE
+	struct epoll_event events[2];
+	int i;
+#else
+	struct usbi_pollfd *ipollfd;
+	struct pollfd pollfd;
+#endif
 
-	transfer = libusb_alloc_transfer(0);
-	libusb_fill_control_setup(buffer,
-		LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT, 0x04, 0x01, 0, 0);
-	libusb_fill_control_transfer(transfer, dev, buffer, cb, &completed, 1000);
-	libusb_submit_transfer(transfer);
+	usbi_mutex_lock(&ctx->event_data_lock);
+	r = ctx->event_flags || ctx->device_close
+		|| !list_empty(&ctx->hotplug_msgs)
+		|| (own_fd != ctx->event_pipe[0]
+			&& !list_empty(&ctx->completed_transfers));
+#ifndef USBI_EPOLL_AVAILABLE
+	list_for_each_entry(ipollfd, &ctx->ipollfds, list, struct usbi_pollfd) {
+		if (r)
+			break;
+		if (ipollfd->pollfd.fd == own_fd)
+			continue;
+		pollfd.fd = ipollfd->pollfd.fd;
+		pollfd.events = ipollfd->pollfd.events;
+		pollfd.revents = 0;
+		r = usbi_poll(&pollfd, 1, 0) > 0;
+	}
+#endif
+	usbi_mutex_unlock(&ctx->event_data_lock);
 
-	while (!completed) {
-		poll(libusb file descriptors, 120*1000);
-		if (poll indicates activity)
-			libusb_handle_events_timeout(ctx, &zero_tv);
+#ifdef USBI_EPOLL_AVAILABLE
+	/* with two events, at least one is not own_fd if anything else is ready */
+	if (!r) {
+		int n = epoll_wait(ctx->epoll_fd, events, 2, 0);
+
+		for (i = 0; i < n; i++)
+			if (events[i].data.fd != own_fd)
+				r = 1;
 	}
-	printf("completed!");
-	// other code here
+#endif
+	return r;
 }
-\endcode
- *
- * Here we are <em>serializing</em> completion of an asynchronous event
- * against a condition - the condition being completion of a specific transfer.
- * The poll() loop has a long timeout to minimize CPU usage during situations
- * when nothing is happening (it could reasonably be unlimited).
- *
- * If this is the only thread that is polling libusb's file descriptors, there
- * is no problem: there is no danger that another thread will swallow up the
- * event that we are interested in. On the other hand, if there is another
- * thread polling the same descriptors, there is a chance that it will receive
- * the event that we were interested in. In this situation, <tt>myfunc()</tt>
- * will only realise that the transfer has completed on the next iteration of
- * the loop, <em>up to 120 seconds later.</em> Clearly a two-minute delay is
- * undesirable, and don't even think about using short timeouts to circumvent
- * this issue!
- *
- * The solution here is to ensure that no two threads are ever polling the
- * file descriptors at the same time. A naive implementation of this would
- * impact the capabilities of the library, so libusb offers the scheme
- * documented below to ensure no loss of functionality.
- *
- * Before we go any further, it is worth mentioning that all libusb-wrapped
- * event handling procedures fully adhere to the scheme documented below.
- * This includes libusb_handle_events() and its variants, and all the
- * synchronous I/O functions - libusb hides this headache from you.
- *
- * \section Using libusb_handle_events() from multiple threads
- *
- * Even when only using libusb_handle_events() and synchronous I/O functions,
- * you can still have a race condition. You might be tempted to solve the
- * above with libusb_handle_events() like so:
- *
-\code
-	libusb_submit_transfer(transfer);
 
-	while (!completed) {
-		libusb_handle_events(ctx);
-	}
-	printf("completed!");
-\endcode
- *
- * This however has a race between the checking of completed and
- * libusb_handle_events() acquiring the events lock, so another thread
- * could have completed the transfer, resulting in this thread hanging
- * until either a timeout or another event occurs. See also commit
- * 6696512aade99bb15d6792af90ae329af270eba6 which fixes this in the
- * synchronous API implementation of libusb.
- *
- * Fixing this race requires checking the variable completed only after
- * taking the event lock, which defeats the concept of just calling
- * libusb_handle_events() without worrying about locking. This is why
- * libusb-1.0.9 introduces the new libusb_handle_events_timeout_completed()
- * and libusb_handle_events_completed() functions, which handles doing the
- * completion check for you after they have acquired the lock:
- *
-\code
-	libusb_submit_transfer(transfer);
+/* Busy-poll reaping: call reap, which returns 0 when it completed a transfer,
+ * 1 when there was nothing to complete and an error code otherwise, until no
+ * transfer has completed for the busy-poll window of the context, instead of
+ * going back to sleep in poll() right after the last completion. The spin
+ * also ends after USBI_BUSY_POLL_MAX_WINDOWS windows, and as soon as the event
+ * handler is needed elsewhere, see busy_poll_interrupted(). Returns like reap
+ * does for the attempt which ended the spin. */
+int usbi_busy_poll(struct libusb_context *ctx, int (*reap)(void *arg),
+	void *arg, int own_fd)
+{
+	uint64_t window_ns = (uint64_t)__atomic_load_n(&ctx->busy_poll_us,
+		__ATOMIC_RELAXED) * 1000;
+	uint64_t start, last, now;
+	uint64_t polls = 0, hits = 0;
+	int r;
 
-	while (!completed) {
-		libusb_handle_events_completed(ctx, &completed);
-	}
-	printf("completed!");
-\endcode
- *
- * This nicely fixes the race in our example. Note that if all you want to
- * do is submit a single transfer and wait for its completion, then using
- * one of the synchronous I/O functions is much easier.
- *
- * \section eventlock The events lock
- *
- * The problem is when we consider the fact that libusb exposes file
- * descriptors to allow for you to integrate asynchronous USB I/O into
- * existing main loops, effectively allowing you to do some work behind
- * libusb's back. If you do take libusb's file descriptors and pass them to
- * poll()/select() yourself, you need to be aware of the associated issues.
- *
- * The first concept to be introduced is the events lock. The events lock
- * is used to serialize threads that want to handle events, such that only
- * one thread is handling events at any one time.
- *
- * You must take the events lock before polling libusb file descriptors,
- * using libusb_lock_events(). You must release the lock as soon as you have
- * aborted your poll()/select() loop, using libusb_unlock_events().
- *
- * \section threadwait Letting other threads do the work for you
- *
- * Although the events lock is a critical part of the solution, it is not
- * enough on it's own. You might wonder if the following is sufficient...
-\code
-	libusb_lock_events(ctx);
-	while (!completed) {
-		poll(libusb file descriptors, 120*1000);
-		if (poll indicates activity)
-			libusb_handle_events_timeout(ctx, &zero_tv);
+	start = last = busy_poll_now();
+	do {
+		r = reap(arg);
+		polls++;
+		now = busy_poll_now();
+		if (r == 0) {
+			hits++;
+			last = now;
+		}
+		if (r < 0 || busy_poll_interrupted(ctx, own_fd))
+			break;
+	} while (now - last < window_ns
+		&& now - start < USBI_BUSY_POLL_MAX_WINDOWS * window_ns);
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	ctx->busy_poll_stats.windows++;
+	ctx->busy_poll_stats.polls += polls;
+	ctx->busy_poll_stats.hits += hits;
+	if (!hits)
+		ctx->busy_poll_stats.misses++;
+	ctx->busy_poll_stats.spin_ns += now - start;
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	return r;
+}
+
+/* complete the first of the transfers signalled as completed, if any. returns
+ * like reap_for_handle() does so that it can busy poll */
+static int complete_signalled_transfer(void *arg)
+{
+	struct libusb_context *ctx = arg;
+	struct usbi_transfer *itransfer;
+	int r;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	if (list_empty(&ctx->completed_transfers)) {
+		usbi_mutex_unlock(&ctx->event_data_lock);
+		return 1;
 	}
-	libusb_unlock_events(ctx);
-\endcode
- * ...and the answer is that it is not. This is because the transfer in the
- * code shown above may take a long time (say 30 seconds) to complete, and
- * the lock is not released until the transfer is completed.
- *
- * Another thread with similar code that wants to do event handling may be
- * working with a transfer that completes after a few milliseconds. Despite
- * having such a quick completion time, the other thread cannot check that
- * status of its transfer until the code above has finished (30 seconds later)
- * due to contention on the lock.
- *
- * To solve this, libusb offers you a mechanism to determine when another
- * thread is handling events. It also offers a mechanism to block your thread
- * until the event handling thread has completed an event (and this mechanism
- * does not involve polling of file descriptors).
- *
- * After determining that another thread is currently handling events, you
- * obtain the <em>event waiters</em> lock using libusb_lock_event_waiters().
- * You then re-check that some other thread is still handling events, and if
- * so, you call libusb_wait_for_event().
- *
- * libusb_wait_for_event() puts your application to sleep until an event
- * occurs, or until a thread releases the events lock. When either of these
- * things happen, your thread is woken up, and should re-check the condition
- * it was waiting on. It should also re-check that another thread is handling
- * events, and if not, it should start handling events itself.
- *
- * This looks like the following, as pseudo-code:
-\code
-retry:
-if (libusb_try_lock_events(ctx) == 0) {
-	// we obtained the event lock: do our own event handling
-	while (!completed) {
-		if (!libusb_event_handling_ok(ctx)) {
-			libusb_unlock_events(ctx);
-			goto retry;
+	itransfer = list_first_entry(&ctx->completed_transfers, struct usbi_transfer, completed_list);
+	list_del(&itransfer->completed_list);
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	r = usbi_backend->handle_transfer_completion(itransfer);
+	if (r)
+		usbi_err(ctx, "backend handle_transfer_completion failed with error %d", r);
+	return r;
+}
+
+static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+{
+	int r;
+	POLL_NFDS_TYPE nfds = 0;
+	POLL_NFDS_TYPE internal_nfds;
+	struct pollfd *fds = NULL;
+	int timeout_ms;
+	int special_event;
+#ifdef USBI_EPOLL_AVAILABLE
+	struct pollfd ready[2 + USBI_EPOLL_MAX_EVENTS];
+#else
+	struct usbi_pollfd *ipollfd;
+	int i = -1;
+#endif
+
+	/* prevent attempts to recursively handle events (e.g. calling into
+	 * libusb_handle_events() from within a hotplug or transfer callback) */
+	if (usbi_handling_events(ctx))
+		return LIBUSB_ERROR_BUSY;
+	usbi_start_event_handling(ctx);
+
+	/* there are certain fds that libusb uses internally, currently:
+	 *
+	 *   1) event pipe
+	 *   2) timerfd
+	 *
+	 * the backend will never need to attempt to handle events on these fds, so
+	 * we determine how many fds are in use internally for this context and when
+	 * handle_events() is called in the backend, the pollfd list and count will
+	 * be adjusted to skip over these internal fds */
+	if (usbi_using_timerfd(ctx))
+		internal_nfds = 2;
+	else
+		internal_nfds = 1;
+
+#ifdef USBI_EPOLL_AVAILABLE
+	/* the ready fds are collected in place of the whole set of poll fds */
+	fds = ready;
+#else
+	/* only reallocate the poll fds when the list of poll fds has been modified
+	 * since the last poll, otherwise reuse them to save the additional overhead */
+	usbi_mutex_lock(&ctx->event_data_lock);
+	if (ctx->event_flags & USBI_EVENT_POLLFDS_MODIFIED) {
+		usbi_dbg("poll fds modified, reallocating");
+
+		if (ctx->pollfds) {
+			free(ctx->pollfds);
+			ctx->pollfds = NULL;
 		}
-		poll(libusb file descriptors, 120*1000);
-		if (poll indicates activity)
-			libusb_handle_events_locked(ctx, 0);
+
+		/* sanity check - it is invalid for a context to have fewer than the
+		 * required internal fds (memory corruption?) */
+		assert(ctx->pollfds_cnt >= internal_nfds);
+
+		ctx->pollfds = calloc(ctx->pollfds_cnt, sizeof(*ctx->pollfds));
+		if (!ctx->pollfds) {
+			usbi_mutex_unlock(&ctx->event_data_lock);
+			r = LIBUSB_ERROR_NO_MEM;
+			goto done;
+		}
+
+		list_for_each_entry(ipollfd, &ctx->ipollfds, list, struct usbi_pollfd) {
+			struct libusb_pollfd *pollfd = &ipollfd->pollfd;
+			i++;
+			ctx->pollfds[i].fd = pollfd->fd;
+			ctx->pollfds[i].events = pollfd->events;
+		}
+
+		/* reset the flag now that we have the updated list */
+		ctx->event_flags &= ~USBI_EVENT_POLLFDS_MODIFIED;
+
+		/* if no further pending events, clear the event pipe so that we do
+		 * not immediately return from poll */
+		if (!usbi_pending_events(ctx))
+			usbi_clear_event(ctx);
 	}
-	libusb_unlock_events(ctx);
-} else {
-	// another thread is doing event handling. wait for it to signal us that
-	// an event has completed
-	libusb_lock_event_waiters(ctx);
+	fds = ctx->pollfds;
+	nfds = ctx->pollfds_cnt;
+	usbi_mutex_unlock(&ctx->event_data_lock);
+#endif
 
-	while (!completed) {
-		// now that we have the event waiters lock, double check that another
-		// thread is still handling events for us. (it may have ceased handling
-		// events in the time it took us to reach this point)
-		if (!libusb_event_handler_active(ctx)) {
-			// whoever was handling events is no longer doing so, try again
-			libusb_unlock_event_waiters(ctx);
-			goto retry;
-		}
+	timeout_ms = (int)(tv->tv_sec * 1000) + (tv->tv_usec / 1000);
 
-		libusb_wait_for_event(ctx, NULL);
+	/* round up to next millisecond */
+	if (tv->tv_usec % 1000)
+		timeout_ms++;
+
+redo_poll:
+#ifdef USBI_EPOLL_AVAILABLE
+	usbi_dbg("epoll_wait() with timeout in %dms", timeout_ms);
+	r = epoll_ready_fds(ctx, fds, internal_nfds, &nfds, timeout_ms);
+	usbi_dbg("epoll_wait() returned %d", r);
+#else
+	usbi_dbg("poll() %d fds with timeout in %dms", nfds, timeout_ms);
+	r = usbi_poll(fds, nfds, timeout_ms);
+	usbi_dbg("poll() returned %d", r);
+#endif
+	if (r == 0) {
+		r = handle_timeouts(ctx);
+		goto done;
+	}
+	else if (r == -1 && errno == EINTR) {
+		r = LIBUSB_ERROR_INTERRUPTED;
+		goto done;
+	}
+	else if (r < 0) {
+		usbi_err(ctx, "poll failed %d err=%d", r, errno);
+		r = LIBUSB_ERROR_IO;
+		goto done;
 	}
-	libusb_unlock_event_waiters(ctx);
-}
-printf("completed!\n");
-\endcode
- *
- * A naive look at the above code may suggest that this can only support
- * one event waiter (hence a total of 2 competing threads, the other doing
- * event handling), because the event waiter seems to have taken the event
- * waiters lock while waiting for an event. However, the system does support
- * multiple event waiters, because libusb_wait_for_event() actually drops
- * the lock while waiting, and reaquires it before continuing.
- *
- * We have now implemented code which can dynamically handle situations where
- * nobody is handling events (so we should do it ourselves), and it can also
- * handle situations where another thread is doing event handling (so we can
- * piggyback onto them). It is also equipped to handle a combination of
- * the two, for example, another thread is doing event handling, but for
- * whatever reason it stops doing so before our condition is met, so we take
- * over the event handling.
- *
- * Four functions were introduced in the above pseudo-code. Their importance
- * should be apparent from the code shown above.
- * -# libusb_try_lock_events() is a non-blocking function which attempts
- *    to acquire the events lock but returns a failure code if it is contended.
- * -# libusb_event_handling_ok() checks that libusb is still happy for your
- *    thread to be performing event handling. Sometimes, libusb needs to
- *    interrupt the event handler, and this is how you can check if you have
- *    been interrupted. If this function returns 0, the correct behaviour is
- *    for you to give up the event handling lock, and then to repeat the cycle.
- *    The following libusb_try_lock_events() will fail, so you will become an
- *    events waiter. For more information on this, read \ref fullstory below.
- * -# libusb_handle_events_locked() is a variant of
- *    libusb_handle_events_timeout() that you can call while holding the
- *    events lock. libusb_handle_events_timeout() itself implements similar
- *    logic to the above, so be sure not to call it when you are
- *    "working behind libusb's back", as is the case here.
- * -# libusb_event_handler_active() determines if someone is currently
- *    holding the events lock
- *
- * You might be wondering why there is no function to wake up all threads
- * blocked on libusb_wait_for_event(). This is because libusb can do this
- * internally: it will wake up all such threads when someone calls
- * libusb_unlock_events() or when a transfer completes (at the point after its
- * callback has returned).
- *
- * \subsection fullstory The full story
- *
- * The above explanation should be enough to get you going, but if you're
- * really thinking through the issues then you may be left with some more
- * questions regarding libusb's internals. If you're curious, read on, and if
- * not, skip to the next section to avoid confusing yourself!
- *
- * The immediate question that may spring to mind is: what if one thread
- * modifies the set of file descriptors that need to be polled while another
- * thread is doing event handling?
- *
- * There are 2 situations in which this may happen.
- * -# libusb_open() will add another file descriptor to the poll set,
- *    therefore it is desirable to interrupt the event handler so that it
- *    restarts, picking up the new descriptor.
- * -# libusb_close() will remove a file descriptor from the poll set. There
- *    are all kinds of race conditions that could arise here, so it is
- *    important that nobody is doing event handling at this time.
- *
- * libusb handles these issues internally, so application developers do not
- * have to stop their event handlers while opening/closing devices. Here's how
- * it works, focusing on the libusb_close() situation first:
- *
- * -# During initialization, libusb opens an internal pipe, and it adds the read
- *    end of this pipe to the set of file descriptors to be polled.
- * -# During libusb_close(), libusb writes some dummy data on this event pipe.
- *    This immediately interrupts the event handler. libusb also records
- *    internally that it is trying to interrupt event handlers for this
- *    high-priority event.
- * -# At this point, some of the functions described above start behaving
- *    differently:
- *   - libusb_event_handling_ok() starts returning 1, indicating that it is NOT
- *     OK for event handling to continue.
- *   - libusb_try_lock_events() starts returning 1, indicating that another
- *     thread holds the event handling lock, even if the lock is uncontended.
- *   - libusb_event_handler_active() starts returning 1, indicating that
- *     another thread is doing event handling, even if that is not true.
- * -# The above changes in behaviour result in the event handler stopping and
- *    giving up the events lock very quickly, giving the high-priority
- *    libusb_close() operation a "free ride" to acquire the events lock. All
- *    threads that are competing to do event handling become event waiters.
- * -# With the events lock held inside libusb_close(), libusb can safely remove
- *    a file descriptor from the poll set, in the safety of knowledge that
- *    nobody is polling those descriptors or trying to access the poll set.
- * -# After obtaining the events lock, the close operation completes very
- *    quickly (usually a matter of milliseconds) and then immediately releases
- *    the events lock.
- * -# At the same time, the behaviour of libusb_event_handling_ok() and friends
- *    reverts to the original, documented behaviour.
- * -# The release of the events lock causes the threads that are waiting for
- *    events to be woken up and to start competing to become event handlers
- *    again. One of them will succeed; it will then re-obtain the list of poll
- *    descriptors, and USB I/O will then continue as normal.
- *
- * libusb_open() is similar, and is actually a more simplistic case. Upon a
- * call to libusb_open():
- *
- * -# The device is opened and a file descriptor is added to the poll set.
- * -# libusb sends some dummy data on the event pipe, and records that it
- *    is trying to modify the poll descriptor set.
- * -# The event handler is interrupted, and the same behaviour change as for
- *    libusb_close() takes effect, causing all event handling threads to become
- *    event waiters.
- * -# The libusb_open() implementation takes its free ride to the events lock.
- * -# Happy that it has successfully paused the events handler, libusb_open()
- *    releases the events lock.
- * -# The event waiter threads are all woken up and compete to become event
- *    handlers again. The one that succeeds will obtain the list of poll
- *    descriptors again, which will include the addition of the new device.
- *
- * \subsection concl Closing remarks
- *
- * The above may seem a little complicated, but hopefully I have made it clear
- * why such complications are necessary. Also, do not forget that this only
- * applies to applications that take libusb's file descriptors and integrate
- * them into their own polling loops.
- *
- * You may decide that it is OK for your multi-threaded application to ignore
- * some of the rules and locks detailed above, because you don't think that
- * two threads can ever be polling the descriptors at the same time. If that
- * is the case, then that's good news for you because you don't have to worry.
- * But be careful here; remember that the synchronous I/O functions do event
- * handling internally. If you have one thread doing event handling in a loop
- * (without implementing the rules and locking semantics documented above)
- * and another trying to send a synchronous USB transfer, you will end up with
- * two threads monitoring the same descriptors, and the above-described
- * undesirable behaviour occurring. The solution is for your polling thread to
- * play by the rules; the synchronous I/O functions do so, and this will result
- * in them getting along in perfect harmony.
- *
- * If you do have a dedicated thread doing event handling, it is perfectly
- * legal for it to take the event handling lock for long periods of time. Any
- * synchronous I/O functions you call from other threads will transparently
- * fall back to the "event waiters" mechanism detailed above. The only
- * consideration that your event handling thread must apply is the one related
- * to libusb_event_handling_ok(): you must call this before every poll(), and
- * give up the events lock if instructed.
- */
 
-int usbi_io_init(struct libusb_context *ctx)
-{
-	int r;
+	special_event = 0;
 
-	usbi_mutex_init(&ctx->flying_transfers_lock);
-	usbi_mutex_init(&ctx->events_lock);
-	usbi_mutex_init(&ctx->event_waiters_lock);
-	usbi_cond_init(&ctx->event_waiters_cond);
-	usbi_mutex_init(&ctx->event_data_lock);
-	usbi_tls_key_create(&ctx->event_handling_key);
-	list_init(&ctx->flying_transfers);
-	list_init(&ctx->ipollfds);
-	list_init(&ctx->hotplug_msgs);
-	list_init(&ctx->completed_transfers);
+	/* fds[0] is always the event pipe */
+	if (fds[0].revents) {
+		libusb_hotplug_message *message, *next;
+		struct list_head hotplug_msgs;
+		struct usbi_transfer *itransfer;
+		int completed = 0;
+		int ret = 0;
+
+		usbi_dbg("caught a fish on the event pipe");
+
+		/* take the the event data lock while processing events */
+		usbi_mutex_lock(&ctx->event_data_lock);
+
+		/* check if someone added a new poll fd */
+		if (ctx->event_flags & USBI_EVENT_POLLFDS_MODIFIED)
+			usbi_dbg("someone updated the poll fds");
+
+		if (ctx->event_flags & USBI_EVENT_USER_INTERRUPT) {
+			usbi_dbg("someone purposely interrupted");
+			ctx->event_flags &= ~USBI_EVENT_USER_INTERRUPT;
+		}
+
+		/* check if someone is closing a device */
+		if (ctx->device_close)
+			usbi_dbg("someone is closing a device");
+
+		/* take all pending hotplug messages, so that the callbacks see a
+		 * batch of device changes in one pass */
+		list_init(&hotplug_msgs);
+		if (!list_empty(&ctx->hotplug_msgs)) {
+			usbi_dbg("hotplug message received");
+			special_event = 1;
+			list_for_each_entry_safe(message, next, &ctx->hotplug_msgs, list,
+					libusb_hotplug_message) {
+				list_del(&message->list);
+				list_add_tail(&message->list, &hotplug_msgs);
+			}
+		}
+
+		/* complete any pending transfers */
+		while (ret == 0 && !list_empty(&ctx->completed_transfers)) {
+			itransfer = list_first_entry(&ctx->completed_transfers, struct usbi_transfer, completed_list);
+			list_del(&itransfer->completed_list);
+			usbi_mutex_unlock(&ctx->event_data_lock);
+			ret = usbi_backend->handle_transfer_completion(itransfer);
+			if (ret)
+				usbi_err(ctx, "backend handle_transfer_completion failed with error %d", ret);
+			usbi_mutex_lock(&ctx->event_data_lock);
+			completed = 1;
+		}
+
+		/* if no further pending events, clear the event pipe */
+		if (!usbi_pending_events(ctx))
+			usbi_clear_event(ctx);
+
+		usbi_mutex_unlock(&ctx->event_data_lock);
+
+		/* process the hotplug messages, if any */
+		list_for_each_entry_safe(message, next, &hotplug_msgs, list,
+				libusb_hotplug_message) {
+			usbi_hotplug_match(ctx, message->device, message->event);
+
+			/* the device left, dereference the device */
+			if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == message->event)
+				libusb_unref_device(message->device);
+
+			list_del(&message->list);
+			free(message);
+		}
 
-	/* FIXME should use an eventfd on kernels that support it */
-	r = usbi_pipe(ctx->event_pipe);
-	if (r < 0) {
-		r = LIBUSB_ERROR_OTHER;
-		goto err;
-	}
+		/* busy poll the transfers completed by the backend, as the Linux
+		 * backend does with the ones it reaps */
+		if (ret == 0 && completed &&
+				__atomic_load_n(&ctx->busy_poll_us, __ATOMIC_RELAXED)) {
+			ret = usbi_busy_poll(ctx, complete_signalled_transfer, ctx,
+				ctx->event_pipe[0]);
+			if (ret > 0)
+				ret = 0;
+			usbi_mutex_lock(&ctx->event_data_lock);
+			if (!usbi_pending_events(ctx))
+				usbi_clear_event(ctx);
+			usbi_mutex_unlock(&ctx->event_data_lock);
+		}
 
-	r = usbi_add_pollfd(ctx, ctx->event_pipe[0], POLLIN);
-	if (r < 0)
-		goto err_close_pipe;
+		if (ret) {
+			/* return error code */
+			r = ret;
+			goto done;
+		}
+
+		if (0 == --r)
+			goto handled;
+	}
 
 #ifdef USBI_TIMERFD_AVAILABLE
-	ctx->timerfd = timerfd_create(usbi_backend->get_timerfd_clockid(),
-		TFD_NONBLOCK);
-	if (ctx->timerfd >= 0) {
-		usbi_dbg("using timerfd for timeouts");
-		r = usbi_add_pollfd(ctx, ctx->timerfd, POLLIN);
-		if (r < 0)
-			goto err_close_timerfd;
-	} else {
-		usbi_dbg("timerfd not available (code %d error %d)", ctx->timerfd, errno);
-		ctx->timerfd = -1;
+	/* on timerfd configurations, fds[1] is the timerfd */
+	if (usbi_using_timerfd(ctx) && fds[1].revents) {
+		/* timerfd indicates that a timeout has expired */
+		int ret;
+		usbi_dbg("timerfd triggered");
+		special_event = 1;
+
+		ret = handle_timerfd_trigger(ctx);
+		if (ret < 0) {
+			/* return error code */
+			r = ret;
+			goto done;
+		}
+
+		if (0 == --r)
+			goto handled;
 	}
 #endif
 
-	return 0;
+	r = usbi_backend->handle_events(ctx, fds + internal_nfds, nfds - internal_nfds, r);
+	if (r)
+		usbi_err(ctx, "backend handle_events failed with error %d", r);
 
-#ifdef USBI_TIMERFD_AVAILABLE
-err_close_timerfd:
-	close(ctx->timerfd);
-	usbi_remove_pollfd(ctx, ctx->event_pipe[0]);
-#endif
-err_close_pipe:
-	usbi_close(ctx->event_pipe[0]);
-	usbi_close(ctx->event_pipe[1]);
-err:
-	usbi_mutex_destroy(&ctx->flying_transfers_lock);
-	usbi_mutex_destroy(&ctx->events_lock);
-	usbi_mutex_destroy(&ctx->event_waiters_lock);
-	usbi_cond_destroy(&ctx->event_waiters_cond);
-	usbi_mutex_destroy(&ctx->event_data_lock);
-	usbi_tls_key_delete(ctx->event_handling_key);
+handled:
+	if (r == 0 && special_event) {
+		timeout_ms = 0;
+		goto redo_poll;
+	}
+
+done:
+	usbi_end_event_handling(ctx);
 	return r;
 }
 
-void usbi_io_exit(struct libusb_context *ctx)
+/* returns the smallest of:
+ *  1. timeout of next URB
+ *  2. user-supplied timeout
+ * returns 1 if there is an already-expired timeout, otherwise returns 0
+ * and populates out
+ */
+static int get_next_timeout(libusb_context *ctx, struct timeval *tv,
+	struct timeval *out)
 {
-	usbi_remove_pollfd(ctx, ctx->event_pipe[0]);
-	usbi_close(ctx->event_pipe[0]);
-	usbi_close(ctx->event_pipe[1]);
-#ifdef USBI_TIMERFD_AVAILABLE
-	if (usbi_using_timerfd(ctx)) {
-		usbi_remove_pollfd(ctx, ctx->timerfd);
-		close(ctx->timerfd);
+	struct timeval timeout;
+	int r = libusb_get_next_timeout(ctx, &timeout);
+	if (r) {
+		/* timeout already expired? */
+		if (!timerisset(&timeout))
+			return 1;
+
+		/* choose the smallest of next URB timeout or user specified timeout */
+		if (timercmp(&timeout, tv, <))
+			*out = timeout;
+		else
+			*out = *tv;
+	} else {
+		*out = *tv;
 	}
-#endif
-	usbi_mutex_destroy(&ctx->flying_transfers_lock);
-	usbi_mutex_destroy(&ctx->events_lock);
-	usbi_mutex_destroy(&ctx->event_waiters_lock);
-	usbi_cond_destroy(&ctx->event_waiters_cond);
-	usbi_mutex_destroy(&ctx->event_data_lock);
-	usbi_tls_key_delete(ctx->event_handling_key);
-	if (ctx->pollfds)
-		free(ctx->pollfds);
+	return 0;
 }
 
-static int calculate_timeout(struct usbi_transfer *transfer)
+/** \ingroup libusb_poll
+ * Handle any pending events.
+ *
+ * libusb determines "pending events" by checking if any timeouts have expired
+ * and by checking the set of file descriptors for activity.
+ *
+ * If a zero timeval is passed, this function will handle any already-pending
+ * events and then immediately return in non-blocking style.
+ *
+ * If a non-zero timeval is passed and no events are currently pending, this
+ * function will block waiting for events to handle up until the specified
+ * timeout. If an event arrives or a signal is raised, this function will
+ * return early.
+ *
+ * If the parameter completed is not NULL then <em>after obtaining the event
+ * handling lock</em> this function will return immediately if the integer
+ * pointed to is not 0. This allows for race free waiting for the completion
+ * of a specific transfer.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param tv the maximum time to block waiting for events, or an all zero
+ * timeval struct for non-blocking mode
+ * \param completed pointer to completion integer to check, or NULL
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ * \ref libusb_mtasync
+ */
+int API_EXPORTED libusb_handle_events_timeout_completed(libusb_context *ctx,
+	struct timeval *tv, int *completed)
 {
 	int r;
-	struct timespec current_time;
-	unsigned int timeout =
-		USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout;
+	struct timeval poll_timeout;
 
-	if (!timeout)
-		return 0;
+	USBI_GET_CONTEXT(ctx);
+	r = get_next_timeout(ctx, tv, &poll_timeout);
+	if (r) {
+		/* timeout already expired */
+		return handle_timeouts(ctx);
+	}
 
-	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &current_time);
-	if (r < 0) {
-		usbi_err(ITRANSFER_CTX(transfer),
-			"failed to read monotonic clock, errno=%d", errno);
+retry:
+	if (libusb_try_lock_events(ctx) == 0) {
+		if (completed == NULL || !*completed) {
+			/* we obtained the event lock: do our own event handling */
+			usbi_dbg("doing our own event handling");
+			r = handle_events(ctx, &poll_timeout);
+		}
+		libusb_unlock_events(ctx);
 		return r;
 	}
 
-	current_time.tv_sec += timeout / 1000;
-	current_time.tv_nsec += (timeout % 1000) * 1000000;
+	/* another thread is doing event handling. wait for thread events that
+	 * notify event completion. */
+	libusb_lock_event_waiters(ctx);
 
-	while (current_time.tv_nsec >= 1000000000) {
-		current_time.tv_nsec -= 1000000000;
-		current_time.tv_sec++;
+	if (completed && *completed)
+		goto already_done;
+
+	if (!libusb_event_handler_active(ctx)) {
+		/* we hit a race: whoever was event handling earlier finished in the
+		 * time it took us to reach this point. try the cycle again. */
+		libusb_unlock_event_waiters(ctx);
+		usbi_dbg("event handler was active but went away, retrying");
+		goto retry;
 	}
 
-	TIMESPEC_TO_TIMEVAL(&transfer->timeout, &current_time);
-	return 0;
+	usbi_dbg("another thread is doing event handling");
+	r = libusb_wait_for_event(ctx, &poll_timeout);
+
+already_done:
+	libusb_unlock_event_waiters(ctx);
+
+	if (r < 0)
+		return r;
+	else if (r == 1)
+		return handle_timeouts(ctx);
+	else
+		return 0;
 }
 
-/** \ingroup libusb_asyncio
- * Allocate a libusb transfer with a specified number of isochronous packet
- * descriptors. The returned transfer is pre-initialized for you. When the new
- * transfer is no longer needed, it should be freed with
- * libusb_free_transfer().
- *
- * Transfers intended for non-isochronous endpoints (e.g. control, bulk,
- * interrupt) should specify an iso_packets count of zero.
+/** \ingroup libusb_poll
+ * Handle any pending events
  *
- * For transfers intended for isochronous endpoints, specify an appropriate
- * number of packet descriptors to be allocated as part of the transfer.
- * The returned transfer is not specially initialized for isochronous I/O;
- * you are still required to set the
- * \ref libusb_transfer::num_iso_packets "num_iso_packets" and
- * \ref libusb_transfer::type "type" fields accordingly.
+ * Like libusb_handle_events_timeout_completed(), but without the completed
+ * parameter, calling this function is equivalent to calling
+ * libusb_handle_events_timeout_completed() with a NULL completed parameter.
  *
- * It is safe to allocate a transfer with some isochronous packets and then
- * use it on a non-isochronous endpoint. If you do this, ensure that at time
- * of submission, num_iso_packets is 0 and that type is set appropriately.
+ * This function is kept primarily for backwards compatibility.
+ * All new code should call libusb_handle_events_completed() or
+ * libusb_handle_events_timeout_completed() to avoid race conditions.
  *
- * \param iso_packets number of isochronous packet descriptors to allocate
- * \returns a newly allocated transfer, or NULL on error
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param tv the maximum time to block waiting for events, or an all zero
+ * timeval struct for non-blocking mode
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
  */
-DEFAULT_VISIBILITY
-struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
-	int iso_packets)
+int API_EXPORTED libusb_handle_events_timeout(libusb_context *ctx,
+	struct timeval *tv)
 {
-	struct libusb_transfer *transfer;
-	size_t os_alloc_size = usbi_backend->transfer_priv_size;
-	size_t alloc_size = sizeof(struct usbi_transfer)
-		+ sizeof(struct libusb_transfer)
-		+ (sizeof(struct libusb_iso_packet_descriptor) * iso_packets)
-		+ os_alloc_size;
-	struct usbi_transfer *itransfer = calloc(1, alloc_size);
-	if (!itransfer)
-		return NULL;
+	return libusb_handle_events_timeout_completed(ctx, tv, NULL);
+}
 
-	itransfer->num_iso_packets = iso_packets;
-	usbi_mutex_init(&itransfer->lock);
-	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	usbi_dbg("transfer %p", transfer);
-	return transfer;
+/** \ingroup libusb_poll
+ * Handle any pending events in blocking mode. There is currently a timeout
+ * hardcoded at 60 seconds but we plan to make it unlimited in future. For
+ * finer control over whether this function is blocking or non-blocking, or
+ * for control over the timeout, use libusb_handle_events_timeout_completed()
+ * instead.
+ *
+ * This function is kept primarily for backwards compatibility.
+ * All new code should call libusb_handle_events_completed() or
+ * libusb_handle_events_timeout_completed() to avoid race conditions.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_handle_events(libusb_context *ctx)
+{
+	struct timeval tv;
+	tv.tv_sec = 60;
+	tv.tv_usec = 0;
+	return libusb_handle_events_timeout_completed(ctx, &tv, NULL);
 }
 
-/** \ingroup libusb_asyncio
- * Free a transfer structure. This should be called for all transfers
- * allocated with libusb_alloc_transfer().
- *
- * If the \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
- * "LIBUSB_TRANSFER_FREE_BUFFER" flag is set and the transfer buffer is
- * non-NULL, this function will also free the transfer buffer using the
- * standard system memory allocator (e.g. free()).
+/** \ingroup libusb_poll
+ * Handle any pending events in blocking mode.
  *
- * It is legal to call this function with a NULL transfer. In this case,
- * the function will simply return safely.
+ * Like libusb_handle_events(), with the addition of a completed parameter
+ * to allow for race free waiting for the completion of a specific transfer.
  *
- * It is not legal to free an active transfer (one which has been submitted
- * and has not yet completed).
+ * See libusb_handle_events_timeout_completed() for details on the completed
+ * parameter.
  *
- * \param transfer the transfer to free
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param completed pointer to completion integer to check, or NULL
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ * \ref libusb_mtasync
  */
-void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
+int API_EXPORTED libusb_handle_events_completed(libusb_context *ctx,
+	int *completed)
 {
-	struct usbi_transfer *itransfer;
-	if (!transfer)
-		return;
-
-	usbi_dbg("transfer %p", transfer);
-	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER && transfer->buffer)
-		free(transfer->buffer);
-
-	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	usbi_mutex_destroy(&itransfer->lock);
-	free(itransfer);
+	struct timeval tv;
+	tv.tv_sec = 60;
+	tv.tv_usec = 0;
+	return libusb_handle_events_timeout_completed(ctx, &tv, completed);
 }
 
-#ifdef USBI_TIMERFD_AVAILABLE
-static int disarm_timerfd(struct libusb_context *ctx)
+/** \ingroup libusb_poll
+ * Handle any pending events by polling file descriptors, without checking if
+ * any other threads are already doing so. Must be called with the event lock
+ * held, see libusb_lock_events().
+ *
+ * This function is designed to be called under the situation where you have
+ * taken the event lock and are calling poll()/select() directly on libusb's
+ * file descriptors (as opposed to using libusb_handle_events() or similar).
+ * You detect events on libusb's descriptors, so you then call this function
+ * with a zero timeout value (while still holding the event lock).
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param tv the maximum time to block waiting for events, or zero for
+ * non-blocking mode
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ * \ref libusb_mtasync
+ */
+int API_EXPORTED libusb_handle_events_locked(libusb_context *ctx,
+	struct timeval *tv)
 {
-	const struct itimerspec disarm_timer = { { 0, 0 }, { 0, 0 } };
 	int r;
+	struct timeval poll_timeout;
 
-	usbi_dbg("");
-	r = timerfd_settime(ctx->timerfd, 0, &disarm_timer, NULL);
-	if (r < 0)
-		return LIBUSB_ERROR_OTHER;
-	else
-		return 0;
+	USBI_GET_CONTEXT(ctx);
+	r = get_next_timeout(ctx, tv, &poll_timeout);
+	if (r) {
+		/* timeout already expired */
+		return handle_timeouts(ctx);
+	}
+
+	return handle_events(ctx, &poll_timeout);
 }
 
-/* iterates through the flying transfers, and rearms the timerfd based on the
- * next upcoming timeout.
- * must be called with flying_list locked.
- * returns 0 on success or a LIBUSB_ERROR code on failure.
+/** \ingroup libusb_poll
+ * Determines whether your application must apply special timing considerations
+ * when monitoring libusb's file descriptors.
+ *
+ * This function is only useful for applications which retrieve and poll
+ * libusb's file descriptors in their own main loop (\ref libusb_pollmain).
+ *
+ * Ordinarily, libusb's event handler needs to be called into at specific
+ * moments in time (in addition to times when there is activity on the file
+ * descriptor set). The usual approach is to use libusb_get_next_timeout()
+ * to learn about when the next timeout occurs, and to adjust your
+ * poll()/select() timeout accordingly so that you can make a call into the
+ * library at that time.
+ *
+ * Some platforms supported by libusb do not come with this baggage - any
+ * events relevant to timing will be represented by activity on the file
+ * descriptor set, and libusb_get_next_timeout() will always return 0.
+ * This function allows you to detect whether you are running on such a
+ * platform.
+ *
+ * Since v1.0.5.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 if you must call into libusb at times determined by
+ * libusb_get_next_timeout(), or 1 if all timeout events are handled internally
+ * or through regular activity on the file descriptors.
+ * \ref libusb_pollmain "Polling libusb file descriptors for event handling"
  */
-static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
+int API_EXPORTED libusb_pollfds_handle_timeouts(libusb_context *ctx)
 {
-	struct usbi_transfer *transfer;
-
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		struct timeval *cur_tv = &transfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, then we have no
-		 * arming to do */
-		if (!timerisset(cur_tv))
-			goto disarm;
-
-		/* act on first transfer that has not already been handled */
-		if (!(transfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))) {
-			int r;
-			const struct itimerspec it = { {0, 0},
-				{ cur_tv->tv_sec, cur_tv->tv_usec * 1000 } };
-			usbi_dbg("next timeout originally %dms", USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
-			r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
-			if (r < 0)
-				return LIBUSB_ERROR_OTHER;
-			return 0;
-		}
-	}
-
-disarm:
-	return disarm_timerfd(ctx);
-}
+#if defined(USBI_TIMERFD_AVAILABLE)
+	USBI_GET_CONTEXT(ctx);
+	return usbi_using_timerfd(ctx);
 #else
-static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
-{
 	UNUSED(ctx);
 	return 0;
-}
 #endif
+}
 
-/* add a transfer to the (timeout-sorted) active transfers list.
- * This function will return non 0 if fails to update the timer,
- * in which case the transfer is *not* on the flying_transfers list. */
-static int add_to_flying_list(struct usbi_transfer *transfer)
+/** \ingroup libusb_poll
+ * Determine the next internal timeout that libusb needs to handle. You only
+ * need to use this function if you are calling poll() or select() or similar
+ * on libusb's file descriptors yourself - you do not need to use it if you
+ * are calling libusb_handle_events() or a variant directly.
+ *
+ * You should call this function in your main loop in order to determine how
+ * long to wait for select() or poll() to return results. libusb needs to be
+ * called into at this timeout, so you should use it as an upper bound on
+ * your select() or poll() call.
+ *
+ * When the timeout has expired, call into libusb_handle_events_timeout()
+ * (perhaps in non-blocking mode) so that libusb can handle the timeout.
+ *
+ * This function may return 1 (success) and an all-zero timeval. If this is
+ * the case, it indicates that libusb has a timeout that has already expired
+ * so you should call libusb_handle_events_timeout() or similar immediately.
+ * A return code of 0 indicates that there are no pending timeouts.
+ *
+ * On some platforms, this function will always returns 0 (no pending
+ * timeouts). See \ref polltime.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param tv output location for a relative time against the current
+ * clock in which libusb must be called into in order to process timeout events
+ * \returns 0 if there are no pending timeouts, 1 if a timeout was returned,
+ * or LIBUSB_ERROR_OTHER on failure
+ */
+int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
+	struct timeval *tv)
 {
-	struct usbi_transfer *cur;
-	struct timeval *timeout = &transfer->timeout;
-	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+	struct usbi_transfer *transfer;
+	struct timespec cur_ts;
+	struct timeval cur_tv;
+	struct timeval next_timeout = { 0, 0 };
 	int r;
-	int first = 1;
 
-	r = calculate_timeout(transfer);
-	if (r)
-		return r;
+	USBI_GET_CONTEXT(ctx);
+	if (usbi_using_timerfd(ctx))
+		return 0;
 
-	/* if we have no other flying transfers, start the list with this one */
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
 	if (list_empty(&ctx->flying_transfers)) {
-		list_add(&transfer->list, &ctx->flying_transfers);
-		goto out;
+		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		usbi_dbg("no URBs, no timeout!");
+		return 0;
 	}
 
-	/* if we have infinite timeout, append to end of list */
-	if (!timerisset(timeout)) {
-		list_add_tail(&transfer->list, &ctx->flying_transfers);
-		/* first is irrelevant in this case */
-		goto out;
-	}
+	/* the next transfer which hasn't already been processed as timed out
+	 * is at the top of the timeout heap */
+	transfer = next_timeout_transfer(ctx);
+	if (transfer)
+		next_timeout = transfer->timeout;
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
-	/* otherwise, find appropriate place in list */
-	list_for_each_entry(cur, &ctx->flying_transfers, list, struct usbi_transfer) {
-		/* find first timeout that occurs after the transfer in question */
-		struct timeval *cur_tv = &cur->timeout;
+	if (!timerisset(&next_timeout)) {
+		usbi_dbg("no URB with timeout or all handled by OS; no timeout!");
+		return 0;
+	}
 
-		if (!timerisset(cur_tv) || (cur_tv->tv_sec > timeout->tv_sec) ||
-				(cur_tv->tv_sec == timeout->tv_sec &&
-					cur_tv->tv_usec > timeout->tv_usec)) {
-			list_add_tail(&transfer->list, &cur->list);
-			goto out;
-		}
-		first = 0;
+	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &cur_ts);
+	if (r < 0) {
+		usbi_err(ctx, "failed to read monotonic clock, errno=%d", errno);
+		return 0;
 	}
-	/* first is 0 at this stage (list not empty) */
+	TIMESPEC_TO_TIMEVAL(&cur_tv, &cur_ts);
 
-	/* otherwise we need to be inserted at the end */
-	list_add_tail(&transfer->list, &ctx->flying_transfers);
-out:
-#ifdef USBI_TIMERFD_AVAILABLE
-	if (first && usbi_using_timerfd(ctx) && timerisset(timeout)) {
-		/* if this transfer has the lowest timeout of all active transfers,
-		 * rearm the timerfd with this transfer's timeout */
-		const struct itimerspec it = { {0, 0},
-			{ timeout->tv_sec, timeout->tv_usec * 1000 } };
-		usbi_dbg("arm timerfd for timeout in %dms (first in line)",
-			USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
-		r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
-		if (r < 0) {
-			usbi_warn(ctx, "failed to arm first timerfd (errno %d)", errno);
-			r = LIBUSB_ERROR_OTHER;
-		}
+	if (!timercmp(&cur_tv, &next_timeout, <)) {
+		usbi_dbg("first timeout already expired");
+		timerclear(tv);
+	} else {
+		timersub(&next_timeout, &cur_tv, tv);
+		usbi_dbg("next timeout in %d.%06ds", tv->tv_sec, tv->tv_usec);
 	}
-#else
-	UNUSED(first);
-#endif
 
-	if (r)
-		list_del(&transfer->list);
+	return 1;
+}
 
-	return r;
+/** \ingroup libusb_poll
+ * Register notification functions for file descriptor additions/removals.
+ * These functions will be invoked for every new or removed file descriptor
+ * that libusb uses as an event source.
+ *
+ * To remove notifiers, pass NULL values for the function pointers.
+ *
+ * Note that file descriptors may have been added even before you register
+ * these notifiers (e.g. at libusb_init() time).
+ *
+ * Additionally, note that the removal notifier may be called during
+ * libusb_exit() (e.g. when it is closing file descriptors that were opened
+ * and added to the poll set at libusb_init() time). If you don't want this,
+ * remove the notifiers immediately before calling libusb_exit().
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param added_cb pointer to function for addition notifications
+ * \param removed_cb pointer to function for removal notifications
+ * \param user_data User data to be passed back to callbacks (useful for
+ * passing context information)
+ */
+void API_EXPORTED libusb_set_pollfd_notifiers(libusb_context *ctx,
+	libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
+	void *user_data)
+{
+	USBI_GET_CONTEXT(ctx);
+	ctx->fd_added_cb = added_cb;
+	ctx->fd_removed_cb = removed_cb;
+	ctx->fd_cb_user_data = user_data;
 }
 
-/* remove a transfer from the active transfers list.
- * This function will *always* remove the transfer from the
- * flying_transfers list. It will return a LIBUSB_ERROR code
- * if it fails to update the timer for the next timeout. */
-static int remove_from_flying_list(struct usbi_transfer *transfer)
+/*
+ * Interrupt the iteration of the event handling thread, so that it picks
+ * up the fd change. Callers of this function must hold the event_data_lock.
+ */
+static void usbi_fd_notification(struct libusb_context *ctx)
 {
-	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
-	int rearm_timerfd;
-	int r = 0;
-
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	rearm_timerfd = (timerisset(&transfer->timeout) &&
-		list_first_entry(&ctx->flying_transfers, struct usbi_transfer, list) == transfer);
-	list_del(&transfer->list);
-	if (usbi_using_timerfd(ctx) && rearm_timerfd)
-		r = arm_timerfd_for_next_timeout(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+#ifdef USBI_EPOLL_AVAILABLE
+	/* epoll picks up fd changes on its own, even in the middle of a wait */
+	UNUSED(ctx);
+#else
+	int pending_events;
 
-	return r;
+	/* Record that there is a new poll fd.
+	 * Only signal an event if there are no prior pending events. */
+	pending_events = usbi_pending_events(ctx);
+	ctx->event_flags |= USBI_EVENT_POLLFDS_MODIFIED;
+	if (!pending_events)
+		usbi_signal_event(ctx);
+#endif
 }
 
-/** \ingroup libusb_asyncio
- * Submit a transfer. This function will fire off the USB transfer and then
- * return immediately.
- *
- * \param transfer the transfer to submit
- * \returns 0 on success
- * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
- * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
- * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
- * by the operating system.
- * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer size is larger than
- * the operating system and/or hardware can support
- * \returns another LIBUSB_ERROR code on other failure
- */
-int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+/* Add a file descriptor to the list of file descriptors to be monitored.
+ * events should be specified as a bitmask of events passed to poll(), e.g.
+ * POLLIN and/or POLLOUT. */
+int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	struct libusb_context *ctx = TRANSFER_CTX(transfer);
-	int r;
-
-	usbi_dbg("transfer %p", transfer);
+	struct usbi_pollfd *ipollfd = malloc(sizeof(*ipollfd));
+	if (!ipollfd)
+		return LIBUSB_ERROR_NO_MEM;
 
-	/*
-	 * Important note on locking, this function takes / releases locks
-	 * in the following order:
-	 *  take flying_transfers_lock
-	 *  take itransfer->lock
-	 *  clear transfer
-	 *  add to flying_transfers list
-	 *  release flying_transfers_lock
-	 *  submit transfer
-	 *  release itransfer->lock
-	 *  if submit failed:
-	 *   take flying_transfers_lock
-	 *   remove from flying_transfers list
-	 *   release flying_transfers_lock
-	 *
-	 * Note that it takes locks in the order a-b and then releases them
-	 * in the same order a-b. This is somewhat unusual but not wrong,
-	 * release order is not important as long as *all* locks are released
-	 * before re-acquiring any locks.
-	 *
-	 * This means that the ordering of first releasing itransfer->lock
-	 * and then re-acquiring the flying_transfers_list on error is
-	 * important and must not be changed!
-	 *
-	 * This is done this way because when we take both locks we must always
-	 * take flying_transfers_lock first to avoid ab-ba style deadlocks with
-	 * the timeout handling and usbi_handle_disconnect paths.
-	 *
-	 * And we cannot release itransfer->lock before the submission is
-	 * complete otherwise timeout handling for transfers with short
-	 * timeouts may run before submission.
-	 */
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	usbi_mutex_lock(&itransfer->lock);
-	if (itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_mutex_unlock(&itransfer->lock);
-		return LIBUSB_ERROR_BUSY;
-	}
-	itransfer->transferred = 0;
-	itransfer->state_flags = 0;
-	itransfer->timeout_flags = 0;
-	r = add_to_flying_list(itransfer);
-	if (r) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_mutex_unlock(&itransfer->lock);
-		return r;
-	}
-	/*
-	 * We must release the flying transfers lock here, because with
-	 * some backends the submit_transfer method is synchroneous.
-	 */
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_dbg("add fd %d events %d", fd, events);
+	ipollfd->pollfd.fd = fd;
+	ipollfd->pollfd.events = events;
 
-	r = usbi_backend->submit_transfer(itransfer);
-	if (r == LIBUSB_SUCCESS) {
-		itransfer->state_flags |= USBI_TRANSFER_IN_FLIGHT;
-		/* keep a reference to this device */
-		libusb_ref_device(transfer->dev_handle->dev);
+#ifdef USBI_EPOLL_AVAILABLE
+	{
+		/* the epoll event flags are the poll ones on Linux */
+		struct epoll_event event;
+
+		memset(&event, 0, sizeof(event));
+		event.events = events;
+		event.data.fd = fd;
+		if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			usbi_err(ctx, "failed to add fd %d to epoll, errno=%d", fd, errno);
+			free(ipollfd);
+			return LIBUSB_ERROR_OTHER;
+		}
 	}
-	usbi_mutex_unlock(&itransfer->lock);
+#endif
 
-	if (r != LIBUSB_SUCCESS)
-		remove_from_flying_list(itransfer);
+	usbi_mutex_lock(&ctx->event_data_lock);
+	list_add_tail(&ipollfd->list, &ctx->ipollfds);
+	ctx->pollfds_cnt++;
+	usbi_fd_notification(ctx);
+	usbi_mutex_unlock(&ctx->event_data_lock);
 
-	return r;
+	if (ctx->fd_added_cb)
+		ctx->fd_added_cb(fd, events, ctx->fd_cb_user_data);
+	return 0;
 }
 
-/** \ingroup libusb_asyncio
- * Asynchronously cancel a previously submitted transfer.
- * This function returns immediately, but this does not indicate cancellation
- * is complete. Your callback function will be invoked at some later time
- * with a transfer status of
- * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
- * "LIBUSB_TRANSFER_CANCELLED."
- *
- * \param transfer the transfer to cancel
- * \returns 0 on success
- * \returns LIBUSB_ERROR_NOT_FOUND if the transfer is not in progress,
- * already complete, or already cancelled.
- * \returns a LIBUSB_ERROR code on failure
- */
-int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+/* Remove a file descriptor from the list of file descriptors to be polled. */
+void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	int r;
+	struct usbi_pollfd *ipollfd;
+	int found = 0;
 
-	usbi_dbg("transfer %p", transfer );
-	usbi_mutex_lock(&itransfer->lock);
-	if (!(itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT)
-			|| (itransfer->state_flags & USBI_TRANSFER_CANCELLING)) {
-		r = LIBUSB_ERROR_NOT_FOUND;
-		goto out;
-	}
-	r = usbi_backend->cancel_transfer(itransfer);
-	if (r < 0) {
-		if (r != LIBUSB_ERROR_NOT_FOUND &&
-		    r != LIBUSB_ERROR_NO_DEVICE)
-			usbi_err(TRANSFER_CTX(transfer),
-				"cancel transfer failed error %d", r);
-		else
-			usbi_dbg("cancel transfer failed error %d", r);
+	usbi_dbg("remove fd %d", fd);
+	usbi_mutex_lock(&ctx->event_data_lock);
+	list_for_each_entry(ipollfd, &ctx->ipollfds, list, struct usbi_pollfd)
+		if (ipollfd->pollfd.fd == fd) {
+			found = 1;
+			break;
+		}
 
-		if (r == LIBUSB_ERROR_NO_DEVICE)
-			itransfer->state_flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
+	if (!found) {
+		usbi_dbg("couldn't find fd %d to remove", fd);
+		usbi_mutex_unlock(&ctx->event_data_lock);
+		return;
 	}
 
-	itransfer->state_flags |= USBI_TRANSFER_CANCELLING;
+#ifdef USBI_EPOLL_AVAILABLE
+	if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)
+		usbi_dbg("failed to remove fd %d from epoll, errno=%d", fd, errno);
+#endif
 
-out:
-	usbi_mutex_unlock(&itransfer->lock);
-	return r;
+	list_del(&ipollfd->list);
+	ctx->pollfds_cnt--;
+	usbi_fd_notification(ctx);
+	usbi_mutex_unlock(&ctx->event_data_lock);
+	free(ipollfd);
+	if (ctx->fd_removed_cb)
+		ctx->fd_removed_cb(fd, ctx->fd_cb_user_data);
 }
 
-/** \ingroup libusb_asyncio
- * Set a transfers bulk stream id. Note users are advised to use
- * libusb_fill_bulk_stream_transfer() instead of calling this function
- * directly.
+/** \ingroup libusb_poll
+ * Retrieve a list of file descriptors that should be polled by your main loop
+ * as libusb event sources.
  *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ * The returned list is NULL-terminated and should be freed with libusb_free_pollfds()
+ * when done. The actual list contents must not be touched.
  *
- * \param transfer the transfer to set the stream id for
- * \param stream_id the stream id to set
- * \see libusb_alloc_streams()
+ * As file descriptors are a Unix-specific concept, this function is not
+ * available on Windows and will always return NULL.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns a NULL-terminated list of libusb_pollfd structures
+ * \returns NULL on error
+ * \returns NULL on platforms where the functionality is not available
  */
-void API_EXPORTED libusb_transfer_set_stream_id(
-	struct libusb_transfer *transfer, uint32_t stream_id)
+DEFAULT_VISIBILITY
+const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
+	libusb_context *ctx)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+#ifndef OS_WINDOWS
+	struct libusb_pollfd **ret = NULL;
+	struct usbi_pollfd *ipollfd;
+	size_t i = 0;
+	USBI_GET_CONTEXT(ctx);
 
-	itransfer->stream_id = stream_id;
+	usbi_mutex_lock(&ctx->event_data_lock);
+
+	ret = calloc(ctx->pollfds_cnt + 1, sizeof(struct libusb_pollfd *));
+	if (!ret)
+		goto out;
+
+	list_for_each_entry(ipollfd, &ctx->ipollfds, list, struct usbi_pollfd)
+		ret[i++] = (struct libusb_pollfd *) ipollfd;
+	ret[ctx->pollfds_cnt] = NULL;
+
+out:
+	usbi_mutex_unlock(&ctx->event_data_lock);
+	return (const struct libusb_pollfd **) ret;
+#else
+	usbi_err(ctx, "external polling of libusb's internal descriptors "\
+		"is not yet supported on Windows platforms");
+	return NULL;
+#endif
 }
 
-/** \ingroup libusb_asyncio
- * Get a transfers bulk stream id.
+/** \ingroup libusb_poll
+ * Free a list of libusb_pollfd structures. This should be called for all
+ * pollfd lists allocated with libusb_get_pollfds().
  *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
  *
- * \param transfer the transfer to get the stream id for
- * \returns the stream id for the transfer
+ * It is legal to call this function with a NULL pollfd list. In this case,
+ * the function will simply return safely.
+ *
+ * \param pollfds the list of libusb_pollfd structures to free
  */
-uint32_t API_EXPORTED libusb_transfer_get_stream_id(
-	struct libusb_transfer *transfer)
+void API_EXPORTED libusb_free_pollfds(const struct libusb_pollfd **pollfds)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	if (!pollfds)
+		return;
 
-	return itransfer->stream_id;
+	free((void *)pollfds);
 }
 
-/* Handle completion of a transfer (completion might be an error condition).
- * This will invoke the user-supplied callback function, which may end up
- * freeing the transfer. Therefore you cannot use the transfer structure
- * after calling this function, and you should free all backend-specific
- * data before calling it.
- * Do not call this function with the usbi_transfer lock held. User-specified
- * callback functions may attempt to directly resubmit the transfer, which
- * will attempt to take the lock. */
-int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
-	enum libusb_transfer_status status)
+/* Backends may call this from handle_events to report disconnection of a
+ * device. This function ensures transfers get cancelled appropriately.
+ * Callers of this function must hold the events_lock.
+ */
+void usbi_handle_disconnect(struct libusb_device_handle *dev_handle)
 {
-	struct libusb_transfer *transfer =
-		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	struct libusb_device_handle *dev_handle = transfer->dev_handle;
-	uint8_t flags;
-	int r;
+	struct usbi_transfer *cur;
+	struct usbi_transfer *to_cancel;
 
-	r = remove_from_flying_list(itransfer);
-	if (r < 0)
-		usbi_err(ITRANSFER_CTX(itransfer), "failed to set timer for next timeout, errno=%d", errno);
+	usbi_dbg("device %d.%d",
+		dev_handle->dev->bus_number, dev_handle->dev->device_address);
 
-	usbi_mutex_lock(&itransfer->lock);
-	itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
-	usbi_mutex_unlock(&itransfer->lock);
+	/* terminate all pending transfers with the LIBUSB_TRANSFER_NO_DEVICE
+	 * status code.
+	 *
+	 * when we find a transfer for this device on the list, there are two
+	 * possible scenarios:
+	 * 1. the transfer is currently in-flight, in which case we terminate the
+	 *    transfer here
+	 * 2. the transfer has been added to the flying transfer list by
+	 *    libusb_submit_transfer, has failed to submit and
+	 *    libusb_submit_transfer is waiting for us to release the
+	 *    flying_transfers_lock to remove it, so we ignore it
+	 */
 
-	if (status == LIBUSB_TRANSFER_COMPLETED
-			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
-		int rqlen = transfer->length;
-		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
-			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
-		if (rqlen != itransfer->transferred) {
-			usbi_dbg("interpreting short transfer as error");
-			status = LIBUSB_TRANSFER_ERROR;
-		}
-	}
+	while (1) {
+		to_cancel = NULL;
+		usbi_mutex_lock(&HANDLE_CTX(dev_handle)->flying_transfers_lock);
+		list_for_each_entry(cur, &HANDLE_CTX(dev_handle)->flying_transfers, list, struct usbi_transfer)
+			if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(cur)->dev_handle == dev_handle) {
+				usbi_mutex_lock(&cur->lock);
+				if (cur->state_flags & USBI_TRANSFER_IN_FLIGHT)
+					to_cancel = cur;
+				usbi_mutex_unlock(&cur->lock);
 
-	flags = transfer->flags;
-	transfer->status = status;
-	transfer->actual_length = itransfer->transferred;
-	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
-	if (transfer->callback)
-		transfer->callback(transfer);
-	/* transfer might have been freed by the above call, do not use from
-	 * this point. */
-	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
-		libusb_free_transfer(transfer);
-	libusb_unref_device(dev_handle->dev);
-	return r;
-}
+				if (to_cancel)
+					break;
+			}
+		usbi_mutex_unlock(&HANDLE_CTX(dev_handle)->flying_transfers_lock);
 
-/* Similar to usbi_handle_transfer_completion() but exclusively for transfers
- * that were asynchronously cancelled. The same concerns w.r.t. freeing of
- * transfers exist here.
- * Do not call this function with the usbi_transfer lock held. User-specified
- * callback functions may attempt to directly resubmit the transfer, which
- * will attempt to take the lock. */
-int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
-{
-	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
-	uint8_t timed_out;
+		if (!to_cancel)
+			break;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	timed_out = transfer->timeout_flags & USBI_TRANSFER_TIMED_OUT;
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		usbi_dbg("cancelling transfer %p from disconnect",
+			 USBI_TRANSFER_TO_LIBUSB_TRANSFER(to_cancel));
 
-	/* if the URB was cancelled due to timeout, report timeout to the user */
-	if (timed_out) {
-		usbi_dbg("detected timeout cancellation");
-		return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_TIMED_OUT);
+		usbi_mutex_lock(&to_cancel->lock);
+		usbi_backend->clear_transfer_priv(to_cancel);
+		usbi_mutex_unlock(&to_cancel->lock);
+		usbi_handle_transfer_completion(to_cancel, LIBUSB_TRANSFER_NO_DEVICE);
 	}
 
-	/* otherwise its a normal async cancel */
-	return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_CANCELLED);
 }
+// line 1 "libusb/libusb/strerror.c"
+/*
+ * libusb strerror code
+ * Copyright © 2013 Hans de Goede <hdegoede@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
 
-/* Add a completed transfer to the completed_transfers list of the
- * context and signal the event. The backend's handle_transfer_completion()
- * function will be called the next time an event handler runs. */
-void usbi_signal_transfer_completion(struct usbi_transfer *transfer)
-{
-	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
-	int pending_events;
+// SKIP #include "libusb/libusb/config.h"
+// line 21 "libusb/libusb/strerror.c"
 
-	usbi_mutex_lock(&ctx->event_data_lock);
-	pending_events = usbi_pending_events(ctx);
-	list_add_tail(&transfer->completed_list, &ctx->completed_transfers);
-	if (!pending_events)
-		usbi_signal_event(ctx);
-	usbi_mutex_unlock(&ctx->event_data_lock);
-}
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(HAVE_STRINGS_H)
+#include <strings.h>
+#endif
+
+// SKIP #include "libusb/libusb/libusbi.h"
+// line 30 "libusb/libusb/strerror.c"
+
+#if defined(_MSC_VER)
+#define strncasecmp _strnicmp
+#endif
+
+static size_t usbi_locale = 0;
+
+/** \ingroup libusb_misc
+ * How to add a new \ref libusb_strerror() translation:
+ * <ol>
+ * <li> Download the latest \c strerror.c from:<br>
+ *      https://raw.github.com/libusb/libusb/master/libusb/sterror.c </li>
+ * <li> Open the file in an UTF-8 capable editor </li>
+ * <li> Add the 2 letter <a href="http://en.wikipedia.org/wiki/List_of_ISO_639-1_codes">ISO 639-1</a>
+ *      code for your locale at the end of \c usbi_locale_supported[]<br>
+ *    Eg. for Chinese, you would add "zh" so that:
+ *    \code... usbi_locale_supported[] = { "en", "nl", "fr" };\endcode
+ *    becomes:
+ *    \code... usbi_locale_supported[] = { "en", "nl", "fr", "zh" };\endcode </li>
+ * <li> Copy the <tt>{ / * English (en) * / ... }</tt> section and add it at the end of \c usbi_localized_errors<br>
+ *    Eg. for Chinese, the last section of \c usbi_localized_errors could look like:
+ *    \code
+ *     }, { / * Chinese (zh) * /
+ *         "Success",
+ *         ...
+ *         "Other error",
+ *     }
+ * };\endcode </li>
+ * <li> Translate each of the English messages from the section you copied into your language </li>
+ * <li> Save the file (in UTF-8 format) and send it to \c libusb-devel\@lists.sourceforge.net </li>
+ * </ol>
+ */
+
+static const char* usbi_locale_supported[] = { "en", "nl", "fr", "ru" };
+static const char* usbi_localized_errors[ARRAYSIZE(usbi_locale_supported)][LIBUSB_ERROR_COUNT] = {
+	{ /* English (en) */
+		"Success",
+		"Input/Output Error",
+		"Invalid parameter",
+		"Access denied (insufficient permissions)",
+		"No such device (it may have been disconnected)",
+		"Entity not found",
+		"Resource busy",
+		"Operation timed out",
+		"Overflow",
+		"Pipe error",
+		"System call interrupted (perhaps due to signal)",
+		"Insufficient memory",
+		"Operation not supported or unimplemented on this platform",
+		"Other error",
+	}, { /* Dutch (nl) */
+		"Gelukt",
+		"Invoer-/uitvoerfout",
+		"Ongeldig argument",
+		"Toegang geweigerd (onvoldoende toegangsrechten)",
+		"Apparaat bestaat niet (verbinding met apparaat verbroken?)",
+		"Niet gevonden",
+		"Apparaat of hulpbron is bezig",
+		"Bewerking verlopen",
+		"Waarde is te groot",
+		"Gebroken pijp",
+		"Onderbroken systeemaanroep",
+		"Onvoldoende geheugen beschikbaar",
+		"Bewerking wordt niet ondersteund",
+		"Andere fout",
+	}, { /* French (fr) */
+		"Succès",
+		"Erreur d'entrée/sortie",
+		"Paramètre invalide",
+		"Accès refusé (permissions insuffisantes)",
+		"Périphérique introuvable (peut-être déconnecté)",
+		"Elément introuvable",
+		"Resource déjà occupée",
+		"Operation expirée",
+		"Débordement",
+		"Erreur de pipe",
+		"Appel système abandonné (peut-être à cause d’un signal)",
+		"Mémoire insuffisante",
+		"Opération non supportée or non implémentée sur cette plateforme",
+		"Autre erreur",
+	}, { /* Russian (ru) */
+		"Успех",
+		"Ошибка ввода/вывода",
+		"Неверный параметр",
+		"Доступ запрещён (не хватает прав)",
+		"Устройство отсутствует (возможно, оно было отсоединено)",
+		"Элемент не найден",
+		"Ресурс занят",
+		"Истекло время ожидания операции",
+		"Переполнение",
+		"Ошибка канала",
+		"Системный вызов прерван (возможно, сигналом)",
+		"Память исчерпана",
+		"Операция не поддерживается данной платформой",
+		"Неизвестная ошибка"
+	}
+};
 
-/** \ingroup libusb_poll
- * Attempt to acquire the event handling lock. This lock is used to ensure that
- * only one thread is monitoring libusb event sources at any one time.
- *
- * You only need to use this lock if you are developing an application
- * which calls poll() or select() on libusb's file descriptors directly.
- * If you stick to libusb's event handling loop functions (e.g.
- * libusb_handle_events()) then you do not need to be concerned with this
- * locking.
+/** \ingroup libusb_misc
+ * Set the language, and only the language, not the encoding! used for
+ * translatable libusb messages.
  *
- * While holding this lock, you are trusted to actually be handling events.
- * If you are no longer handling events, you must call libusb_unlock_events()
- * as soon as possible.
+ * This takes a locale string in the default setlocale format: lang[-region]
+ * or lang[_country_region][.codeset]. Only the lang part of the string is
+ * used, and only 2 letter ISO 639-1 codes are accepted for it, such as "de".
+ * The optional region, country_region or codeset parts are ignored. This
+ * means that functions which return translatable strings will NOT honor the
+ * specified encoding. 
+ * All strings returned are encoded as UTF-8 strings.
  *
- * \param ctx the context to operate on, or NULL for the default context
- * \returns 0 if the lock was obtained successfully
- * \returns 1 if the lock was not obtained (i.e. another thread holds the lock)
- * \ref libusb_mtasync
- */
-int API_EXPORTED libusb_try_lock_events(libusb_context *ctx)
-{
-	int r;
-	unsigned int ru;
-	USBI_GET_CONTEXT(ctx);
-
-	/* is someone else waiting to close a device? if so, don't let this thread
-	 * start event handling */
-	usbi_mutex_lock(&ctx->event_data_lock);
-	ru = ctx->device_close;
-	usbi_mutex_unlock(&ctx->event_data_lock);
-	if (ru) {
-		usbi_dbg("someone else is closing a device");
-		return 1;
-	}
-
-	r = usbi_mutex_trylock(&ctx->events_lock);
-	if (r)
-		return 1;
-
-	ctx->event_handler_active = 1;
-	return 0;
-}
-
-/** \ingroup libusb_poll
- * Acquire the event handling lock, blocking until successful acquisition if
- * it is contended. This lock is used to ensure that only one thread is
- * monitoring libusb event sources at any one time.
+ * If libusb_setlocale() is not called, all messages will be in English.
  *
- * You only need to use this lock if you are developing an application
- * which calls poll() or select() on libusb's file descriptors directly.
- * If you stick to libusb's event handling loop functions (e.g.
- * libusb_handle_events()) then you do not need to be concerned with this
- * locking.
+ * The following functions return translatable strings: libusb_strerror().
+ * Note that the libusb log messages controlled through libusb_set_debug()
+ * are not translated, they are always in English.
  *
- * While holding this lock, you are trusted to actually be handling events.
- * If you are no longer handling events, you must call libusb_unlock_events()
- * as soon as possible.
+ * For POSIX UTF-8 environments if you want libusb to follow the standard
+ * locale settings, call libusb_setlocale(setlocale(LC_MESSAGES, NULL)),
+ * after your app has done its locale setup.
  *
- * \param ctx the context to operate on, or NULL for the default context
- * \ref libusb_mtasync
+ * \param locale locale-string in the form of lang[_country_region][.codeset]
+ * or lang[-region], where lang is a 2 letter ISO 639-1 code
+ * \returns LIBUSB_SUCCESS on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the locale doesn't meet the requirements
+ * \returns LIBUSB_ERROR_NOT_FOUND if the requested language is not supported
+ * \returns a LIBUSB_ERROR code on other errors
  */
-void API_EXPORTED libusb_lock_events(libusb_context *ctx)
-{
-	USBI_GET_CONTEXT(ctx);
-	usbi_mutex_lock(&ctx->events_lock);
-	ctx->event_handler_active = 1;
-}
 
-/** \ingroup libusb_poll
- * Release the lock previously acquired with libusb_try_lock_events() or
- * libusb_lock_events(). Releasing this lock will wake up any threads blocked
- * on libusb_wait_for_event().
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \ref libusb_mtasync
- */
-void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
+int API_EXPORTED libusb_setlocale(const char *locale)
 {
-	USBI_GET_CONTEXT(ctx);
-	ctx->event_handler_active = 0;
-	usbi_mutex_unlock(&ctx->events_lock);
-
-	/* FIXME: perhaps we should be a bit more efficient by not broadcasting
-	 * the availability of the events lock when we are modifying pollfds
-	 * (check ctx->device_close)? */
-	usbi_mutex_lock(&ctx->event_waiters_lock);
-	usbi_cond_broadcast(&ctx->event_waiters_cond);
-	usbi_mutex_unlock(&ctx->event_waiters_lock);
-}
+	size_t i;
 
-/** \ingroup libusb_poll
- * Determine if it is still OK for this thread to be doing event handling.
- *
- * Sometimes, libusb needs to temporarily pause all event handlers, and this
- * is the function you should use before polling file descriptors to see if
- * this is the case.
- *
- * If this function instructs your thread to give up the events lock, you
- * should just continue the usual logic that is documented in \ref libusb_mtasync.
- * On the next iteration, your thread will fail to obtain the events lock,
- * and will hence become an event waiter.
- *
- * This function should be called while the events lock is held: you don't
- * need to worry about the results of this function if your thread is not
- * the current event handler.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \returns 1 if event handling can start or continue
- * \returns 0 if this thread must give up the events lock
- * \ref fullstory "Multi-threaded I/O: the full story"
- */
-int API_EXPORTED libusb_event_handling_ok(libusb_context *ctx)
-{
-	unsigned int r;
-	USBI_GET_CONTEXT(ctx);
+	if ( (locale == NULL) || (strlen(locale) < 2)
+	  || ((strlen(locale) > 2) && (locale[2] != '-') && (locale[2] != '_') && (locale[2] != '.')) )
+		return LIBUSB_ERROR_INVALID_PARAM;
 
-	/* is someone else waiting to close a device? if so, don't let this thread
-	 * continue event handling */
-	usbi_mutex_lock(&ctx->event_data_lock);
-	r = ctx->device_close;
-	usbi_mutex_unlock(&ctx->event_data_lock);
-	if (r) {
-		usbi_dbg("someone else is closing a device");
-		return 0;
+	for (i=0; i<ARRAYSIZE(usbi_locale_supported); i++) {
+		if (strncasecmp(usbi_locale_supported[i], locale, 2) == 0)
+			break;
+	}
+	if (i >= ARRAYSIZE(usbi_locale_supported)) {
+		return LIBUSB_ERROR_NOT_FOUND;
 	}
 
-	return 1;
-}
+	usbi_locale = i;
 
+	return LIBUSB_SUCCESS;
+}
 
-/** \ingroup libusb_poll
- * Determine if an active thread is handling events (i.e. if anyone is holding
- * the event handling lock).
+/** \ingroup libusb_misc
+ * Returns a constant string with a short description of the given error code,
+ * this description is intended for displaying to the end user and will be in
+ * the language set by libusb_setlocale().
  *
- * \param ctx the context to operate on, or NULL for the default context
- * \returns 1 if a thread is handling events
- * \returns 0 if there are no threads currently handling events
- * \ref libusb_mtasync
+ * The returned string is encoded in UTF-8.
+ *
+ * The messages always start with a capital letter and end without any dot.
+ * The caller must not free() the returned string.
+ *
+ * \param errcode the error code whose description is desired
+ * \returns a short description of the error code in UTF-8 encoding
  */
-int API_EXPORTED libusb_event_handler_active(libusb_context *ctx)
+DEFAULT_VISIBILITY const char* LIBUSB_CALL libusb_strerror(enum libusb_error errcode)
 {
-	unsigned int r;
-	USBI_GET_CONTEXT(ctx);
+	int errcode_index = -errcode;
 
-	/* is someone else waiting to close a device? if so, don't let this thread
-	 * start event handling -- indicate that event handling is happening */
-	usbi_mutex_lock(&ctx->event_data_lock);
-	r = ctx->device_close;
-	usbi_mutex_unlock(&ctx->event_data_lock);
-	if (r) {
-		usbi_dbg("someone else is closing a device");
-		return 1;
+	if ((errcode_index < 0) || (errcode_index >= LIBUSB_ERROR_COUNT)) {
+		/* "Other Error", which should always be our last message, is returned */
+		errcode_index = LIBUSB_ERROR_COUNT - 1;
 	}
 
-	return ctx->event_handler_active;
+	return usbi_localized_errors[usbi_locale][errcode_index];
 }
-
-/** \ingroup libusb_poll
- * Interrupt any active thread that is handling events. This is mainly useful
- * for interrupting a dedicated event handling thread when an application
- * wishes to call libusb_exit().
+// line 1 "libusb/libusb/sync.c"
+/*
+ * Synchronous I/O functions for libusb
+ * Copyright © 2007-2008 Daniel Drake <dsd@gentoo.org>
  *
- * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
  *
- * \param ctx the context to operate on, or NULL for the default context
- * \ref libusb_mtasync
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
-void API_EXPORTED libusb_interrupt_event_handler(libusb_context *ctx)
-{
-	int pending_events;
-	USBI_GET_CONTEXT(ctx);
-
-	usbi_dbg("");
-	usbi_mutex_lock(&ctx->event_data_lock);
-
-	pending_events = usbi_pending_events(ctx);
-	ctx->event_flags |= USBI_EVENT_USER_INTERRUPT;
-	if (!pending_events)
-		usbi_signal_event(ctx);
-
-	usbi_mutex_unlock(&ctx->event_data_lock);
-}
 
-/** \ingroup libusb_poll
- * Acquire the event waiters lock. This lock is designed to be obtained under
- * the situation where you want to be aware when events are completed, but
- * some other thread is event handling so calling libusb_handle_events() is not
- * allowed.
- *
- * You then obtain this lock, re-check that another thread is still handling
- * events, then call libusb_wait_for_event().
- *
- * You only need to use this lock if you are developing an application
- * which calls poll() or select() on libusb's file descriptors directly,
- * <b>and</b> may potentially be handling events from 2 threads simultaenously.
- * If you stick to libusb's event handling loop functions (e.g.
- * libusb_handle_events()) then you do not need to be concerned with this
- * locking.
+// SKIP #include "libusb/libusb/config.h"
+// line 21 "libusb/libusb/sync.c"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// SKIP #include "libusb/libusb/libusbi.h"
+// line 28 "libusb/libusb/sync.c"
+
+/**
+ * @defgroup libusb_syncio Synchronous device I/O
  *
- * \param ctx the context to operate on, or NULL for the default context
- * \ref libusb_mtasync
+ * This page documents libusb's synchronous (blocking) API for USB device I/O.
+ * This interface is easy to use but has some limitations. More advanced users
+ * may wish to consider using the \ref libusb_asyncio "asynchronous I/O API" instead.
  */
-void API_EXPORTED libusb_lock_event_waiters(libusb_context *ctx)
+
+/* A synchronous transfer completes on whichever thread handles events. When
+ * that is another thread, typically a hidapi read thread sitting in
+ * libusb_handle_events(), the caller parks on a condition of its own which
+ * the completion callback signals. It then wakes up once, rather than along
+ * with all event waiters each time the event handler finishes a pass. */
+struct sync_transfer {
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	int completed;
+};
+
+/* How often a parked caller checks that some thread still handles events, in
+ * case the event handler went away for good */
+#define SYNC_PARK_CHECK_MS	10
+
+static void sync_transfer_init(struct sync_transfer *sync)
 {
-	USBI_GET_CONTEXT(ctx);
-	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_mutex_init(&sync->lock);
+	usbi_cond_init(&sync->cond);
+	sync->completed = 0;
 }
 
-/** \ingroup libusb_poll
- * Release the event waiters lock.
- * \param ctx the context to operate on, or NULL for the default context
- * \ref libusb_mtasync
- */
-void API_EXPORTED libusb_unlock_event_waiters(libusb_context *ctx)
+static void sync_transfer_destroy(struct sync_transfer *sync)
 {
-	USBI_GET_CONTEXT(ctx);
-	usbi_mutex_unlock(&ctx->event_waiters_lock);
+	usbi_cond_destroy(&sync->cond);
+	usbi_mutex_destroy(&sync->lock);
 }
 
-/** \ingroup libusb_poll
- * Wait for another thread to signal completion of an event. Must be called
- * with the event waiters lock held, see libusb_lock_event_waiters().
- *
- * This function will block until any of the following conditions are met:
- * -# The timeout expires
- * -# A transfer completes
- * -# A thread releases the event handling lock through libusb_unlock_events()
- *
- * Condition 1 is obvious. Condition 2 unblocks your thread <em>after</em>
- * the callback for the transfer has completed. Condition 3 is important
- * because it means that the thread that was previously handling events is no
- * longer doing so, so if any events are to complete, another thread needs to
- * step up and start event handling.
- *
- * This function releases the event waiters lock before putting your thread
- * to sleep, and reacquires the lock as it is being woken up.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \param tv maximum timeout for this blocking function. A NULL value
- * indicates unlimited timeout.
- * \returns 0 after a transfer completes or another thread stops event handling
- * \returns 1 if the timeout expired
- * \ref libusb_mtasync
- */
-int API_EXPORTED libusb_wait_for_event(libusb_context *ctx, struct timeval *tv)
+static void LIBUSB_CALL sync_transfer_cb(struct libusb_transfer *transfer)
 {
-	int r;
+	struct sync_transfer *sync = transfer->user_data;
 
-	USBI_GET_CONTEXT(ctx);
-	if (tv == NULL) {
-		usbi_cond_wait(&ctx->event_waiters_cond, &ctx->event_waiters_lock);
-		return 0;
-	}
+	usbi_dbg("actual_length=%d", transfer->actual_length);
+	usbi_mutex_lock(&sync->lock);
+	sync->completed = 1;
+	usbi_cond_signal(&sync->cond);
+	usbi_mutex_unlock(&sync->lock);
+	/* caller interprets result and frees transfer */
+}
 
-	r = usbi_cond_timedwait(&ctx->event_waiters_cond,
-		&ctx->event_waiters_lock, tv);
+/* Wait for the transfer to complete as long as another thread handles
+ * events. Returns 1 once the transfer completed, 0 if nobody handles events */
+static int sync_transfer_park(struct libusb_context *ctx,
+	struct sync_transfer *sync)
+{
+	struct timeval tv = { 0, SYNC_PARK_CHECK_MS * 1000 };
+	int completed;
 
-	if (r < 0)
-		return r;
-	else
-		return (r == ETIMEDOUT);
+	usbi_mutex_lock(&sync->lock);
+	while (!sync->completed && libusb_event_handler_active(ctx))
+		usbi_cond_timedwait(&sync->cond, &sync->lock, &tv);
+	completed = sync->completed;
+	usbi_mutex_unlock(&sync->lock);
+
+	return completed;
 }
 
-static void handle_timeout(struct usbi_transfer *itransfer)
+static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
 {
-	struct libusb_transfer *transfer =
-		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	int r;
+	struct sync_transfer *sync = transfer->user_data;
+	struct libusb_context *ctx = HANDLE_CTX(transfer->dev_handle);
 
-	itransfer->timeout_flags |= USBI_TRANSFER_TIMEOUT_HANDLED;
-	r = libusb_cancel_transfer(transfer);
-	if (r == LIBUSB_SUCCESS)
-		itransfer->timeout_flags |= USBI_TRANSFER_TIMED_OUT;
-	else
-		usbi_warn(TRANSFER_CTX(transfer),
-			"async cancel failed %d errno=%d", r, errno);
+	while (!sync_transfer_park(ctx, sync)) {
+		/* nobody else is handling events, do it on this thread */
+		r = libusb_handle_events_completed(ctx, &sync->completed);
+		if (r < 0) {
+			if (r == LIBUSB_ERROR_INTERRUPTED)
+				continue;
+			usbi_err(ctx, "libusb_handle_events failed: %s, cancelling transfer and retrying",
+				 libusb_error_name(r));
+			libusb_cancel_transfer(transfer);
+			continue;
+		}
+	}
 }
 
-static int handle_timeouts_locked(struct libusb_context *ctx)
+/** \ingroup libusb_syncio
+ * Perform a USB control transfer.
+ *
+ * The direction of the transfer is inferred from the bmRequestType field of
+ * the setup packet.
+ *
+ * The wValue, wIndex and wLength fields values should be given in host-endian
+ * byte order.
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param bmRequestType the request type field for the setup packet
+ * \param bRequest the request field for the setup packet
+ * \param wValue the value field for the setup packet
+ * \param wIndex the index field for the setup packet
+ * \param data a suitably-sized data buffer for either input or output
+ * (depending on direction bits within bmRequestType)
+ * \param wLength the length field for the setup packet. The data buffer should
+ * be at least this size.
+ * \param timeout timeout (in millseconds) that this function should wait
+ * before giving up due to no response being received. For an unlimited
+ * timeout, use value 0.
+ * \returns on success, the number of bytes actually transferred
+ * \returns LIBUSB_ERROR_TIMEOUT if the transfer timed out
+ * \returns LIBUSB_ERROR_PIPE if the control request was not supported by the
+ * device
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_BUSY if called from event handling context
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer size is larger than
+ * the operating system and/or hardware can support
+ * \returns another LIBUSB_ERROR code on other failures
+ */
+int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+	unsigned char *data, uint16_t wLength, unsigned int timeout)
 {
+	struct libusb_transfer *transfer;
+	struct sync_transfer sync;
+	unsigned char *buffer;
 	int r;
-	struct timespec systime_ts;
-	struct timeval systime;
-	struct usbi_transfer *transfer;
 
-	if (list_empty(&ctx->flying_transfers))
-		return 0;
+	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
+		return LIBUSB_ERROR_BUSY;
 
-	/* get current time */
-	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &systime_ts);
-	if (r < 0)
-		return r;
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer)
+		return LIBUSB_ERROR_NO_MEM;
 
-	TIMESPEC_TO_TIMEVAL(&systime, &systime_ts);
+	buffer = (unsigned char*) malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
+	if (!buffer) {
+		libusb_free_transfer(transfer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
 
-	/* iterate through flying transfers list, finding all transfers that
-	 * have expired timeouts */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		struct timeval *cur_tv = &transfer->timeout;
+	libusb_fill_control_setup(buffer, bmRequestType, bRequest, wValue, wIndex,
+		wLength);
+	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
+		memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
 
-		/* if we've reached transfers of infinite timeout, we're all done */
-		if (!timerisset(cur_tv))
-			return 0;
+	sync_transfer_init(&sync);
+	libusb_fill_control_transfer(transfer, dev_handle, buffer,
+		sync_transfer_cb, &sync, timeout);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		sync_transfer_destroy(&sync);
+		libusb_free_transfer(transfer);
+		return r;
+	}
 
-		/* ignore timeouts we've already handled */
-		if (transfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
+	sync_transfer_wait_for_completion(transfer);
+	sync_transfer_destroy(&sync);
 
-		/* if transfer has non-expired timeout, nothing more to do */
-		if ((cur_tv->tv_sec > systime.tv_sec) ||
-				(cur_tv->tv_sec == systime.tv_sec &&
-					cur_tv->tv_usec > systime.tv_usec))
-			return 0;
+	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
+		memcpy(data, libusb_control_transfer_get_data(transfer),
+			transfer->actual_length);
 
-		/* otherwise, we've got an expired timeout to handle */
-		handle_timeout(transfer);
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		r = transfer->actual_length;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		r = LIBUSB_ERROR_TIMEOUT;
+		break;
+	case LIBUSB_TRANSFER_STALL:
+		r = LIBUSB_ERROR_PIPE;
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		r = LIBUSB_ERROR_NO_DEVICE;
+		break;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		r = LIBUSB_ERROR_OVERFLOW;
+		break;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_CANCELLED:
+		r = LIBUSB_ERROR_IO;
+		break;
+	default:
+		usbi_warn(HANDLE_CTX(dev_handle),
+			"unrecognised status code %d", transfer->status);
+		r = LIBUSB_ERROR_OTHER;
 	}
-	return 0;
+
+	libusb_free_transfer(transfer);
+	return r;
 }
 
-static int handle_timeouts(struct libusb_context *ctx)
+static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned char *buffer, int length,
+	int *transferred, unsigned int timeout, unsigned char type)
 {
+	struct libusb_transfer *transfer;
+	struct sync_transfer sync;
 	int r;
-	USBI_GET_CONTEXT(ctx);
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	r = handle_timeouts_locked(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
+		return LIBUSB_ERROR_BUSY;
+
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer)
+		return LIBUSB_ERROR_NO_MEM;
+
+	sync_transfer_init(&sync);
+	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer, length,
+		sync_transfer_cb, &sync, timeout);
+	transfer->type = type;
+
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		sync_transfer_destroy(&sync);
+		libusb_free_transfer(transfer);
+		return r;
+	}
+
+	sync_transfer_wait_for_completion(transfer);
+	sync_transfer_destroy(&sync);
+
+	if (transferred)
+		*transferred = transfer->actual_length;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		r = 0;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		r = LIBUSB_ERROR_TIMEOUT;
+		break;
+	case LIBUSB_TRANSFER_STALL:
+		r = LIBUSB_ERROR_PIPE;
+		break;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		r = LIBUSB_ERROR_OVERFLOW;
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		r = LIBUSB_ERROR_NO_DEVICE;
+		break;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_CANCELLED:
+		r = LIBUSB_ERROR_IO;
+		break;
+	default:
+		usbi_warn(HANDLE_CTX(dev_handle),
+			"unrecognised status code %d", transfer->status);
+		r = LIBUSB_ERROR_OTHER;
+	}
+
+	libusb_free_transfer(transfer);
 	return r;
 }
 
-#ifdef USBI_TIMERFD_AVAILABLE
-static int handle_timerfd_trigger(struct libusb_context *ctx)
+/** \ingroup libusb_syncio
+ * Perform a USB bulk transfer. The direction of the transfer is inferred from
+ * the direction bits of the endpoint address.
+ *
+ * For bulk reads, the <tt>length</tt> field indicates the maximum length of
+ * data you are expecting to receive. If less data arrives than expected,
+ * this function will return that data, so be sure to check the
+ * <tt>transferred</tt> output parameter.
+ *
+ * You should also check the <tt>transferred</tt> parameter for bulk writes.
+ * Not all of the data may have been written.
+ *
+ * Also check <tt>transferred</tt> when dealing with a timeout error code.
+ * libusb may have to split your transfer into a number of chunks to satisfy
+ * underlying O/S requirements, meaning that the timeout may expire after
+ * the first few chunks have completed. libusb is careful not to lose any data
+ * that may have been transferred; do not assume that timeout conditions
+ * indicate a complete lack of I/O.
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param endpoint the address of a valid endpoint to communicate with
+ * \param data a suitably-sized data buffer for either input or output
+ * (depending on endpoint)
+ * \param length for bulk writes, the number of bytes from data to be sent. for
+ * bulk reads, the maximum number of bytes to receive into the data buffer.
+ * \param transferred output location for the number of bytes actually
+ * transferred. Since version 1.0.21 (\ref LIBUSB_API_VERSION >= 0x01000105),
+ * it is legal to pass a NULL pointer if you do not wish to receive this
+ * information.
+ * \param timeout timeout (in millseconds) that this function should wait
+ * before giving up due to no response being received. For an unlimited
+ * timeout, use value 0.
+ *
+ * \returns 0 on success (and populates <tt>transferred</tt>)
+ * \returns LIBUSB_ERROR_TIMEOUT if the transfer timed out (and populates
+ * <tt>transferred</tt>)
+ * \returns LIBUSB_ERROR_PIPE if the endpoint halted
+ * \returns LIBUSB_ERROR_OVERFLOW if the device offered more data, see
+ * \ref libusb_packetoverflow
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_BUSY if called from event handling context
+ * \returns another LIBUSB_ERROR code on other failures
+ */
+int API_EXPORTED libusb_bulk_transfer(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned char *data, int length, int *transferred,
+	unsigned int timeout)
 {
-	int r;
-
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-
-	/* process the timeout that just happened */
-	r = handle_timeouts_locked(ctx);
-	if (r < 0)
-		goto out;
-
-	/* arm for next timeout*/
-	r = arm_timerfd_for_next_timeout(ctx);
-
-out:
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-	return r;
+	return do_sync_bulk_transfer(dev_handle, endpoint, data, length,
+		transferred, timeout, LIBUSB_TRANSFER_TYPE_BULK);
 }
-#endif
 
-/* do the actual event handling. assumes that no other thread is concurrently
- * doing the same thing. */
-static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+/** \ingroup libusb_syncio
+ * Perform a USB interrupt transfer. The direction of the transfer is inferred
+ * from the direction bits of the endpoint address.
+ *
+ * For interrupt reads, the <tt>length</tt> field indicates the maximum length
+ * of data you are expecting to receive. If less data arrives than expected,
+ * this function will return that data, so be sure to check the
+ * <tt>transferred</tt> output parameter.
+ *
+ * You should also check the <tt>transferred</tt> parameter for interrupt
+ * writes. Not all of the data may have been written.
+ *
+ * Also check <tt>transferred</tt> when dealing with a timeout error code.
+ * libusb may have to split your transfer into a number of chunks to satisfy
+ * underlying O/S requirements, meaning that the timeout may expire after
+ * the first few chunks have completed. libusb is careful not to lose any data
+ * that may have been transferred; do not assume that timeout conditions
+ * indicate a complete lack of I/O.
+ *
+ * The default endpoint bInterval value is used as the polling interval.
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param endpoint the address of a valid endpoint to communicate with
+ * \param data a suitably-sized data buffer for either input or output
+ * (depending on endpoint)
+ * \param length for bulk writes, the number of bytes from data to be sent. for
+ * bulk reads, the maximum number of bytes to receive into the data buffer.
+ * \param transferred output location for the number of bytes actually
+ * transferred. Since version 1.0.21 (\ref LIBUSB_API_VERSION >= 0x01000105),
+ * it is legal to pass a NULL pointer if you do not wish to receive this
+ * information.
+ * \param timeout timeout (in millseconds) that this function should wait
+ * before giving up due to no response being received. For an unlimited
+ * timeout, use value 0.
+ *
+ * \returns 0 on success (and populates <tt>transferred</tt>)
+ * \returns LIBUSB_ERROR_TIMEOUT if the transfer timed out
+ * \returns LIBUSB_ERROR_PIPE if the endpoint halted
+ * \returns LIBUSB_ERROR_OVERFLOW if the device offered more data, see
+ * \ref libusb_packetoverflow
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_BUSY if called from event handling context
+ * \returns another LIBUSB_ERROR code on other error
+ */
+int API_EXPORTED libusb_interrupt_transfer(
+	struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	unsigned char *data, int length, int *transferred, unsigned int timeout)
 {
-	int r;
-	struct usbi_pollfd *ipollfd;
-	POLL_NFDS_TYPE nfds = 0;
-	POLL_NFDS_TYPE internal_nfds;
-	struct pollfd *fds = NULL;
-	int i = -1;
-	int timeout_ms;
-	int special_event;
-
-	/* prevent attempts to recursively handle events (e.g. calling into
-	 * libusb_handle_events() from within a hotplug or transfer callback) */
-	if (usbi_handling_events(ctx))
-		return LIBUSB_ERROR_BUSY;
-	usbi_start_event_handling(ctx);
-
-	/* there are certain fds that libusb uses internally, currently:
-	 *
-	 *   1) event pipe
-	 *   2) timerfd
-	 *
-	 * the backend will never need to attempt to handle events on these fds, so
-	 * we determine how many fds are in use internally for this context and when
-	 * handle_events() is called in the backend, the pollfd list and count will
-	 * be adjusted to skip over these internal fds */
-	if (usbi_using_timerfd(ctx))
-		internal_nfds = 2;
-	else
-		internal_nfds = 1;
-
-	/* only reallocate the poll fds when the list of poll fds has been modified
-	 * since the last poll, otherwise reuse them to save the additional overhead */
-	usbi_mutex_lock(&ctx->event_data_lock);
-	if (ctx->event_flags & USBI_EVENT_POLLFDS_MODIFIED) {
-		usbi_dbg("poll fds modified, reallocating");
+	return do_sync_bulk_transfer(dev_handle, endpoint, data, length,
+		transferred, timeout, LIBUSB_TRANSFER_TYPE_INTERRUPT);
+}
+// line 1 "hidapi/libusb/hid.c"
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
 
-		if (ctx->pollfds) {
-			free(ctx->pollfds);
-			ctx->pollfds = NULL;
-		}
+ Alan Ott
+ Signal 11 Software
 
-		/* sanity check - it is invalid for a context to have fewer than the
-		 * required internal fds (memory corruption?) */
-		assert(ctx->pollfds_cnt >= internal_nfds);
+ 8/22/2009
+ Linux Version - 6/2/2010
+ Libusb Version - 8/13/2010
+ FreeBSD Version - 11/1/2011
 
-		ctx->pollfds = calloc(ctx->pollfds_cnt, sizeof(*ctx->pollfds));
-		if (!ctx->pollfds) {
-			usbi_mutex_unlock(&ctx->event_data_lock);
-			r = LIBUSB_ERROR_NO_MEM;
-			goto done;
-		}
+ Copyright 2009, All Rights Reserved.
 
-		list_for_each_entry(ipollfd, &ctx->ipollfds, list, struct usbi_pollfd) {
-			struct libusb_pollfd *pollfd = &ipollfd->pollfd;
-			i++;
-			ctx->pollfds[i].fd = pollfd->fd;
-			ctx->pollfds[i].events = pollfd->events;
-		}
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        http://github.com/signal11/hidapi .
+********************************************************/
 
-		/* reset the flag now that we have the updated list */
-		ctx->event_flags &= ~USBI_EVENT_POLLFDS_MODIFIED;
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <locale.h>
+#include <errno.h>
 
-		/* if no further pending events, clear the event pipe so that we do
-		 * not immediately return from poll */
-		if (!usbi_pending_events(ctx))
-			usbi_clear_event(ctx);
-	}
-	fds = ctx->pollfds;
-	nfds = ctx->pollfds_cnt;
-	usbi_mutex_unlock(&ctx->event_data_lock);
+/* Unix */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <wchar.h>
 
-	timeout_ms = (int)(tv->tv_sec * 1000) + (tv->tv_usec / 1000);
+/* GNU / LibUSB */
+// SKIP #include "libusb/libusb/libusb.h"
+// line 46 "hidapi/libusb/hid.c"
+#ifndef __ANDROID__
+#include <iconv.h>
+#endif
 
-	/* round up to next millisecond */
-	if (tv->tv_usec % 1000)
-		timeout_ms++;
+// line 1 "hidapi/hidapi/hidapi.h"
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
 
-redo_poll:
-	usbi_dbg("poll() %d fds with timeout in %dms", nfds, timeout_ms);
-	r = usbi_poll(fds, nfds, timeout_ms);
-	usbi_dbg("poll() returned %d", r);
-	if (r == 0) {
-		r = handle_timeouts(ctx);
-		goto done;
-	}
-	else if (r == -1 && errno == EINTR) {
-		r = LIBUSB_ERROR_INTERRUPTED;
-		goto done;
-	}
-	else if (r < 0) {
-		usbi_err(ctx, "poll failed %d err=%d", r, errno);
-		r = LIBUSB_ERROR_IO;
-		goto done;
-	}
+ Alan Ott
+ Signal 11 Software
 
-	special_event = 0;
+ 8/22/2009
 
-	/* fds[0] is always the event pipe */
-	if (fds[0].revents) {
-		libusb_hotplug_message *message = NULL;
-		struct usbi_transfer *itransfer;
-		int ret = 0;
+ Copyright 2009, All Rights Reserved.
 
-		usbi_dbg("caught a fish on the event pipe");
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        http://github.com/signal11/hidapi .
+********************************************************/
 
-		/* take the the event data lock while processing events */
-		usbi_mutex_lock(&ctx->event_data_lock);
+/** @file
+ * @defgroup API hidapi API
+ */
 
-		/* check if someone added a new poll fd */
-		if (ctx->event_flags & USBI_EVENT_POLLFDS_MODIFIED)
-			usbi_dbg("someone updated the poll fds");
+#ifndef HIDAPI_H__
+#define HIDAPI_H__
 
-		if (ctx->event_flags & USBI_EVENT_USER_INTERRUPT) {
-			usbi_dbg("someone purposely interrupted");
-			ctx->event_flags &= ~USBI_EVENT_USER_INTERRUPT;
-		}
+#include <wchar.h>
 
-		/* check if someone is closing a device */
-		if (ctx->device_close)
-			usbi_dbg("someone is closing a device");
+#ifdef _WIN32
+      #define HID_API_EXPORT __declspec(dllexport)
+      #define HID_API_CALL
+#else
+      #define HID_API_EXPORT /**< API export macro */
+      #define HID_API_CALL /**< API call macro */
+#endif
 
-		/* check for any pending hotplug messages */
-		if (!list_empty(&ctx->hotplug_msgs)) {
-			usbi_dbg("hotplug message received");
-			special_event = 1;
-			message = list_first_entry(&ctx->hotplug_msgs, libusb_hotplug_message, list);
-			list_del(&message->list);
-		}
+#define HID_API_EXPORT_CALL HID_API_EXPORT HID_API_CALL /**< API export and call macro*/
 
-		/* complete any pending transfers */
-		while (ret == 0 && !list_empty(&ctx->completed_transfers)) {
-			itransfer = list_first_entry(&ctx->completed_transfers, struct usbi_transfer, completed_list);
-			list_del(&itransfer->completed_list);
-			usbi_mutex_unlock(&ctx->event_data_lock);
-			ret = usbi_backend->handle_transfer_completion(itransfer);
-			if (ret)
-				usbi_err(ctx, "backend handle_transfer_completion failed with error %d", ret);
-			usbi_mutex_lock(&ctx->event_data_lock);
-		}
+#ifdef __cplusplus
+extern "C" {
+#endif
+		struct hid_device_;
+		typedef struct hid_device_ hid_device; /**< opaque hidapi structure */
 
-		/* if no further pending events, clear the event pipe */
-		if (!usbi_pending_events(ctx))
-			usbi_clear_event(ctx);
+		/** hidapi info structure */
+		struct hid_device_info {
+			/** Platform-specific device path */
+			char *path;
+			/** Device Vendor ID */
+			unsigned short vendor_id;
+			/** Device Product ID */
+			unsigned short product_id;
+			/** Serial Number */
+			wchar_t *serial_number;
+			/** Device Release Number in binary-coded decimal,
+			    also known as Device Version Number */
+			unsigned short release_number;
+			/** Manufacturer String */
+			wchar_t *manufacturer_string;
+			/** Product string */
+			wchar_t *product_string;
+			/** Usage Page for this Device/Interface
+			    (Windows/Mac only). */
+			unsigned short usage_page;
+			/** Usage for this Device/Interface
+			    (Windows/Mac only).*/
+			unsigned short usage;
+			/** The USB interface which this logical device
+			    represents. Valid on both Linux implementations
+			    in all cases, and valid on the Windows implementation
+			    only if the device contains more than one interface. */
+			int interface_number;
 
-		usbi_mutex_unlock(&ctx->event_data_lock);
+			/** Pointer to the next device */
+			struct hid_device_info *next;
+		};
 
-		/* process the hotplug message, if any */
-		if (message) {
-			usbi_hotplug_match(ctx, message->device, message->event);
 
-			/* the device left, dereference the device */
-			if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == message->event)
-				libusb_unref_device(message->device);
+		/** @brief Initialize the HIDAPI library.
 
-			free(message);
-		}
+			This function initializes the HIDAPI library. Calling it is not
+			strictly necessary, as it will be called automatically by
+			hid_enumerate() and any of the hid_open_*() functions if it is
+			needed.  This function should be called at the beginning of
+			execution however, if there is a chance of HIDAPI handles
+			being opened by different threads simultaneously.
+			
+			@ingroup API
 
-		if (ret) {
-			/* return error code */
-			r = ret;
-			goto done;
-		}
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_init(void);
 
-		if (0 == --r)
-			goto handled;
-	}
+		/** @brief Finalize the HIDAPI library.
 
-#ifdef USBI_TIMERFD_AVAILABLE
-	/* on timerfd configurations, fds[1] is the timerfd */
-	if (usbi_using_timerfd(ctx) && fds[1].revents) {
-		/* timerfd indicates that a timeout has expired */
-		int ret;
-		usbi_dbg("timerfd triggered");
-		special_event = 1;
+			This function frees all of the static data associated with
+			HIDAPI. It should be called at the end of execution to avoid
+			memory leaks. Hotplug watches are interrupted, as by
+			hid_hotplug_watch_interrupt(), and still have to be
+			destroyed.
 
-		ret = handle_timerfd_trigger(ctx);
-		if (ret < 0) {
-			/* return error code */
-			r = ret;
-			goto done;
-		}
+			@ingroup API
 
-		if (0 == --r)
-			goto handled;
-	}
-#endif
+		    @returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_exit(void);
 
-	r = usbi_backend->handle_events(ctx, fds + internal_nfds, nfds - internal_nfds, r);
-	if (r)
-		usbi_err(ctx, "backend handle_events failed with error %d", r);
+		/** @brief Enumerate the HID Devices.
 
-handled:
-	if (r == 0 && special_event) {
-		timeout_ms = 0;
-		goto redo_poll;
-	}
+			This function returns a linked list of all the HID devices
+			attached to the system which match vendor_id and product_id.
+			If @p vendor_id is set to 0 then any vendor matches.
+			If @p product_id is set to 0 then any product matches.
+			If @p vendor_id and @p product_id are both set to 0, then
+			all HID devices will be returned.
 
-done:
-	usbi_end_event_handling(ctx);
-	return r;
-}
+			@ingroup API
+			@param vendor_id The Vendor ID (VID) of the types of device
+				to open.
+			@param product_id The Product ID (PID) of the types of
+				device to open.
 
-/* returns the smallest of:
- *  1. timeout of next URB
- *  2. user-supplied timeout
- * returns 1 if there is an already-expired timeout, otherwise returns 0
- * and populates out
- */
-static int get_next_timeout(libusb_context *ctx, struct timeval *tv,
-	struct timeval *out)
-{
-	struct timeval timeout;
-	int r = libusb_get_next_timeout(ctx, &timeout);
-	if (r) {
-		/* timeout already expired? */
-		if (!timerisset(&timeout))
-			return 1;
+		    @returns
+		    	This function returns a pointer to a linked list of type
+		    	struct #hid_device, containing information about the HID devices
+		    	attached to the system, or NULL in the case of failure. Free
+		    	this linked list by calling hid_free_enumeration().
+		*/
+		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned short vendor_id, unsigned short product_id);
 
-		/* choose the smallest of next URB timeout or user specified timeout */
-		if (timercmp(&timeout, tv, <))
-			*out = timeout;
-		else
-			*out = *tv;
-	} else {
-		*out = *tv;
-	}
-	return 0;
-}
+		/** @brief Free an enumeration Linked List
 
-/** \ingroup libusb_poll
- * Handle any pending events.
- *
- * libusb determines "pending events" by checking if any timeouts have expired
- * and by checking the set of file descriptors for activity.
- *
- * If a zero timeval is passed, this function will handle any already-pending
- * events and then immediately return in non-blocking style.
- *
- * If a non-zero timeval is passed and no events are currently pending, this
- * function will block waiting for events to handle up until the specified
- * timeout. If an event arrives or a signal is raised, this function will
- * return early.
- *
- * If the parameter completed is not NULL then <em>after obtaining the event
- * handling lock</em> this function will return immediately if the integer
- * pointed to is not 0. This allows for race free waiting for the completion
- * of a specific transfer.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \param tv the maximum time to block waiting for events, or an all zero
- * timeval struct for non-blocking mode
- * \param completed pointer to completion integer to check, or NULL
- * \returns 0 on success, or a LIBUSB_ERROR code on failure
- * \ref libusb_mtasync
- */
-int API_EXPORTED libusb_handle_events_timeout_completed(libusb_context *ctx,
-	struct timeval *tv, int *completed)
-{
-	int r;
-	struct timeval poll_timeout;
+		    This function frees a linked list created by hid_enumerate().
+
+			@ingroup API
+		    @param devs Pointer to a list of struct_device returned from
+		    	      hid_enumerate().
+		*/
+		void  HID_API_EXPORT HID_API_CALL hid_free_enumeration(struct hid_device_info *devs);
+
+		/** hidapi packed enumeration record
+
+			All string members are byte offsets into the string area
+			of the owning #hid_snapshot. Strings are UTF-8 encoded and
+			NUL terminated, the accompanying length excludes the
+			terminator. An absent string has a length of zero.
+		*/
+		struct hid_snapshot_entry {
+			/** Platform-specific device path */
+			unsigned int path, path_len;
+			/** Serial Number */
+			unsigned int serial_number, serial_number_len;
+			/** Manufacturer String */
+			unsigned int manufacturer_string, manufacturer_string_len;
+			/** Product string */
+			unsigned int product_string, product_string_len;
+			/** Device Vendor ID */
+			unsigned short vendor_id;
+			/** Device Product ID */
+			unsigned short product_id;
+			/** Device Release Number in binary-coded decimal */
+			unsigned short release_number;
+			/** The USB interface which this logical device represents */
+			int interface_number;
+		};
 
-	USBI_GET_CONTEXT(ctx);
-	r = get_next_timeout(ctx, tv, &poll_timeout);
-	if (r) {
-		/* timeout already expired */
-		return handle_timeouts(ctx);
-	}
+		/** hidapi packed enumeration result
 
-retry:
-	if (libusb_try_lock_events(ctx) == 0) {
-		if (completed == NULL || !*completed) {
-			/* we obtained the event lock: do our own event handling */
-			usbi_dbg("doing our own event handling");
-			r = handle_events(ctx, &poll_timeout);
-		}
-		libusb_unlock_events(ctx);
-		return r;
-	}
+			The header, the entry array and the string area share a
+			single allocation, so the whole result can be consumed
+			and released without walking a linked list.
+		*/
+		struct hid_snapshot {
+			/** Number of records in @p entries */
+			size_t count;
+			/** Size in bytes of the whole allocation */
+			size_t size;
+			/** Array of @p count records */
+			struct hid_snapshot_entry *entries;
+			/** String area referenced by the records */
+			const char *strings;
+		};
 
-	/* another thread is doing event handling. wait for thread events that
-	 * notify event completion. */
-	libusb_lock_event_waiters(ctx);
+		/** @brief Enumerate the HID Devices into a packed buffer.
 
-	if (completed && *completed)
-		goto already_done;
+			This function behaves like hid_enumerate(), but returns
+			its result as one contiguous block instead of a linked
+			list of individually allocated records.
 
-	if (!libusb_event_handler_active(ctx)) {
-		/* we hit a race: whoever was event handling earlier finished in the
-		 * time it took us to reach this point. try the cycle again. */
-		libusb_unlock_event_waiters(ctx);
-		usbi_dbg("event handler was active but went away, retrying");
-		goto retry;
-	}
+			@ingroup API
+			@param vendor_id The Vendor ID (VID) of the types of device
+				to open.
+			@param product_id The Product ID (PID) of the types of
+				device to open.
 
-	usbi_dbg("another thread is doing event handling");
-	r = libusb_wait_for_event(ctx, &poll_timeout);
+		    @returns
+		    	This function returns a pointer to a #hid_snapshot, or
+		    	NULL in the case of failure. A successful enumeration
+		    	without any matching device yields an empty snapshot.
+		    	Free it by calling hid_free_snapshot().
+		*/
+		struct hid_snapshot HID_API_EXPORT * HID_API_CALL hid_enumerate_snapshot(unsigned short vendor_id, unsigned short product_id);
 
-already_done:
-	libusb_unlock_event_waiters(ctx);
+		/** @brief Free a packed enumeration
 
-	if (r < 0)
-		return r;
-	else if (r == 1)
-		return handle_timeouts(ctx);
-	else
-		return 0;
-}
+			@ingroup API
+		    @param snapshot Pointer returned from hid_enumerate_snapshot().
+		*/
+		void  HID_API_EXPORT HID_API_CALL hid_free_snapshot(struct hid_snapshot *snapshot);
 
-/** \ingroup libusb_poll
- * Handle any pending events
- *
- * Like libusb_handle_events_timeout_completed(), but without the completed
- * parameter, calling this function is equivalent to calling
- * libusb_handle_events_timeout_completed() with a NULL completed parameter.
- *
- * This function is kept primarily for backwards compatibility.
- * All new code should call libusb_handle_events_completed() or
- * libusb_handle_events_timeout_completed() to avoid race conditions.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \param tv the maximum time to block waiting for events, or an all zero
- * timeval struct for non-blocking mode
- * \returns 0 on success, or a LIBUSB_ERROR code on failure
- */
-int API_EXPORTED libusb_handle_events_timeout(libusb_context *ctx,
-	struct timeval *tv)
-{
-	return libusb_handle_events_timeout_completed(ctx, tv, NULL);
-}
+		struct hid_hotplug_watch_;
+		typedef struct hid_hotplug_watch_ hid_hotplug_watch; /**< opaque hotplug watch */
 
-/** \ingroup libusb_poll
- * Handle any pending events in blocking mode. There is currently a timeout
- * hardcoded at 60 seconds but we plan to make it unlimited in future. For
- * finer control over whether this function is blocking or non-blocking, or
- * for control over the timeout, use libusb_handle_events_timeout_completed()
- * instead.
- *
- * This function is kept primarily for backwards compatibility.
- * All new code should call libusb_handle_events_completed() or
- * libusb_handle_events_timeout_completed() to avoid race conditions.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \returns 0 on success, or a LIBUSB_ERROR code on failure
- */
-int API_EXPORTED libusb_handle_events(libusb_context *ctx)
-{
-	struct timeval tv;
-	tv.tv_sec = 60;
-	tv.tv_usec = 0;
-	return libusb_handle_events_timeout_completed(ctx, &tv, NULL);
-}
+		/** Device arrival or removal as reported by a #hid_hotplug_watch */
+		enum hid_hotplug_event_type {
+			/** A HID device has been plugged in */
+			HID_HOTPLUG_ARRIVED = 1,
+			/** A HID device has been unplugged */
+			HID_HOTPLUG_LEFT = 2,
+		};
 
-/** \ingroup libusb_poll
- * Handle any pending events in blocking mode.
- *
- * Like libusb_handle_events(), with the addition of a completed parameter
- * to allow for race free waiting for the completion of a specific transfer.
- *
- * See libusb_handle_events_timeout_completed() for details on the completed
- * parameter.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \param completed pointer to completion integer to check, or NULL
- * \returns 0 on success, or a LIBUSB_ERROR code on failure
- * \ref libusb_mtasync
- */
-int API_EXPORTED libusb_handle_events_completed(libusb_context *ctx,
-	int *completed)
-{
-	struct timeval tv;
-	tv.tv_sec = 60;
-	tv.tv_usec = 0;
-	return libusb_handle_events_timeout_completed(ctx, &tv, completed);
-}
+		/** hidapi hotplug event */
+		struct hid_hotplug_event {
+			/** One of #hid_hotplug_event_type */
+			int event;
+			/** Linked list of the HID interfaces of the device. The
+			    strings are not available for removed devices. */
+			struct hid_device_info *devs;
+			/** Pointer to the next event */
+			struct hid_hotplug_event *next;
+		};
 
-/** \ingroup libusb_poll
- * Handle any pending events by polling file descriptors, without checking if
- * any other threads are already doing so. Must be called with the event lock
- * held, see libusb_lock_events().
- *
- * This function is designed to be called under the situation where you have
- * taken the event lock and are calling poll()/select() directly on libusb's
- * file descriptors (as opposed to using libusb_handle_events() or similar).
- * You detect events on libusb's descriptors, so you then call this function
- * with a zero timeout value (while still holding the event lock).
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \param tv the maximum time to block waiting for events, or zero for
- * non-blocking mode
- * \returns 0 on success, or a LIBUSB_ERROR code on failure
- * \ref libusb_mtasync
- */
-int API_EXPORTED libusb_handle_events_locked(libusb_context *ctx,
-	struct timeval *tv)
-{
-	int r;
-	struct timeval poll_timeout;
+		/** @brief Start watching for HID device arrival and removal.
 
-	USBI_GET_CONTEXT(ctx);
-	r = get_next_timeout(ctx, tv, &poll_timeout);
-	if (r) {
-		/* timeout already expired */
-		return handle_timeouts(ctx);
-	}
+			The devices attached at the time of the call are reported
+			as arrivals by the first call to hid_hotplug_watch_wait(),
+			so no device is missed between an enumeration and the
+			watch. A device may therefore be reported to arrive twice.
 
-	return handle_events(ctx, &poll_timeout);
-}
+			@ingroup API
 
-/** \ingroup libusb_poll
- * Determines whether your application must apply special timing considerations
- * when monitoring libusb's file descriptors.
- *
- * This function is only useful for applications which retrieve and poll
- * libusb's file descriptors in their own main loop (\ref libusb_pollmain).
- *
- * Ordinarily, libusb's event handler needs to be called into at specific
- * moments in time (in addition to times when there is activity on the file
- * descriptor set). The usual approach is to use libusb_get_next_timeout()
- * to learn about when the next timeout occurs, and to adjust your
- * poll()/select() timeout accordingly so that you can make a call into the
- * library at that time.
- *
- * Some platforms supported by libusb do not come with this baggage - any
- * events relevant to timing will be represented by activity on the file
- * descriptor set, and libusb_get_next_timeout() will always return 0.
- * This function allows you to detect whether you are running on such a
- * platform.
- *
- * Since v1.0.5.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \returns 0 if you must call into libusb at times determined by
- * libusb_get_next_timeout(), or 1 if all timeout events are handled internally
- * or through regular activity on the file descriptors.
- * \ref libusb_pollmain "Polling libusb file descriptors for event handling"
- */
-int API_EXPORTED libusb_pollfds_handle_timeouts(libusb_context *ctx)
-{
-#if defined(USBI_TIMERFD_AVAILABLE)
-	USBI_GET_CONTEXT(ctx);
-	return usbi_using_timerfd(ctx);
-#else
-	UNUSED(ctx);
-	return 0;
-#endif
-}
+			@returns
+				This function returns a pointer to a #hid_hotplug_watch
+				object on success or NULL if hotplug notifications are
+				not available. Free it by calling
+				hid_hotplug_watch_destroy().
+		*/
+		hid_hotplug_watch HID_API_EXPORT * HID_API_CALL hid_hotplug_watch_create(void);
 
-/** \ingroup libusb_poll
- * Determine the next internal timeout that libusb needs to handle. You only
- * need to use this function if you are calling poll() or select() or similar
- * on libusb's file descriptors yourself - you do not need to use it if you
- * are calling libusb_handle_events() or a variant directly.
- *
- * You should call this function in your main loop in order to determine how
- * long to wait for select() or poll() to return results. libusb needs to be
- * called into at this timeout, so you should use it as an upper bound on
- * your select() or poll() call.
- *
- * When the timeout has expired, call into libusb_handle_events_timeout()
- * (perhaps in non-blocking mode) so that libusb can handle the timeout.
- *
- * This function may return 1 (success) and an all-zero timeval. If this is
- * the case, it indicates that libusb has a timeout that has already expired
- * so you should call libusb_handle_events_timeout() or similar immediately.
- * A return code of 0 indicates that there are no pending timeouts.
- *
- * On some platforms, this function will always returns 0 (no pending
- * timeouts). See \ref polltime.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \param tv output location for a relative time against the current
- * clock in which libusb must be called into in order to process timeout events
- * \returns 0 if there are no pending timeouts, 1 if a timeout was returned,
- * or LIBUSB_ERROR_OTHER on failure
- */
-int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
-	struct timeval *tv)
-{
-	struct usbi_transfer *transfer;
-	struct timespec cur_ts;
-	struct timeval cur_tv;
-	struct timeval next_timeout = { 0, 0 };
-	int r;
+		/** @brief Wait for the next batch of hotplug events.
 
-	USBI_GET_CONTEXT(ctx);
-	if (usbi_using_timerfd(ctx))
-		return 0;
+			This function blocks, taking part in the USB event
+			handling, until devices arrive or leave or the watch is
+			interrupted.
+
+			@ingroup API
+			@param watch A watch handle returned from hid_hotplug_watch_create().
+
+			@returns
+				This function returns a linked list of events, or NULL
+				once the watch has been interrupted. Free the list by
+				calling hid_hotplug_free_events().
+		*/
+		struct hid_hotplug_event HID_API_EXPORT * HID_API_CALL hid_hotplug_watch_wait(hid_hotplug_watch *watch);
+
+		/** @brief Wake up and stop a watch.
+
+			May be called from any thread. Every pending and future
+			hid_hotplug_watch_wait() on the watch returns NULL.
+
+			@ingroup API
+			@param watch A watch handle returned from hid_hotplug_watch_create().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_hotplug_watch_interrupt(hid_hotplug_watch *watch);
+
+		/** @brief Stop watching and release a watch.
+
+			Must not be called while a hid_hotplug_watch_wait() on the
+			watch is still in progress.
+
+			@ingroup API
+			@param watch A watch handle returned from hid_hotplug_watch_create().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_hotplug_watch_destroy(hid_hotplug_watch *watch);
+
+		/** @brief Free a list of events returned from hid_hotplug_watch_wait().
+
+			@ingroup API
+			@param events Pointer to the head of the list.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_hotplug_free_events(struct hid_hotplug_event *events);
+
+		/** @brief Open a HID device using a Vendor ID (VID), Product ID
+			(PID) and optionally a serial number.
+
+			If @p serial_number is NULL, the first device with the
+			specified VID and PID is opened.
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	if (list_empty(&ctx->flying_transfers)) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_dbg("no URBs, no timeout!");
-		return 0;
-	}
+			@ingroup API
+			@param vendor_id The Vendor ID (VID) of the device to open.
+			@param product_id The Product ID (PID) of the device to open.
+			@param serial_number The Serial Number of the device to open
+				               (Optionally NULL).
 
-	/* find next transfer which hasn't already been processed as timed out */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		if (transfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
+			@returns
+				This function returns a pointer to a #hid_device object on
+				success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_device * HID_API_CALL hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number);
 
-		/* if we've reached transfers of infinte timeout, we're done looking */
-		if (!timerisset(&transfer->timeout))
-			break;
+		/** @brief Open a HID device by its path name.
 
-		next_timeout = transfer->timeout;
-		break;
-	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+			The path name be determined by calling hid_enumerate(), or a
+			platform-specific path name can be used (eg: /dev/hidraw0 on
+			Linux).
 
-	if (!timerisset(&next_timeout)) {
-		usbi_dbg("no URB with timeout or all handled by OS; no timeout!");
-		return 0;
-	}
+			@ingroup API
+		    @param path The path name of the device to open
 
-	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &cur_ts);
-	if (r < 0) {
-		usbi_err(ctx, "failed to read monotonic clock, errno=%d", errno);
-		return 0;
-	}
-	TIMESPEC_TO_TIMEVAL(&cur_tv, &cur_ts);
+			@returns
+				This function returns a pointer to a #hid_device object on
+				success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_device * HID_API_CALL hid_open_path(const char *path);
 
-	if (!timercmp(&cur_tv, &next_timeout, <)) {
-		usbi_dbg("first timeout already expired");
-		timerclear(tv);
-	} else {
-		timersub(&next_timeout, &cur_tv, tv);
-		usbi_dbg("next timeout in %d.%06ds", tv->tv_sec, tv->tv_usec);
-	}
+		/** @brief Open a HID device by its path name on a given context.
 
-	return 1;
-}
+			Devices are spread over the libusb contexts set up with
+			hid_set_context_count(), each of which has its own event
+			handling. hid_open_path() picks the context from a hash
+			of the path, this function lets the caller choose it.
 
-/** \ingroup libusb_poll
- * Register notification functions for file descriptor additions/removals.
- * These functions will be invoked for every new or removed file descriptor
- * that libusb uses as an event source.
- *
- * To remove notifiers, pass NULL values for the function pointers.
- *
- * Note that file descriptors may have been added even before you register
- * these notifiers (e.g. at libusb_init() time).
- *
- * Additionally, note that the removal notifier may be called during
- * libusb_exit() (e.g. when it is closing file descriptors that were opened
- * and added to the poll set at libusb_init() time). If you don't want this,
- * remove the notifiers immediately before calling libusb_exit().
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \param added_cb pointer to function for addition notifications
- * \param removed_cb pointer to function for removal notifications
- * \param user_data User data to be passed back to callbacks (useful for
- * passing context information)
- */
-void API_EXPORTED libusb_set_pollfd_notifiers(libusb_context *ctx,
-	libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
-	void *user_data)
-{
-	USBI_GET_CONTEXT(ctx);
-	ctx->fd_added_cb = added_cb;
-	ctx->fd_removed_cb = removed_cb;
-	ctx->fd_cb_user_data = user_data;
-}
+			@ingroup API
+			@param path The path name of the device to open
+			@param context The index of the context to open the device
+				on, or -1 to pick it from the path.
 
-/*
- * Interrupt the iteration of the event handling thread, so that it picks
- * up the fd change. Callers of this function must hold the event_data_lock.
- */
-static void usbi_fd_notification(struct libusb_context *ctx)
-{
-	int pending_events;
+			@returns
+				This function returns a pointer to a #hid_device object on
+				success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_device * HID_API_CALL hid_open_path_context(const char *path, int context);
 
-	/* Record that there is a new poll fd.
-	 * Only signal an event if there are no prior pending events. */
-	pending_events = usbi_pending_events(ctx);
-	ctx->event_flags |= USBI_EVENT_POLLFDS_MODIFIED;
-	if (!pending_events)
-		usbi_signal_event(ctx);
-}
+		/** @brief Open every HID interface of a composite device.
 
-/* Add a file descriptor to the list of file descriptors to be monitored.
- * events should be specified as a bitmask of events passed to poll(), e.g.
- * POLLIN and/or POLLOUT. */
-int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
-{
-	struct usbi_pollfd *ipollfd = malloc(sizeof(*ipollfd));
-	if (!ipollfd)
-		return LIBUSB_ERROR_NO_MEM;
+			The interfaces are claimed on a single libusb handle of
+			the device, and their input reports are received by a
+			single thread, where hid_open_path() would open the device
+			and start a thread once per interface. Each interface gets
+			its own #hid_device, closed with hid_close() as usual. The
+			device itself is closed along with the last of them.
 
-	usbi_dbg("add fd %d events %d", fd, events);
-	ipollfd->pollfd.fd = fd;
-	ipollfd->pollfd.events = events;
-	usbi_mutex_lock(&ctx->event_data_lock);
-	list_add_tail(&ipollfd->list, &ctx->ipollfds);
-	ctx->pollfds_cnt++;
-	usbi_fd_notification(ctx);
-	usbi_mutex_unlock(&ctx->event_data_lock);
+			@ingroup API
+			@param path The path name of any HID interface of the
+				device, as returned from hid_enumerate().
+			@param devs Array receiving the #hid_device of each HID
+				interface, by order of the configuration descriptor.
+			@param max The size of @p devs.
 
-	if (ctx->fd_added_cb)
-		ctx->fd_added_cb(fd, events, ctx->fd_cb_user_data);
-	return 0;
-}
+			@returns
+				This function returns the number of interfaces
+				opened, or -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_open_interfaces(const char *path, hid_device **devs, int max);
 
-/* Remove a file descriptor from the list of file descriptors to be polled. */
-void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
-{
-	struct usbi_pollfd *ipollfd;
-	int found = 0;
+		/** @brief Set the number of libusb contexts devices are spread over.
 
-	usbi_dbg("remove fd %d", fd);
-	usbi_mutex_lock(&ctx->event_data_lock);
-	list_for_each_entry(ipollfd, &ctx->ipollfds, list, struct usbi_pollfd)
-		if (ipollfd->pollfd.fd == fd) {
-			found = 1;
-			break;
-		}
+			Every context has its own event lock and transfer lists,
+			so the completions of devices opened on different contexts
+			are handled without contending with each other. Enumeration
+			and hotplug notifications always use the first context.
 
-	if (!found) {
-		usbi_dbg("couldn't find fd %d to remove", fd);
-		usbi_mutex_unlock(&ctx->event_data_lock);
-		return;
-	}
+			The count can only be changed while the library is not
+			initialized, that is before the first call to hid_init()
+			or any function calling it, or after hid_exit().
 
-	list_del(&ipollfd->list);
-	ctx->pollfds_cnt--;
-	usbi_fd_notification(ctx);
-	usbi_mutex_unlock(&ctx->event_data_lock);
-	free(ipollfd);
-	if (ctx->fd_removed_cb)
-		ctx->fd_removed_cb(fd, ctx->fd_cb_user_data);
-}
+			@ingroup API
+			@param count The number of contexts, from 1 to
+				HID_MAX_CONTEXTS. The default is 1.
 
-/** \ingroup libusb_poll
- * Retrieve a list of file descriptors that should be polled by your main loop
- * as libusb event sources.
- *
- * The returned list is NULL-terminated and should be freed with libusb_free_pollfds()
- * when done. The actual list contents must not be touched.
- *
- * As file descriptors are a Unix-specific concept, this function is not
- * available on Windows and will always return NULL.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \returns a NULL-terminated list of libusb_pollfd structures
- * \returns NULL on error
- * \returns NULL on platforms where the functionality is not available
- */
-DEFAULT_VISIBILITY
-const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
-	libusb_context *ctx)
-{
-#ifndef OS_WINDOWS
-	struct libusb_pollfd **ret = NULL;
-	struct usbi_pollfd *ipollfd;
-	size_t i = 0;
-	USBI_GET_CONTEXT(ctx);
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_set_context_count(int count);
 
-	usbi_mutex_lock(&ctx->event_data_lock);
+		/** @brief Write an Output report to a HID device.
 
-	ret = calloc(ctx->pollfds_cnt + 1, sizeof(struct libusb_pollfd *));
-	if (!ret)
-		goto out;
+			The first byte of @p data[] must contain the Report ID. For
+			devices which only support a single report, this must be set
+			to 0x0. The remaining bytes contain the report data. Since
+			the Report ID is mandatory, calls to hid_write() will always
+			contain one more byte than the report contains. For example,
+			if a hid report is 16 bytes long, 17 bytes must be passed to
+			hid_write(), the Report ID (or 0x0, for devices with a
+			single report), followed by the report data (16 bytes). In
+			this example, the length passed in would be 17.
 
-	list_for_each_entry(ipollfd, &ctx->ipollfds, list, struct usbi_pollfd)
-		ret[i++] = (struct libusb_pollfd *) ipollfd;
-	ret[ctx->pollfds_cnt] = NULL;
+			hid_write() will send the data on the first OUT endpoint, if
+			one exists. If it does not, it will send the data through
+			the Control Endpoint (Endpoint 0).
 
-out:
-	usbi_mutex_unlock(&ctx->event_data_lock);
-	return (const struct libusb_pollfd **) ret;
-#else
-	usbi_err(ctx, "external polling of libusb's internal descriptors "\
-		"is not yet supported on Windows platforms");
-	return NULL;
-#endif
-}
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data The data to send, including the report number as
+				the first byte.
+			@param length The length in bytes of the data to send.
 
-/** \ingroup libusb_poll
- * Free a list of libusb_pollfd structures. This should be called for all
- * pollfd lists allocated with libusb_get_pollfds().
- *
- * Since version 1.0.20, \ref LIBUSB_API_VERSION >= 0x01000104
- *
- * It is legal to call this function with a NULL pollfd list. In this case,
- * the function will simply return safely.
- *
- * \param pollfds the list of libusb_pollfd structures to free
- */
-void API_EXPORTED libusb_free_pollfds(const struct libusb_pollfd **pollfds)
-{
-	if (!pollfds)
-		return;
+			@returns
+				This function returns the actual number of bytes written and
+				-1 on error.
+		*/
+		int  HID_API_EXPORT HID_API_CALL hid_write(hid_device *device, const unsigned char *data, size_t length);
 
-	free((void *)pollfds);
-}
+		/** @brief Read an Input report from a HID device with timeout.
 
-/* Backends may call this from handle_events to report disconnection of a
- * device. This function ensures transfers get cancelled appropriately.
- * Callers of this function must hold the events_lock.
- */
-void usbi_handle_disconnect(struct libusb_device_handle *dev_handle)
-{
-	struct usbi_transfer *cur;
-	struct usbi_transfer *to_cancel;
+			Input reports are returned
+			to the host through the INTERRUPT IN endpoint. The first byte will
+			contain the Report number if the device uses numbered reports.
 
-	usbi_dbg("device %d.%d",
-		dev_handle->dev->bus_number, dev_handle->dev->device_address);
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data A buffer to put the read data into.
+			@param length The number of bytes to read. For devices with
+				multiple reports, make sure to read an extra byte for
+				the report number.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the actual number of bytes read and
+				-1 on error. If no packet was available to be read within
+				the timeout period, this function returns 0.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds);
 
-	/* terminate all pending transfers with the LIBUSB_TRANSFER_NO_DEVICE
-	 * status code.
-	 *
-	 * when we find a transfer for this device on the list, there are two
-	 * possible scenarios:
-	 * 1. the transfer is currently in-flight, in which case we terminate the
-	 *    transfer here
-	 * 2. the transfer has been added to the flying transfer list by
-	 *    libusb_submit_transfer, has failed to submit and
-	 *    libusb_submit_transfer is waiting for us to release the
-	 *    flying_transfers_lock to remove it, so we ignore it
-	 */
+		/** @brief Read an Input report from a HID device.
 
-	while (1) {
-		to_cancel = NULL;
-		usbi_mutex_lock(&HANDLE_CTX(dev_handle)->flying_transfers_lock);
-		list_for_each_entry(cur, &HANDLE_CTX(dev_handle)->flying_transfers, list, struct usbi_transfer)
-			if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(cur)->dev_handle == dev_handle) {
-				usbi_mutex_lock(&cur->lock);
-				if (cur->state_flags & USBI_TRANSFER_IN_FLIGHT)
-					to_cancel = cur;
-				usbi_mutex_unlock(&cur->lock);
+			Input reports are returned
+		    to the host through the INTERRUPT IN endpoint. The first byte will
+			contain the Report number if the device uses numbered reports.
 
-				if (to_cancel)
-					break;
-			}
-		usbi_mutex_unlock(&HANDLE_CTX(dev_handle)->flying_transfers_lock);
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data A buffer to put the read data into.
+			@param length The number of bytes to read. For devices with
+				multiple reports, make sure to read an extra byte for
+				the report number.
 
-		if (!to_cancel)
-			break;
+			@returns
+				This function returns the actual number of bytes read and
+				-1 on error. If no packet was available to be read and
+				the handle is in non-blocking mode, this function returns 0.
+		*/
+		int  HID_API_EXPORT HID_API_CALL hid_read(hid_device *device, unsigned char *data, size_t length);
 
-		usbi_dbg("cancelling transfer %p from disconnect",
-			 USBI_TRANSFER_TO_LIBUSB_TRANSFER(to_cancel));
+		/** @brief Set the device handle to be non-blocking.
 
-		usbi_mutex_lock(&to_cancel->lock);
-		usbi_backend->clear_transfer_priv(to_cancel);
-		usbi_mutex_unlock(&to_cancel->lock);
-		usbi_handle_transfer_completion(to_cancel, LIBUSB_TRANSFER_NO_DEVICE);
-	}
+			In non-blocking mode calls to hid_read() will return
+			immediately with a value of 0 if there is no data to be
+			read. In blocking mode, hid_read() will wait (block) until
+			there is data to read before returning.
 
-}
-// line 1 "libusb/libusb/strerror.c"
-/*
- * libusb strerror code
- * Copyright © 2013 Hans de Goede <hdegoede@redhat.com>
- *
- * This library is free software; you can redistribute it and/or
- * modify it under the terms of the GNU Lesser General Public
- * License as published by the Free Software Foundation; either
- * version 2.1 of the License, or (at your option) any later version.
- *
- * This library is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
- * Lesser General Public License for more details.
- *
- * You should have received a copy of the GNU Lesser General Public
- * License along with this library; if not, write to the Free Software
- * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
- */
+			Nonblocking can be turned on and off at any time.
 
-// SKIP #include "libusb/libusb/config.h"
-// line 21 "libusb/libusb/strerror.c"
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param nonblock enable or not the nonblocking reads
+			 - 1 to enable nonblocking
+			 - 0 to disable nonblocking.
 
-#include <locale.h>
-#include <stdlib.h>
-#include <string.h>
-#if defined(HAVE_STRINGS_H)
-#include <strings.h>
-#endif
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int  HID_API_EXPORT HID_API_CALL hid_set_nonblocking(hid_device *device, int nonblock);
 
-// SKIP #include "libusb/libusb/libusbi.h"
-// line 30 "libusb/libusb/strerror.c"
+		/** @brief Send a Feature report to the device.
 
-#if defined(_MSC_VER)
-#define strncasecmp _strnicmp
-#endif
+			Feature reports are sent over the Control endpoint as a
+			Set_Report transfer.  The first byte of @p data[] must
+			contain the Report ID. For devices which only support a
+			single report, this must be set to 0x0. The remaining bytes
+			contain the report data. Since the Report ID is mandatory,
+			calls to hid_send_feature_report() will always contain one
+			more byte than the report contains. For example, if a hid
+			report is 16 bytes long, 17 bytes must be passed to
+			hid_send_feature_report(): the Report ID (or 0x0, for
+			devices which do not use numbered reports), followed by the
+			report data (16 bytes). In this example, the length passed
+			in would be 17.
 
-static size_t usbi_locale = 0;
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data The data to send, including the report number as
+				the first byte.
+			@param length The length in bytes of the data to send, including
+				the report number.
 
-/** \ingroup libusb_misc
- * How to add a new \ref libusb_strerror() translation:
- * <ol>
- * <li> Download the latest \c strerror.c from:<br>
- *      https://raw.github.com/libusb/libusb/master/libusb/sterror.c </li>
- * <li> Open the file in an UTF-8 capable editor </li>
- * <li> Add the 2 letter <a href="http://en.wikipedia.org/wiki/List_of_ISO_639-1_codes">ISO 639-1</a>
- *      code for your locale at the end of \c usbi_locale_supported[]<br>
- *    Eg. for Chinese, you would add "zh" so that:
- *    \code... usbi_locale_supported[] = { "en", "nl", "fr" };\endcode
- *    becomes:
- *    \code... usbi_locale_supported[] = { "en", "nl", "fr", "zh" };\endcode </li>
- * <li> Copy the <tt>{ / * English (en) * / ... }</tt> section and add it at the end of \c usbi_localized_errors<br>
- *    Eg. for Chinese, the last section of \c usbi_localized_errors could look like:
- *    \code
- *     }, { / * Chinese (zh) * /
- *         "Success",
- *         ...
- *         "Other error",
- *     }
- * };\endcode </li>
- * <li> Translate each of the English messages from the section you copied into your language </li>
- * <li> Save the file (in UTF-8 format) and send it to \c libusb-devel\@lists.sourceforge.net </li>
- * </ol>
- */
+			@returns
+				This function returns the actual number of bytes written and
+				-1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_send_feature_report(hid_device *device, const unsigned char *data, size_t length);
 
-static const char* usbi_locale_supported[] = { "en", "nl", "fr", "ru" };
-static const char* usbi_localized_errors[ARRAYSIZE(usbi_locale_supported)][LIBUSB_ERROR_COUNT] = {
-	{ /* English (en) */
-		"Success",
-		"Input/Output Error",
-		"Invalid parameter",
-		"Access denied (insufficient permissions)",
-		"No such device (it may have been disconnected)",
-		"Entity not found",
-		"Resource busy",
-		"Operation timed out",
-		"Overflow",
-		"Pipe error",
-		"System call interrupted (perhaps due to signal)",
-		"Insufficient memory",
-		"Operation not supported or unimplemented on this platform",
-		"Other error",
-	}, { /* Dutch (nl) */
-		"Gelukt",
-		"Invoer-/uitvoerfout",
-		"Ongeldig argument",
-		"Toegang geweigerd (onvoldoende toegangsrechten)",
-		"Apparaat bestaat niet (verbinding met apparaat verbroken?)",
-		"Niet gevonden",
-		"Apparaat of hulpbron is bezig",
-		"Bewerking verlopen",
-		"Waarde is te groot",
-		"Gebroken pijp",
-		"Onderbroken systeemaanroep",
-		"Onvoldoende geheugen beschikbaar",
-		"Bewerking wordt niet ondersteund",
-		"Andere fout",
-	}, { /* French (fr) */
-		"Succès",
-		"Erreur d'entrée/sortie",
-		"Paramètre invalide",
-		"Accès refusé (permissions insuffisantes)",
-		"Périphérique introuvable (peut-être déconnecté)",
-		"Elément introuvable",
-		"Resource déjà occupée",
-		"Operation expirée",
-		"Débordement",
-		"Erreur de pipe",
-		"Appel système abandonné (peut-être à cause d’un signal)",
-		"Mémoire insuffisante",
-		"Opération non supportée or non implémentée sur cette plateforme",
-		"Autre erreur",
-	}, { /* Russian (ru) */
-		"Успех",
-		"Ошибка ввода/вывода",
-		"Неверный параметр",
-		"Доступ запрещён (не хватает прав)",
-		"Устройство отсутствует (возможно, оно было отсоединено)",
-		"Элемент не найден",
-		"Ресурс занят",
-		"Истекло время ожидания операции",
-		"Переполнение",
-		"Ошибка канала",
-		"Системный вызов прерван (возможно, сигналом)",
-		"Память исчерпана",
-		"Операция не поддерживается данной платформой",
-		"Неизвестная ошибка"
-	}
-};
+		/** @brief Get a feature report from a HID device.
 
-/** \ingroup libusb_misc
- * Set the language, and only the language, not the encoding! used for
- * translatable libusb messages.
- *
- * This takes a locale string in the default setlocale format: lang[-region]
- * or lang[_country_region][.codeset]. Only the lang part of the string is
- * used, and only 2 letter ISO 639-1 codes are accepted for it, such as "de".
- * The optional region, country_region or codeset parts are ignored. This
- * means that functions which return translatable strings will NOT honor the
- * specified encoding. 
- * All strings returned are encoded as UTF-8 strings.
- *
- * If libusb_setlocale() is not called, all messages will be in English.
- *
- * The following functions return translatable strings: libusb_strerror().
- * Note that the libusb log messages controlled through libusb_set_debug()
- * are not translated, they are always in English.
- *
- * For POSIX UTF-8 environments if you want libusb to follow the standard
- * locale settings, call libusb_setlocale(setlocale(LC_MESSAGES, NULL)),
- * after your app has done its locale setup.
- *
- * \param locale locale-string in the form of lang[_country_region][.codeset]
- * or lang[-region], where lang is a 2 letter ISO 639-1 code
- * \returns LIBUSB_SUCCESS on success
- * \returns LIBUSB_ERROR_INVALID_PARAM if the locale doesn't meet the requirements
- * \returns LIBUSB_ERROR_NOT_FOUND if the requested language is not supported
- * \returns a LIBUSB_ERROR code on other errors
- */
+			Set the first byte of @p data[] to the Report ID of the
+			report to be read.  Make sure to allow space for this
+			extra byte in @p data[]. Upon return, the first byte will
+			still contain the Report ID, and the report data will
+			start in data[1].
 
-int API_EXPORTED libusb_setlocale(const char *locale)
-{
-	size_t i;
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data A buffer to put the read data into, including
+				the Report ID. Set the first byte of @p data[] to the
+				Report ID of the report to be read, or set it to zero
+				if your device does not use numbered reports.
+			@param length The number of bytes to read, including an
+				extra byte for the report ID. The buffer can be longer
+				than the actual report.
 
-	if ( (locale == NULL) || (strlen(locale) < 2)
-	  || ((strlen(locale) > 2) && (locale[2] != '-') && (locale[2] != '_') && (locale[2] != '.')) )
-		return LIBUSB_ERROR_INVALID_PARAM;
+			@returns
+				This function returns the number of bytes read plus
+				one for the report ID (which is still in the first
+				byte), or -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_feature_report(hid_device *device, unsigned char *data, size_t length);
 
-	for (i=0; i<ARRAYSIZE(usbi_locale_supported); i++) {
-		if (strncasecmp(usbi_locale_supported[i], locale, 2) == 0)
-			break;
-	}
-	if (i >= ARRAYSIZE(usbi_locale_supported)) {
-		return LIBUSB_ERROR_NOT_FOUND;
-	}
+		/** @brief Stop receiving input reports from a HID device.
 
-	usbi_locale = i;
+			Stops the background reader of the device and wakes up
+			every thread blocked in hid_read() or hid_read_timeout(),
+			which then return -1. The handle stays valid for other
+			threads still using it, but must eventually be released
+			with hid_close(). Calling it more than once is harmless.
 
-	return LIBUSB_SUCCESS;
-}
+			@ingroup API
+			@param device A device handle returned from hid_open().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_shutdown(hid_device *device);
 
-/** \ingroup libusb_misc
- * Returns a constant string with a short description of the given error code,
- * this description is intended for displaying to the end user and will be in
- * the language set by libusb_setlocale().
- *
- * The returned string is encoded in UTF-8.
- *
- * The messages always start with a capital letter and end without any dot.
- * The caller must not free() the returned string.
- *
- * \param errcode the error code whose description is desired
- * \returns a short description of the error code in UTF-8 encoding
- */
-DEFAULT_VISIBILITY const char* LIBUSB_CALL libusb_strerror(enum libusb_error errcode)
-{
-	int errcode_index = -errcode;
+		/** @brief Close a HID device.
 
-	if ((errcode_index < 0) || (errcode_index >= LIBUSB_ERROR_COUNT)) {
-		/* "Other Error", which should always be our last message, is returned */
-		errcode_index = LIBUSB_ERROR_COUNT - 1;
-	}
+			@ingroup API
+			@param device A device handle returned from hid_open().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_close(hid_device *device);
 
-	return usbi_localized_errors[usbi_locale][errcode_index];
-}
-// line 1 "libusb/libusb/sync.c"
-/*
- * Synchronous I/O functions for libusb
- * Copyright © 2007-2008 Daniel Drake <dsd@gentoo.org>
- *
- * This library is free software; you can redistribute it and/or
- * modify it under the terms of the GNU Lesser General Public
- * License as published by the Free Software Foundation; either
- * version 2.1 of the License, or (at your option) any later version.
- *
- * This library is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
- * Lesser General Public License for more details.
- *
- * You should have received a copy of the GNU Lesser General Public
- * License along with this library; if not, write to the Free Software
- * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
- */
+		/** @brief Get The Manufacturer String from a HID device.
 
-// SKIP #include "libusb/libusb/config.h"
-// line 21 "libusb/libusb/sync.c"
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param string A wide string buffer to put the data into.
+			@param maxlen The length of the buffer in multiples of wchar_t.
 
-#include <errno.h>
-#include <stdint.h>
-#include <stdlib.h>
-#include <string.h>
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *device, wchar_t *string, size_t maxlen);
 
-// SKIP #include "libusb/libusb/libusbi.h"
-// line 28 "libusb/libusb/sync.c"
+		/** @brief Get The Product String from a HID device.
 
-/**
- * @defgroup libusb_syncio Synchronous device I/O
- *
- * This page documents libusb's synchronous (blocking) API for USB device I/O.
- * This interface is easy to use but has some limitations. More advanced users
- * may wish to consider using the \ref libusb_asyncio "asynchronous I/O API" instead.
- */
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param string A wide string buffer to put the data into.
+			@param maxlen The length of the buffer in multiples of wchar_t.
 
-static void LIBUSB_CALL sync_transfer_cb(struct libusb_transfer *transfer)
-{
-	int *completed = transfer->user_data;
-	*completed = 1;
-	usbi_dbg("actual_length=%d", transfer->actual_length);
-	/* caller interprets result and frees transfer */
-}
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_get_product_string(hid_device *device, wchar_t *string, size_t maxlen);
 
-static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
-{
-	int r, *completed = transfer->user_data;
-	struct libusb_context *ctx = HANDLE_CTX(transfer->dev_handle);
+		/** @brief Get The Serial Number String from a HID device.
 
-	while (!*completed) {
-		r = libusb_handle_events_completed(ctx, completed);
-		if (r < 0) {
-			if (r == LIBUSB_ERROR_INTERRUPTED)
-				continue;
-			usbi_err(ctx, "libusb_handle_events failed: %s, cancelling transfer and retrying",
-				 libusb_error_name(r));
-			libusb_cancel_transfer(transfer);
-			continue;
-		}
-	}
-}
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param string A wide string buffer to put the data into.
+			@param maxlen The length of the buffer in multiples of wchar_t.
 
-/** \ingroup libusb_syncio
- * Perform a USB control transfer.
- *
- * The direction of the transfer is inferred from the bmRequestType field of
- * the setup packet.
- *
- * The wValue, wIndex and wLength fields values should be given in host-endian
- * byte order.
- *
- * \param dev_handle a handle for the device to communicate with
- * \param bmRequestType the request type field for the setup packet
- * \param bRequest the request field for the setup packet
- * \param wValue the value field for the setup packet
- * \param wIndex the index field for the setup packet
- * \param data a suitably-sized data buffer for either input or output
- * (depending on direction bits within bmRequestType)
- * \param wLength the length field for the setup packet. The data buffer should
- * be at least this size.
- * \param timeout timeout (in millseconds) that this function should wait
- * before giving up due to no response being received. For an unlimited
- * timeout, use value 0.
- * \returns on success, the number of bytes actually transferred
- * \returns LIBUSB_ERROR_TIMEOUT if the transfer timed out
- * \returns LIBUSB_ERROR_PIPE if the control request was not supported by the
- * device
- * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
- * \returns LIBUSB_ERROR_BUSY if called from event handling context
- * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer size is larger than
- * the operating system and/or hardware can support
- * \returns another LIBUSB_ERROR code on other failures
- */
-int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
-	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
-	unsigned char *data, uint16_t wLength, unsigned int timeout)
-{
-	struct libusb_transfer *transfer;
-	unsigned char *buffer;
-	int completed = 0;
-	int r;
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *device, wchar_t *string, size_t maxlen);
 
-	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
-		return LIBUSB_ERROR_BUSY;
+		/** @brief Get a string from a HID device, based on its string index.
 
-	transfer = libusb_alloc_transfer(0);
-	if (!transfer)
-		return LIBUSB_ERROR_NO_MEM;
+			Strings are read from the device the first time they are
+			asked for, by this function or the ones getting the
+			manufacturer, product and serial number strings, and kept
+			until the device is closed. hid_open() keeps the strings
+			it compared to find the device.
 
-	buffer = (unsigned char*) malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
-	if (!buffer) {
-		libusb_free_transfer(transfer);
-		return LIBUSB_ERROR_NO_MEM;
-	}
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param string_index The index of the string to get.
+			@param string A wide string buffer to put the data into.
+			@param maxlen The length of the buffer in multiples of wchar_t.
 
-	libusb_fill_control_setup(buffer, bmRequestType, bRequest, wValue, wIndex,
-		wLength);
-	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
-		memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *device, int string_index, wchar_t *string, size_t maxlen);
 
-	libusb_fill_control_transfer(transfer, dev_handle, buffer,
-		sync_transfer_cb, &completed, timeout);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
-	r = libusb_submit_transfer(transfer);
-	if (r < 0) {
-		libusb_free_transfer(transfer);
-		return r;
-	}
+		/** @brief Get a string describing the last error which occurred.
 
-	sync_transfer_wait_for_completion(transfer);
+			@ingroup API
+			@param device A device handle returned from hid_open(), or
+				NULL for the last error of the calling thread.
 
-	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
-		memcpy(data, libusb_control_transfer_get_data(transfer),
-			transfer->actual_length);
+			@returns
+				This function returns a string containing the last error
+				which occurred or NULL if none has occurred. The string
+				is static and must not be freed.
+		*/
+		HID_API_EXPORT const wchar_t* HID_API_CALL hid_error(hid_device *device);
 
-	switch (transfer->status) {
-	case LIBUSB_TRANSFER_COMPLETED:
-		r = transfer->actual_length;
-		break;
-	case LIBUSB_TRANSFER_TIMED_OUT:
-		r = LIBUSB_ERROR_TIMEOUT;
-		break;
-	case LIBUSB_TRANSFER_STALL:
-		r = LIBUSB_ERROR_PIPE;
-		break;
-	case LIBUSB_TRANSFER_NO_DEVICE:
-		r = LIBUSB_ERROR_NO_DEVICE;
-		break;
-	case LIBUSB_TRANSFER_OVERFLOW:
-		r = LIBUSB_ERROR_OVERFLOW;
-		break;
-	case LIBUSB_TRANSFER_ERROR:
-	case LIBUSB_TRANSFER_CANCELLED:
-		r = LIBUSB_ERROR_IO;
-		break;
-	default:
-		usbi_warn(HANDLE_CTX(dev_handle),
-			"unrecognised status code %d", transfer->status);
-		r = LIBUSB_ERROR_OTHER;
-	}
+		/** @brief Get the code of the last error which occurred.
 
-	libusb_free_transfer(transfer);
-	return r;
-}
+			Errors are recorded per device, and for the calling thread
+			regardless of the device. The latter is the only record of
+			failures to open a device.
 
-static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
-	unsigned char endpoint, unsigned char *buffer, int length,
-	int *transferred, unsigned int timeout, unsigned char type)
-{
-	struct libusb_transfer *transfer;
-	int completed = 0;
-	int r;
+			@ingroup API
+			@param device A device handle returned from hid_open(), or
+				NULL for the last error of the calling thread.
 
-	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
-		return LIBUSB_ERROR_BUSY;
+			@returns
+				This function returns the libusb error code (one of
+				enum libusb_error) of the last failure, or 0 if none
+				has occurred.
+		*/
+		int HID_API_EXPORT_CALL hid_error_code(hid_device *device);
+
+		/** Number of buckets of a latency histogram. Latencies are
+			counted in microseconds: below 8 each value has its
+			own bucket, above it every power of two range is split
+			in 8 equal buckets, up to 2^32 us which the last bucket
+			also counts. See hid_latency_bucket_floor(). */
+		#define HID_LATENCY_BUCKETS 240
+
+		/** A latency histogram of struct hid_device_stats. */
+		struct hid_latency_histogram
+		{
+			/** Number of latencies recorded */
+			unsigned long long count;
+			/** Sum of the latencies recorded, in nanoseconds */
+			unsigned long long sum_ns;
+			/** Number of latencies recorded per bucket */
+			unsigned long long buckets[HID_LATENCY_BUCKETS];
+		};
 
-	transfer = libusb_alloc_transfer(0);
-	if (!transfer)
-		return LIBUSB_ERROR_NO_MEM;
+		/** I/O counters of an open device. Input reports are counted
+			as the read thread receives them, regardless of whether
+			they are ever read with hid_read(). */
+		struct hid_device_stats
+		{
+			/** Input reports received from the device */
+			unsigned long long reports_received;
+			/** Input reports discarded because the queue was full */
+			unsigned long long reports_dropped;
+			/** Bytes of input reports received */
+			unsigned long long bytes_received;
+			/** Successful hid_write() calls */
+			unsigned long long writes;
+			/** Bytes written with hid_write() */
+			unsigned long long bytes_written;
+			/** Successful hid_get_feature_report() calls */
+			unsigned long long feature_gets;
+			/** Successful hid_send_feature_report() calls */
+			unsigned long long feature_sets;
+			/** Transfers which timed out, including input transfers
+				which saw no report for 5 seconds */
+			unsigned long long timeouts;
+			/** Transfers which failed for another reason */
+			unsigned long long errors;
+			/** Submit to complete latency of input transfers */
+			struct hid_latency_histogram read_latency;
+			/** Latency of hid_write() */
+			struct hid_latency_histogram write_latency;
+			/** Latency of feature report gets and sets */
+			struct hid_latency_histogram feature_latency;
+		};
 
-	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer, length,
-		sync_transfer_cb, &completed, timeout);
-	transfer->type = type;
+		/** @brief Get a snapshot of the I/O counters of a device.
 
-	r = libusb_submit_transfer(transfer);
-	if (r < 0) {
-		libusb_free_transfer(transfer);
-		return r;
-	}
+			The counters are updated without locking, so the snapshot
+			is not atomic as a whole: counters may be off by the
+			operations in flight while it is taken.
 
-	sync_transfer_wait_for_completion(transfer);
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param stats Output location for the counters.
 
-	if (transferred)
-		*transferred = transfer->actual_length;
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_get_device_stats(hid_device *device, struct hid_device_stats *stats);
 
-	switch (transfer->status) {
-	case LIBUSB_TRANSFER_COMPLETED:
-		r = 0;
-		break;
-	case LIBUSB_TRANSFER_TIMED_OUT:
-		r = LIBUSB_ERROR_TIMEOUT;
-		break;
-	case LIBUSB_TRANSFER_STALL:
-		r = LIBUSB_ERROR_PIPE;
-		break;
-	case LIBUSB_TRANSFER_OVERFLOW:
-		r = LIBUSB_ERROR_OVERFLOW;
-		break;
-	case LIBUSB_TRANSFER_NO_DEVICE:
-		r = LIBUSB_ERROR_NO_DEVICE;
-		break;
-	case LIBUSB_TRANSFER_ERROR:
-	case LIBUSB_TRANSFER_CANCELLED:
-		r = LIBUSB_ERROR_IO;
-		break;
-	default:
-		usbi_warn(HANDLE_CTX(dev_handle),
-			"unrecognised status code %d", transfer->status);
-		r = LIBUSB_ERROR_OTHER;
-	}
+		/** @brief Get the lowest latency counted by a histogram bucket.
 
-	libusb_free_transfer(transfer);
-	return r;
-}
+			@ingroup API
+			@param bucket The bucket index, below HID_LATENCY_BUCKETS.
 
-/** \ingroup libusb_syncio
- * Perform a USB bulk transfer. The direction of the transfer is inferred from
- * the direction bits of the endpoint address.
- *
- * For bulk reads, the <tt>length</tt> field indicates the maximum length of
- * data you are expecting to receive. If less data arrives than expected,
- * this function will return that data, so be sure to check the
- * <tt>transferred</tt> output parameter.
- *
- * You should also check the <tt>transferred</tt> parameter for bulk writes.
- * Not all of the data may have been written.
- *
- * Also check <tt>transferred</tt> when dealing with a timeout error code.
- * libusb may have to split your transfer into a number of chunks to satisfy
- * underlying O/S requirements, meaning that the timeout may expire after
- * the first few chunks have completed. libusb is careful not to lose any data
- * that may have been transferred; do not assume that timeout conditions
- * indicate a complete lack of I/O.
- *
- * \param dev_handle a handle for the device to communicate with
- * \param endpoint the address of a valid endpoint to communicate with
- * \param data a suitably-sized data buffer for either input or output
- * (depending on endpoint)
- * \param length for bulk writes, the number of bytes from data to be sent. for
- * bulk reads, the maximum number of bytes to receive into the data buffer.
- * \param transferred output location for the number of bytes actually
- * transferred. Since version 1.0.21 (\ref LIBUSB_API_VERSION >= 0x01000105),
- * it is legal to pass a NULL pointer if you do not wish to receive this
- * information.
- * \param timeout timeout (in millseconds) that this function should wait
- * before giving up due to no response being received. For an unlimited
- * timeout, use value 0.
- *
- * \returns 0 on success (and populates <tt>transferred</tt>)
- * \returns LIBUSB_ERROR_TIMEOUT if the transfer timed out (and populates
- * <tt>transferred</tt>)
- * \returns LIBUSB_ERROR_PIPE if the endpoint halted
- * \returns LIBUSB_ERROR_OVERFLOW if the device offered more data, see
- * \ref libusb_packetoverflow
- * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
- * \returns LIBUSB_ERROR_BUSY if called from event handling context
- * \returns another LIBUSB_ERROR code on other failures
- */
-int API_EXPORTED libusb_bulk_transfer(struct libusb_device_handle *dev_handle,
-	unsigned char endpoint, unsigned char *data, int length, int *transferred,
-	unsigned int timeout)
-{
-	return do_sync_bulk_transfer(dev_handle, endpoint, data, length,
-		transferred, timeout, LIBUSB_TRANSFER_TYPE_BULK);
-}
+			@returns
+				This function returns the lowest latency of the
+				bucket in microseconds, the bucket counting the
+				latencies up to the floor of the next one.
+		*/
+		unsigned long long HID_API_EXPORT_CALL hid_latency_bucket_floor(int bucket);
+
+		/** Where the input transfer buffer of a device lives, see
+			hid_get_read_buffer_mode(). */
+		enum hid_buffer_mode {
+			/** Heap memory, which the kernel copies every report
+				into from a bounce buffer */
+			HID_BUFFER_HEAP = 0,
+			/** Device memory mapped from usbfs, which the host
+				controller writes reports to directly */
+			HID_BUFFER_DEVICE = 1,
+		};
 
-/** \ingroup libusb_syncio
- * Perform a USB interrupt transfer. The direction of the transfer is inferred
- * from the direction bits of the endpoint address.
- *
- * For interrupt reads, the <tt>length</tt> field indicates the maximum length
- * of data you are expecting to receive. If less data arrives than expected,
- * this function will return that data, so be sure to check the
- * <tt>transferred</tt> output parameter.
- *
- * You should also check the <tt>transferred</tt> parameter for interrupt
- * writes. Not all of the data may have been written.
- *
- * Also check <tt>transferred</tt> when dealing with a timeout error code.
- * libusb may have to split your transfer into a number of chunks to satisfy
- * underlying O/S requirements, meaning that the timeout may expire after
- * the first few chunks have completed. libusb is careful not to lose any data
- * that may have been transferred; do not assume that timeout conditions
- * indicate a complete lack of I/O.
- *
- * The default endpoint bInterval value is used as the polling interval.
- *
- * \param dev_handle a handle for the device to communicate with
- * \param endpoint the address of a valid endpoint to communicate with
- * \param data a suitably-sized data buffer for either input or output
- * (depending on endpoint)
- * \param length for bulk writes, the number of bytes from data to be sent. for
- * bulk reads, the maximum number of bytes to receive into the data buffer.
- * \param transferred output location for the number of bytes actually
- * transferred. Since version 1.0.21 (\ref LIBUSB_API_VERSION >= 0x01000105),
- * it is legal to pass a NULL pointer if you do not wish to receive this
- * information.
- * \param timeout timeout (in millseconds) that this function should wait
- * before giving up due to no response being received. For an unlimited
- * timeout, use value 0.
- *
- * \returns 0 on success (and populates <tt>transferred</tt>)
- * \returns LIBUSB_ERROR_TIMEOUT if the transfer timed out
- * \returns LIBUSB_ERROR_PIPE if the endpoint halted
- * \returns LIBUSB_ERROR_OVERFLOW if the device offered more data, see
- * \ref libusb_packetoverflow
- * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
- * \returns LIBUSB_ERROR_BUSY if called from event handling context
- * \returns another LIBUSB_ERROR code on other error
- */
-int API_EXPORTED libusb_interrupt_transfer(
-	struct libusb_device_handle *dev_handle, unsigned char endpoint,
-	unsigned char *data, int length, int *transferred, unsigned int timeout)
-{
-	return do_sync_bulk_transfer(dev_handle, endpoint, data, length,
-		transferred, timeout, LIBUSB_TRANSFER_TYPE_INTERRUPT);
-}
-// line 1 "hidapi/libusb/hid.c"
-/*******************************************************
- HIDAPI - Multi-Platform library for
- communication with HID devices.
+		/** @brief Get where the input reports of a device are received.
 
- Alan Ott
- Signal 11 Software
+			Devices opened on kernels supporting usbfs memory
+			mapping receive their input reports without an extra
+			copy in the kernel, others fall back to heap buffers.
 
- 8/22/2009
- Linux Version - 6/2/2010
- Libusb Version - 8/13/2010
- FreeBSD Version - 11/1/2011
+			@ingroup API
+			@param device A device handle returned from hid_open().
 
- Copyright 2009, All Rights Reserved.
+			@returns
+				This function returns one of enum hid_buffer_mode.
+		*/
+		int HID_API_EXPORT_CALL hid_get_read_buffer_mode(hid_device *device);
+
+		/** Maximum number of libusb contexts, see hid_set_context_count(). */
+		#define HID_MAX_CONTEXTS 16
+
+		/** Counters of the busy-poll reaping mode. */
+		struct hid_busy_poll_stats
+		{
+			/** Spin windows opened after a completion */
+			unsigned long long windows;
+			/** Non-blocking reap attempts made while spinning */
+			unsigned long long polls;
+			/** Completions reaped while spinning */
+			unsigned long long hits;
+			/** Windows which expired without reaping anything */
+			unsigned long long misses;
+			/** Total time spent spinning, in nanoseconds */
+			unsigned long long spin_ns;
+		};
 
- At the discretion of the user of this library,
- this software may be licensed under the terms of the
- GNU General Public License v3, a BSD-Style license, or the
- original HIDAPI license as outlined in the LICENSE.txt,
- LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
- files located at the root of the source distribution.
- These files may also be found in the public source
- code repository located at:
-        http://github.com/signal11/hidapi .
-********************************************************/
+		/** @brief Set the busy-poll window of the event handling thread.
 
-/* C */
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <ctype.h>
-#include <locale.h>
-#include <errno.h>
+			After a device completed a transfer, the event handling
+			thread keeps checking it for further completions for
+			window_us microseconds instead of sleeping right away.
+			This lowers the latency of devices which report at a
+			high rate at the expense of CPU time. The setting
+			survives hid_exit().
 
-/* Unix */
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/ioctl.h>
-#include <sys/utsname.h>
-#include <fcntl.h>
-#include <pthread.h>
-#include <wchar.h>
+			@ingroup API
+			@param window_us The spin window, or 0 to disable.
 
-/* GNU / LibUSB */
-// SKIP #include "libusb/libusb/libusb.h"
-// line 46 "hidapi/libusb/hid.c"
-#ifndef __ANDROID__
-#include <iconv.h>
-#endif
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_set_busy_poll(unsigned int window_us);
 
-// line 1 "hidapi/hidapi/hidapi.h"
-/*******************************************************
- HIDAPI - Multi-Platform library for
- communication with HID devices.
+		/** @brief Get the busy-poll counters.
 
- Alan Ott
- Signal 11 Software
+			@ingroup API
+			@param stats Output location for the counters, which
+				are all zero while the library is not initialized.
 
- 8/22/2009
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_get_busy_poll_stats(struct hid_busy_poll_stats *stats);
+
+		/** Points of the transfer lifecycle recorded by the trace ring. */
+		enum hid_trace_event_type {
+			HID_TRACE_SUBMIT = 1,
+			HID_TRACE_REAP = 2,
+			HID_TRACE_TIMEOUT = 3,
+			HID_TRACE_CANCEL = 4,
+			HID_TRACE_COMPLETE = 5,
+		};
 
- Copyright 2009, All Rights Reserved.
+		/** A record of the transfer lifecycle trace ring. */
+		struct hid_trace_event
+		{
+			/** Monotonic clock time of the event, in nanoseconds */
+			unsigned long long timestamp_ns;
+			/** Address of the libusb transfer */
+			unsigned long long transfer;
+			/** Transfer length, or length transferred once reaped */
+			unsigned int length;
+			/** Submission, OS, cancellation or transfer status */
+			int status;
+			/** One of enum hid_trace_event_type */
+			unsigned char type;
+			/** Endpoint address of the transfer */
+			unsigned char endpoint;
+			/** libusb transfer type */
+			unsigned char transfer_type;
+		};
 
- At the discretion of the user of this library,
- this software may be licensed under the terms of the
- GNU General Public License v3, a BSD-Style license, or the
- original HIDAPI license as outlined in the LICENSE.txt,
- LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
- files located at the root of the source distribution.
- These files may also be found in the public source
- code repository located at:
-        http://github.com/signal11/hidapi .
-********************************************************/
+		/** @brief Enable or disable the transfer trace rings.
 
-/** @file
- * @defgroup API hidapi API
- */
+			Every libusb context keeps a ring of the most recent
+			transfer submissions, reaps, timeouts, cancellations and
+			completions while tracing is enabled. The setting
+			survives hid_exit().
 
-#ifndef HIDAPI_H__
-#define HIDAPI_H__
+			@ingroup API
+			@param capacity The number of records kept per context,
+				or 0 to disable tracing. The capacity of a ring
+				is fixed once it has been allocated.
 
-#include <wchar.h>
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_set_trace(unsigned int capacity);
 
-#ifdef _WIN32
-      #define HID_API_EXPORT __declspec(dllexport)
-      #define HID_API_CALL
-#else
-      #define HID_API_EXPORT /**< API export macro */
-      #define HID_API_CALL /**< API call macro */
-#endif
+		/** @brief Copy the trace ring of a context out, oldest first.
 
-#define HID_API_EXPORT_CALL HID_API_EXPORT HID_API_CALL /**< API export and call macro*/
+			@ingroup API
+			@param context The index of the context, see
+				hid_set_context_count().
+			@param events Output array of at least max_events records.
+			@param max_events The size of the events array.
 
-#ifdef __cplusplus
-extern "C" {
-#endif
-		struct hid_device_;
-		typedef struct hid_device_ hid_device; /**< opaque hidapi structure */
+			@returns
+				This function returns the number of records copied,
+				or -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_trace_dump(int context, struct hid_trace_event *events, int max_events);
 
-		/** hidapi info structure */
-		struct hid_device_info {
-			/** Platform-specific device path */
-			char *path;
+		/** A virtual device of the simulated bus, see
+			hid_virtual_add_device(). */
+		struct hid_virtual_device
+		{
 			/** Device Vendor ID */
 			unsigned short vendor_id;
 			/** Device Product ID */
 			unsigned short product_id;
-			/** Serial Number */
-			wchar_t *serial_number;
-			/** Device Release Number in binary-coded decimal,
-			    also known as Device Version Number */
+			/** Device Release Number in binary-coded decimal */
 			unsigned short release_number;
-			/** Manufacturer String */
-			wchar_t *manufacturer_string;
-			/** Product string */
-			wchar_t *product_string;
-			/** Usage Page for this Device/Interface
-			    (Windows/Mac only). */
-			unsigned short usage_page;
-			/** Usage for this Device/Interface
-			    (Windows/Mac only).*/
-			unsigned short usage;
-			/** The USB interface which this logical device
-			    represents. Valid on both Linux implementations
-			    in all cases, and valid on the Windows implementation
-			    only if the device contains more than one interface. */
-			int interface_number;
-
-			/** Pointer to the next device */
-			struct hid_device_info *next;
+			/** UTF-8 Manufacturer String, or NULL */
+			const char *manufacturer_string;
+			/** UTF-8 Product String, or NULL */
+			const char *product_string;
+			/** UTF-8 Serial Number, or NULL */
+			const char *serial_number;
+			/** Size of the input reports, 0 selects 64 */
+			unsigned short input_report_length;
+			/** Size of the output reports, 0 for none */
+			unsigned short output_report_length;
+			/** Size of the feature reports, 0 for none */
+			unsigned short feature_report_length;
+			/** Interval of the periodic input reports in
+				microseconds, 0 to only echo output reports */
+			unsigned int report_interval_us;
+			/** Time taken by control and output transfers, in
+				microseconds */
+			unsigned int latency_us;
+			/** Number of identical HID interfaces, up to 4,
+				0 selects 1 */
+			unsigned char interface_count;
 		};
 
+		/** @brief Select the libusb backend.
 
-		/** @brief Initialize the HIDAPI library.
+			"usbfs" talks to the USB devices of the system, which is
+			the default. "virtual" simulates a bus holding the devices
+			added with hid_virtual_add_device(), which echo output
+			reports back as input reports, keep the feature reports
+			set and send periodic input reports. It lets the library
+			be tested and benchmarked without hardware.
+
+			The backend can only be changed while the library is not
+			initialized.
 
-			This function initializes the HIDAPI library. Calling it is not
-			strictly necessary, as it will be called automatically by
-			hid_enumerate() and any of the hid_open_*() functions if it is
-			needed.  This function should be called at the beginning of
-			execution however, if there is a chance of HIDAPI handles
-			being opened by different threads simultaneously.
-			
 			@ingroup API
+			@param name The name of the backend.
 
 			@returns
 				This function returns 0 on success and -1 on error.
 		*/
-		int HID_API_EXPORT HID_API_CALL hid_init(void);
+		int HID_API_EXPORT_CALL hid_set_backend(const char *name);
 
-		/** @brief Finalize the HIDAPI library.
+		/** @brief Set the number of threads scanning for devices.
 
-			This function frees all of the static data associated with
-			HIDAPI. It should be called at the end of execution to avoid
-			memory leaks.
+			Creating a context reads the attributes and descriptors
+			of every USB device from sysfs. On hosts with many
+			devices these reads can be spread over a small pool of
+			threads. The default of 0 keeps the scan on the calling
+			thread. The setting survives hid_exit().
 
 			@ingroup API
+			@param threads The number of threads, including the
+				calling one, at most 64.
 
-		    @returns
+			@returns
 				This function returns 0 on success and -1 on error.
 		*/
-		int HID_API_EXPORT HID_API_CALL hid_exit(void);
+		int HID_API_EXPORT_CALL hid_set_scan_threads(unsigned int threads);
 
-		/** @brief Enumerate the HID Devices.
+		/** @brief Set the hotplug debounce window.
 
-			This function returns a linked list of all the HID devices
-			attached to the system which match vendor_id and product_id.
-			If @p vendor_id is set to 0 then any vendor matches.
-			If @p product_id is set to 0 then any product matches.
-			If @p vendor_id and @p product_id are both set to 0, then
-			all HID devices will be returned.
+			Device changes seen by the hotplug monitor are
+			collected for this long and then reported together,
+			with a device removed and added again in the meantime
+			reported once per direction, or not at all if it comes
+			back at the same address. The default of 0 only groups
+			the changes read in one wakeup of the monitor.
 
 			@ingroup API
-			@param vendor_id The Vendor ID (VID) of the types of device
-				to open.
-			@param product_id The Product ID (PID) of the types of
-				device to open.
+			@param window_ms The window in milliseconds, at most
+				10000.
 
-		    @returns
-		    	This function returns a pointer to a linked list of type
-		    	struct #hid_device, containing information about the HID devices
-		    	attached to the system, or NULL in the case of failure. Free
-		    	this linked list by calling hid_free_enumeration().
+			@returns
+				This function returns 0 on success and -1 on error.
 		*/
-		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned short vendor_id, unsigned short product_id);
+		int HID_API_EXPORT_CALL hid_set_hotplug_debounce(unsigned int window_ms);
 
-		/** @brief Free an enumeration Linked List
+		/** @brief Plug a device into the simulated bus.
 
-		    This function frees a linked list created by hid_enumerate().
+			The device shows up in hid_enumerate() and raises hotplug
+			arrival events while the "virtual" backend is selected.
 
 			@ingroup API
-		    @param devs Pointer to a list of struct_device returned from
-		    	      hid_enumerate().
-		*/
-		void  HID_API_EXPORT HID_API_CALL hid_free_enumeration(struct hid_device_info *devs);
+			@param device The description of the device.
 
-		/** @brief Open a HID device using a Vendor ID (VID), Product ID
-			(PID) and optionally a serial number.
+			@returns
+				This function returns the ID of the device, to
+				pass to hid_virtual_remove_device(), or -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_virtual_add_device(const struct hid_virtual_device *device);
 
-			If @p serial_number is NULL, the first device with the
-			specified VID and PID is opened.
+		/** @brief Unplug a device from the simulated bus.
 
 			@ingroup API
-			@param vendor_id The Vendor ID (VID) of the device to open.
-			@param product_id The Product ID (PID) of the device to open.
-			@param serial_number The Serial Number of the device to open
-				               (Optionally NULL).
+			@param id The ID returned by hid_virtual_add_device().
 
 			@returns
-				This function returns a pointer to a #hid_device object on
-				success or NULL on failure.
+				This function returns 0 on success and -1 on error.
 		*/
-		HID_API_EXPORT hid_device * HID_API_CALL hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number);
+		int HID_API_EXPORT_CALL hid_virtual_remove_device(int id);
 
-		/** @brief Open a HID device by its path name.
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+// line 51 "hidapi/libusb/hid.c"
+
+#ifdef __ANDROID__
+
+/* Barrier implementation because Android/Bionic don't have pthread_barrier.
+   This implementation came from Brent Priddy and was posted on
+   StackOverflow. It is used with his permission. */
+typedef int pthread_barrierattr_t;
+typedef struct pthread_barrier {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int count;
+    int trip_count;
+} pthread_barrier_t;
+
+static int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned int count)
+{
+	if(count == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if(pthread_mutex_init(&barrier->mutex, 0) < 0) {
+		return -1;
+	}
+	if(pthread_cond_init(&barrier->cond, 0) < 0) {
+		pthread_mutex_destroy(&barrier->mutex);
+		return -1;
+	}
+	barrier->trip_count = count;
+	barrier->count = 0;
+
+	return 0;
+}
+
+static int pthread_barrier_destroy(pthread_barrier_t *barrier)
+{
+	pthread_cond_destroy(&barrier->cond);
+	pthread_mutex_destroy(&barrier->mutex);
+	return 0;
+}
+
+static int pthread_barrier_wait(pthread_barrier_t *barrier)
+{
+	pthread_mutex_lock(&barrier->mutex);
+	++(barrier->count);
+	if(barrier->count >= barrier->trip_count)
+	{
+		barrier->count = 0;
+		pthread_cond_broadcast(&barrier->cond);
+		pthread_mutex_unlock(&barrier->mutex);
+		return 1;
+	}
+	else
+	{
+		pthread_cond_wait(&barrier->cond, &(barrier->mutex));
+		pthread_mutex_unlock(&barrier->mutex);
+		return 0;
+	}
+}
+
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef DEBUG_PRINTF
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define LOG(...) do {} while (0)
+#endif
+
+#ifndef __FreeBSD__
+#define DETACH_KERNEL_DRIVER
+#endif
+
+/* Uncomment to enable the retrieval of Usage and Usage Page in
+hid_enumerate(). Warning, on platforms different from FreeBSD
+this is very invasive as it requires the detach
+and re-attach of the kernel driver. See comments inside hid_enumerate().
+libusb HIDAPI programs are encouraged to use the interface number
+instead to differentiate between interfaces on a composite HID device. */
+/*#define INVASIVE_GET_USAGE*/
+
+/* Linked List of input reports received from the device. */
+struct input_report {
+	uint8_t *data;
+	size_t len;
+	struct input_report *next;
+};
+
+/* Linked List of the string descriptors read from the device, which are
+   kept for as long as it is open. */
+struct cached_string {
+	int index;
+	wchar_t *str;
+	struct cached_string *next;
+};
+
+
+struct hid_device_ {
+	/* Handle to the actual device. */
+	libusb_device_handle *device_handle;
+
+	/* Context the device was opened on, whose events read_thread() handles */
+	libusb_context *context;
+
+	/* Endpoint information */
+	int input_endpoint;
+	int output_endpoint;
+	int input_ep_max_packet_size;
+
+	/* The interface number of the HID */
+	int interface;
+
+	/* Indexes of Strings */
+	int manufacturer_index;
+	int product_index;
+	int serial_index;
+
+	/* Whether blocking reads are used */
+	int blocking; /* boolean */
+
+	/* Read thread objects */
+	pthread_t thread;
+	pthread_mutex_t mutex; /* Protects input_reports */
+	pthread_cond_t condition;
+	pthread_barrier_t barrier; /* Ensures correct startup sequence */
+	int shutdown_thread;
+	int cancelled;
+	int thread_joined; /* read_thread() has been waited for */
+	int read_error; /* libusb error code which stopped read_thread() */
+	struct libusb_transfer *transfer;
+	int read_buffer_mode; /* enum hid_buffer_mode of the transfer buffer */
+
+	/* libusb error code of the last failed call on this device */
+	int last_error;
+
+	/* I/O counters, updated with relaxed atomics */
+	struct hid_device_stats stats;
+	/* Time the input transfer was last submitted, only used by read_thread() */
+	unsigned long long read_submitted_ns;
+
+	/* List of received input reports. */
+	struct input_report *input_reports;
+
+	/* Handle and read thread shared with the other interfaces of the
+	   device, if opened with hid_open_interfaces() */
+	struct hid_shared_handle *shared;
+
+	/* String descriptors read so far, protected by mutex */
+	struct cached_string *strings;
+};
+
+/* The libusb handle of a composite device opened with hid_open_interfaces(),
+   whose interfaces are claimed on it and have their input transfers served by
+   a single thread. It is closed along with the last of its interfaces. */
+struct hid_shared_handle {
+	libusb_device_handle *device_handle;
+	libusb_context *context;
+	pthread_t thread;
+	int shutdown_thread;
+
+	pthread_mutex_t mutex; /* Protects the members */
+	hid_device **members; /* Interfaces not closed yet */
+	int count;
+};
+
+static libusb_context *usb_context = NULL;
+
+/* Serializes the lazy creation and the destruction of usb_context. Everything
+   else relies on libusb being thread safe, so enumerating and opening devices
+   may run concurrently. */
+static pthread_mutex_t usb_context_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Devices are opened on one of usb_contexts, the first of which is
+   usb_context. The count takes effect on the next hid_init(). These and the
+   busy-poll window applied to every context are guarded by usb_context_lock. */
+static libusb_context *usb_contexts[HID_MAX_CONTEXTS];
+static int usb_context_count = 1;
+static unsigned int busy_poll_us = 0;
+static unsigned int trace_capacity = 0;
+
+/* Hotplug watches share a single libusb callback, which fans out to the
+   active watches under hotplug_lock. Watches can thus be released without
+   racing a callback already in flight on the event handling thread.
+   hotplug_busy counts the hid_hotplug_watch_wait() calls using the context
+   outside of the lock, which hid_exit() waits for on hotplug_cond. */
+static pthread_mutex_t hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hotplug_cond = PTHREAD_COND_INITIALIZER;
+static struct hid_hotplug_watch_ *hotplug_watches = NULL;
+static int hotplug_registered = 0;
+static int hotplug_busy = 0;
+
+static void hotplug_stop_watches(void);
+
+uint16_t get_usb_code_for_current_locale(void);
+static int return_data(hid_device *dev, unsigned char *data, size_t length);
+
+static hid_device *new_hid_device(void)
+{
+	hid_device *dev = calloc(1, sizeof(hid_device));
+	dev->blocking = 1;
+
+	pthread_mutex_init(&dev->mutex, NULL);
+	pthread_cond_init(&dev->condition, NULL);
+	pthread_barrier_init(&dev->barrier, NULL, 2);
+
+	return dev;
+}
+
+static void free_hid_device(hid_device *dev)
+{
+	/* Free the cached strings */
+	while (dev->strings) {
+		struct cached_string *next = dev->strings->next;
+		free(dev->strings->str);
+		free(dev->strings);
+		dev->strings = next;
+	}
+
+	/* Clean up the thread objects */
+	pthread_barrier_destroy(&dev->barrier);
+	pthread_cond_destroy(&dev->condition);
+	pthread_mutex_destroy(&dev->mutex);
+
+	/* Free the device itself */
+	free(dev);
+}
 
-			The path name be determined by calling hid_enumerate(), or a
-			platform-specific path name can be used (eg: /dev/hidraw0 on
-			Linux).
+/* libusb error code of the last failed call made by this thread */
+static __thread int thread_error;
 
-			@ingroup API
-		    @param path The path name of the device to open
+/* Record the libusb error code of a failed call, both for the thread and,
+   when the call concerns one, the device. */
+static void register_error(hid_device *dev, int code)
+{
+	if (code >= 0)
+		code = LIBUSB_ERROR_OTHER;
+	thread_error = code;
+	if (dev)
+		dev->last_error = code;
+}
 
-			@returns
-				This function returns a pointer to a #hid_device object on
-				success or NULL on failure.
-		*/
-		HID_API_EXPORT hid_device * HID_API_CALL hid_open_path(const char *path);
+static unsigned long long monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-		/** @brief Write an Output report to a HID device.
+static void count_stat(unsigned long long *counter, unsigned long long n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
 
-			The first byte of @p data[] must contain the Report ID. For
-			devices which only support a single report, this must be set
-			to 0x0. The remaining bytes contain the report data. Since
-			the Report ID is mandatory, calls to hid_write() will always
-			contain one more byte than the report contains. For example,
-			if a hid report is 16 bytes long, 17 bytes must be passed to
-			hid_write(), the Report ID (or 0x0, for devices with a
-			single report), followed by the report data (16 bytes). In
-			this example, the length passed in would be 17.
+static int latency_bucket(unsigned long long us)
+{
+	int msb;
 
-			hid_write() will send the data on the first OUT endpoint, if
-			one exists. If it does not, it will send the data through
-			the Control Endpoint (Endpoint 0).
+	if (us < 8)
+		return (int)us;
+	msb = 63 - __builtin_clzll(us);
+	if (msb > 31)
+		return HID_LATENCY_BUCKETS - 1;
+	return (msb - 2) * 8 + (int)((us >> (msb - 3)) & 7);
+}
 
-			@ingroup API
-			@param device A device handle returned from hid_open().
-			@param data The data to send, including the report number as
-				the first byte.
-			@param length The length in bytes of the data to send.
+/* Record a latency which started at start_ns into the histogram. */
+static void count_latency(struct hid_latency_histogram *h, unsigned long long start_ns)
+{
+	unsigned long long ns = monotonic_ns() - start_ns;
 
-			@returns
-				This function returns the actual number of bytes written and
-				-1 on error.
-		*/
-		int  HID_API_EXPORT HID_API_CALL hid_write(hid_device *device, const unsigned char *data, size_t length);
+	count_stat(&h->count, 1);
+	count_stat(&h->sum_ns, ns);
+	count_stat(&h->buckets[latency_bucket(ns / 1000)], 1);
+}
 
-		/** @brief Read an Input report from a HID device with timeout.
+/* Count a failed transfer of dev. */
+static void count_failure(hid_device *dev, int code)
+{
+	if (code == LIBUSB_ERROR_TIMEOUT)
+		count_stat(&dev->stats.timeouts, 1);
+	else
+		count_stat(&dev->stats.errors, 1);
+}
 
-			Input reports are returned
-			to the host through the INTERRUPT IN endpoint. The first byte will
-			contain the Report number if the device uses numbered reports.
+#ifdef INVASIVE_GET_USAGE
+/* Get bytes from a HID Report Descriptor.
+   Only call with a num_bytes of 0, 1, 2, or 4. */
+static uint32_t get_bytes(uint8_t *rpt, size_t len, size_t num_bytes, size_t cur)
+{
+	/* Return if there aren't enough bytes. */
+	if (cur + num_bytes >= len)
+		return 0;
 
-			@ingroup API
-			@param device A device handle returned from hid_open().
-			@param data A buffer to put the read data into.
-			@param length The number of bytes to read. For devices with
-				multiple reports, make sure to read an extra byte for
-				the report number.
-			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+	if (num_bytes == 0)
+		return 0;
+	else if (num_bytes == 1) {
+		return rpt[cur+1];
+	}
+	else if (num_bytes == 2) {
+		return (rpt[cur+2] * 256 + rpt[cur+1]);
+	}
+	else if (num_bytes == 4) {
+		return (rpt[cur+4] * 0x01000000 +
+		        rpt[cur+3] * 0x00010000 +
+		        rpt[cur+2] * 0x00000100 +
+		        rpt[cur+1] * 0x00000001);
+	}
+	else
+		return 0;
+}
 
-			@returns
-				This function returns the actual number of bytes read and
-				-1 on error. If no packet was available to be read within
-				the timeout period, this function returns 0.
-		*/
-		int HID_API_EXPORT HID_API_CALL hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds);
+/* Retrieves the device's Usage Page and Usage from the report
+   descriptor. The algorithm is simple, as it just returns the first
+   Usage and Usage Page that it finds in the descriptor.
+   The return value is 0 on success and -1 on failure. */
+static int get_usage(uint8_t *report_descriptor, size_t size,
+                     unsigned short *usage_page, unsigned short *usage)
+{
+	unsigned int i = 0;
+	int size_code;
+	int data_len, key_size;
+	int usage_found = 0, usage_page_found = 0;
 
-		/** @brief Read an Input report from a HID device.
+	while (i < size) {
+		int key = report_descriptor[i];
+		int key_cmd = key & 0xfc;
 
-			Input reports are returned
-		    to the host through the INTERRUPT IN endpoint. The first byte will
-			contain the Report number if the device uses numbered reports.
+		//printf("key: %02hhx\n", key);
 
-			@ingroup API
-			@param device A device handle returned from hid_open().
-			@param data A buffer to put the read data into.
-			@param length The number of bytes to read. For devices with
-				multiple reports, make sure to read an extra byte for
-				the report number.
+		if ((key & 0xf0) == 0xf0) {
+			/* This is a Long Item. The next byte contains the
+			   length of the data section (value) for this key.
+			   See the HID specification, version 1.11, section
+			   6.2.2.3, titled "Long Items." */
+			if (i+1 < size)
+				data_len = report_descriptor[i+1];
+			else
+				data_len = 0; /* malformed report */
+			key_size = 3;
+		}
+		else {
+			/* This is a Short Item. The bottom two bits of the
+			   key contain the size code for the data section
+			   (value) for this key.  Refer to the HID
+			   specification, version 1.11, section 6.2.2.2,
+			   titled "Short Items." */
+			size_code = key & 0x3;
+			switch (size_code) {
+			case 0:
+			case 1:
+			case 2:
+				data_len = size_code;
+				break;
+			case 3:
+				data_len = 4;
+				break;
+			default:
+				/* Can't ever happen since size_code is & 0x3 */
+				data_len = 0;
+				break;
+			};
+			key_size = 1;
+		}
 
-			@returns
-				This function returns the actual number of bytes read and
-				-1 on error. If no packet was available to be read and
-				the handle is in non-blocking mode, this function returns 0.
-		*/
-		int  HID_API_EXPORT HID_API_CALL hid_read(hid_device *device, unsigned char *data, size_t length);
+		if (key_cmd == 0x4) {
+			*usage_page  = get_bytes(report_descriptor, size, data_len, i);
+			usage_page_found = 1;
+			//printf("Usage Page: %x\n", (uint32_t)*usage_page);
+		}
+		if (key_cmd == 0x8) {
+			*usage = get_bytes(report_descriptor, size, data_len, i);
+			usage_found = 1;
+			//printf("Usage: %x\n", (uint32_t)*usage);
+		}
 
-		/** @brief Set the device handle to be non-blocking.
+		if (usage_page_found && usage_found)
+			return 0; /* success */
 
-			In non-blocking mode calls to hid_read() will return
-			immediately with a value of 0 if there is no data to be
-			read. In blocking mode, hid_read() will wait (block) until
-			there is data to read before returning.
+		/* Skip over this key and it's associated data */
+		i += data_len + key_size;
+	}
 
-			Nonblocking can be turned on and off at any time.
+	return -1; /* failure */
+}
+#endif /* INVASIVE_GET_USAGE */
 
-			@ingroup API
-			@param device A device handle returned from hid_open().
-			@param nonblock enable or not the nonblocking reads
-			 - 1 to enable nonblocking
-			 - 0 to disable nonblocking.
+#if defined(__FreeBSD__) && __FreeBSD__ < 10
+/* The libusb version included in FreeBSD < 10 doesn't have this function. In
+   mainline libusb, it's inlined in libusb.h. This function will bear a striking
+   resemblance to that one, because there's about one way to code it.
 
-			@returns
-				This function returns 0 on success and -1 on error.
-		*/
-		int  HID_API_EXPORT HID_API_CALL hid_set_nonblocking(hid_device *device, int nonblock);
+   Note that the data parameter is Unicode in UTF-16LE encoding.
+   Return value is the number of bytes in data, or LIBUSB_ERROR_*.
+ */
+static inline int libusb_get_string_descriptor(libusb_device_handle *dev,
+	uint8_t descriptor_index, uint16_t lang_id,
+	unsigned char *data, int length)
+{
+	return libusb_control_transfer(dev,
+		LIBUSB_ENDPOINT_IN | 0x0, /* Endpoint 0 IN */
+		LIBUSB_REQUEST_GET_DESCRIPTOR,
+		(LIBUSB_DT_STRING << 8) | descriptor_index,
+		lang_id, data, (uint16_t) length, 1000);
+}
 
-		/** @brief Send a Feature report to the device.
+#endif
 
-			Feature reports are sent over the Control endpoint as a
-			Set_Report transfer.  The first byte of @p data[] must
-			contain the Report ID. For devices which only support a
-			single report, this must be set to 0x0. The remaining bytes
-			contain the report data. Since the Report ID is mandatory,
-			calls to hid_send_feature_report() will always contain one
-			more byte than the report contains. For example, if a hid
-			report is 16 bytes long, 17 bytes must be passed to
-			hid_send_feature_report(): the Report ID (or 0x0, for
-			devices which do not use numbered reports), followed by the
-			report data (16 bytes). In this example, the length passed
-			in would be 17.
 
-			@ingroup API
-			@param device A device handle returned from hid_open().
-			@param data The data to send, including the report number as
-				the first byte.
-			@param length The length in bytes of the data to send, including
-				the report number.
+/* Get the first language the device says it reports. This comes from
+   USB string #0. */
+static uint16_t get_first_language(libusb_device_handle *dev)
+{
+	uint16_t buf[32];
+	int len;
 
-			@returns
-				This function returns the actual number of bytes written and
-				-1 on error.
-		*/
-		int HID_API_EXPORT HID_API_CALL hid_send_feature_report(hid_device *device, const unsigned char *data, size_t length);
+	/* Get the string from libusb. */
+	len = libusb_get_string_descriptor(dev,
+			0x0, /* String ID */
+			0x0, /* Language */
+			(unsigned char*)buf,
+			sizeof(buf));
+	if (len < 4)
+		return 0x0;
 
-		/** @brief Get a feature report from a HID device.
+	return buf[1]; /* First two bytes are len and descriptor type. */
+}
 
-			Set the first byte of @p data[] to the Report ID of the
-			report to be read.  Make sure to allow space for this
-			extra byte in @p data[]. Upon return, the first byte will
-			still contain the Report ID, and the report data will
-			start in data[1].
+static int is_language_supported(libusb_device_handle *dev, uint16_t lang)
+{
+	uint16_t buf[32];
+	int len;
+	int i;
 
-			@ingroup API
-			@param device A device handle returned from hid_open().
-			@param data A buffer to put the read data into, including
-				the Report ID. Set the first byte of @p data[] to the
-				Report ID of the report to be read, or set it to zero
-				if your device does not use numbered reports.
-			@param length The number of bytes to read, including an
-				extra byte for the report ID. The buffer can be longer
-				than the actual report.
+	/* Get the string from libusb. */
+	len = libusb_get_string_descriptor(dev,
+			0x0, /* String ID */
+			0x0, /* Language */
+			(unsigned char*)buf,
+			sizeof(buf));
+	if (len < 4)
+		return 0x0;
 
-			@returns
-				This function returns the number of bytes read plus
-				one for the report ID (which is still in the first
-				byte), or -1 on error.
-		*/
-		int HID_API_EXPORT HID_API_CALL hid_get_feature_report(hid_device *device, unsigned char *data, size_t length);
 
-		/** @brief Close a HID device.
+	len /= 2; /* language IDs are two-bytes each. */
+	/* Start at index 1 because there are two bytes of protocol data. */
+	for (i = 1; i < len; i++) {
+		if (buf[i] == lang)
+			return 1;
+	}
 
-			@ingroup API
-			@param device A device handle returned from hid_open().
-		*/
-		void HID_API_EXPORT HID_API_CALL hid_close(hid_device *device);
+	return 0;
+}
 
-		/** @brief Get The Manufacturer String from a HID device.
 
-			@ingroup API
-			@param device A device handle returned from hid_open().
-			@param string A wide string buffer to put the data into.
-			@param maxlen The length of the buffer in multiples of wchar_t.
+/* This function returns a newly allocated wide string containing the USB
+   device string numbered by the index. The returned string must be freed
+   by using free(). */
+static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
+{
+	char buf[512];
+	int len;
+	wchar_t *str = NULL;
 
-			@returns
-				This function returns 0 on success and -1 on error.
-		*/
-		int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *device, wchar_t *string, size_t maxlen);
+#ifndef __ANDROID__ /* we don't use iconv on Android */
+	wchar_t wbuf[256];
+	/* iconv variables */
+	iconv_t ic;
+	size_t inbytes;
+	size_t outbytes;
+	size_t res;
+#ifdef __FreeBSD__
+	const char *inptr;
+#else
+	char *inptr;
+#endif
+	char *outptr;
+#endif
 
-		/** @brief Get The Product String from a HID device.
+	/* Determine which language to use. */
+	uint16_t lang;
+	lang = get_usb_code_for_current_locale();
+	if (!is_language_supported(dev, lang))
+		lang = get_first_language(dev);
 
-			@ingroup API
-			@param device A device handle returned from hid_open().
-			@param string A wide string buffer to put the data into.
-			@param maxlen The length of the buffer in multiples of wchar_t.
+	/* Get the string from libusb. */
+	len = libusb_get_string_descriptor(dev,
+			idx,
+			lang,
+			(unsigned char*)buf,
+			sizeof(buf));
+	if (len < 0)
+		return NULL;
 
-			@returns
-				This function returns 0 on success and -1 on error.
-		*/
-		int HID_API_EXPORT_CALL hid_get_product_string(hid_device *device, wchar_t *string, size_t maxlen);
+#ifdef __ANDROID__
 
-		/** @brief Get The Serial Number String from a HID device.
+	/* Bionic does not have iconv support nor wcsdup() function, so it
+	   has to be done manually.  The following code will only work for
+	   code points that can be represented as a single UTF-16 character,
+	   and will incorrectly convert any code points which require more
+	   than one UTF-16 character.
 
-			@ingroup API
-			@param device A device handle returned from hid_open().
-			@param string A wide string buffer to put the data into.
-			@param maxlen The length of the buffer in multiples of wchar_t.
+	   Skip over the first character (2-bytes).  */
+	len -= 2;
+	str = malloc((len / 2 + 1) * sizeof(wchar_t));
+	int i;
+	for (i = 0; i < len / 2; i++) {
+		str[i] = buf[i * 2 + 2] | (buf[i * 2 + 3] << 8);
+	}
+	str[len / 2] = 0x00000000;
 
-			@returns
-				This function returns 0 on success and -1 on error.
-		*/
-		int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *device, wchar_t *string, size_t maxlen);
+#else
 
-		/** @brief Get a string from a HID device, based on its string index.
+	/* buf does not need to be explicitly NULL-terminated because
+	   it is only passed into iconv() which does not need it. */
 
-			@ingroup API
-			@param device A device handle returned from hid_open().
-			@param string_index The index of the string to get.
-			@param string A wide string buffer to put the data into.
-			@param maxlen The length of the buffer in multiples of wchar_t.
+	/* Initialize iconv. */
+	ic = iconv_open("WCHAR_T", "UTF-16LE");
+	if (ic == (iconv_t)-1) {
+		LOG("iconv_open() failed\n");
+		return NULL;
+	}
 
-			@returns
-				This function returns 0 on success and -1 on error.
-		*/
-		int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *device, int string_index, wchar_t *string, size_t maxlen);
+	/* Convert to native wchar_t (UTF-32 on glibc/BSD systems).
+	   Skip the first character (2-bytes). */
+	inptr = buf+2;
+	inbytes = len-2;
+	outptr = (char*) wbuf;
+	outbytes = sizeof(wbuf);
+	res = iconv(ic, &inptr, &inbytes, &outptr, &outbytes);
+	if (res == (size_t)-1) {
+		LOG("iconv() failed\n");
+		goto err;
+	}
 
-		/** @brief Get a string describing the last error which occurred.
+	/* Write the terminating NULL. */
+	wbuf[sizeof(wbuf)/sizeof(wbuf[0])-1] = 0x00000000;
+	if (outbytes >= sizeof(wbuf[0]))
+		*((wchar_t*)outptr) = 0x00000000;
 
-			@ingroup API
-			@param device A device handle returned from hid_open().
+	/* Allocate and copy the string. */
+	str = wcsdup(wbuf);
 
-			@returns
-				This function returns a string containing the last error
-				which occurred or NULL if none has occurred.
-		*/
-		HID_API_EXPORT const wchar_t* HID_API_CALL hid_error(hid_device *device);
+err:
+	iconv_close(ic);
 
-#ifdef __cplusplus
-}
 #endif
 
-#endif
+	return str;
+}
 
-// line 51 "hidapi/libusb/hid.c"
+static char *make_path(libusb_device *dev, int interface_number)
+{
+	char str[64];
+	snprintf(str, sizeof(str), "%04x:%04x:%02x",
+		libusb_get_bus_number(dev),
+		libusb_get_device_address(dev),
+		interface_number);
+	str[sizeof(str)-1] = '\0';
 
-#ifdef __ANDROID__
+	return strdup(str);
+}
 
-/* Barrier implementation because Android/Bionic don't have pthread_barrier.
-   This implementation came from Brent Priddy and was posted on
-   StackOverflow. It is used with his permission. */
-typedef int pthread_barrierattr_t;
-typedef struct pthread_barrier {
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-    int count;
-    int trip_count;
-} pthread_barrier_t;
 
-static int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned int count)
+int HID_API_EXPORT hid_init(void)
 {
-	if(count == 0) {
-		errno = EINVAL;
-		return -1;
-	}
+	int res = 0;
 
-	if(pthread_mutex_init(&barrier->mutex, 0) < 0) {
-		return -1;
-	}
-	if(pthread_cond_init(&barrier->cond, 0) < 0) {
-		pthread_mutex_destroy(&barrier->mutex);
-		return -1;
+	pthread_mutex_lock(&usb_context_lock);
+	if (!usb_context) {
+		const char *locale;
+		int i;
+
+		/* Init Libusb */
+		for (i = 0; i < usb_context_count; i++) {
+			res = libusb_init(&usb_contexts[i]);
+			if (res)
+				break;
+			if (busy_poll_us)
+				libusb_set_busy_poll(usb_contexts[i], busy_poll_us);
+			if (trace_capacity)
+				libusb_set_trace(usb_contexts[i], trace_capacity);
+		}
+		if (res) {
+			while (i-- > 0) {
+				libusb_exit(usb_contexts[i]);
+				usb_contexts[i] = NULL;
+			}
+			register_error(NULL, res);
+			res = -1;
+		}
+		else
+			usb_context = usb_contexts[0];
+
+		/* Set the locale if it's not set. */
+		locale = setlocale(LC_CTYPE, NULL);
+		if (!res && !locale)
+			setlocale(LC_CTYPE, "");
 	}
-	barrier->trip_count = count;
-	barrier->count = 0;
+	pthread_mutex_unlock(&usb_context_lock);
 
-	return 0;
+	return res;
 }
 
-static int pthread_barrier_destroy(pthread_barrier_t *barrier)
+int HID_API_EXPORT hid_exit(void)
 {
-	pthread_cond_destroy(&barrier->cond);
-	pthread_mutex_destroy(&barrier->mutex);
+	pthread_mutex_lock(&usb_context_lock);
+	if (usb_context) {
+		int i;
+
+		/* The watches live on usb_context: stop them, and wait for
+		   the ones being waited on to let go of it. libusb_exit() drops
+		   the shared hotplug callback. */
+		pthread_mutex_lock(&hotplug_lock);
+		hotplug_stop_watches();
+		while (hotplug_busy) {
+			libusb_interrupt_event_handler(usb_context);
+			pthread_cond_wait(&hotplug_cond, &hotplug_lock);
+		}
+		hotplug_registered = 0;
+		pthread_mutex_unlock(&hotplug_lock);
+
+		for (i = usb_context_count - 1; i >= 0; i--) {
+			libusb_exit(usb_contexts[i]);
+			usb_contexts[i] = NULL;
+		}
+		usb_context = NULL;
+	}
+	pthread_mutex_unlock(&usb_context_lock);
+
 	return 0;
 }
 
-static int pthread_barrier_wait(pthread_barrier_t *barrier)
+int HID_API_EXPORT_CALL hid_set_busy_poll(unsigned int window_us)
 {
-	pthread_mutex_lock(&barrier->mutex);
-	++(barrier->count);
-	if(barrier->count >= barrier->trip_count)
-	{
-		barrier->count = 0;
-		pthread_cond_broadcast(&barrier->cond);
-		pthread_mutex_unlock(&barrier->mutex);
-		return 1;
-	}
-	else
-	{
-		pthread_cond_wait(&barrier->cond, &(barrier->mutex));
-		pthread_mutex_unlock(&barrier->mutex);
-		return 0;
+	int res = 0;
+
+	int i;
+
+	pthread_mutex_lock(&usb_context_lock);
+	busy_poll_us = window_us;
+	for (i = 0; usb_context && i < usb_context_count && !res; i++)
+		res = libusb_set_busy_poll(usb_contexts[i], window_us);
+	pthread_mutex_unlock(&usb_context_lock);
+
+	if (res < 0) {
+		register_error(NULL, res);
+		return -1;
 	}
+	return 0;
 }
 
-#endif
+int HID_API_EXPORT_CALL hid_get_busy_poll_stats(struct hid_busy_poll_stats *stats)
+{
+	struct libusb_busy_poll_stats counters;
+	int i;
 
-#ifdef __cplusplus
-extern "C" {
-#endif
+	if (!stats) {
+		register_error(NULL, LIBUSB_ERROR_INVALID_PARAM);
+		return -1;
+	}
 
-#ifdef DEBUG_PRINTF
-#define LOG(...) fprintf(stderr, __VA_ARGS__)
-#else
-#define LOG(...) do {} while (0)
-#endif
+	/* Sum the counters up over all contexts */
+	memset(stats, 0, sizeof(*stats));
+	pthread_mutex_lock(&usb_context_lock);
+	for (i = 0; usb_context && i < usb_context_count; i++) {
+		libusb_get_busy_poll_stats(usb_contexts[i], &counters);
+		stats->windows += counters.windows;
+		stats->polls += counters.polls;
+		stats->hits += counters.hits;
+		stats->misses += counters.misses;
+		stats->spin_ns += counters.spin_ns;
+	}
+	pthread_mutex_unlock(&usb_context_lock);
+	return 0;
+}
 
-#ifndef __FreeBSD__
-#define DETACH_KERNEL_DRIVER
-#endif
+int HID_API_EXPORT_CALL hid_set_trace(unsigned int capacity)
+{
+	int res = 0;
+	int i;
 
-/* Uncomment to enable the retrieval of Usage and Usage Page in
-hid_enumerate(). Warning, on platforms different from FreeBSD
-this is very invasive as it requires the detach
-and re-attach of the kernel driver. See comments inside hid_enumerate().
-libusb HIDAPI programs are encouraged to use the interface number
-instead to differentiate between interfaces on a composite HID device. */
-/*#define INVASIVE_GET_USAGE*/
+	pthread_mutex_lock(&usb_context_lock);
+	trace_capacity = capacity;
+	for (i = 0; usb_context && i < usb_context_count && !res; i++)
+		res = libusb_set_trace(usb_contexts[i], capacity);
+	pthread_mutex_unlock(&usb_context_lock);
 
-/* Linked List of input reports received from the device. */
-struct input_report {
-	uint8_t *data;
-	size_t len;
-	struct input_report *next;
-};
+	if (res < 0) {
+		register_error(NULL, res);
+		return -1;
+	}
+	return 0;
+}
 
+int HID_API_EXPORT_CALL hid_trace_dump(int context, struct hid_trace_event *events, int max_events)
+{
+	struct libusb_trace_event *records;
+	int res = 0;
+	int i;
 
-struct hid_device_ {
-	/* Handle to the actual device. */
-	libusb_device_handle *device_handle;
+	if (context < 0 || !events || max_events < 0) {
+		register_error(NULL, LIBUSB_ERROR_INVALID_PARAM);
+		return -1;
+	}
+	if (!max_events)
+		return 0;
 
-	/* Endpoint information */
-	int input_endpoint;
-	int output_endpoint;
-	int input_ep_max_packet_size;
+	records = malloc(max_events * sizeof(*records));
+	if (!records) {
+		register_error(NULL, LIBUSB_ERROR_NO_MEM);
+		return -1;
+	}
 
-	/* The interface number of the HID */
-	int interface;
+	pthread_mutex_lock(&usb_context_lock);
+	if (context >= usb_context_count)
+		res = LIBUSB_ERROR_INVALID_PARAM;
+	else if (usb_context)
+		res = libusb_trace_dump(usb_contexts[context], records, max_events);
+	pthread_mutex_unlock(&usb_context_lock);
 
-	/* Indexes of Strings */
-	int manufacturer_index;
-	int product_index;
-	int serial_index;
+	for (i = 0; i < res; i++) {
+		events[i].timestamp_ns = records[i].timestamp_ns;
+		events[i].transfer = records[i].transfer;
+		events[i].length = records[i].length;
+		events[i].status = records[i].status;
+		events[i].type = records[i].type;
+		events[i].endpoint = records[i].endpoint;
+		events[i].transfer_type = records[i].transfer_type;
+	}
+	free(records);
 
-	/* Whether blocking reads are used */
-	int blocking; /* boolean */
+	if (res < 0) {
+		register_error(NULL, res);
+		return -1;
+	}
+	return res;
+}
 
-	/* Read thread objects */
-	pthread_t thread;
-	pthread_mutex_t mutex; /* Protects input_reports */
-	pthread_cond_t condition;
-	pthread_barrier_t barrier; /* Ensures correct startup sequence */
-	int shutdown_thread;
-	int cancelled;
-	struct libusb_transfer *transfer;
+int HID_API_EXPORT_CALL hid_set_context_count(int count)
+{
+	int res = 0;
 
-	/* List of received input reports. */
-	struct input_report *input_reports;
-};
+	if (count < 1 || count > HID_MAX_CONTEXTS) {
+		register_error(NULL, LIBUSB_ERROR_INVALID_PARAM);
+		return -1;
+	}
 
-static libusb_context *usb_context = NULL;
+	pthread_mutex_lock(&usb_context_lock);
+	if (usb_context)
+		res = LIBUSB_ERROR_BUSY;
+	else
+		usb_context_count = count;
+	pthread_mutex_unlock(&usb_context_lock);
 
-uint16_t get_usb_code_for_current_locale(void);
-static int return_data(hid_device *dev, unsigned char *data, size_t length);
+	if (res < 0) {
+		register_error(NULL, res);
+		return -1;
+	}
+	return 0;
+}
 
-static hid_device *new_hid_device(void)
+int HID_API_EXPORT_CALL hid_set_backend(const char *name)
 {
-	hid_device *dev = calloc(1, sizeof(hid_device));
-	dev->blocking = 1;
+	int res;
 
-	pthread_mutex_init(&dev->mutex, NULL);
-	pthread_cond_init(&dev->condition, NULL);
-	pthread_barrier_init(&dev->barrier, NULL, 2);
+	pthread_mutex_lock(&usb_context_lock);
+	if (usb_context)
+		res = LIBUSB_ERROR_BUSY;
+	else
+		res = libusb_set_backend(name);
+	pthread_mutex_unlock(&usb_context_lock);
 
-	return dev;
+	if (res < 0) {
+		register_error(NULL, res);
+		return -1;
+	}
+	return 0;
 }
 
-static void free_hid_device(hid_device *dev)
+int HID_API_EXPORT_CALL hid_set_scan_threads(unsigned int threads)
 {
-	/* Clean up the thread objects */
-	pthread_barrier_destroy(&dev->barrier);
-	pthread_cond_destroy(&dev->condition);
-	pthread_mutex_destroy(&dev->mutex);
+	int res = libusb_set_scan_threads(threads);
 
-	/* Free the device itself */
-	free(dev);
+	if (res < 0) {
+		register_error(NULL, res);
+		return -1;
+	}
+	return 0;
 }
 
-#if 0
-/*TODO: Implement this funciton on hidapi/libusb.. */
-static void register_error(hid_device *device, const char *op)
+int HID_API_EXPORT_CALL hid_set_hotplug_debounce(unsigned int window_ms)
 {
+	int res = libusb_set_hotplug_debounce(window_ms);
 
+	if (res < 0) {
+		register_error(NULL, res);
+		return -1;
+	}
+	return 0;
 }
-#endif
 
-#ifdef INVASIVE_GET_USAGE
-/* Get bytes from a HID Report Descriptor.
-   Only call with a num_bytes of 0, 1, 2, or 4. */
-static uint32_t get_bytes(uint8_t *rpt, size_t len, size_t num_bytes, size_t cur)
+int HID_API_EXPORT_CALL hid_virtual_add_device(const struct hid_virtual_device *device)
 {
-	/* Return if there aren't enough bytes. */
-	if (cur + num_bytes >= len)
-		return 0;
+	struct libusb_virtual_device desc;
+	int res;
 
-	if (num_bytes == 0)
-		return 0;
-	else if (num_bytes == 1) {
-		return rpt[cur+1];
+	if (!device) {
+		register_error(NULL, LIBUSB_ERROR_INVALID_PARAM);
+		return -1;
 	}
-	else if (num_bytes == 2) {
-		return (rpt[cur+2] * 256 + rpt[cur+1]);
+
+	memset(&desc, 0, sizeof(desc));
+	desc.idVendor = device->vendor_id;
+	desc.idProduct = device->product_id;
+	desc.bcdDevice = device->release_number;
+	desc.manufacturer = device->manufacturer_string;
+	desc.product = device->product_string;
+	desc.serial_number = device->serial_number;
+	desc.input_report_size = device->input_report_length;
+	desc.output_report_size = device->output_report_length;
+	desc.feature_report_size = device->feature_report_length;
+	desc.report_interval_us = device->report_interval_us;
+	desc.latency_us = device->latency_us;
+	desc.num_interfaces = device->interface_count;
+
+	res = libusb_virtual_add_device(&desc);
+	if (res < 0) {
+		register_error(NULL, res);
+		return -1;
 	}
-	else if (num_bytes == 4) {
-		return (rpt[cur+4] * 0x01000000 +
-		        rpt[cur+3] * 0x00010000 +
-		        rpt[cur+2] * 0x00000100 +
-		        rpt[cur+1] * 0x00000001);
+	return res;
+}
+
+int HID_API_EXPORT_CALL hid_virtual_remove_device(int id)
+{
+	int res = libusb_virtual_remove_device(id);
+
+	if (res < 0) {
+		register_error(NULL, res);
+		return -1;
 	}
-	else
-		return 0;
+	return 0;
 }
 
-/* Retrieves the device's Usage Page and Usage from the report
-   descriptor. The algorithm is simple, as it just returns the first
-   Usage and Usage Page that it finds in the descriptor.
-   The return value is 0 on success and -1 on failure. */
-static int get_usage(uint8_t *report_descriptor, size_t size,
-                     unsigned short *usage_page, unsigned short *usage)
+/* Get the context to open the device at path on. A negative index selects
+   the context from a hash of the path, so each device sticks to the same
+   one. Returns NULL if the index is out of range. */
+static libusb_context *context_for_path(const char *path, int index)
 {
-	unsigned int i = 0;
-	int size_code;
-	int data_len, key_size;
-	int usage_found = 0, usage_page_found = 0;
+	libusb_context *ctx = NULL;
+	uint32_t hash = 2166136261u;
+	const char *c;
 
-	while (i < size) {
-		int key = report_descriptor[i];
-		int key_cmd = key & 0xfc;
+	/* FNV-1a */
+	for (c = path; *c; c++)
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
 
-		//printf("key: %02hhx\n", key);
+	pthread_mutex_lock(&usb_context_lock);
+	if (index < 0)
+		index = (int)(hash % (uint32_t)usb_context_count);
+	if (usb_context && index < usb_context_count)
+		ctx = usb_contexts[index];
+	pthread_mutex_unlock(&usb_context_lock);
 
-		if ((key & 0xf0) == 0xf0) {
-			/* This is a Long Item. The next byte contains the
-			   length of the data section (value) for this key.
-			   See the HID specification, version 1.11, section
-			   6.2.2.3, titled "Long Items." */
-			if (i+1 < size)
-				data_len = report_descriptor[i+1];
-			else
-				data_len = 0; /* malformed report */
-			key_size = 3;
-		}
-		else {
-			/* This is a Short Item. The bottom two bits of the
-			   key contain the size code for the data section
-			   (value) for this key.  Refer to the HID
-			   specification, version 1.11, section 6.2.2.2,
-			   titled "Short Items." */
-			size_code = key & 0x3;
-			switch (size_code) {
-			case 0:
-			case 1:
-			case 2:
-				data_len = size_code;
-				break;
-			case 3:
-				data_len = 4;
-				break;
-			default:
-				/* Can't ever happen since size_code is & 0x3 */
-				data_len = 0;
-				break;
-			};
-			key_size = 1;
-		}
+	return ctx;
+}
 
-		if (key_cmd == 0x4) {
-			*usage_page  = get_bytes(report_descriptor, size, data_len, i);
-			usage_page_found = 1;
-			//printf("Usage Page: %x\n", (uint32_t)*usage_page);
-		}
-		if (key_cmd == 0x8) {
-			*usage = get_bytes(report_descriptor, size, data_len, i);
-			usage_found = 1;
-			//printf("Usage: %x\n", (uint32_t)*usage);
-		}
+/* Append a record for every HID interface of dev which matches vendor_id and
+   product_id to the list starting at *root and ending at cur_dev. String
+   descriptors are only read if open_strings is set and the device can be
+   opened. Returns the new end of the list. */
+static struct hid_device_info *enumerate_device(libusb_device *dev,
+	unsigned short vendor_id, unsigned short product_id, int open_strings,
+	struct hid_device_info **root, struct hid_device_info *cur_dev)
+{
+	libusb_device_handle *handle;
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *conf_desc = NULL;
+	int j, k;
+	int interface_num = 0;
 
-		if (usage_page_found && usage_found)
-			return 0; /* success */
+	int res = libusb_get_device_descriptor(dev, &desc);
+	unsigned short dev_vid = desc.idVendor;
+	unsigned short dev_pid = desc.idProduct;
 
-		/* Skip over this key and it's associated data */
-		i += data_len + key_size;
-	}
+	res = libusb_get_active_config_descriptor(dev, &conf_desc);
+	if (res < 0)
+		libusb_get_config_descriptor(dev, 0, &conf_desc);
+	if (conf_desc) {
+		for (j = 0; j < conf_desc->bNumInterfaces; j++) {
+			const struct libusb_interface *intf = &conf_desc->interface[j];
+			for (k = 0; k < intf->num_altsetting; k++) {
+				const struct libusb_interface_descriptor *intf_desc;
+				intf_desc = &intf->altsetting[k];
+				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
+					interface_num = intf_desc->bInterfaceNumber;
 
-	return -1; /* failure */
-}
-#endif /* INVASIVE_GET_USAGE */
+					/* Check the VID/PID against the arguments */
+					if ((vendor_id == 0x0 || vendor_id == dev_vid) &&
+					    (product_id == 0x0 || product_id == dev_pid)) {
+						struct hid_device_info *tmp;
 
-#if defined(__FreeBSD__) && __FreeBSD__ < 10
-/* The libusb version included in FreeBSD < 10 doesn't have this function. In
-   mainline libusb, it's inlined in libusb.h. This function will bear a striking
-   resemblance to that one, because there's about one way to code it.
+						/* VID/PID match. Create the record. */
+						tmp = calloc(1, sizeof(struct hid_device_info));
+						if (cur_dev) {
+							cur_dev->next = tmp;
+						}
+						else {
+							*root = tmp;
+						}
+						cur_dev = tmp;
 
-   Note that the data parameter is Unicode in UTF-16LE encoding.
-   Return value is the number of bytes in data, or LIBUSB_ERROR_*.
- */
-static inline int libusb_get_string_descriptor(libusb_device_handle *dev,
-	uint8_t descriptor_index, uint16_t lang_id,
-	unsigned char *data, int length)
+						/* Fill out the record */
+						cur_dev->next = NULL;
+						cur_dev->path = make_path(dev, interface_num);
+
+						res = open_strings ? libusb_open(dev, &handle) : -1;
+
+						if (res >= 0) {
+							/* Serial Number */
+							if (desc.iSerialNumber > 0)
+								cur_dev->serial_number =
+									get_usb_string(handle, desc.iSerialNumber);
+
+							/* Manufacturer and Product strings */
+							if (desc.iManufacturer > 0)
+								cur_dev->manufacturer_string =
+									get_usb_string(handle, desc.iManufacturer);
+							if (desc.iProduct > 0)
+								cur_dev->product_string =
+									get_usb_string(handle, desc.iProduct);
+
+#ifdef INVASIVE_GET_USAGE
 {
-	return libusb_control_transfer(dev,
-		LIBUSB_ENDPOINT_IN | 0x0, /* Endpoint 0 IN */
-		LIBUSB_REQUEST_GET_DESCRIPTOR,
-		(LIBUSB_DT_STRING << 8) | descriptor_index,
-		lang_id, data, (uint16_t) length, 1000);
-}
+						/*
+						This section is removed because it is too
+						invasive on the system. Getting a Usage Page
+						and Usage requires parsing the HID Report
+						descriptor. Getting a HID Report descriptor
+						involves claiming the interface. Claiming the
+						interface involves detaching the kernel driver.
+						Detaching the kernel driver is hard on the system
+						because it will unclaim interfaces (if another
+						app has them claimed) and the re-attachment of
+						the driver will sometimes change /dev entry names.
+						It is for these reasons that this section is
+						#if 0. For composite devices, use the interface
+						field in the hid_device_info struct to distinguish
+						between interfaces. */
+							unsigned char data[256];
+#ifdef DETACH_KERNEL_DRIVER
+							int detached = 0;
+							/* Usage Page and Usage */
+							res = libusb_kernel_driver_active(handle, interface_num);
+							if (res == 1) {
+								res = libusb_detach_kernel_driver(handle, interface_num);
+								if (res < 0)
+									LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
+								else
+									detached = 1;
+							}
+#endif
+							res = libusb_claim_interface(handle, interface_num);
+							if (res >= 0) {
+								/* Get the HID Report Descriptor. */
+								res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
+								if (res >= 0) {
+									unsigned short page=0, usage=0;
+									/* Parse the usage and usage page
+									   out of the report descriptor. */
+									get_usage(data, res,  &page, &usage);
+									cur_dev->usage_page = page;
+									cur_dev->usage = usage;
+								}
+								else
+									LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
 
+								/* Release the interface */
+								res = libusb_release_interface(handle, interface_num);
+								if (res < 0)
+									LOG("Can't release the interface.\n");
+							}
+							else
+								LOG("Can't claim interface %d\n", res);
+#ifdef DETACH_KERNEL_DRIVER
+							/* Re-attach kernel driver if necessary. */
+							if (detached) {
+								res = libusb_attach_kernel_driver(handle, interface_num);
+								if (res < 0)
+									LOG("Couldn't re-attach kernel driver.\n");
+							}
 #endif
+}
+#endif /* INVASIVE_GET_USAGE */
 
+							libusb_close(handle);
+						}
+						/* VID/PID */
+						cur_dev->vendor_id = dev_vid;
+						cur_dev->product_id = dev_pid;
 
-/* Get the first language the device says it reports. This comes from
-   USB string #0. */
-static uint16_t get_first_language(libusb_device_handle *dev)
-{
-	uint16_t buf[32];
-	int len;
+						/* Release Number */
+						cur_dev->release_number = desc.bcdDevice;
 
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			0x0, /* String ID */
-			0x0, /* Language */
-			(unsigned char*)buf,
-			sizeof(buf));
-	if (len < 4)
-		return 0x0;
+						/* Interface Number */
+						cur_dev->interface_number = interface_num;
+					}
+				}
+			} /* altsettings */
+		} /* interfaces */
+		libusb_free_config_descriptor(conf_desc);
+	}
 
-	return buf[1]; /* First two bytes are len and descriptor type. */
+	return cur_dev;
 }
 
-static int is_language_supported(libusb_device_handle *dev, uint16_t lang)
-{
-	uint16_t buf[32];
+/* Devices picked out of the device list of a context by their VID/PID. They
+   are referenced, so that they can be opened once the list is unlocked, and
+   only take an allocation when there are more than fit in the fixed array. */
+struct device_pick {
+	libusb_device *fixed[16];
+	libusb_device **devs;
 	int len;
-	int i;
+	int size;
+};
 
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			0x0, /* String ID */
-			0x0, /* Language */
-			(unsigned char*)buf,
-			sizeof(buf));
-	if (len < 4)
-		return 0x0;
+static int LIBUSB_CALL pick_device(libusb_device *dev, void *user_data)
+{
+	struct device_pick *pick = user_data;
 
+	if (pick->len == pick->size) {
+		int size = pick->size * 2;
+		libusb_device **devs;
 
-	len /= 2; /* language IDs are two-bytes each. */
-	/* Start at index 1 because there are two bytes of protocol data. */
-	for (i = 1; i < len; i++) {
-		if (buf[i] == lang)
-			return 1;
+		if (pick->devs == pick->fixed) {
+			devs = malloc(size * sizeof(*devs));
+			if (devs)
+				memcpy(devs, pick->fixed, sizeof(pick->fixed));
+		}
+		else
+			devs = realloc(pick->devs, size * sizeof(*devs));
+		if (!devs)
+			return 1; /* out of memory, keep what was picked so far */
+		pick->devs = devs;
+		pick->size = size;
 	}
-
+	pick->devs[pick->len++] = libusb_ref_device(dev);
 	return 0;
 }
 
+static void pick_devices(libusb_context *ctx, unsigned short vendor_id,
+	unsigned short product_id, struct device_pick *pick)
+{
+	struct libusb_device_filter filter = {
+		vendor_id ? vendor_id : LIBUSB_DEVICE_MATCH_ANY,
+		product_id ? product_id : LIBUSB_DEVICE_MATCH_ANY,
+		LIBUSB_DEVICE_MATCH_ANY
+	};
 
-/* This function returns a newly allocated wide string containing the USB
-   device string numbered by the index. The returned string must be freed
-   by using free(). */
-static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
+	pick->devs = pick->fixed;
+	pick->len = 0;
+	pick->size = sizeof(pick->fixed) / sizeof(pick->fixed[0]);
+	libusb_foreach_device(ctx, &filter, pick_device, pick);
+}
+
+static void release_devices(struct device_pick *pick)
 {
-	char buf[512];
-	int len;
-	wchar_t *str = NULL;
+	int i;
 
-#ifndef __ANDROID__ /* we don't use iconv on Android */
-	wchar_t wbuf[256];
-	/* iconv variables */
-	iconv_t ic;
-	size_t inbytes;
-	size_t outbytes;
-	size_t res;
-#ifdef __FreeBSD__
-	const char *inptr;
-#else
-	char *inptr;
-#endif
-	char *outptr;
-#endif
+	for (i = 0; i < pick->len; i++)
+		libusb_unref_device(pick->devs[i]);
+	if (pick->devs != pick->fixed)
+		free(pick->devs);
+}
 
-	/* Determine which language to use. */
-	uint16_t lang;
-	lang = get_usb_code_for_current_locale();
-	if (!is_language_supported(dev, lang))
-		lang = get_first_language(dev);
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct device_pick pick;
+	int i;
 
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			idx,
-			lang,
-			(unsigned char*)buf,
-			sizeof(buf));
-	if (len < 0)
+	struct hid_device_info *root = NULL; /* return object */
+	struct hid_device_info *cur_dev = NULL;
+
+	if(hid_init() < 0)
 		return NULL;
 
-#ifdef __ANDROID__
+	/* Only the devices with the requested VID/PID are referenced and
+	   looked at, the others are skipped while walking the device list. */
+	pick_devices(usb_context, vendor_id, product_id, &pick);
+	for (i = 0; i < pick.len; i++)
+		cur_dev = enumerate_device(pick.devs[i], vendor_id, product_id, 1, &root, cur_dev);
+	release_devices(&pick);
 
-	/* Bionic does not have iconv support nor wcsdup() function, so it
-	   has to be done manually.  The following code will only work for
-	   code points that can be represented as a single UTF-16 character,
-	   and will incorrectly convert any code points which require more
-	   than one UTF-16 character.
+	return root;
+}
 
-	   Skip over the first character (2-bytes).  */
-	len -= 2;
-	str = malloc((len / 2 + 1) * sizeof(wchar_t));
-	int i;
-	for (i = 0; i < len / 2; i++) {
-		str[i] = buf[i * 2 + 2] | (buf[i * 2 + 3] << 8);
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+	struct hid_device_info *d = devs;
+	while (d) {
+		struct hid_device_info *next = d->next;
+		free(d->path);
+		free(d->serial_number);
+		free(d->manufacturer_string);
+		free(d->product_string);
+		free(d);
+		d = next;
 	}
-	str[len / 2] = 0x00000000;
+}
 
-#else
+/* Number of bytes needed to encode the wide string as UTF-8, without the
+   terminating NUL. Invalid code points are replaced by U+FFFD. */
+static size_t wcs_utf8_len(const wchar_t *str)
+{
+	size_t len = 0;
 
-	/* buf does not need to be explicitly NULL-terminated because
-	   it is only passed into iconv() which does not need it. */
+	if (!str)
+		return 0;
+	for (; *str; str++) {
+		uint32_t c = (uint32_t)*str;
+		if (c < 0x80)
+			len += 1;
+		else if (c < 0x800)
+			len += 2;
+		else if (c < 0x10000 || c > 0x10ffff)
+			len += 3;
+		else
+			len += 4;
+	}
+	return len;
+}
 
-	/* Initialize iconv. */
-	ic = iconv_open("WCHAR_T", "UTF-16LE");
-	if (ic == (iconv_t)-1) {
-		LOG("iconv_open() failed\n");
+/* Encode the wide string as NUL terminated UTF-8 into dst, which must hold
+   at least wcs_utf8_len(str) + 1 bytes. Returns the encoded length. */
+static size_t wcs_to_utf8(char *dst, const wchar_t *str)
+{
+	unsigned char *out = (unsigned char *)dst;
+
+	if (str) {
+		for (; *str; str++) {
+			uint32_t c = (uint32_t)*str;
+			if ((c >= 0xd800 && c <= 0xdfff) || c > 0x10ffff)
+				c = 0xfffd;
+			if (c < 0x80) {
+				*out++ = c;
+			} else if (c < 0x800) {
+				*out++ = 0xc0 | (c >> 6);
+				*out++ = 0x80 | (c & 0x3f);
+			} else if (c < 0x10000) {
+				*out++ = 0xe0 | (c >> 12);
+				*out++ = 0x80 | ((c >> 6) & 0x3f);
+				*out++ = 0x80 | (c & 0x3f);
+			} else {
+				*out++ = 0xf0 | (c >> 18);
+				*out++ = 0x80 | ((c >> 12) & 0x3f);
+				*out++ = 0x80 | ((c >> 6) & 0x3f);
+				*out++ = 0x80 | (c & 0x3f);
+			}
+		}
+	}
+	*out = '\0';
+	return (char *)out - dst;
+}
+
+struct hid_snapshot HID_API_EXPORT *hid_enumerate_snapshot(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_device_info *devs, *d;
+	struct hid_snapshot *snapshot;
+	size_t count = 0, strings = 0, i = 0, off = 0;
+	char *area;
+
+	if (hid_init() < 0)
 		return NULL;
+
+	/* An empty list is a valid result, so only bail on init failure above */
+	devs = hid_enumerate(vendor_id, product_id);
+
+	/* Size the block: header, record array, then every string with its NUL */
+	for (d = devs; d; d = d->next) {
+		count++;
+		strings += (d->path ? strlen(d->path) : 0) + 1;
+		strings += wcs_utf8_len(d->serial_number) + 1;
+		strings += wcs_utf8_len(d->manufacturer_string) + 1;
+		strings += wcs_utf8_len(d->product_string) + 1;
 	}
 
-	/* Convert to native wchar_t (UTF-32 on glibc/BSD systems).
-	   Skip the first character (2-bytes). */
-	inptr = buf+2;
-	inbytes = len-2;
-	outptr = (char*) wbuf;
-	outbytes = sizeof(wbuf);
-	res = iconv(ic, &inptr, &inbytes, &outptr, &outbytes);
-	if (res == (size_t)-1) {
-		LOG("iconv() failed\n");
-		goto err;
+	snapshot = malloc(sizeof(*snapshot) + count * sizeof(struct hid_snapshot_entry) + strings);
+	if (!snapshot) {
+		hid_free_enumeration(devs);
+		return NULL;
 	}
+	snapshot->count = count;
+	snapshot->size = sizeof(*snapshot) + count * sizeof(struct hid_snapshot_entry) + strings;
+	snapshot->entries = (struct hid_snapshot_entry *)(snapshot + 1);
+	area = (char *)(snapshot->entries + count);
+	snapshot->strings = area;
 
-	/* Write the terminating NULL. */
-	wbuf[sizeof(wbuf)/sizeof(wbuf[0])-1] = 0x00000000;
-	if (outbytes >= sizeof(wbuf[0]))
-		*((wchar_t*)outptr) = 0x00000000;
+	for (d = devs; d; d = d->next, i++) {
+		struct hid_snapshot_entry *e = &snapshot->entries[i];
+		size_t len;
 
-	/* Allocate and copy the string. */
-	str = wcsdup(wbuf);
+		len = d->path ? strlen(d->path) : 0;
+		memcpy(area + off, d->path ? d->path : "", len + 1);
+		e->path = off;
+		e->path_len = len;
+		off += len + 1;
 
-err:
-	iconv_close(ic);
+		e->serial_number = off;
+		e->serial_number_len = wcs_to_utf8(area + off, d->serial_number);
+		off += e->serial_number_len + 1;
 
-#endif
+		e->manufacturer_string = off;
+		e->manufacturer_string_len = wcs_to_utf8(area + off, d->manufacturer_string);
+		off += e->manufacturer_string_len + 1;
 
-	return str;
+		e->product_string = off;
+		e->product_string_len = wcs_to_utf8(area + off, d->product_string);
+		off += e->product_string_len + 1;
+
+		e->vendor_id = d->vendor_id;
+		e->product_id = d->product_id;
+		e->release_number = d->release_number;
+		e->interface_number = d->interface_number;
+	}
+	hid_free_enumeration(devs);
+
+	return snapshot;
 }
 
-static char *make_path(libusb_device *dev, int interface_number)
+void  HID_API_EXPORT hid_free_snapshot(struct hid_snapshot *snapshot)
 {
-	char str[64];
-	snprintf(str, sizeof(str), "%04x:%04x:%02x",
-		libusb_get_bus_number(dev),
-		libusb_get_device_address(dev),
-		interface_number);
-	str[sizeof(str)-1] = '\0';
-
-	return strdup(str);
+	free(snapshot);
 }
 
+/* A hotplug notification which has not been turned into a hid_hotplug_event
+   yet. The device is referenced until then. */
+struct hotplug_pending {
+	libusb_device *dev;
+	int event;
+	struct hotplug_pending *next;
+};
+
+struct hid_hotplug_watch_ {
+	/* The context the watch was created on, valid until stop is set */
+	libusb_context *context;
+	struct hotplug_pending *head;
+	struct hotplug_pending **tail;
+	/* Completion flag handed to the libusb event handling */
+	int wake;
+	int stop;
+	struct hid_hotplug_watch_ *next;
+};
 
-int HID_API_EXPORT hid_init(void)
+/* Must be called with hotplug_lock held */
+static void hotplug_queue(hid_hotplug_watch *watch, libusb_device *dev, int event)
 {
-	if (!usb_context) {
-		const char *locale;
+	struct hotplug_pending *p;
 
-		/* Init Libusb */
-		if (libusb_init(&usb_context))
-			return -1;
+	if (watch->stop)
+		return;
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return;
 
-		/* Set the locale if it's not set. */
-		locale = setlocale(LC_CTYPE, NULL);
-		if (!locale)
-			setlocale(LC_CTYPE, "");
-	}
+	p->dev = libusb_ref_device(dev);
+	p->event = event;
+	*watch->tail = p;
+	watch->tail = &p->next;
+	watch->wake = 1;
+}
 
+static int LIBUSB_CALL hotplug_queue_attached(libusb_device *dev, void *user_data)
+{
+	hotplug_queue(user_data, dev, HID_HOTPLUG_ARRIVED);
 	return 0;
 }
 
-int HID_API_EXPORT hid_exit(void)
+static int LIBUSB_CALL hotplug_callback(libusb_context *ctx, libusb_device *dev,
+	libusb_hotplug_event event, void *user_data)
 {
-	if (usb_context) {
-		libusb_exit(usb_context);
-		usb_context = NULL;
-	}
+	hid_hotplug_watch *watch;
+
+	UNUSED(ctx);
+	UNUSED(user_data);
+
+	pthread_mutex_lock(&hotplug_lock);
+	for (watch = hotplug_watches; watch; watch = watch->next)
+		hotplug_queue(watch, dev, event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ?
+			HID_HOTPLUG_ARRIVED : HID_HOTPLUG_LEFT);
+	pthread_mutex_unlock(&hotplug_lock);
 
 	return 0;
 }
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+hid_hotplug_watch HID_API_EXPORT *hid_hotplug_watch_create(void)
 {
-	libusb_device **devs;
-	libusb_device *dev;
-	libusb_device_handle *handle;
-	ssize_t num_devs;
-	int i = 0;
-
-	struct hid_device_info *root = NULL; /* return object */
-	struct hid_device_info *cur_dev = NULL;
+	hid_hotplug_watch *watch;
 
-	if(hid_init() < 0)
+	if (hid_init() < 0)
+		return NULL;
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
 		return NULL;
 
-	num_devs = libusb_get_device_list(usb_context, &devs);
-	if (num_devs < 0)
+	watch = calloc(1, sizeof(*watch));
+	if (!watch)
 		return NULL;
-	while ((dev = devs[i++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		struct libusb_config_descriptor *conf_desc = NULL;
-		int j, k;
-		int interface_num = 0;
-
-		int res = libusb_get_device_descriptor(dev, &desc);
-		unsigned short dev_vid = desc.idVendor;
-		unsigned short dev_pid = desc.idProduct;
-
-		res = libusb_get_active_config_descriptor(dev, &conf_desc);
-		if (res < 0)
-			libusb_get_config_descriptor(dev, 0, &conf_desc);
-		if (conf_desc) {
-			for (j = 0; j < conf_desc->bNumInterfaces; j++) {
-				const struct libusb_interface *intf = &conf_desc->interface[j];
-				for (k = 0; k < intf->num_altsetting; k++) {
-					const struct libusb_interface_descriptor *intf_desc;
-					intf_desc = &intf->altsetting[k];
-					if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-						interface_num = intf_desc->bInterfaceNumber;
-
-						/* Check the VID/PID against the arguments */
-						if ((vendor_id == 0x0 || vendor_id == dev_vid) &&
-						    (product_id == 0x0 || product_id == dev_pid)) {
-							struct hid_device_info *tmp;
-
-							/* VID/PID match. Create the record. */
-							tmp = calloc(1, sizeof(struct hid_device_info));
-							if (cur_dev) {
-								cur_dev->next = tmp;
-							}
-							else {
-								root = tmp;
-							}
-							cur_dev = tmp;
+	watch->tail = &watch->head;
+
+	pthread_mutex_lock(&usb_context_lock);
+	pthread_mutex_lock(&hotplug_lock);
+	watch->context = usb_context;
+	if (!watch->context) {
+		/* hid_exit() got there first */
+		pthread_mutex_unlock(&hotplug_lock);
+		pthread_mutex_unlock(&usb_context_lock);
+		free(watch);
+		return NULL;
+	}
+	if (!hotplug_registered) {
+		if (libusb_hotplug_register_callback(watch->context,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			0, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, NULL) != LIBUSB_SUCCESS) {
+			pthread_mutex_unlock(&hotplug_lock);
+			pthread_mutex_unlock(&usb_context_lock);
+			free(watch);
+			return NULL;
+		}
+		hotplug_registered = 1;
+	}
+	watch->next = hotplug_watches;
+	hotplug_watches = watch;
 
-							/* Fill out the record */
-							cur_dev->next = NULL;
-							cur_dev->path = make_path(dev, interface_num);
+	/* Report what is already attached. The watch is live at this point, so
+	   a device plugged in meanwhile is reported at least once. */
+	libusb_foreach_device(watch->context, NULL, hotplug_queue_attached, watch);
+	pthread_mutex_unlock(&hotplug_lock);
+	pthread_mutex_unlock(&usb_context_lock);
 
-							res = libusb_open(dev, &handle);
+	return watch;
+}
 
-							if (res >= 0) {
-								/* Serial Number */
-								if (desc.iSerialNumber > 0)
-									cur_dev->serial_number =
-										get_usb_string(handle, desc.iSerialNumber);
-
-								/* Manufacturer and Product strings */
-								if (desc.iManufacturer > 0)
-									cur_dev->manufacturer_string =
-										get_usb_string(handle, desc.iManufacturer);
-								if (desc.iProduct > 0)
-									cur_dev->product_string =
-										get_usb_string(handle, desc.iProduct);
+struct hid_hotplug_event HID_API_EXPORT *hid_hotplug_watch_wait(hid_hotplug_watch *watch)
+{
+	struct hid_hotplug_event *events = NULL, **last = &events;
+	struct hotplug_pending *p, *next;
 
-#ifdef INVASIVE_GET_USAGE
+	while (!events) {
+		pthread_mutex_lock(&hotplug_lock);
+		if (watch->stop) {
+			pthread_mutex_unlock(&hotplug_lock);
+			return NULL;
+		}
+		p = watch->head;
+		watch->head = NULL;
+		watch->tail = &watch->head;
+		watch->wake = 0;
+		hotplug_busy++;
+		pthread_mutex_unlock(&hotplug_lock);
+
+		if (!p) {
+			/* Nothing queued: drive the event handling (or wait for the
+			   thread which does) until the callback sets the flag. */
+			struct timeval tv = { 3600, 0 };
+			libusb_handle_events_timeout_completed(watch->context, &tv, &watch->wake);
+		}
+		for (; p; p = next) {
+			struct hid_device_info *devs = NULL;
+
+			next = p->next;
+			enumerate_device(p->dev, 0, 0, p->event == HID_HOTPLUG_ARRIVED, &devs, NULL);
+			if (devs) {
+				struct hid_hotplug_event *ev = calloc(1, sizeof(*ev));
+				if (ev) {
+					ev->event = p->event;
+					ev->devs = devs;
+					*last = ev;
+					last = &ev->next;
+				}
+				else
+					hid_free_enumeration(devs);
+			}
+			libusb_unref_device(p->dev);
+			free(p);
+		}
+
+		pthread_mutex_lock(&hotplug_lock);
+		if (--hotplug_busy == 0)
+			pthread_cond_broadcast(&hotplug_cond);
+		pthread_mutex_unlock(&hotplug_lock);
+	}
+
+	return events;
+}
+
+/* Stop every watch, dropping the devices they have queued. Must be called
+   with hotplug_lock held. */
+static void hotplug_stop_watches(void)
 {
-							/*
-							This section is removed because it is too
-							invasive on the system. Getting a Usage Page
-							and Usage requires parsing the HID Report
-							descriptor. Getting a HID Report descriptor
-							involves claiming the interface. Claiming the
-							interface involves detaching the kernel driver.
-							Detaching the kernel driver is hard on the system
-							because it will unclaim interfaces (if another
-							app has them claimed) and the re-attachment of
-							the driver will sometimes change /dev entry names.
-							It is for these reasons that this section is
-							#if 0. For composite devices, use the interface
-							field in the hid_device_info struct to distinguish
-							between interfaces. */
-								unsigned char data[256];
-#ifdef DETACH_KERNEL_DRIVER
-								int detached = 0;
-								/* Usage Page and Usage */
-								res = libusb_kernel_driver_active(handle, interface_num);
-								if (res == 1) {
-									res = libusb_detach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
-									else
-										detached = 1;
-								}
-#endif
-								res = libusb_claim_interface(handle, interface_num);
-								if (res >= 0) {
-									/* Get the HID Report Descriptor. */
-									res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
-									if (res >= 0) {
-										unsigned short page=0, usage=0;
-										/* Parse the usage and usage page
-										   out of the report descriptor. */
-										get_usage(data, res,  &page, &usage);
-										cur_dev->usage_page = page;
-										cur_dev->usage = usage;
-									}
-									else
-										LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
-
-									/* Release the interface */
-									res = libusb_release_interface(handle, interface_num);
-									if (res < 0)
-										LOG("Can't release the interface.\n");
-								}
-								else
-									LOG("Can't claim interface %d\n", res);
-#ifdef DETACH_KERNEL_DRIVER
-								/* Re-attach kernel driver if necessary. */
-								if (detached) {
-									res = libusb_attach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't re-attach kernel driver.\n");
-								}
-#endif
+	hid_hotplug_watch *watch;
+	struct hotplug_pending *p, *next;
+
+	for (watch = hotplug_watches; watch; watch = watch->next) {
+		watch->stop = 1;
+		watch->wake = 1;
+		for (p = watch->head; p; p = next) {
+			next = p->next;
+			libusb_unref_device(p->dev);
+			free(p);
+		}
+		watch->head = NULL;
+		watch->tail = &watch->head;
+	}
+}
+
+void HID_API_EXPORT hid_hotplug_watch_interrupt(hid_hotplug_watch *watch)
+{
+	pthread_mutex_lock(&hotplug_lock);
+	/* Once stopped, the context may be gone already */
+	if (!watch->stop) {
+		watch->stop = 1;
+		watch->wake = 1;
+		libusb_interrupt_event_handler(watch->context);
+	}
+	pthread_mutex_unlock(&hotplug_lock);
+}
+
+void HID_API_EXPORT hid_hotplug_watch_destroy(hid_hotplug_watch *watch)
+{
+	hid_hotplug_watch **w;
+	struct hotplug_pending *p, *next;
+
+	pthread_mutex_lock(&hotplug_lock);
+	for (w = &hotplug_watches; *w; w = &(*w)->next) {
+		if (*w == watch) {
+			*w = watch->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&hotplug_lock);
+
+	for (p = watch->head; p; p = next) {
+		next = p->next;
+		libusb_unref_device(p->dev);
+		free(p);
+	}
+	free(watch);
+}
+
+void HID_API_EXPORT hid_hotplug_free_events(struct hid_hotplug_event *events)
+{
+	while (events) {
+		struct hid_hotplug_event *next = events->next;
+		hid_free_enumeration(events->devs);
+		free(events);
+		events = next;
+	}
+}
+
+/* Return the cached string of dev numbered by the index, or NULL. Called
+   with dev->mutex held. */
+static struct cached_string *find_cached_string(hid_device *dev, int index)
+{
+	struct cached_string *cs;
+
+	for (cs = dev->strings; cs; cs = cs->next) {
+		if (cs->index == index)
+			return cs;
+	}
+	return NULL;
 }
-#endif /* INVASIVE_GET_USAGE */
 
-								libusb_close(handle);
-							}
-							/* VID/PID */
-							cur_dev->vendor_id = dev_vid;
-							cur_dev->product_id = dev_pid;
+/* Keep str as the string of dev numbered by the index, unless one is kept
+   already. Takes ownership of str, and returns the string kept, or NULL if
+   str is NULL or there is no memory to keep it. */
+static const wchar_t *cache_string(hid_device *dev, int index, wchar_t *str)
+{
+	struct cached_string *cs;
 
-							/* Release Number */
-							cur_dev->release_number = desc.bcdDevice;
+	if (!str)
+		return NULL;
 
-							/* Interface Number */
-							cur_dev->interface_number = interface_num;
-						}
-					}
-				} /* altsettings */
-			} /* interfaces */
-			libusb_free_config_descriptor(conf_desc);
+	pthread_mutex_lock(&dev->mutex);
+	cs = find_cached_string(dev, index);
+	if (cs) {
+		free(str);
+	}
+	else {
+		cs = malloc(sizeof(*cs));
+		if (!cs) {
+			pthread_mutex_unlock(&dev->mutex);
+			free(str);
+			return NULL;
 		}
+		cs->index = index;
+		cs->str = str;
+		cs->next = dev->strings;
+		dev->strings = cs;
 	}
+	pthread_mutex_unlock(&dev->mutex);
 
-	libusb_free_device_list(devs, 1);
-
-	return root;
+	return cs->str;
 }
 
-void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+/* Return the string of dev numbered by the index, reading it from the device
+   only the first time. The string lives as long as dev. Index 0 is not a
+   string but the list of languages, and devices use it for missing
+   strings. */
+static const wchar_t *get_cached_string(hid_device *dev, int index)
 {
-	struct hid_device_info *d = devs;
-	while (d) {
-		struct hid_device_info *next = d->next;
-		free(d->path);
-		free(d->serial_number);
-		free(d->manufacturer_string);
-		free(d->product_string);
-		free(d);
-		d = next;
-	}
+	struct cached_string *cs;
+	wchar_t *str;
+
+	if (index <= 0 || index > 0xff)
+		return NULL;
+
+	pthread_mutex_lock(&dev->mutex);
+	cs = find_cached_string(dev, index);
+	pthread_mutex_unlock(&dev->mutex);
+	if (cs)
+		return cs->str;
+
+	/* Read without holding the mutex, input reports are queued under it */
+	str = get_usb_string(dev->device_handle, index);
+	if (!str)
+		return NULL;
+	return cache_string(dev, index, str);
 }
 
 hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
 {
-	struct hid_device_info *devs, *cur_dev;
+	struct device_pick pick;
+	struct hid_device_info *devs = NULL, *cur_dev = NULL;
 	const char *path_to_open = NULL;
 	hid_device *handle = NULL;
+	int i;
 
-	devs = hid_enumerate(vendor_id, product_id);
-	cur_dev = devs;
-	while (cur_dev) {
-		if (cur_dev->vendor_id == vendor_id &&
-		    cur_dev->product_id == product_id) {
-			if (serial_number) {
-				if (cur_dev->serial_number &&
-				    wcscmp(serial_number, cur_dev->serial_number) == 0) {
+	if (hid_init() < 0)
+		return NULL;
+
+	/* Look at the matching devices one at a time, reading the strings only
+	   when a serial number has to be compared, and stop at the first hit. */
+	pick_devices(usb_context, vendor_id, product_id, &pick);
+	for (i = 0; i < pick.len && !path_to_open; i++) {
+		enumerate_device(pick.devs[i], vendor_id, product_id,
+			serial_number != NULL, &devs, NULL);
+		cur_dev = devs;
+		while (cur_dev) {
+			if (cur_dev->vendor_id == vendor_id &&
+			    cur_dev->product_id == product_id) {
+				if (serial_number) {
+					if (cur_dev->serial_number &&
+					    wcscmp(serial_number, cur_dev->serial_number) == 0) {
+						path_to_open = cur_dev->path;
+						break;
+					}
+				}
+				else {
 					path_to_open = cur_dev->path;
 					break;
 				}
 			}
-			else {
-				path_to_open = cur_dev->path;
-				break;
-			}
+			cur_dev = cur_dev->next;
+		}
+		if (!path_to_open) {
+			hid_free_enumeration(devs);
+			devs = NULL;
 		}
-		cur_dev = cur_dev->next;
 	}
+	release_devices(&pick);
 
 	if (path_to_open) {
 		/* Open the device */
 		handle = hid_open_path(path_to_open);
 	}
 
+	/* Keep the strings read to find the device */
+	if (handle) {
+		if (cur_dev->manufacturer_string)
+			cache_string(handle, handle->manufacturer_index,
+				wcsdup(cur_dev->manufacturer_string));
+		if (cur_dev->product_string)
+			cache_string(handle, handle->product_index,
+				wcsdup(cur_dev->product_string));
+		if (cur_dev->serial_number)
+			cache_string(handle, handle->serial_index,
+				wcsdup(cur_dev->serial_number));
+	}
+
 	hid_free_enumeration(devs);
 
 	return handle;
 }
 
+/* Wake the threads waiting for input reports on a device whose input
+   transfer has ended. Do this under a mutex to make sure that a thread which
+   is about to go to sleep waiting on the condition actually will go to sleep
+   before the condition is signaled. */
+static void wake_readers(hid_device *dev)
+{
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cond_broadcast(&dev->condition);
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+/* Mark the reads of a device as over once its input transfer won't be
+   submitted again. read_thread() wakes the readers on its way out, but the
+   thread of a composite device goes on serving the other interfaces, so their
+   readers are woken right away. dev must not be touched once cancelled is
+   set, as hid_close() may then free it. */
+static void end_reads(hid_device *dev)
+{
+	dev->shutdown_thread = 1;
+	if (dev->shared)
+		wake_readers(dev);
+	dev->cancelled = 1;
+}
+
 static void read_callback(struct libusb_transfer *transfer)
 {
 	hid_device *dev = transfer->user_data;
@@ -15592,7 +20271,13 @@ static void read_callback(struct libusb_transfer *transfer)
 
 	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
 
-		struct input_report *rpt = malloc(sizeof(*rpt));
+		struct input_report *rpt;
+
+		count_latency(&dev->stats.read_latency, dev->read_submitted_ns);
+		count_stat(&dev->stats.reports_received, 1);
+		count_stat(&dev->stats.bytes_received, transfer->actual_length);
+
+		rpt = malloc(sizeof(*rpt));
 		rpt->data = malloc(transfer->actual_length);
 		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
 		rpt->len = transfer->actual_length;
@@ -15621,45 +20306,57 @@ static void read_callback(struct libusb_transfer *transfer)
 			   anything from the device. */
 			if (num_queued > 30) {
 				return_data(dev, NULL, 0);
+				count_stat(&dev->stats.reports_dropped, 1);
 			}
 		}
 		pthread_mutex_unlock(&dev->mutex);
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-		dev->shutdown_thread = 1;
-		dev->cancelled = 1;
+		end_reads(dev);
 		return;
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
-		dev->shutdown_thread = 1;
-		dev->cancelled = 1;
+		count_stat(&dev->stats.errors, 1);
+		dev->read_error = LIBUSB_ERROR_NO_DEVICE;
+		end_reads(dev);
 		return;
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
 		//LOG("Timeout (normal)\n");
+		count_stat(&dev->stats.timeouts, 1);
 	}
 	else {
 		LOG("Unknown transfer code: %d\n", transfer->status);
+		count_stat(&dev->stats.errors, 1);
 	}
 
 	/* Re-submit the transfer object. */
+	dev->read_submitted_ns = monotonic_ns();
 	res = libusb_submit_transfer(transfer);
 	if (res != 0) {
 		LOG("Unable to submit URB. libusb error code: %d\n", res);
-		dev->shutdown_thread = 1;
-		dev->cancelled = 1;
+		dev->read_error = res;
+		end_reads(dev);
 	}
 }
 
 
-static void *read_thread(void *param)
+/* Set up the input transfer of a device and make its first submission.
+   Further submissions are made from inside read_callback(). */
+static void start_input_transfer(hid_device *dev)
 {
-	hid_device *dev = param;
 	unsigned char *buf;
+	int res;
 	const size_t length = dev->input_ep_max_packet_size;
 
-	/* Set up the transfer object. */
-	buf = malloc(length);
+	/* The buffer is preferably device memory, which spares the kernel
+	   copying every report through a bounce buffer, but not every kernel
+	   offers it. */
+	buf = libusb_dev_mem_alloc(dev->device_handle, length);
+	if (buf)
+		dev->read_buffer_mode = HID_BUFFER_DEVICE;
+	else
+		buf = malloc(length);
 	dev->transfer = libusb_alloc_transfer(0);
 	libusb_fill_interrupt_transfer(dev->transfer,
 		dev->device_handle,
@@ -15670,9 +20367,20 @@ static void *read_thread(void *param)
 		dev,
 		5000/*timeout*/);
 
-	/* Make the first submission. Further submissions are made
-	   from inside read_callback() */
-	libusb_submit_transfer(dev->transfer);
+	dev->read_submitted_ns = monotonic_ns();
+	res = libusb_submit_transfer(dev->transfer);
+	if (res != 0) {
+		LOG("Unable to submit URB. libusb error code: %d\n", res);
+		dev->read_error = res;
+		end_reads(dev);
+	}
+}
+
+static void *read_thread(void *param)
+{
+	hid_device *dev = param;
+
+	start_input_transfer(dev);
 
 	/* Notify the main thread that the read thread is up and running. */
 	pthread_barrier_wait(&dev->barrier);
@@ -15680,7 +20388,7 @@ static void *read_thread(void *param)
 	/* Handle all the events. */
 	while (!dev->shutdown_thread) {
 		int res;
-		res = libusb_handle_events(usb_context);
+		res = libusb_handle_events(dev->context);
 		if (res < 0) {
 			/* There was an error. */
 			LOG("read_thread(): libusb reports error # %d\n", res);
@@ -15690,6 +20398,7 @@ static void *read_thread(void *param)
 			    res != LIBUSB_ERROR_TIMEOUT &&
 			    res != LIBUSB_ERROR_OVERFLOW &&
 			    res != LIBUSB_ERROR_INTERRUPTED) {
+				dev->read_error = res;
 				break;
 			}
 		}
@@ -15700,16 +20409,11 @@ static void *read_thread(void *param)
 	libusb_cancel_transfer(dev->transfer);
 
 	while (!dev->cancelled)
-		libusb_handle_events_completed(usb_context, &dev->cancelled);
+		libusb_handle_events_completed(dev->context, &dev->cancelled);
 
 	/* Now that the read thread is stopping, Wake any threads which are
-	   waiting on data (in hid_read_timeout()). Do this under a mutex to
-	   make sure that a thread which is about to go to sleep waiting on
-	   the condition actually will go to sleep before the condition is
-	   signaled. */
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cond_broadcast(&dev->condition);
-	pthread_mutex_unlock(&dev->mutex);
+	   waiting on data (in hid_read_timeout()). */
+	wake_readers(dev);
 
 	/* The dev->transfer->buffer and dev->transfer objects are cleaned up
 	   in hid_close(). They are not cleaned up here because this thread
@@ -15722,13 +20426,89 @@ static void *read_thread(void *param)
 	return NULL;
 }
 
+/* Claim the HID interface described by intf_desc on the handle of dev, and
+   take the string indexes, interface number and endpoints from the
+   descriptors. Returns a libusb error code. */
+static int claim_hid_interface(hid_device *dev,
+	const struct libusb_device_descriptor *desc,
+	const struct libusb_interface_descriptor *intf_desc)
+{
+	int res;
+	int i;
+
+#ifdef DETACH_KERNEL_DRIVER
+	/* Detach the kernel driver, but only if the
+	   device is managed by the kernel */
+	if (libusb_kernel_driver_active(dev->device_handle, intf_desc->bInterfaceNumber) == 1) {
+		res = libusb_detach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
+		if (res < 0) {
+			LOG("Unable to detach Kernel Driver\n");
+			return res;
+		}
+	}
+#endif
+	res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
+	if (res < 0) {
+		LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
+		return res;
+	}
+
+	/* Store off the string descriptor indexes */
+	dev->manufacturer_index = desc->iManufacturer;
+	dev->product_index      = desc->iProduct;
+	dev->serial_index       = desc->iSerialNumber;
+
+	/* Store off the interface number */
+	dev->interface = intf_desc->bInterfaceNumber;
+
+	/* Find the INPUT and OUTPUT endpoints. An
+	   OUTPUT endpoint is not required. */
+	for (i = 0; i < intf_desc->bNumEndpoints; i++) {
+		const struct libusb_endpoint_descriptor *ep
+			= &intf_desc->endpoint[i];
+
+		/* Determine the type and direction of this
+		   endpoint. */
+		int is_interrupt =
+			(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+		      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
+		int is_output =
+			(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+		      == LIBUSB_ENDPOINT_OUT;
+		int is_input =
+			(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+		      == LIBUSB_ENDPOINT_IN;
+
+		/* Decide whether to use it for input or output. */
+		if (dev->input_endpoint == 0 &&
+		    is_interrupt && is_input) {
+			/* Use this endpoint for INPUT */
+			dev->input_endpoint = ep->bEndpointAddress;
+			dev->input_ep_max_packet_size = ep->wMaxPacketSize;
+		}
+		if (dev->output_endpoint == 0 &&
+		    is_interrupt && is_output) {
+			/* Use this endpoint for OUTPUT */
+			dev->output_endpoint = ep->bEndpointAddress;
+		}
+	}
+
+	return LIBUSB_SUCCESS;
+}
 
 hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	return hid_open_path_context(path, -1);
+}
+
+hid_device * HID_API_EXPORT hid_open_path_context(const char *path, int context)
 {
 	hid_device *dev = NULL;
 
-	libusb_device **devs;
+	libusb_context *ctx;
+	libusb_device *devs[2] = { NULL, NULL };
 	libusb_device *usb_dev;
+	unsigned int bus_number, device_address, interface_number;
 	int res;
 	int d = 0;
 	int good_open = 0;
@@ -15736,13 +20516,32 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 	if(hid_init() < 0)
 		return NULL;
 
+	ctx = context_for_path(path, context);
+	if (!ctx) {
+		register_error(NULL, LIBUSB_ERROR_INVALID_PARAM);
+		return NULL;
+	}
+
+	/* The path names the bus and address of the device, so look it up
+	   directly rather than listing every device. */
+	if (sscanf(path, "%x:%x:%x", &bus_number, &device_address,
+			&interface_number) != 3 ||
+			bus_number > 0xff || device_address > 0xff ||
+			!(devs[0] = libusb_get_device_by_address(ctx,
+				bus_number, device_address))) {
+		register_error(NULL, LIBUSB_ERROR_NOT_FOUND);
+		return NULL;
+	}
+
 	dev = new_hid_device();
+	dev->context = ctx;
 
-	libusb_get_device_list(usb_context, &devs);
+	/* Reported if no interface matches the path */
+	res = LIBUSB_ERROR_NOT_FOUND;
 	while ((usb_dev = devs[d++]) != NULL) {
 		struct libusb_device_descriptor desc;
 		struct libusb_config_descriptor *conf_desc = NULL;
-		int i,j,k;
+		int j,k;
 		libusb_get_device_descriptor(usb_dev, &desc);
 
 		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
@@ -15764,69 +20563,13 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 							free(dev_path);
 							break;
 						}
-						good_open = 1;
-#ifdef DETACH_KERNEL_DRIVER
-						/* Detach the kernel driver, but only if the
-						   device is managed by the kernel */
-						if (libusb_kernel_driver_active(dev->device_handle, intf_desc->bInterfaceNumber) == 1) {
-							res = libusb_detach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
-							if (res < 0) {
-								libusb_close(dev->device_handle);
-								LOG("Unable to detach Kernel Driver\n");
-								free(dev_path);
-								good_open = 0;
-								break;
-							}
-						}
-#endif
-						res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
+						res = claim_hid_interface(dev, &desc, intf_desc);
 						if (res < 0) {
-							LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
 							free(dev_path);
 							libusb_close(dev->device_handle);
-							good_open = 0;
 							break;
 						}
-
-						/* Store off the string descriptor indexes */
-						dev->manufacturer_index = desc.iManufacturer;
-						dev->product_index      = desc.iProduct;
-						dev->serial_index       = desc.iSerialNumber;
-
-						/* Store off the interface number */
-						dev->interface = intf_desc->bInterfaceNumber;
-
-						/* Find the INPUT and OUTPUT endpoints. An
-						   OUTPUT endpoint is not required. */
-						for (i = 0; i < intf_desc->bNumEndpoints; i++) {
-							const struct libusb_endpoint_descriptor *ep
-								= &intf_desc->endpoint[i];
-
-							/* Determine the type and direction of this
-							   endpoint. */
-							int is_interrupt =
-								(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
-							      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
-							int is_output =
-								(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-							      == LIBUSB_ENDPOINT_OUT;
-							int is_input =
-								(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-							      == LIBUSB_ENDPOINT_IN;
-
-							/* Decide whether to use it for input or output. */
-							if (dev->input_endpoint == 0 &&
-							    is_interrupt && is_input) {
-								/* Use this endpoint for INPUT */
-								dev->input_endpoint = ep->bEndpointAddress;
-								dev->input_ep_max_packet_size = ep->wMaxPacketSize;
-							}
-							if (dev->output_endpoint == 0 &&
-							    is_interrupt && is_output) {
-								/* Use this endpoint for OUTPUT */
-								dev->output_endpoint = ep->bEndpointAddress;
-							}
-						}
+						good_open = 1;
 
 						pthread_create(&dev->thread, NULL, read_thread, dev);
 
@@ -15842,7 +20585,7 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 
 	}
 
-	libusb_free_device_list(devs, 1);
+	libusb_unref_device(devs[0]);
 
 	/* If we have a good handle, return it. */
 	if (good_open) {
@@ -15850,17 +20593,216 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 	}
 	else {
 		/* Unable to open any devices. */
+		register_error(NULL, res);
 		free_hid_device(dev);
 		return NULL;
 	}
 }
 
 
+static void free_shared_handle(struct hid_shared_handle *shared)
+{
+	pthread_mutex_destroy(&shared->mutex);
+	free(shared->members);
+	free(shared);
+}
+
+/* Serve the input transfers of the interfaces of a composite device until
+   the last of them is closed. */
+static void *shared_read_thread(void *param)
+{
+	struct hid_shared_handle *shared = param;
+	/* hid_close() wakes the thread up to stop it, but another thread
+	   handling the events of the context may take the wakeup, so the
+	   wait is bounded anyway */
+	struct timeval tv = { 1, 0 };
+	int res = 0;
+	int i;
+
+	while (!__atomic_load_n(&shared->shutdown_thread, __ATOMIC_ACQUIRE)) {
+		res = libusb_handle_events_timeout_completed(shared->context,
+			&tv, &shared->shutdown_thread);
+		if (res < 0) {
+			LOG("shared_read_thread(): libusb reports error # %d\n", res);
+
+			if (res != LIBUSB_ERROR_BUSY &&
+			    res != LIBUSB_ERROR_TIMEOUT &&
+			    res != LIBUSB_ERROR_OVERFLOW &&
+			    res != LIBUSB_ERROR_INTERRUPTED)
+				break;
+		}
+		res = 0;
+	}
+	if (!res)
+		return NULL;
+
+	/* On a fatal error, fail the reads of the interfaces left. Their
+	   transfers are cancelled by hid_close(). */
+	pthread_mutex_lock(&shared->mutex);
+	for (i = 0; i < shared->count; i++) {
+		hid_device *dev = shared->members[i];
+
+		pthread_mutex_lock(&dev->mutex);
+		if (!dev->read_error)
+			dev->read_error = res;
+		dev->shutdown_thread = 1;
+		pthread_cond_broadcast(&dev->condition);
+		pthread_mutex_unlock(&dev->mutex);
+	}
+	pthread_mutex_unlock(&shared->mutex);
+
+	return NULL;
+}
+
+/* Drop an interface of a composite device from its shared handle, closing
+   the handle along with the last interface. */
+static void leave_shared_handle(hid_device *dev)
+{
+	struct hid_shared_handle *shared = dev->shared;
+	int i, last;
+
+	pthread_mutex_lock(&shared->mutex);
+	for (i = 0; i < shared->count; i++) {
+		if (shared->members[i] == dev) {
+			shared->members[i] = shared->members[--shared->count];
+			break;
+		}
+	}
+	last = shared->count == 0;
+	pthread_mutex_unlock(&shared->mutex);
+	if (!last)
+		return;
+
+	__atomic_store_n(&shared->shutdown_thread, 1, __ATOMIC_RELEASE);
+	libusb_interrupt_event_handler(shared->context);
+	pthread_join(shared->thread, NULL);
+
+	libusb_close(shared->device_handle);
+	free_shared_handle(shared);
+}
+
+int HID_API_EXPORT_CALL hid_open_interfaces(const char *path, hid_device **devs, int max)
+{
+	struct hid_shared_handle *shared;
+	libusb_context *ctx;
+	libusb_device *usb_dev;
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *conf_desc = NULL;
+	unsigned int bus_number, device_address, interface_number;
+	int count = 0;
+	int res;
+	int i, j, k;
+
+	if (hid_init() < 0)
+		return -1;
+
+	ctx = path && devs && max >= 0 ? context_for_path(path, -1) : NULL;
+	if (!ctx) {
+		register_error(NULL, LIBUSB_ERROR_INVALID_PARAM);
+		return -1;
+	}
+
+	if (sscanf(path, "%x:%x:%x", &bus_number, &device_address,
+			&interface_number) != 3 ||
+			bus_number > 0xff || device_address > 0xff ||
+			!(usb_dev = libusb_get_device_by_address(ctx,
+				bus_number, device_address))) {
+		register_error(NULL, LIBUSB_ERROR_NOT_FOUND);
+		return -1;
+	}
+
+	shared = calloc(1, sizeof(*shared));
+	if (!shared) {
+		libusb_unref_device(usb_dev);
+		register_error(NULL, LIBUSB_ERROR_NO_MEM);
+		return -1;
+	}
+	shared->context = ctx;
+	pthread_mutex_init(&shared->mutex, NULL);
+
+	libusb_get_device_descriptor(usb_dev, &desc);
+	res = libusb_get_active_config_descriptor(usb_dev, &conf_desc);
+	if (res < 0)
+		goto out;
+	res = libusb_open(usb_dev, &shared->device_handle);
+	if (res < 0) {
+		LOG("can't open device\n");
+		goto out;
+	}
+
+	/* Claim every HID interface, through its first HID alternate setting */
+	shared->members = calloc(conf_desc->bNumInterfaces + 1, sizeof(*shared->members));
+	if (!shared->members) {
+		res = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+	for (j = 0; j < conf_desc->bNumInterfaces; j++) {
+		const struct libusb_interface *intf = &conf_desc->interface[j];
+		for (k = 0; k < intf->num_altsetting; k++) {
+			const struct libusb_interface_descriptor *intf_desc;
+			hid_device *dev;
+
+			intf_desc = &intf->altsetting[k];
+			if (intf_desc->bInterfaceClass != LIBUSB_CLASS_HID)
+				continue;
+			if (count == max) {
+				res = LIBUSB_ERROR_OVERFLOW;
+				goto out;
+			}
+
+			dev = new_hid_device();
+			dev->context = ctx;
+			dev->device_handle = shared->device_handle;
+			dev->shared = shared;
+			res = claim_hid_interface(dev, &desc, intf_desc);
+			if (res < 0) {
+				free_hid_device(dev);
+				goto out;
+			}
+			devs[count++] = dev;
+			break;
+		}
+	}
+	if (count == 0) {
+		res = LIBUSB_ERROR_NOT_FOUND;
+		goto out;
+	}
+
+	/* Start receiving once every interface is claimed */
+	memcpy(shared->members, devs, count * sizeof(*devs));
+	shared->count = count;
+	if (pthread_create(&shared->thread, NULL, shared_read_thread, shared) != 0) {
+		res = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+	for (i = 0; i < count; i++)
+		start_input_transfer(devs[i]);
+
+out:
+	if (conf_desc)
+		libusb_free_config_descriptor(conf_desc);
+	libusb_unref_device(usb_dev);
+
+	if (res < 0) {
+		for (i = 0; i < count; i++) {
+			libusb_release_interface(shared->device_handle, devs[i]->interface);
+			free_hid_device(devs[i]);
+		}
+		if (shared->device_handle)
+			libusb_close(shared->device_handle);
+		free_shared_handle(shared);
+		register_error(NULL, res);
+		return -1;
+	}
+	return count;
+}
+
 int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
 {
 	int res;
 	int report_number = data[0];
 	int skipped_report_id = 0;
+	unsigned long long start_ns = monotonic_ns();
 
 	if (report_number == 0x0) {
 		data++;
@@ -15879,8 +20821,14 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 			(unsigned char *)data, length,
 			1000/*timeout millis*/);
 
-		if (res < 0)
+		if (res < 0) {
+			register_error(dev, res);
+			count_failure(dev, res);
 			return -1;
+		}
+		count_latency(&dev->stats.write_latency, start_ns);
+		count_stat(&dev->stats.writes, 1);
+		count_stat(&dev->stats.bytes_written, length);
 
 		if (skipped_report_id)
 			length++;
@@ -15896,8 +20844,14 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 			length,
 			&actual_length, 1000);
 
-		if (res < 0)
+		if (res < 0) {
+			register_error(dev, res);
+			count_failure(dev, res);
 			return -1;
+		}
+		count_latency(&dev->stats.write_latency, start_ns);
+		count_stat(&dev->stats.writes, 1);
+		count_stat(&dev->stats.bytes_written, actual_length);
 
 		if (skipped_report_id)
 			actual_length++;
@@ -16008,6 +20962,9 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 	}
 
 ret:
+	if (bytes_read < 0)
+		register_error(dev, dev->shutdown_thread && dev->read_error ?
+			dev->read_error : LIBUSB_ERROR_OTHER);
 	pthread_mutex_unlock(&dev->mutex);
 	pthread_cleanup_pop(0);
 
@@ -16032,6 +20989,7 @@ int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char
 	int res = -1;
 	int skipped_report_id = 0;
 	int report_number = data[0];
+	unsigned long long start_ns = monotonic_ns();
 
 	if (report_number == 0x0) {
 		data++;
@@ -16047,8 +21005,13 @@ int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char
 		(unsigned char *)data, length,
 		1000/*timeout millis*/);
 
-	if (res < 0)
+	if (res < 0) {
+		register_error(dev, res);
+		count_failure(dev, res);
 		return -1;
+	}
+	count_latency(&dev->stats.feature_latency, start_ns);
+	count_stat(&dev->stats.feature_sets, 1);
 
 	/* Account for the report ID */
 	if (skipped_report_id)
@@ -16062,6 +21025,7 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 	int res = -1;
 	int skipped_report_id = 0;
 	int report_number = data[0];
+	unsigned long long start_ns = monotonic_ns();
 
 	if (report_number == 0x0) {
 		/* Offset the return buffer by 1, so that the report ID
@@ -16078,8 +21042,13 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 		(unsigned char *)data, length,
 		1000/*timeout millis*/);
 
-	if (res < 0)
+	if (res < 0) {
+		register_error(dev, res);
+		count_failure(dev, res);
 		return -1;
+	}
+	count_latency(&dev->stats.feature_latency, start_ns);
+	count_stat(&dev->stats.feature_gets, 1);
 
 	if (skipped_report_id)
 		res++;
@@ -16088,27 +21057,92 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 }
 
 
-void HID_API_EXPORT hid_close(hid_device *dev)
+int HID_API_EXPORT_CALL hid_get_device_stats(hid_device *dev, struct hid_device_stats *stats)
 {
-	if (!dev)
+	/* struct hid_device_stats is made of unsigned long long only */
+	const unsigned long long *src = (const unsigned long long *)&dev->stats;
+	unsigned long long *dst = (unsigned long long *)stats;
+	size_t i;
+
+	if (!stats) {
+		register_error(dev, LIBUSB_ERROR_INVALID_PARAM);
+		return -1;
+	}
+
+	for (i = 0; i < sizeof(*stats) / sizeof(*dst); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	return 0;
+}
+
+unsigned long long HID_API_EXPORT_CALL hid_latency_bucket_floor(int bucket)
+{
+	if (bucket < 8)
+		return bucket < 0 ? 0 : (unsigned long long)bucket;
+	return (unsigned long long)(8 + bucket % 8) << (bucket / 8 - 1);
+}
+
+int HID_API_EXPORT_CALL hid_get_read_buffer_mode(hid_device *dev)
+{
+	/* set by start_input_transfer() before hid_open_path() returns */
+	return dev->read_buffer_mode;
+}
+
+void HID_API_EXPORT hid_shutdown(hid_device *dev)
+{
+	if (!dev || dev->thread_joined)
+		return;
+
+	if (dev->shared) {
+		/* The thread of a composite device serves the other
+		   interfaces too, so only the transfer of this one is
+		   cancelled and waited for. The callback may resubmit it
+		   while racing the first cancellation. */
+		if (!dev->read_error)
+			dev->read_error = LIBUSB_ERROR_INTERRUPTED;
+		dev->shutdown_thread = 1;
+		while (!dev->cancelled) {
+			libusb_cancel_transfer(dev->transfer);
+			libusb_handle_events_completed(dev->context, &dev->cancelled);
+		}
+		dev->thread_joined = 1;
 		return;
+	}
 
 	/* Cause read_thread() to stop. */
+	if (!dev->read_error)
+		dev->read_error = LIBUSB_ERROR_INTERRUPTED;
 	dev->shutdown_thread = 1;
 	libusb_cancel_transfer(dev->transfer);
 
-	/* Wait for read_thread() to end. */
+	/* Wait for read_thread() to end. It wakes up the blocked readers
+	   on its way out. */
 	pthread_join(dev->thread, NULL);
+	dev->thread_joined = 1;
+}
+
+void HID_API_EXPORT hid_close(hid_device *dev)
+{
+	if (!dev)
+		return;
+
+	hid_shutdown(dev);
 
 	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
+	if (dev->read_buffer_mode == HID_BUFFER_DEVICE)
+		libusb_dev_mem_free(dev->device_handle, dev->transfer->buffer,
+			dev->input_ep_max_packet_size);
+	else
+		free(dev->transfer->buffer);
 	libusb_free_transfer(dev->transfer);
 
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
 
-	/* Close the handle */
-	libusb_close(dev->device_handle);
+	/* Close the handle, unless other interfaces still use it */
+	if (dev->shared)
+		leave_shared_handle(dev);
+	else
+		libusb_close(dev->device_handle);
 
 	/* Clear out the queue of received reports. */
 	pthread_mutex_lock(&dev->mutex);
@@ -16138,13 +21172,12 @@ int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev, wchar_t *s
 
 int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen)
 {
-	wchar_t *str;
+	const wchar_t *str;
 
-	str = get_usb_string(dev->device_handle, string_index);
+	str = get_cached_string(dev, string_index);
 	if (str) {
 		wcsncpy(string, str, maxlen);
 		string[maxlen-1] = L'\0';
-		free(str);
 		return 0;
 	}
 	else
@@ -16152,9 +21185,43 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 }
 
 
+int HID_API_EXPORT_CALL hid_error_code(hid_device *dev)
+{
+	return dev ? dev->last_error : thread_error;
+}
+
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
-	return NULL;
+	switch (hid_error_code(dev)) {
+	case 0:
+		return NULL;
+	case LIBUSB_ERROR_IO:
+		return L"Input/Output Error";
+	case LIBUSB_ERROR_INVALID_PARAM:
+		return L"Invalid parameter";
+	case LIBUSB_ERROR_ACCESS:
+		return L"Access denied (insufficient permissions)";
+	case LIBUSB_ERROR_NO_DEVICE:
+		return L"No such device (it may have been disconnected)";
+	case LIBUSB_ERROR_NOT_FOUND:
+		return L"Entity not found";
+	case LIBUSB_ERROR_BUSY:
+		return L"Resource busy";
+	case LIBUSB_ERROR_TIMEOUT:
+		return L"Operation timed out";
+	case LIBUSB_ERROR_OVERFLOW:
+		return L"Overflow";
+	case LIBUSB_ERROR_PIPE:
+		return L"Pipe error";
+	case LIBUSB_ERROR_INTERRUPTED:
+		return L"System call interrupted (perhaps due to signal)";
+	case LIBUSB_ERROR_NO_MEM:
+		return L"Insufficient memory";
+	case LIBUSB_ERROR_NOT_SUPPORTED:
+		return L"Operation not supported or unimplemented on this platform";
+	default:
+		return L"Other error";
+	}
 }
 
 